@@ -0,0 +1,198 @@
+//=============================================================================
+//
+// Name:        bench_flow_record.cpp
+// Authors:     James H. Loving
+// Description: This file benchmarks the per-packet work done by
+//              log_packet() before and after the flow_record fast path.
+//              Both variants stop short of console and socket I/O, so the
+//              numbers are packets per second per core of pure CPU work.
+//
+//              To run manually:
+//              - cmake CMakeLists.txt
+//              - make
+//              - ./runBenchmarks
+//
+//=============================================================================
+
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "../libs/flow_record/flow_record.hpp"
+
+/**
+    Build a minimal IPv4/TCP or IPv6/TCP packet for the benchmarks.
+*/
+static std::vector<char> make_packet(int version,
+                                     uint16_t source_port)
+{
+    std::vector<char> packet(version == 4 ? 40 : 60, 0);
+    uint8_t *p = reinterpret_cast<uint8_t *>(&packet[0]);
+    int header_len = version == 4 ? 20 : 40;
+
+    if (version == 4)
+    {
+        p[0] = 0x45;
+        p[9] = IPPROTO_TCP;
+        inet_pton(AF_INET, "192.168.1.23", p + 12);
+        inet_pton(AF_INET, "93.184.216.34", p + 16);
+    }
+    else
+    {
+        p[0] = 0x60;
+        p[6] = IPPROTO_TCP;
+        inet_pton(AF_INET6, "2001:db8:85a3::8a2e:370:7334", p + 8);
+        inet_pton(AF_INET6, "2606:2800:220:1:248:1893:25c8:1946", p + 24);
+    }
+
+    p[header_len] = source_port >> 8;
+    p[header_len + 1] = source_port & 0xff;
+    p[header_len + 3] = 80;
+
+    return packet;
+}
+
+static const uint8_t HW_ADDR[6] = {0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+
+/**
+    The string-based work log_packet() and conn_log::add_ipv4/add_ipv6 did
+    per packet before flow records: sprintf() the MAC, inet_ntop() both
+    addresses into strings, pass them around by value, re-validate the MAC
+    and concatenate the Bloomd commands.
+*/
+static size_t legacy_packet(const std::vector<char> &packet)
+{
+    const struct iphdr *v4 = reinterpret_cast<const struct iphdr *>(&packet[0]);
+
+    std::string mac_address = "";
+    char temp[3];
+    for (int i = 0; i < 6; ++i)
+    {
+        sprintf(temp, "%02x", HW_ADDR[i]);
+        mac_address += temp;
+    }
+
+    std::string source_address, dest_address, key;
+    uint16_t source_port = 0;
+
+    if (v4->version == 4)
+    {
+        char str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &v4->saddr, str, INET_ADDRSTRLEN);
+        source_address = str;
+        inet_ntop(AF_INET, &v4->daddr, str, INET_ADDRSTRLEN);
+        dest_address = str;
+
+        const struct tcphdr *tcp = reinterpret_cast<const struct tcphdr *>(&packet[v4->ihl << 2]);
+        source_port = ntohs(tcp->th_sport);
+    }
+    else
+    {
+        const struct ip6_hdr *v6 = reinterpret_cast<const struct ip6_hdr *>(&packet[0]);
+        char str[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &v6->ip6_src, str, INET6_ADDRSTRLEN);
+        source_address = str;
+        inet_ntop(AF_INET6, &v6->ip6_dst, str, INET6_ADDRSTRLEN);
+        dest_address = str;
+    }
+
+    // pprint_packet() and add_ipv4()/add_ipv6() took their strings by value
+    std::string copy_mac = mac_address, copy_source = source_address,
+                copy_dest = dest_address;
+    benchmark::DoNotOptimize(copy_source);
+    benchmark::DoNotOptimize(copy_dest);
+
+    bool valid = copy_mac.length() == 12;
+    for (size_t i = 0; i < copy_mac.length(); ++i)
+    {
+        valid &= !(copy_mac[i] < 48 || copy_mac[i] > 102 || (copy_mac[i] > 57 && copy_mac[i] < 97));
+    }
+    benchmark::DoNotOptimize(valid);
+
+    std::string slot = std::to_string(1500000000 / 3600);
+    std::string create = "create " + slot + "\n";
+    if (v4->version == 4)
+    {
+        key = "set " + slot + " " + copy_mac + "|" + std::to_string(source_port) + "\n";
+    }
+    else
+    {
+        key = "set " + slot + " " + copy_mac + "|" + copy_source + "\n";
+    }
+
+    return create.length() + key.length();
+}
+
+/**
+    The flow_record fast path: parse into a fixed-size record, then format
+    the Bloomd commands on the stack.
+*/
+static size_t fast_packet(const std::vector<char> &packet)
+{
+    struct flow_record flow;
+    char slot[24];
+    char key[FLOW_KEY_BYTES];
+    char command[2 * FLOW_KEY_BYTES + 64];
+    char *end;
+
+    parse_flow(&packet[0], packet.size(), HW_ADDR, 6, 1500000000, &flow);
+
+    format_uint(flow.timestamp / 3600, slot);
+    end = stpcpy(stpcpy(stpcpy(command, "create "), slot), "\n");
+    size_t length = end - command;
+
+    end = stpcpy(stpcpy(stpcpy(command, "set "), slot), " ");
+    char *key_end = flow.version == 4 ?
+        pack_key_ipv4(1, flow.source_port, key) :
+        pack_key_ipv6(1, flow.source_address, key);
+    end = format_hex(key, key_end - key, end);
+    end = stpcpy(end, "\n");
+    benchmark::DoNotOptimize(command);
+
+    return length + (end - command);
+}
+
+static void BM_legacy_packet(benchmark::State &state)
+{
+    std::vector<char> packet = make_packet(state.range(0), 51234);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(legacy_packet(packet));
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_legacy_packet)->Arg(4)->Arg(6);
+
+static void BM_flow_record_packet(benchmark::State &state)
+{
+    std::vector<char> packet = make_packet(state.range(0), 51234);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(fast_packet(packet));
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_flow_record_packet)->Arg(4)->Arg(6);
+
+static void BM_parse_flow(benchmark::State &state)
+{
+    std::vector<char> packet = make_packet(state.range(0), 51234);
+    struct flow_record flow;
+
+    for (auto _ : state)
+    {
+        parse_flow(&packet[0], packet.size(), HW_ADDR, 6, 1500000000, &flow);
+        benchmark::DoNotOptimize(flow);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_parse_flow)->Arg(4)->Arg(6);
@@ -17,7 +17,20 @@ struct args_struct parse_args(int arg_count,
                               char **arg_vector)
 {
     struct args_struct args;
-    
+    args.verbose = false;
+    args.storage_threads = STORAGE_THREADS;
+    args.ring_size = FLOW_RING_SIZE;
+    args.ring_overflow = FLOW_RING_OVERFLOW;
+    args.filter_budget = MAX_FILTER_SIZE;
+    args.retention = MAX_FILTER_AGE;
+    args.fine_window = FINE_WINDOW;
+    args.fp_rate = FILTER_PROBABILITY;
+    args.port_index = false;
+    args.window = 0;
+    args.backend = "bloomd";
+    args.query_threads = QUERY_THREADS;
+    args.serve_socket = SERVE_SOCKET;
+
     if (arg_count > 1)
     {
         args.command = arg_vector[1];
@@ -27,21 +40,73 @@ struct args_struct parse_args(int arg_count,
         args.command = "help";
     }
 
+    // options may appear anywhere after the command
+    std::vector<std::string> positional;
+    for (int i = 2; i < arg_count; ++i)
+    {
+        std::string arg = arg_vector[i];
+
+        if (arg == "-v")
+        {
+            args.verbose = true;
+        }
+        else if (arg.substr(0, 2) == "--")
+        {
+            if (!parse_option(arg, args))
+            {
+                args.command = "invalid";
+            }
+        }
+        else
+        {
+            positional.push_back(arg);
+        }
+    }
+
     if (args.command == "start")
     {
-        if (arg_count != 2)
+        if (!positional.empty())
         {
             args.command = "invalid";
         }
     }
     else if (args.command == "query")
     {
-        if (arg_count == 6)
+        if (positional.size() == 4)
+        {
+            args.query_timestamp = positional[0];
+            args.query_version = positional[1];
+            args.query_metadata = positional[2];   
+            args.print_format = positional[3];
+        }
+        else
+        {
+            args.command = "invalid";
+        }
+    }
+    else if (args.command == "serve" || args.command == "stats")
+    {
+        if (!positional.empty())
+        {
+            args.command = "invalid";
+        }
+    }
+    else if (args.command == "query-batch")
+    {
+        if (positional.size() == 1)
+        {
+            args.query_file = positional[0];
+        }
+        else
+        {
+            args.command = "invalid";
+        }
+    }
+    else if (args.command == "purge")
+    {
+        if (positional.size() == 1)
         {
-            args.query_timestamp = arg_vector[2];
-            args.query_version = arg_vector[3];
-            args.query_metadata = arg_vector[4];   
-            args.print_format = arg_vector[5];
+            args.purge_mac = positional[0];
         }
         else
         {
@@ -52,16 +117,195 @@ struct args_struct parse_args(int arg_count,
     return args;
 }
 
+bool parse_option(const std::string &option,
+                  struct args_struct &args)
+{
+    size_t equals = option.find('=');
+    if (option.substr(0, 2) != "--" || equals == std::string::npos)
+    {
+        return false;
+    }
+
+    std::string name = option.substr(2, equals - 2);
+    std::string value = option.substr(equals + 1);
+    char *end;
+    unsigned long number = strtoul(value.c_str(), &end, 10);
+    bool is_number = !value.empty() && *end == '\0';
+
+    if (name == "storage-threads" && is_number && number > 0 && number <= 256)
+    {
+        args.storage_threads = number;
+    }
+    else if (name == "ring-size" && is_number && number > 0 && number <= (1UL << 30))
+    {
+        args.ring_size = number;
+    }
+    else if (name == "filter-budget" && is_number && number > 0)
+    {
+        args.filter_budget = static_cast<uint64_t>(number) * 1048576;
+    }
+    else if (name == "retention" && is_number)
+    {
+        args.retention = static_cast<time_t>(number) * 86400;
+    }
+    else if (name == "backend" && (value == "bloomd" || value == "local" || value == "cuckoo" ||
+                                   value.compare(0, 7, "bloomd:") == 0 ||
+                                   value.compare(0, 6, "local:") == 0 ||
+                                   value.compare(0, 7, "cuckoo:") == 0 ||
+                                   value.compare(0, 8, "sharded:") == 0))
+    {
+        args.backend = value;
+    }
+    else if (name == "port-index" && (value == "on" || value == "off"))
+    {
+        args.port_index = value == "on";
+    }
+    else if (name == "window" && is_number)
+    {
+        args.window = static_cast<time_t>(number);
+    }
+    else if (name == "fine-window" && is_number)
+    {
+        args.fine_window = static_cast<time_t>(number) * 60;
+    }
+    else if (name == "fp-rate")
+    {
+        double rate = strtod(value.c_str(), &end);
+        if (value.empty() || *end != '\0' || !(rate > 0 && rate < 1))
+        {
+            return false;
+        }
+        args.fp_rate = rate;
+    }
+    else if (name == "rollup")
+    {
+        // "<level>:<days>,...", ex "day:7,week:30"
+        std::vector<struct rollup_rule> rules;
+        std::istringstream fields(value);
+        std::string field;
+        while (std::getline(fields, field, ','))
+        {
+            size_t colon = field.find(':');
+            std::string level = field.substr(0, colon);
+            unsigned long days = colon == std::string::npos ? 0 : strtoul(field.c_str() + colon + 1, &end, 10);
+            if (colon == std::string::npos || colon + 1 == field.length() || *end != '\0' ||
+                (level != "day" && level != "week"))
+            {
+                return false;
+            }
+
+            struct rollup_rule rule;
+            rule.length = level == "day" ? DAY_LENGTH : WEEK_LENGTH;
+            rule.age = static_cast<time_t>(days) * 86400;
+            rules.push_back(rule);
+        }
+        if (rules.empty())
+        {
+            return false;
+        }
+        args.rollups = rules;
+    }
+    else if (name == "overflow" && (value == "drop-newest" || value == "drop-oldest" || value == "block"))
+    {
+        args.ring_overflow = value;
+    }
+    else if (name == "query-threads" && is_number && number > 0 && number <= 256)
+    {
+        args.query_threads = number;
+    }
+    else if (name == "socket" && !value.empty())
+    {
+        args.serve_socket = value;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool parse_timestamp(const std::string &text,
+                     time_t *timestamp)
+{
+    struct tm t{};
+
+    if (strptime(text.c_str(), "%Y-%m-%dT%H:%M:%SZ", &t) == NULL)
+    {
+        return false;
+    }
+
+    *timestamp = mktime(&t) + (&t)->tm_gmtoff;
+    return true;
+}
+
+bool parse_ports(const std::string &text,
+                 port_bitmap *ports)
+{
+    std::istringstream fields(text);
+    std::string field;
+    bool any = false;
+
+    if (!text.empty() && text[text.length() - 1] == ',')
+    {
+        return false;
+    }
+
+    while (std::getline(fields, field, ','))
+    {
+        // "<port>" or "<first>-<last>"
+        size_t dash = field.find('-');
+        std::string first = field.substr(0, dash);
+        std::string last = dash == std::string::npos ? first : field.substr(dash + 1);
+        unsigned long low = strtoul(first.c_str(), NULL, 10);
+        unsigned long high = strtoul(last.c_str(), NULL, 10);
+        if (first.empty() || last.empty() ||
+            first.find_first_not_of("0123456789") != std::string::npos ||
+            last.find_first_not_of("0123456789") != std::string::npos ||
+            high > 65535 || low > high)
+        {
+            return false;
+        }
+
+        ports->add_range(low, high);
+        any = true;
+    }
+
+    return any;
+}
+
 void print_help()
 {
-    std::cout << "Usage: edict <command> <subcommands>\n\n";
+    std::cout << "Usage: edict <command> <subcommands> [<options>]\n\n";
     std::cout << "<command> may be one of the following:\n";
-    std::cout << std::setw(5) << "" << std::setw(10) << std::left << "start" << "Start EDICT logging.\n";
+    std::cout << std::setw(5) << "" << std::setw(10) << std::left << "start" << "Start EDICT logging. Usage: edict start [-v]\n";
+    std::cout << std::setw(20) << "" << std::setw(15) << std::left << "-v" << "Print every logged packet\n";
     std::cout << std::setw(5) << "" << std::setw(10) << std::left << "query" << "Query EDICT's logs. Usage: edict query <timestamp> <version> <metadata> <format>\n";
     std::cout << std::setw(20) << "" << std::setw(15) << std::left << "<timestamp>" << "ISO 8601-formatted timestamp of connection (in UTC)\n";
     std::cout << std::setw(20) << "" << std::setw(15) << std::left << "<version>" << "IP version: 'v4' or 'v6' (no quotes)\n";
-    std::cout << std::setw(20) << "" << std::setw(15) << std::left << "<metadata>" << "Source port (for IPv4) or source IPv6 address\n";
+    std::cout << std::setw(20) << "" << std::setw(15) << std::left << "<metadata>" << "Source port (for IPv4) or source IPv6 address; for IPv4, also ports and ranges, ex '80,1024-2047' (port index only)\n";
     std::cout << std::setw(20) << "" << std::setw(15) << std::left << "<format>" << "Format for printing, 'plain' or 'xml' (no quotes)\n";
+    std::cout << std::setw(5) << "" << std::setw(10) << std::left << "query-batch" << "Query many connections, results as NDJSON. Usage: edict query-batch <file>\n";
+    std::cout << std::setw(20) << "" << std::setw(15) << std::left << "<file>" << "One '<timestamp> <version> <metadata>' per line, or '-' for stdin\n";
+    std::cout << std::setw(5) << "" << std::setw(10) << std::left << "serve" << "Answer query-batch lines on a Unix socket, with warm caches. Usage: edict serve [--socket=<path>]\n";
+    std::cout << std::setw(5) << "" << std::setw(10) << std::left << "stats" << "List connection filters with their keys, capacity, size and false positive rate. Usage: edict stats\n";
+    std::cout << std::setw(5) << "" << std::setw(10) << std::left << "purge" << "Remove a device's connections from every filter kept (cuckoo backend only). Usage: edict purge <mac>\n";
+    std::cout << std::setw(20) << "" << std::setw(15) << std::left << "<mac>" << "12-char, lowercase hex MAC address, ex after adding it to " << DNT_FILE << "\n";
+    std::cout << "\n";
+    std::cout << "<options> may be any of the following:\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--backend=<name>" << "Connection log storage: 'bloomd', 'bloomd:<host>:<port>', 'bloomd:<socket path>', 'local' (in-process files), 'local:<directory>', 'cuckoo' (in-process, deletable), 'cuckoo:<directory>' or 'sharded:<backend>,<backend>,...' (default bloomd)\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--storage-threads=<n>" << "Threads writing to the connection log (default " << STORAGE_THREADS << ")\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--ring-size=<n>" << "Flows buffered between capture and each storage thread (default " << FLOW_RING_SIZE << ")\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--overflow=<policy>" << "When the buffer is full: drop-newest, drop-oldest or block (default " << FLOW_RING_OVERFLOW << ")\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--filter-budget=<MB>" << "Max memory for connection filters (default " << MAX_FILTER_SIZE / 1048576 << ")\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--retention=<days>" << "Drop connection filters older than this (default 0, no limit)\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--fine-window=<minutes>" << "Also keep one-minute filters this long, for tighter recent queries (default 0, none; pass to queries too)\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--fp-rate=<rate>" << "False positive rate new connection filters are sized for, from the keys recent hours held (default " << FILTER_PROBABILITY << ")\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--rollup=<rules>" << "Merge hourly filters into day/week filters once this many days old, ex 'day:7,week:30' (local backends only)\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--port-index=on|off" << "Also record each device's exact IPv4 source ports per minute, for range and window queries (default off)\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--window=<seconds>" << "Query IPv4 connections from this long before to this long after <timestamp>, in the port index; matched per whole minute, so a window of 0 is <timestamp>'s minute (default 0)\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--query-threads=<n>" << "Threads answering query-batch (default " << QUERY_THREADS << ")\n";
+    std::cout << std::setw(5) << "" << std::setw(25) << std::left << "--socket=<path>" << "Unix socket for serve (default " << SERVE_SOCKET << ")\n";
     std::cout << "\n";
 
     time_t now;
@@ -71,11 +315,25 @@ void print_help()
     std::cout << "Current UTC time: " << time_buf << "\n";
 }
 
-void pprint_packet(std::string mac_address,
-                  std::string source_address,
-                  std::string dest_address,
-                  uint16_t source_port,
-                  uint16_t dest_port)
+void pprint_flow(const struct flow_record &flow)
+{
+    char mac_address[MAC_STRLEN];
+    char source_address[INET6_ADDRSTRLEN];
+    char dest_address[INET6_ADDRSTRLEN];
+
+    format_mac(flow.mac, mac_address);
+    format_address(flow.version, flow.source_address, source_address);
+    format_address(flow.version, flow.dest_address, dest_address);
+
+    pprint_packet(mac_address, source_address, dest_address,
+                  flow.source_port, flow.dest_port);
+}
+
+void pprint_packet(const std::string &mac_address,
+                   const std::string &source_address,
+                   const std::string &dest_address,
+                   uint16_t source_port,
+                   uint16_t dest_port)
 {
     std::cout << "\"" << mac_address << "\"\n"
               << "Source: "
@@ -87,108 +345,253 @@ void pprint_packet(std::string mac_address,
               << "\n";
 }
 
-static int log_packet(struct nflog_data *ldata,
-                      conn_log *connections,
-                      device_log *devices)
+static int log_packet(struct flow_record *flow,
+                      flow_rings *rings,
+                      flow_spool *spool,
+                      device_log *devices,
+                      bool verbose)
 {
-    struct nfulnl_msg_packet_hdr *ph = nflog_get_msg_packet_hdr(ldata);
-    char *payload;
-    nflog_get_payload(ldata, &payload); 
-
-    struct nfulnl_msg_packet_hw *packet_hw = nflog_get_packet_hw(ldata);
-
-    // TODO: reinterpret_cast
-    struct iphdr *packet_header_v4 = (struct iphdr*) payload;
-
-    // get MAC address
-    std::string mac_address = "";
-    if (packet_hw)
-    {
-        char temp[2];
-        
-        // format MAC address as std::string of char-encoded hex values
-        for (int i = 0; i < ntohs(packet_hw->hw_addrlen); ++i)
-        {
-            sprintf(temp, "%02x", packet_hw->hw_addr[i]);
-            mac_address += temp;
-        }
-    }
-
     // ignore packets from devices that are on DO-NOT-TRACK list
-    if (!devices->should_log(mac_address))
+    if (!devices->should_log(flow->mac))
     {
         return 0;
     }
   
     // if the device is new, add it to device_log
-    if (!(devices->count(mac_address)))
+    flow->device = devices->device_id(flow->mac);
+    if (!flow->device)
     {
         std::string make_model = "make_model"; // TODO: get make_model from wifi code
-        devices->add_device(mac_address, make_model);
+        flow->device = devices->add_device(flow->mac, make_model);
         printf("\n*** New Device! ***\n");
     }
 
-    // process IPv4 packets
-    if (packet_header_v4->version == 4)
+    if (verbose)
     {
-        std::string source_address, dest_address;
-        uint16_t source_port, dest_port;
-
-        // get the source IPv4 address
-        char str[INET_ADDRSTRLEN];
-        // TODO: reinterpret_cast
-        struct in_addr *addr = (struct in_addr*)&(packet_header_v4->saddr);
-        inet_ntop(AF_INET, addr, str, INET_ADDRSTRLEN);
-        source_address = str;
+        pprint_flow(*flow);
+        std::cout << "\n";
+    }
 
-        // get the destination IPv4 address
-        // TODO: reinterpret_cast
-        addr = (struct in_addr*)&(packet_header_v4->daddr);
-        inet_ntop(AF_INET, addr, str, INET_ADDRSTRLEN);
-        dest_address = str;
+    // hand the packet to its device's storage thread; the policy decides
+    // on overflow, and a flow it turns away is spooled rather than lost
+    if (!(*rings)[storage_shard(flow->device, rings->size())]->push(*flow) && spool)
+    {
+        spool->push(*flow);
+    }
 
-        // get the source & destination TCP/UDP ports
-        int off_tl = packet_header_v4->ihl << 2;
-        // TODO: reinterpret_cast
-        char *tl = (char *) packet_header_v4 + off_tl;
-        // TODO: reinterpret_cast
-        struct tcphdr *tcphdr = (struct tcphdr*) tl;
-        source_port = ntohs(tcphdr->th_sport);
-        dest_port = ntohs(tcphdr->th_dport);
+    return 0;
+}
 
-        pprint_packet(mac_address, source_address, dest_address, source_port, dest_port);
+size_t storage_shard(uint32_t device,
+                     size_t shards)
+{
+    // IDs are dense, so mix them before taking the remainder
+    return (static_cast<uint64_t>(device) * 0x9E3779B97F4A7C15ULL >> 32) % shards;
+}
 
-        connections->add_ipv4(mac_address, source_port);
+void store_flow(const struct flow_record &flow,
+                conn_log *connections)
+{
+    // process IPv4 packets; a replayed flow goes to the filter of the
+    // timeslot it was captured in
+    if (flow.version == 4)
+    {
+        connections->add_ipv4(flow.device, flow.source_port, flow.timestamp);
     }
 
     // process IPv6 packets
-    else if (packet_header_v4->version == 6)
+    else if (flow.version == 6)
     {
-        std::string source_address, dest_address;
-        uint16_t source_port, dest_port;
+        connections->add_ipv6(flow.device, flow.source_address, flow.timestamp);
+    }
+}
+
+/**
+    Spool the flows whose keys a failed flush lost.
+
+    \param pending Flows stored since the last successful flush; emptied.
+*/
+static void spool_pending(std::vector<struct flow_record> &pending,
+                          flow_spool *spool)
+{
+    if (spool)
+    {
+        for (size_t i = 0; i < pending.size(); ++i)
+        {
+            spool->push(pending[i]);
+        }
+    }
+
+    pending.clear();
+}
+
+void store_flows(ring_buffer<struct flow_record> *ring,
+                 conn_log *connections,
+                 flow_spool *spool,
+                 const std::atomic<bool> *running,
+                 std::atomic<uint64_t> *failures,
+                 std::atomic<time_t> *failed)
+{
+    struct flow_record flow;
+    unsigned int idle = 0;
+
+    // flows whose keys may still be queued, kept until a flush succeeds
+    std::vector<struct flow_record> pending;
+
+    while (true)
+    {
+        if (ring->pop(flow))
+        {
+            idle = 0;
 
-        // TODO: reinterpret_cast
-        struct ip6_hdr *packet_header_v6 = (struct ip6_hdr*) payload;
+            // shortly after a failure, spool rather than wait on a backend
+            // that is likely still down; the replayer retries it meanwhile
+            if (spool && time(nullptr) - failed->load() < static_cast<time_t>(SPOOL_BACKOFF))
+            {
+                spool->push(flow);
+                continue;
+            }
 
-        // get the source IPv6 address
-        char str[INET6_ADDRSTRLEN];
-        struct in6_addr *addr = &packet_header_v6->ip6_src;
-        inet_ntop(AF_INET6, addr, str, INET6_ADDRSTRLEN);
-        source_address = str;
+            try
+            {
+                pending.push_back(flow);
+                store_flow(flow, connections);
 
-        // get the destination IPv6 address
-        // TODO reinterpret_cast
-        addr = (struct in6_addr*)&(packet_header_v6->ip6_dst);
-        inet_ntop(AF_INET6, addr, str, INET6_ADDRSTRLEN);
-        dest_address = str;
+                // duplicates queue no keys, so flush to bound what is kept
+                if (pending.size() >= SPOOL_PENDING)
+                {
+                    connections->flush();
+                }
+                if (!connections->queued())
+                {
+                    pending.clear();
+                }
+            }
+            catch (std::exception &e)
+            {
+                // a Bloomd error must not take the capture path down with it
+                if (failures->fetch_add(1) % 1000 == 0)
+                {
+                    std::cout << "store_flows: " << e.what() << "\n";
+                }
+                failed->store(time(nullptr));
+                spool_pending(pending, spool);
+            }
+        }
+        else if (!running->load())
+        {
+            break;
+        }
+        else
+        {
+            // nothing to add: make sure queued keys don't wait too long
+            try
+            {
+                connections->flush_stale();
+                if (!connections->queued())
+                {
+                    pending.clear();
+                }
+            }
+            catch (std::exception &e)
+            {
+                failures->fetch_add(1);
+                std::cout << "store_flows: " << e.what() << "\n";
+                failed->store(time(nullptr));
+                spool_pending(pending, spool);
+            }
 
-        pprint_packet(mac_address, source_address, dest_address, 0, 0);
+            if (++idle < 64)
+            {
+                std::this_thread::yield();
+            }
+            else
+            {
+                usleep(1000);
+            }
+        }
+    }
 
-        connections->add_ipv6(mac_address, source_address);
+    try
+    {
+        connections->flush();
+    }
+    catch (std::exception &e)
+    {
+        failures->fetch_add(1);
+        std::cout << "store_flows: " << e.what() << "\n";
+        failed->store(time(nullptr));
+        spool_pending(pending, spool);
     }
+}
 
-    std::cout << "\n";
-    return 0;
+void replay_spool(flow_spool *spool,
+                  const std::string &backend,
+                  time_t retention,
+                  time_t fine_window,
+                  bool port_index,
+                  const std::atomic<bool> *running,
+                  std::atomic<time_t> *failed)
+{
+    std::vector<struct flow_record> flows(SPOOL_REPLAY_BATCH);
+    std::unique_ptr<conn_log> connections;
+
+    while (running->load())
+    {
+        size_t count = spool->peek(&flows[0], flows.size());
+        if (!count)
+        {
+            usleep(SPOOL_POLL_INTERVAL * 1000);
+            continue;
+        }
+
+        // records leave the spool only once the backend has them; a
+        // failed batch is replayed whole, which the filters don't mind
+        try
+        {
+            if (!connections)
+            {
+                connections.reset(new conn_log(backend));
+                connections->set_fine_window(fine_window);
+                if (port_index)
+                {
+                    connections->set_port_index(open_port_index());
+                }
+            }
+
+            // flows past retention would only bring back pruned filters
+            time_t oldest = retention ? time(nullptr) - retention : 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (flows[i].timestamp >= oldest)
+                {
+                    store_flow(flows[i], connections.get());
+                }
+            }
+            connections->flush();
+            spool->pop(count);
+        }
+        catch (std::exception &e)
+        {
+            // reconnect on the next attempt
+            connections.reset();
+            if (failed)
+            {
+                failed->store(time(nullptr));
+            }
+            sleep(SPOOL_RETRY_INTERVAL);
+        }
+    }
+}
+
+static void log_batch(struct log_struct *ls)
+{
+    for (unsigned int i = 0; i < ls->batch_size; ++i)
+    {
+        log_packet(&ls->batch[i], ls->rings, ls->spool, ls->devices, ls->verbose);
+    }
+
+    ls->batch_size = 0;
 }
 
 static int cb(struct nflog_g_handle *gh,
@@ -199,20 +602,38 @@ static int cb(struct nflog_g_handle *gh,
     // grab the passed logs via the log_struct pointer
     struct log_struct *ls = reinterpret_cast<struct log_struct *>(data);
 
-    log_packet(nfa, ls->connections, ls->devices);
+    // a datagram can carry more packets than expected; make room
+    if (ls->batch_size == FLOW_BATCH_SIZE)
+    {
+        log_batch(ls);
+    }
+
+    char *payload;
+    int payload_len = nflog_get_payload(nfa, &payload);
+    struct nfulnl_msg_packet_hw *packet_hw = nflog_get_packet_hw(nfa);
+
+    if (parse_flow(payload,
+                   payload_len,
+                   packet_hw ? packet_hw->hw_addr : NULL,
+                   packet_hw ? ntohs(packet_hw->hw_addrlen) : 0,
+                   ls->now,
+                   &ls->batch[ls->batch_size]))
+    {
+        ++ls->batch_size;
+    }
 
     return 0;
 }
 
-int start_edict(conn_log connections,
-                device_log devices)
+int start_edict(conn_log &connections,
+                device_log &devices,
+                const struct args_struct &args)
 {
     struct nflog_handle *h;
     struct nflog_g_handle *qh;
-    struct nflog_g_handle *qh100;
     int rv, fd_nflog;
-    char buf[4096];
-    char *payload;
+    unsigned long overruns = 0;
+    time_t last_stats = time(nullptr);
 
     // setup NFLog
     h = nflog_open();
@@ -233,11 +654,11 @@ int start_edict(conn_log connections,
         throw std::runtime_error("start_edict: error during nflog_bind_pf()");
     }
 
-    printf("binding this socket to group 2\n");
-    qh = nflog_bind_group(h, 2);
+    printf("binding this socket to group %u\n", NFLOG_GROUP);
+    qh = nflog_bind_group(h, NFLOG_GROUP);
     if (!qh)
     {
-        throw std::runtime_error("start_edict: no handle for group 2");
+        throw std::runtime_error("start_edict: no handle for group " + std::to_string(NFLOG_GROUP));
     }
 
     printf("setting copy_packet mode\n");
@@ -246,75 +667,281 @@ int start_edict(conn_log connections,
         throw std::runtime_error("start_edict: can't set packet copy mode");
     }
 
-    fd_nflog = nflog_fd(h);
-
-    // register callback, and pass logs to callback via void* ptr to log_struct
-    printf("registering callback for group 2\n");
-    struct log_struct ls;
-    ls.connections = &connections;
-    ls.devices = &devices;
-    nflog_callback_register(qh, &cb, reinterpret_cast<void*>(&ls));
-
-    // process packets as they are received
-    printf("going into main loop\n");
-    while ((rv = recv(fd_nflog, buf, sizeof(buf), 0)) && rv >= 0)
+    // let the kernel coalesce packets into large datagrams, so each
+    // wakeup carries up to NFLOG_QTHRESH packets instead of one
+    printf("setting queue threshold %u, timeout %u, buffer size %u\n",
+           NFLOG_QTHRESH, NFLOG_TIMEOUT, NFLOG_BUFFER_SIZE);
+    if (nflog_set_nlbufsiz(qh, NFLOG_BUFFER_SIZE) < 0)
     {
-        nflog_handle_packet(h, buf, rv);
+        throw std::runtime_error("start_edict: can't set nflog buffer size");
+    }
+    if (nflog_set_qthresh(qh, NFLOG_QTHRESH) < 0)
+    {
+        throw std::runtime_error("start_edict: can't set nflog queue threshold");
+    }
+    if (nflog_set_timeout(qh, NFLOG_TIMEOUT) < 0)
+    {
+        throw std::runtime_error("start_edict: can't set nflog timeout");
     }
 
-    printf("unbinding from group 2\n");
-    nflog_unbind_group(qh);
-
-    #ifdef INSANE
-    /* normally, applications SHOULD NOT issue this command,
-     * since it detaches other programs/sockets from AF_INET, too ! */
-    printf("unbinding from AF_INET\n");
-    nflog_unbind_pf(h, AF_INET);
-    #endif
-
-    printf("closing handle\n");
-    nflog_close(h);
-
-    return EXIT_SUCCESS;
-}
+    fd_nflog = nflog_fd(h);
 
-std::map<std::string, struct device_log_entry> query_edict(conn_log connections,
-                                                           device_log devices,
-                                                           struct args_struct args)
-{
-    time_t timestamp;
-    struct tm t{};
+    // a larger socket buffer absorbs bursts while a batch is processed;
+    // SO_RCVBUFFORCE needs CAP_NET_ADMIN, so fall back to SO_RCVBUF
+    if (setsockopt(fd_nflog, SOL_SOCKET, SO_RCVBUFFORCE,
+                   &NFLOG_SOCKET_BUFFER, sizeof(NFLOG_SOCKET_BUFFER)) < 0)
+    {
+        setsockopt(fd_nflog, SOL_SOCKET, SO_RCVBUF,
+                   &NFLOG_SOCKET_BUFFER, sizeof(NFLOG_SOCKET_BUFFER));
+    }
 
-    std::map<std::string, struct device_log_entry> devices_cache = devices.get_devices();
+    // start the storage threads, each with its own ring; the first one
+    // uses the caller's conn_log, the others open their own backend
+    // connections
+    printf("starting %u storage thread(s), ring size %u, overflow %s\n",
+           args.storage_threads, args.ring_size, args.ring_overflow.c_str());
+    flow_rings rings;
+    for (unsigned int i = 0; i < args.storage_threads; ++i)
+    {
+        rings.push_back(std::unique_ptr<ring_buffer<struct flow_record> >(
+            new ring_buffer<struct flow_record>(args.ring_size,
+                                                parse_overflow_policy(args.ring_overflow))));
+    }
+    std::atomic<bool> running(true);
+    std::atomic<uint64_t> failures(0);
+    std::atomic<time_t> failed(0);
+    std::vector<std::unique_ptr<conn_log> > extra_connections;
+    std::vector<std::thread> storage;
 
-    if (strptime(args.query_timestamp.c_str(), "%Y-%m-%dT%H:%M:%SZ", &t) != NULL)
+    // flows the backend can't take wait in the spool; without one they are
+    // lost, as before
+    std::unique_ptr<flow_spool> spool;
+    try
     {
-        timestamp = mktime(&t) + (&t)->tm_gmtoff;
-    }	
-    else
+        spool.reset(new flow_spool());
+        printf("spool %s holds %llu flows\n", SPOOL_FILE,
+               static_cast<unsigned long long>(spool->depth()));
+    }
+    catch (std::exception &e)
     {
-        throw std::invalid_argument("query_edict: invalid timestamp");
+        std::cerr << "start_edict: running without a spool: " << e.what() << "\n";
     }
 
-    if (args.query_version == "v4")
+    // the exact port index is optional; capture goes on without it
+    std::shared_ptr<port_index> ports;
+    if (args.port_index)
     {
-        uint16_t source_port;
         try
         {
-            source_port = static_cast<uint16_t>(std::stoi(args.query_metadata));
+            ports = open_port_index();
+            printf("recording exact source ports in %s\n", PORT_INDEX_DIR);
         }
-        catch (int e)
+        catch (std::exception &e)
         {
-            throw std::invalid_argument("query_edict: invalid IPv4 source port");
+            std::cerr << "start_edict: running without a port index: " << e.what() << "\n";
         }
+    }
 
-        return check_ipv4(connections, devices_cache, timestamp, source_port);
+    connections.set_fine_window(args.fine_window);
+    connections.set_port_index(ports);
+    storage.push_back(std::thread(store_flows, rings[0].get(), &connections, spool.get(),
+                                  &running, &failures, &failed));
+    for (unsigned int i = 1; i < args.storage_threads; ++i)
+    {
+        extra_connections.push_back(std::unique_ptr<conn_log>(new conn_log(args.backend)));
+        extra_connections.back()->set_fine_window(args.fine_window);
+        extra_connections.back()->set_port_index(ports);
+        storage.push_back(std::thread(store_flows, rings[i].get(), extra_connections.back().get(),
+                                      spool.get(), &running, &failures, &failed));
     }
-    else if (args.query_version == "v6")
+
+    // the replayer stops with capture; what it leaves is replayed on restart
+    std::thread replayer;
+    if (spool)
     {
-        if (!connections.valid_ipv6(args.query_metadata))
-        {
-            throw std::invalid_argument("query_edict: invalid IPv6 source address");
+        replayer = std::thread(replay_spool, spool.get(), args.backend,
+                               args.retention, args.fine_window, static_cast<bool>(ports), &running, &failed);
+    }
+
+    // filter creation, size accounting and pruning run in the background
+    filter_manager manager(args.filter_budget, args.retention, args.backend,
+                           args.rollups, args.fine_window, args.fp_rate);
+    manager.start();
+
+    // register callback, and pass logs to callback via void* ptr to log_struct
+    printf("registering callback for group %u\n", NFLOG_GROUP);
+    std::vector<struct flow_record> batch(FLOW_BATCH_SIZE);
+    struct log_struct ls;
+    ls.rings = &rings;
+    ls.spool = spool.get();
+    ls.devices = &devices;
+    ls.batch = &batch[0];
+    ls.batch_size = 0;
+    ls.now = 0;
+    ls.verbose = args.verbose;
+    nflog_callback_register(qh, &cb, reinterpret_cast<void*>(&ls));
+
+    // one buffer per datagram, so a single recvmmsg() drains a whole burst
+    std::vector<char> buf(NFLOG_RECV_BATCH * NFLOG_BUFFER_SIZE);
+    struct iovec iovecs[NFLOG_RECV_BATCH];
+    struct mmsghdr msgs[NFLOG_RECV_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (unsigned int i = 0; i < NFLOG_RECV_BATCH; ++i)
+    {
+        iovecs[i].iov_base = &buf[i * NFLOG_BUFFER_SIZE];
+        iovecs[i].iov_len = NFLOG_BUFFER_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // process packets as they are received: block for the first datagram,
+    // then take whatever else is already queued
+    printf("going into main loop\n");
+    while (true)
+    {
+        rv = recvmmsg(fd_nflog, msgs, NFLOG_RECV_BATCH, MSG_WAITFORONE, NULL);
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno == ENOBUFS)
+            {
+                // the kernel dropped messages; note it and keep going
+                if (overruns++ % 1000 == 0)
+                {
+                    printf("nflog socket overrun (%lu so far)\n", overruns);
+                }
+                continue;
+            }
+            break;
+        }
+
+        // parse every packet in the batch, then log them together
+        ls.now = time(nullptr);
+        for (int i = 0; i < rv; ++i)
+        {
+            nflog_handle_packet(h, static_cast<char *>(iovecs[i].iov_base),
+                                msgs[i].msg_len);
+        }
+        log_batch(&ls);
+
+        if (ls.now - last_stats >= STATS_INTERVAL)
+        {
+            last_stats = ls.now;
+
+            // share of keys the storage threads skipped as already written
+            uint64_t duplicates = connections.duplicate_keys();
+            uint64_t keys = duplicates + connections.distinct_keys();
+            for (size_t i = 0; i < extra_connections.size(); ++i)
+            {
+                duplicates += extra_connections[i]->duplicate_keys();
+                keys += extra_connections[i]->duplicate_keys() + extra_connections[i]->distinct_keys();
+            }
+
+            // rings summed, plus the deepest one to show an uneven split
+            size_t depth = 0, deepest = 0, capacity = 0;
+            uint64_t pushes = 0, drops = 0;
+            for (size_t i = 0; i < rings.size(); ++i)
+            {
+                depth += rings[i]->depth();
+                deepest = std::max(deepest, rings[i]->depth());
+                capacity += rings[i]->capacity();
+                pushes += rings[i]->pushes();
+                drops += rings[i]->drops();
+            }
+
+            printf("ring depth %zu/%zu (deepest %zu), queued %llu, dropped %llu, store failures %llu, "
+                   "nflog overruns %lu, filter size %llu, archived %llu, duplicate keys %.1f%%, "
+                   "spool depth %llu, spool age %lds, spool drops %llu\n",
+                   depth, capacity, deepest,
+                   static_cast<unsigned long long>(pushes),
+                   static_cast<unsigned long long>(drops),
+                   static_cast<unsigned long long>(failures.load()),
+                   overruns,
+                   static_cast<unsigned long long>(manager.total_size()),
+                   static_cast<unsigned long long>(manager.archived_size()),
+                   keys ? 100.0 * duplicates / keys : 0.0,
+                   static_cast<unsigned long long>(spool ? spool->depth() : 0),
+                   static_cast<long>(spool ? spool->age(ls.now) : 0),
+                   static_cast<unsigned long long>(spool ? spool->drops() : 0));
+        }
+    }
+
+    // let the storage threads drain what is left
+    running = false;
+    for (size_t i = 0; i < storage.size(); ++i)
+    {
+        storage[i].join();
+    }
+    if (replayer.joinable())
+    {
+        replayer.join();
+    }
+    manager.stop();
+
+    printf("unbinding from group %u\n", NFLOG_GROUP);
+    nflog_unbind_group(qh);
+
+    #ifdef INSANE
+    /* normally, applications SHOULD NOT issue this command,
+     * since it detaches other programs/sockets from AF_INET, too ! */
+    printf("unbinding from AF_INET\n");
+    nflog_unbind_pf(h, AF_INET);
+    #endif
+
+    printf("closing handle\n");
+    nflog_close(h);
+
+    return EXIT_SUCCESS;
+}
+
+std::map<std::string, struct device_log_entry> query_edict(conn_log &connections,
+                                                           device_log &devices,
+                                                           struct args_struct args)
+{
+    time_t timestamp;
+
+    std::map<std::string, struct device_log_entry> devices_cache = devices.get_devices();
+
+    if (!parse_timestamp(args.query_timestamp, &timestamp))
+    {
+        throw std::invalid_argument("query_edict: invalid timestamp");
+    }
+
+    if (args.query_version == "v4" &&
+        (args.window || args.query_metadata.find_first_of(",-") != std::string::npos))
+    {
+        port_bitmap source_ports;
+        if (!parse_ports(args.query_metadata, &source_ports))
+        {
+            throw std::invalid_argument("query_edict: invalid IPv4 source ports");
+        }
+
+        connections.set_port_index(open_port_index());
+        return check_ipv4_ports(connections, devices_cache, timestamp - args.window,
+                                timestamp + args.window, source_ports);
+    }
+    else if (args.query_version == "v4")
+    {
+        uint16_t source_port;
+        try
+        {
+            source_port = static_cast<uint16_t>(std::stoi(args.query_metadata));
+        }
+        catch (int e)
+        {
+            throw std::invalid_argument("query_edict: invalid IPv4 source port");
+        }
+
+        return check_ipv4(connections, devices_cache, timestamp, source_port);
+    }
+    else if (args.query_version == "v6")
+    {
+        if (!connections.valid_ipv6(args.query_metadata))
+        {
+            throw std::invalid_argument("query_edict: invalid IPv6 source address");
         }
 
         return check_ipv6(connections, devices_cache, timestamp, args.query_metadata);
@@ -325,48 +952,731 @@ std::map<std::string, struct device_log_entry> query_edict(conn_log connections,
     }
 }
 
-std::map<std::string, struct device_log_entry> check_ipv4(conn_log connections,
-                                                          std::map<std::string, struct device_log_entry> devices,
+typedef std::map<std::string, struct device_log_entry>::value_type device_entry;
+
+/**
+    Index the device log cache by device ID, NULL where an ID is unused.
+*/
+static std::vector<const device_entry *> devices_by_id(const std::map<std::string, struct device_log_entry> &devices)
+{
+    std::vector<const device_entry *> by_id;
+
+    for (std::map<std::string, struct device_log_entry>::const_iterator it = devices.begin(); it != devices.end(); ++it)
+    {
+        if (it->second.id >= by_id.size())
+        {
+            by_id.resize(it->second.id + 1, NULL);
+        }
+        by_id[it->second.id] = &*it;
+    }
+
+    return by_id;
+}
+
+/**
+    Pick the devices a query has to check: the reverse index's candidates
+    that are known devices, or every known device without a usable index.
+*/
+static std::vector<uint32_t> query_devices(const std::vector<const device_entry *> &by_id,
+                                           bool indexed,
+                                           const std::set<uint32_t> &candidates)
+{
+    std::vector<uint32_t> ids;
+
+    if (indexed)
+    {
+        for (std::set<uint32_t>::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
+        {
+            if (*it < by_id.size() && by_id[*it])
+            {
+                ids.push_back(*it);
+            }
+        }
+    }
+    else
+    {
+        // ID 0 is never assigned
+        for (uint32_t id = 1; id < by_id.size(); ++id)
+        {
+            if (by_id[id])
+            {
+                ids.push_back(id);
+            }
+        }
+    }
+
+    return ids;
+}
+
+std::map<std::string, struct device_log_entry> check_ipv4(conn_log &connections,
+                                                          const std::map<std::string, struct device_log_entry> &devices,
                                                           time_t timestamp,
                                                           uint16_t source_port)
 {
     std::map<std::string, struct device_log_entry> has_ipv4;
-    
-    for (std::map<std::string, struct device_log_entry>::iterator it=devices.begin(); it != devices.end(); ++it)
+    std::set<uint32_t> candidates;
+    std::vector<bool> found;
+
+    // with a reverse index only the devices that used the port are checked,
+    // and all of them in one batch either way
+    std::vector<const device_entry *> by_id = devices_by_id(devices);
+    bool indexed = connections.candidates_ipv4(source_port, timestamp, candidates);
+    std::vector<uint32_t> ids = query_devices(by_id, indexed, candidates);
+    connections.has_ipv4(ids, source_port, timestamp, found);
+
+    for (size_t i = 0; i < ids.size(); ++i)
     {
-        // TODO: potential mismatch between MAC formats between device log and conn log
-        // appearance: device log stores w/out colons, conn log stores w/
-        std::string mac = it->first;
-        
-        if (connections.has_ipv4(mac, source_port, timestamp))
+        if (found[i])
         {
-            has_ipv4.insert(std::pair<std::string, struct device_log_entry>(mac, devices[mac]));
+            has_ipv4.insert(*by_id[ids[i]]);
         }
-    } 
+    }
 
     return has_ipv4;
 }
 
-std::map<std::string, struct device_log_entry> check_ipv6(conn_log connections,
-                                                          std::map<std::string, struct device_log_entry> devices,
+std::map<std::string, struct device_log_entry> check_ipv4_ports(conn_log &connections,
+                                                                const std::map<std::string, struct device_log_entry> &devices,
+                                                                time_t from,
+                                                                time_t to,
+                                                                const port_bitmap &ports)
+{
+    std::map<std::string, struct device_log_entry> has_ports;
+    std::set<uint32_t> matches;
+
+    // the index names the devices outright, nothing is left to check
+    if (!connections.exact_ipv4(ports, from, to, matches))
+    {
+        throw std::runtime_error("check_ipv4_ports: could not read the port index; start edict with --port-index=on");
+    }
+
+    std::vector<const device_entry *> by_id = devices_by_id(devices);
+    for (std::set<uint32_t>::iterator it = matches.begin(); it != matches.end(); ++it)
+    {
+        if (*it < by_id.size() && by_id[*it])
+        {
+            has_ports.insert(*by_id[*it]);
+        }
+    }
+
+    return has_ports;
+}
+
+std::map<std::string, struct device_log_entry> check_ipv6(conn_log &connections,
+                                                          const std::map<std::string, struct device_log_entry> &devices,
                                                           time_t timestamp,
                                                           std::string ipv6_address)
 {
     std::map<std::string, struct device_log_entry> has_ipv6;
+    std::set<uint32_t> candidates;
+    std::vector<bool> found;
+
+    // with a reverse index only the devices that used the address are
+    // checked, and all of them in one batch either way
+    std::vector<const device_entry *> by_id = devices_by_id(devices);
+    bool indexed = connections.candidates_ipv6(ipv6_address, timestamp, candidates);
+    std::vector<uint32_t> ids = query_devices(by_id, indexed, candidates);
+    connections.has_ipv6(ids, ipv6_address, timestamp, found);
 
-    for (std::map<std::string, struct device_log_entry>::iterator it=devices.begin(); it != devices.end(); ++it)
+    for (size_t i = 0; i < ids.size(); ++i)
     {
-        std::string mac = it->first;
-        
-        if (connections.has_ipv6(mac, ipv6_address, timestamp))
+        if (found[i])
         {
-            has_ipv6.insert(std::pair<std::string, struct device_log_entry>(mac, devices[mac]));
+            has_ipv6.insert(*by_id[ids[i]]);
         }
-    } 
+    }
 
     return has_ipv6;
 }
 
+bool parse_batch_query(const std::string &text,
+                       struct batch_query &query)
+{
+    std::vector<std::string> fields;
+    size_t start = text.find_first_not_of(" \t,\r");
+
+    while (start != std::string::npos)
+    {
+        size_t end = text.find_first_of(" \t,\r", start);
+        fields.push_back(text.substr(start, end - start));
+        start = text.find_first_not_of(" \t,\r", end);
+    }
+
+    query.text = text;
+    if (fields.size() != 3 || !parse_timestamp(fields[0], &query.timestamp))
+    {
+        return false;
+    }
+
+    if (fields[1] == "v4")
+    {
+        char *end;
+        unsigned long port = strtoul(fields[2].c_str(), &end, 10);
+
+        query.ipv6 = false;
+        query.source_port = static_cast<uint16_t>(port);
+        return *end == '\0' && port <= 65535;
+    }
+    else if (fields[1] == "v6")
+    {
+        query.ipv6 = true;
+        query.source_address = fields[2];
+        return inet_pton(AF_INET6, fields[2].c_str(), query.address) == 1;
+    }
+
+    return false;
+}
+
+/**
+    Escape a string for use inside a JSON string literal.
+*/
+static std::string json_escape(const std::string &text)
+{
+    std::string escaped;
+
+    for (size_t i = 0; i < text.length(); ++i)
+    {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if (c < 0x20)
+        {
+            char code[7];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+
+    return escaped;
+}
+
+std::string format_results_json(const struct batch_query &query,
+                                const std::map<std::string, struct device_log_entry> &results)
+{
+    std::ostringstream json;
+
+    json << "{\"line\":" << query.line
+         << ",\"query\":\"" << json_escape(query.text) << "\""
+         << ",\"matches\":[";
+    for (std::map<std::string, struct device_log_entry>::const_iterator it = results.begin(); it != results.end(); ++it)
+    {
+        char time_buf[sizeof("1111-11-11T11:11:11Z")];
+        strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&it->second.first_seen));
+
+        json << (it == results.begin() ? "" : ",")
+             << "{\"mac\":\"" << json_escape(it->first) << "\""
+             << ",\"make_model\":\"" << json_escape(it->second.make_model) << "\""
+             << ",\"first_seen\":\"" << time_buf << "\"}";
+    }
+    json << "]}";
+
+    return json.str();
+}
+
+/**
+    Format a query that could not be answered as one line of NDJSON.
+*/
+static std::string format_error_json(const struct batch_query &query,
+                                     const std::string &error)
+{
+    return "{\"line\":" + std::to_string(query.line) +
+           ",\"query\":\"" + json_escape(query.text) + "\"" +
+           ",\"error\":\"" + json_escape(error) + "\"}";
+}
+
+void answer_query_group(conn_log &connections,
+                        const std::map<std::string, struct device_log_entry> &devices,
+                        const std::vector<struct batch_query> &group,
+                        std::ostream &out,
+                        std::mutex &out_lock)
+{
+    std::vector<std::vector<uint32_t> > ids(group.size());
+    std::vector<uint32_t> every_device;
+    std::vector<bool> indexed(group.size());
+    std::vector<bool> found;
+    std::vector<std::string> lines;
+    key_batch keys;
+    char key[FLOW_KEY_BYTES];
+    size_t first = 0;
+
+    // without a usable index every query checks every device; list them once
+    std::vector<const device_entry *> by_id = devices_by_id(devices);
+    std::set<uint32_t> none;
+    every_device = query_devices(by_id, false, none);
+
+    for (size_t i = 0; i < group.size(); ++i)
+    {
+        const struct batch_query &query = group[i];
+        std::set<uint32_t> candidates;
+
+        indexed[i] = query.ipv6 ?
+            connections.candidates_ipv6(query.source_address, query.timestamp, candidates) :
+            connections.candidates_ipv4(query.source_port, query.timestamp, candidates);
+        if (indexed[i])
+        {
+            ids[i] = query_devices(by_id, true, candidates);
+        }
+
+        const std::vector<uint32_t> &checked = indexed[i] ? ids[i] : every_device;
+        for (size_t j = 0; j < checked.size(); ++j)
+        {
+            char *end = query.ipv6 ?
+                pack_key_ipv6(checked[j], query.address, key) :
+                pack_key_ipv4(checked[j], query.source_port, key);
+            keys.add(key, end - key);
+        }
+
+        // send the batch once it is full, or at the end of the group
+        if (keys.size() < QUERY_BATCH_KEYS && i + 1 < group.size())
+        {
+            continue;
+        }
+
+        lines.clear();
+        try
+        {
+            connections.has_keys(keys, query.timestamp, found);
+
+            size_t k = 0;
+            for (size_t q = first; q <= i; ++q)
+            {
+                const std::vector<uint32_t> &probed = indexed[q] ? ids[q] : every_device;
+                std::map<std::string, struct device_log_entry> results;
+
+                for (size_t j = 0; j < probed.size(); ++j, ++k)
+                {
+                    if (found[k])
+                    {
+                        results.insert(*by_id[probed[j]]);
+                    }
+                }
+                lines.push_back(format_results_json(group[q], results));
+            }
+        }
+        catch (std::exception &e)
+        {
+            lines.clear();
+            for (size_t q = first; q <= i; ++q)
+            {
+                lines.push_back(format_error_json(group[q], e.what()));
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(out_lock);
+            for (size_t l = 0; l < lines.size(); ++l)
+            {
+                out << lines[l] << "\n";
+            }
+            out.flush();
+        }
+
+        keys.clear();
+        first = i + 1;
+    }
+}
+
+int query_batch(device_log &devices,
+                const struct args_struct &args)
+{
+    std::ifstream file;
+    std::istream *in = &std::cin;
+
+    if (args.query_file != "-")
+    {
+        file.open(args.query_file.c_str());
+        if (!file)
+        {
+            std::cerr << "query-batch: could not open " << args.query_file << "\n";
+            return EXIT_FAILURE;
+        }
+        in = &file;
+    }
+
+    // read the device log once, and connect each worker once, for every query
+    const std::map<std::string, struct device_log_entry> devices_cache = devices.get_devices();
+    std::vector<std::shared_ptr<conn_log> > connections;
+    for (unsigned int i = 0; i < args.query_threads; ++i)
+    {
+        connections.push_back(std::make_shared<conn_log>(args.backend));
+        connections.back()->set_fine_window(args.fine_window);
+    }
+
+    std::mutex out_lock;
+    std::string text;
+    size_t line = 0;
+
+    while (*in)
+    {
+        // group a chunk of queries by the filters they probe
+        std::map<std::vector<std::string>, std::vector<struct batch_query> > groups;
+        std::vector<std::string> probes;
+        for (unsigned int read = 0; read < QUERY_CHUNK && std::getline(*in, text); ++read)
+        {
+            struct batch_query query;
+            query.line = ++line;
+
+            if (text.find_first_not_of(" \t\r") == std::string::npos || text[0] == '#')
+            {
+                continue;
+            }
+            else if (!parse_batch_query(text, query))
+            {
+                std::lock_guard<std::mutex> guard(out_lock);
+                std::cout << format_error_json(query, "invalid query") << "\n";
+                continue;
+            }
+
+            connections[0]->probe_filters(query.timestamp, probes);
+            groups[probes].push_back(query);
+        }
+
+        std::vector<const std::vector<struct batch_query> *> work;
+        for (std::map<std::vector<std::string>, std::vector<struct batch_query> >::iterator it = groups.begin(); it != groups.end(); ++it)
+        {
+            work.push_back(&it->second);
+        }
+
+        // each worker takes the next unanswered group
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < connections.size() && i < work.size(); ++i)
+        {
+            workers.push_back(std::thread([&, i]()
+            {
+                for (size_t w = next++; w < work.size(); w = next++)
+                {
+                    answer_query_group(*connections[i], devices_cache, *work[w], std::cout, out_lock);
+                }
+            }));
+        }
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            workers[i].join();
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+std::shared_ptr<const std::map<std::string, struct device_log_entry> > serve_devices(struct serve_state *state)
+{
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    // a stat() and, only if devices were added, a short read
+    if (state->devices->refresh() || !state->device_table)
+    {
+        state->device_table = std::make_shared<const std::map<std::string, struct device_log_entry> >(state->devices->get_devices());
+
+        // cached results may be missing devices that were just added
+        state->results.clear();
+    }
+
+    // and they may still have a device that was just purged
+    struct stat st;
+    off_t purged = stat(state->purge_log.c_str(), &st) == 0 ? st.st_size : 0;
+    if (purged != state->purged)
+    {
+        state->results.clear();
+        state->purged = purged;
+    }
+
+    return state->device_table;
+}
+
+std::string answer_request(conn_log &connections,
+                           struct serve_state *state,
+                           const std::string &request,
+                           size_t number)
+{
+    struct batch_query query;
+    query.line = number;
+
+    if (!parse_batch_query(request, query))
+    {
+        return format_error_json(query, "invalid query");
+    }
+
+    std::shared_ptr<const std::map<std::string, struct device_log_entry> > devices = serve_devices(state);
+    std::map<std::string, struct device_log_entry> results;
+
+    // the same query always has the same answer once its timeslots are over
+    time_t last_slot = std::max(query.timestamp / static_cast<time_t>(FILTER_LENGTH),
+                                connections.fuzzy_slot(query.timestamp));
+    bool cacheable = (last_slot + 1) * static_cast<time_t>(FILTER_LENGTH) + SERVE_CACHE_DELAY <= time(nullptr);
+
+    // keyed on the canonical form of the query
+    std::string key = std::to_string(query.timestamp) + " v4 " + std::to_string(query.source_port);
+    if (query.ipv6)
+    {
+        char address[INET6_ADDRSTRLEN];
+        format_address(6, query.address, address);
+        key = std::to_string(query.timestamp) + " v6 " + address;
+    }
+
+    if (cacheable && state->results.get(key, results))
+    {
+        return format_results_json(query, results);
+    }
+
+    try
+    {
+        results = query.ipv6 ?
+            check_ipv6(connections, *devices, query.timestamp, query.source_address) :
+            check_ipv4(connections, *devices, query.timestamp, query.source_port);
+    }
+    catch (std::exception &e)
+    {
+        return format_error_json(query, e.what());
+    }
+
+    if (cacheable)
+    {
+        state->results.put(key, results);
+    }
+
+    return format_results_json(query, results);
+}
+
+/**
+    edict serve worker: accept connections and answer their requests, one
+    line each, until the listening socket is closed.
+*/
+static void serve_clients(int listener,
+                          conn_log *connections,
+                          struct serve_state *state)
+{
+    for (;;)
+    {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            break;
+        }
+
+        // a client that stops sending must not hold this worker forever
+        struct timeval timeout{};
+        timeout.tv_sec = SERVE_TIMEOUT;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::string pending;
+        size_t number = 0;
+        char buffer[4096];
+        ssize_t received;
+
+        while ((received = recv(client, buffer, sizeof(buffer), 0)) > 0)
+        {
+            pending.append(buffer, received);
+
+            // answer every complete line received so far, in one write
+            std::string replies;
+            size_t newline;
+            while ((newline = pending.find('\n')) != std::string::npos)
+            {
+                std::string request = pending.substr(0, newline);
+                pending.erase(0, newline + 1);
+
+                replies += answer_request(*connections, state, request, ++number);
+                replies += '\n';
+            }
+
+            for (size_t sent = 0; sent < replies.length(); )
+            {
+                ssize_t written = send(client, replies.data() + sent, replies.length() - sent, MSG_NOSIGNAL);
+                if (written <= 0)
+                {
+                    received = 0;
+                    break;
+                }
+                sent += written;
+            }
+            if (received <= 0)
+            {
+                break;
+            }
+        }
+
+        close(client);
+    }
+}
+
+int serve_edict(device_log &devices,
+                const struct args_struct &args)
+{
+    struct sockaddr_un address{};
+    if (args.serve_socket.length() >= sizeof(address.sun_path))
+    {
+        std::cerr << "serve: socket path too long: " << args.serve_socket << "\n";
+        return EXIT_FAILURE;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, args.serve_socket.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(args.serve_socket.c_str());
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0 ||
+        listen(listener, SOMAXCONN) < 0)
+    {
+        std::cerr << "serve: could not listen on " << args.serve_socket << ": " << strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+
+    // the web interface runs as another user in the same group
+    chmod(args.serve_socket.c_str(), 0660);
+
+    // warm everything up before the first request
+    struct serve_state state;
+    state.devices = &devices;
+    serve_devices(&state);
+
+    std::vector<std::shared_ptr<conn_log> > connections;
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < SERVE_THREADS; ++i)
+    {
+        connections.push_back(std::make_shared<conn_log>(args.backend));
+        connections[i]->set_fine_window(args.fine_window);
+        workers.push_back(std::thread(serve_clients, listener, connections[i].get(), &state));
+    }
+
+    std::cerr << "serve: listening on " << args.serve_socket << "\n";
+    for (unsigned int i = 0; i < workers.size(); ++i)
+    {
+        workers[i].join();
+    }
+
+    close(listener);
+    unlink(args.serve_socket.c_str());
+
+    return EXIT_SUCCESS;
+}
+
+int print_stats(const struct args_struct &args)
+{
+    std::shared_ptr<filter_store> store = open_store(args.backend);
+    std::map<std::string, uint64_t> names = store->list();
+    std::map<std::string, uint64_t> archived = store->archived();
+    names.insert(archived.begin(), archived.end());
+
+    std::cout << std::left << std::setw(12) << "filter" << std::right
+              << std::setw(14) << "keys" << std::setw(14) << "capacity"
+              << std::setw(14) << "bytes" << std::setw(12) << "fp rate" << "\n";
+    for (std::map<std::string, uint64_t>::iterator it = names.begin(); it != names.end(); ++it)
+    {
+        struct filter_stats stats;
+        if (!store->stats(it->first, stats))
+        {
+            continue;
+        }
+
+        std::cout << std::left << std::setw(12) << it->first << std::right
+                  << std::setw(14) << stats.keys
+                  << std::setw(14) << (stats.capacity ? std::to_string(stats.capacity) : "-")
+                  << std::setw(14) << stats.size
+                  << std::setw(12) << std::setprecision(3) << stats.probability << "\n";
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int purge_device(device_log &devices,
+                 const struct args_struct &args)
+{
+    uint64_t mac;
+    if (!parse_mac(args.purge_mac, &mac))
+    {
+        std::cerr << "purge: invalid MAC address " << args.purge_mac << "\n";
+        return EXIT_FAILURE;
+    }
+
+    uint32_t device = devices.device_id(mac);
+    if (!device)
+    {
+        std::cerr << "purge: no connections logged for " << args.purge_mac << "\n";
+        return EXIT_FAILURE;
+    }
+    if (devices.should_log(mac))
+    {
+        std::cerr << "purge: warning: " << args.purge_mac << " is not in " << DNT_FILE
+                  << ", so its new connections will still be logged\n";
+    }
+
+    std::shared_ptr<filter_store> store = open_store(args.backend);
+    std::map<std::string, uint64_t> names = store->list();
+    std::map<std::string, uint64_t> archived = store->archived();
+    names.insert(archived.begin(), archived.end());
+
+    uint64_t keys = 0;
+    size_t filters = 0;
+    for (std::map<std::string, uint64_t>::iterator it = names.begin(); it != names.end(); ++it)
+    {
+        time_t period;
+        unsigned int length;
+        if (!conn_log::parse_filter_name(it->first, &period, &length))
+        {
+            continue;
+        }
+
+        uint64_t removed = 0;
+        if (!store->purge(it->first, device, &removed))
+        {
+            std::cerr << "purge: backend " << args.backend << " can't delete keys; "
+                      << "log to --backend=cuckoo to be able to purge devices\n";
+            return EXIT_FAILURE;
+        }
+        keys += removed;
+        filters += removed ? 1 : 0;
+    }
+
+    // the indexes still show the device was there
+    uint64_t entries = 0;
+    try
+    {
+        entries = open_index()->purge(device);
+    }
+    catch (std::runtime_error &e)
+    {
+        std::cerr << "purge: " << e.what() << "\n";
+    }
+
+    uint64_t records = 0;
+    try
+    {
+        records = open_port_index()->purge(device);
+    }
+    catch (std::runtime_error &e)
+    {
+        std::cerr << "purge: " << e.what() << "\n";
+    }
+
+    // a running edict serve may have cached results with the device
+    std::ofstream log(PURGE_LOG, std::ios::app);
+    log << time(nullptr) << " " << args.purge_mac << "\n";
+    if (!log)
+    {
+        std::cerr << "purge: could not write " << PURGE_LOG << "; restart edict serve to forget "
+                  << args.purge_mac << "\n";
+    }
+
+    std::cout << "purge: removed " << keys << " keys from " << filters << " of "
+              << names.size() << " filters, " << entries << " index entries and "
+              << records << " port records\n";
+
+    return EXIT_SUCCESS;
+}
+
 void print_results(std::map<std::string, struct device_log_entry> results,
                    std::string format)
 {
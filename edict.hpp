@@ -11,22 +11,33 @@
 //=============================================================================
 
 #include <arpa/inet.h>
+#include <atomic>
+#include <errno.h>
 #include <fcntl.h>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <thread>
 #include <time.h>
 #include <unordered_set>
 #include <unistd.h>
+#include <vector>
 
 extern "C"
 {
@@ -34,15 +45,103 @@ extern "C"
 }
 
 #include "libs/conn_log/conn_log.hpp"
+#include "libs/conn_log/filter_manager.hpp"
+#include "libs/conn_log/local_store.hpp"
 #include "libs/device_log/device_log.hpp"
+#include "libs/flow_record/flow_record.hpp"
+#include "libs/flow_spool/flow_spool.hpp"
+#include "libs/lru_cache/lru_cache.hpp"
+#include "libs/ring_buffer/ring_buffer.hpp"
+
+const unsigned int NFLOG_GROUP = 2;     /**< NFLOG group EDICT listens on */
+const unsigned int NFLOG_RECV_BATCH = 16;
+                                        /**< max netlink datagrams drained
+                                             per recvmmsg() wakeup */
+const unsigned int NFLOG_BUFFER_SIZE = 65536;
+                                        /**< size of each datagram buffer
+                                             (bytes), also the kernel-side
+                                             nflog buffer size */
+const unsigned int NFLOG_QTHRESH = 64;  /**< packets the kernel queues
+                                             before flushing a datagram */
+const unsigned int NFLOG_TIMEOUT = 10;  /**< max time the kernel holds a
+                                             partial datagram (1/100 s) */
+const unsigned int FLOW_BATCH_SIZE = NFLOG_RECV_BATCH * NFLOG_QTHRESH;
+                                        /**< flow records parsed before
+                                             they are logged as a batch */
+const unsigned int STORAGE_THREADS = 1;/**< default number of threads
+                                             storing flows, each draining
+                                             its own flow ring */
+const unsigned int FLOW_RING_SIZE = 65536;
+                                        /**< default capacity of each flow
+                                             ring */
+const char FLOW_RING_OVERFLOW[] = "drop-newest";
+                                        /**< default flow ring overflow
+                                             policy, see ring_buffer.hpp */
+const unsigned int STATS_INTERVAL = 60; /**< how often to print capture
+                                             statistics (seconds) */
+const int NFLOG_SOCKET_BUFFER = 8388608;/**< netlink socket receive
+                                             buffer (bytes) */
+const unsigned int QUERY_THREADS = 4;   /**< default number of query-batch
+                                             worker threads */
+const unsigned int QUERY_CHUNK = 4096;  /**< query-batch lines read, grouped
+                                             and answered at a time */
+const unsigned int QUERY_BATCH_KEYS = 65536;
+                                        /**< max keys query-batch checks in
+                                             one has_keys() call */
+const char SERVE_SOCKET[] = "/var/run/edict.sock";
+                                        /**< default Unix socket edict serve
+                                             listens on */
+const unsigned int SERVE_THREADS = 4;   /**< edict serve worker threads, each
+                                             with its own conn_log */
+const char PURGE_LOG[] = "/var/lib/edict/purges.log";
+                                        /**< edict purge appends each device
+                                             it purged; edict serve empties
+                                             its result cache as it grows */
+const unsigned int SERVE_TIMEOUT = 10;  /**< seconds edict serve waits for
+                                             a client's next request */
+const unsigned int SERVE_CACHE_SIZE = 4096;
+                                        /**< query results edict serve keeps */
+const unsigned int SERVE_CACHE_DELAY = 60;
+                                        /**< results are only cached once
+                                             their timeslots ended this long
+                                             ago (seconds) */
+const unsigned int SPOOL_PENDING = 4096;
+                                        /**< flows a storage thread keeps
+                                             for the spool before forcing
+                                             a flush */
+const unsigned int SPOOL_REPLAY_BATCH = 4096;
+                                        /**< spooled flows replayed per
+                                             flush */
+const unsigned int SPOOL_POLL_INTERVAL = 100;
+                                        /**< how often an idle replayer
+                                             checks the spool (ms) */
+const unsigned int SPOOL_RETRY_INTERVAL = 1;
+                                        /**< wait after a failed replay
+                                             (seconds) */
+const unsigned int SPOOL_BACKOFF = 5;   /**< after a backend failure, the
+                                             storage threads spool their
+                                             flows this long before trying
+                                             the backend again (seconds) */
+
+/**
+    Flow rings, one per storage thread. The capture thread is the only
+    producer and each storage thread the only consumer of its ring.
+*/
+typedef std::vector<std::unique_ptr<ring_buffer<struct flow_record> > > flow_rings;
 
 /**
     Store logs, used for passing logs to log_packet via callback and void* ptr.
 */
 struct log_struct
 {
-    conn_log *connections;
+    flow_rings *rings;          /**< hand flows to storage */
+    flow_spool *spool;          /**< takes the flows a full ring turns
+                                     away, or NULL */
     device_log *devices;
+    struct flow_record *batch;  /**< flows parsed from the current recvmmsg() */
+    unsigned int batch_size;    /**< number of flows in batch */
+    time_t now;                 /**< timestamp of the current recvmmsg() */
+    bool verbose;               /**< print every logged packet */
 };
 
 /**
@@ -55,6 +154,56 @@ struct args_struct
     std::string query_version;
     std::string query_metadata;
     std::string print_format;
+    bool verbose;
+    unsigned int storage_threads;
+    unsigned int ring_size;
+    std::string ring_overflow;
+    uint64_t filter_budget;
+    time_t retention;
+    std::vector<struct rollup_rule> rollups;
+    time_t fine_window;
+    double fp_rate;
+    bool port_index;
+    time_t window;
+    std::string backend;
+    std::string query_file;
+    unsigned int query_threads;
+    std::string serve_socket;
+    std::string purge_mac;
+};
+
+/**
+    One line of query-batch input: "<timestamp> <version> <metadata>".
+*/
+struct batch_query
+{
+    size_t line;                /**< line number in the input, from 1 */
+    std::string text;           /**< the line, for error output */
+    time_t timestamp;           /**< time_t-encoded timestamp */
+    bool ipv6;                  /**< v6 (source address) or v4 (source port) */
+    uint16_t source_port;       /**< v4 source port */
+    std::string source_address; /**< v6 source address, as given */
+    uint8_t address[16];        /**< v6 source address, binary */
+};
+
+/**
+    State shared by edict serve's worker threads.
+*/
+struct serve_state
+{
+    device_log *devices;        /**< refreshed before each request */
+    std::mutex lock;            /**< guards devices and device_table */
+    std::shared_ptr<const std::map<std::string, struct device_log_entry> > device_table;
+                                /**< current device log cache */
+    lru_cache<std::string, std::map<std::string, struct device_log_entry> > results;
+                                /**< results of finished timeslots' queries */
+    std::string purge_log;      /**< see PURGE_LOG */
+    off_t purged;               /**< size of purge_log when results were
+                                     last emptied, -1 before */
+
+    serve_state() : devices(NULL), results(SERVE_CACHE_SIZE), purge_log(PURGE_LOG), purged(-1)
+    {
+    }
 };
 
 /**
@@ -70,11 +219,52 @@ struct args_struct
 struct args_struct parse_args(int arg_count,
                               char **arg_vector);
 
+/**
+    Parse a single "--name=value" option into a struct args_struct.
+
+    \param option Command-line option, ex "--storage-threads=4".
+    \param args struct args_struct to store the option's value in.
+
+    \return Boolean indicator of the option's validity.
+*/
+bool parse_option(const std::string &option,
+                  struct args_struct &args);
+
+/**
+    Parse an ISO 8601 timestamp in UTC, ex "2018-01-01T12:00:00Z".
+
+    \param text String-encoded timestamp.
+    \param timestamp Set to the time_t-encoded timestamp.
+
+    \return Boolean indicator of the timestamp's validity.
+*/
+bool parse_timestamp(const std::string &text,
+                     time_t *timestamp);
+
+/**
+    Parse a list of TCP/UDP ports and port ranges, ex "80,443,1024-2047".
+
+    \param text Comma-separated ports and "<first>-<last>" ranges.
+    \param ports Set the ports are added to.
+
+    \return Boolean indicator of the list's validity.
+*/
+bool parse_ports(const std::string &text,
+                 port_bitmap *ports);
+
 /**
     Print the command line arguments' help to stdout.
 */
 void print_help();
 
+/**
+    Pretty print a flow record to stdout. This is the only place the
+    capture path converts addresses to text.
+
+    \param flow Flow record to print.
+*/
+void pprint_flow(const struct flow_record &flow);
+
 /**
     Pretty print a packet's metadata to stdout.
 
@@ -84,23 +274,103 @@ void print_help();
     \param source_port uint16_t-encoded source TCP/UDP port
     \param dest_port uint16_t-encoded destination TCP/UDP port
 */
-void pprint_packet(std::string mac_address,
-                  std::string source_address,
-                  std::string dest_address,
-                  uint16_t source_port,
-                  uint16_t dest_port);
+void pprint_packet(const std::string &mac_address,
+                   const std::string &source_address,
+                   const std::string &dest_address,
+                   uint16_t source_port,
+                   uint16_t dest_port);
 
 /**
-    Log a packet into the device_log and conn_log.
+    Log a parsed packet into the device_log and queue it for the conn_log.
 
-    \param ldata Pointer to packet's nflog metadata.
+    \param flow Flow record parsed from the packet's nflog data; its device
+        ID is filled in.
+    \param rings Flow rings drained by the storage threads.
+    \param spool Spool for the flows a full ring turns away, or NULL.
+    \param verbose Print the packet to stdout.
 */
-static int log_packet(struct nflog_data *ldata,
-                      conn_log connections,
-                      device_log devices);
+static int log_packet(struct flow_record *flow,
+                      flow_rings *rings,
+                      flow_spool *spool,
+                      device_log *devices,
+                      bool verbose);
 
 /**
-    Establish a callback function for the packet's data.
+    Pick the storage thread for a device's flows. Every flow of a device
+    goes to the same thread, so each thread's recent keys cache only sees
+    its share of the devices.
+
+    \param device Device ID.
+    \param shards Number of storage threads.
+
+    \return Index of the storage thread, below shards.
+*/
+size_t storage_shard(uint32_t device,
+                     size_t shards);
+
+/**
+    Add a single flow record to the conn_log.
+
+    \param flow Flow record taken from the ring buffer.
+*/
+void store_flow(const struct flow_record &flow,
+                conn_log *connections);
+
+/**
+    Storage thread: drain the ring buffer into a conn_log until
+    capture stops and the ring is empty. Flows the conn_log fails to store,
+    and every flow for SPOOL_BACKOFF seconds after the backend failed, go
+    to the spool.
+
+    \param ring Ring buffer filled by the capture thread.
+    \param spool Spool for flows the backend can't take, or NULL.
+    \param running Cleared by the capture thread when it stops.
+    \param failures Count of flows the conn_log failed to store.
+    \param failed Time the backend last failed, shared with the other
+        storage threads and the replayer.
+*/
+void store_flows(ring_buffer<struct flow_record> *ring,
+                 conn_log *connections,
+                 flow_spool *spool,
+                 const std::atomic<bool> *running,
+                 std::atomic<uint64_t> *failures,
+                 std::atomic<time_t> *failed);
+
+/**
+    Replayer thread: store spooled flows, oldest first and under their
+    original timestamps, retrying (and reconnecting) until the backend
+    takes them.
+
+    \param spool Spool filled by the storage threads.
+    \param backend Backend option, as for conn_log.
+    \param retention Flows older than this (seconds) are dropped, 0 for
+        no limit.
+    \param fine_window Time one-minute filters are kept (seconds), see
+        conn_log::set_fine_window().
+    \param port_index Record source ports in the exact port index too,
+        see conn_log::set_port_index().
+    \param running Cleared by the capture thread when it stops.
+    \param failed Set to the time of each failed replay, or NULL.
+*/
+void replay_spool(flow_spool *spool,
+                  const std::string &backend,
+                  time_t retention,
+                  time_t fine_window,
+                  bool port_index,
+                  const std::atomic<bool> *running,
+                  std::atomic<time_t> *failed);
+
+/**
+    Log every flow record parsed during the current recvmmsg() batch,
+    then empty the batch.
+
+    \param ls Pointer to the logs and batch shared with cb().
+*/
+static void log_batch(struct log_struct *ls);
+
+/**
+    Establish a callback function for the packet's data. The packet is
+    only parsed into the batch here; it is logged by log_batch().
 */
 static int cb(struct nflog_g_handle *gh,
               struct nfgenmsg *nfmsg,
@@ -108,20 +378,27 @@ static int cb(struct nflog_g_handle *gh,
               void *data);
 
 /**
-    Start (or restart) EDICT's device and connection logging.
+    Start (or restart) EDICT's device and connection logging. The calling
+    thread captures packets; args.storage_threads threads store them, each
+    from its own flow ring and over its own backend connection.
+
+    \param args struct args_struct containing the start options.
 */
-int start_edict(conn_log connections,
-                device_log devices);
+int start_edict(conn_log &connections,
+                device_log &devices,
+                const struct args_struct &args);
 
 /**
     Query EDICT's logs for a specific TCP/UDP connection, defined in an args_struct.
+    IPv4 queries for a port range or set, or with a window, are answered
+    from the exact port index instead of the filters; see check_ipv4_ports().
 
     \param devices Device log cache, as stored as a std::map<std::string, struct device_log_entry>,
         where the std::string key is a MAC address.
     \param args struct args_struct containing the metadata to search for
 */
-std::map<std::string, struct device_log_entry> query_edict(conn_log connections,
-                                                           device_log devices,
+std::map<std::string, struct device_log_entry> query_edict(conn_log &connections,
+                                                           device_log &devices,
                                                            struct args_struct args);
 
 /**
@@ -134,11 +411,30 @@ std::map<std::string, struct device_log_entry> query_edict(conn_log connections,
 
     \return std::map of (MAC_address, device_log_entry) of all matching connections
 */
-std::map<std::string, struct device_log_entry> check_ipv4(conn_log connections,
-                                                          std::map<std::string, struct device_log_entry> devices,
+std::map<std::string, struct device_log_entry> check_ipv4(conn_log &connections,
+                                                          const std::map<std::string, struct device_log_entry> &devices,
                                                           time_t timestamp,
                                                           uint16_t source_port);
 
+/**
+    Check EDICT's exact port index for IPv4 connections from any of a set
+    of source ports during a window. There are no false positives.
+
+    \param devices Device log cache, as stored as a std::map<std::string, struct device_log_entry>,
+        where the std::string key is a MAC address.
+    \param from time_t-encoded start of the window (in UTC, if applicable)
+    \param to time_t-encoded end of the window, inclusive
+    \param ports TCP/UDP source ports to look for, ex a range
+
+    \return std::map of (MAC_address, device_log_entry) of all matching connections.
+        Throws std::runtime_error if the index can't be read.
+*/
+std::map<std::string, struct device_log_entry> check_ipv4_ports(conn_log &connections,
+                                                                const std::map<std::string, struct device_log_entry> &devices,
+                                                                time_t from,
+                                                                time_t to,
+                                                                const port_bitmap &ports);
+
 /**
     Check EDICT's connection log for a specific IPv6 connection.
 
@@ -149,11 +445,133 @@ std::map<std::string, struct device_log_entry> check_ipv4(conn_log connections,
 
     \return std::map of (MAC_address, device_log_entry) of all matching connections
 */
-std::map<std::string, struct device_log_entry> check_ipv6(conn_log connections,
-                                                          std::map<std::string, struct device_log_entry> devices,
+std::map<std::string, struct device_log_entry> check_ipv6(conn_log &connections,
+                                                          const std::map<std::string, struct device_log_entry> &devices,
                                                           time_t timestamp,
                                                           std::string ipv6_address);
 
+/**
+    Parse one line of query-batch input, "<timestamp> <version> <metadata>"
+    separated by spaces, tabs or commas.
+
+    \param text The line.
+    \param query struct batch_query to store the parsed line in.
+
+    \return Boolean indicator of the line's validity.
+*/
+bool parse_batch_query(const std::string &text,
+                       struct batch_query &query);
+
+/**
+    Answer a group of query-batch queries that probe the same filters (see
+    conn_log::probe_filters), so all of their probes go out in the same
+    has_keys() batches. Each result is written as one line of
+    NDJSON as soon as its batch completes.
+
+    \param connections The calling worker's own conn_log.
+    \param devices Device log cache, shared by every worker.
+    \param group Queries to answer.
+    \param out Stream to write results to.
+    \param out_lock Guards out between workers.
+*/
+void answer_query_group(conn_log &connections,
+                        const std::map<std::string, struct device_log_entry> &devices,
+                        const std::vector<struct batch_query> &group,
+                        std::ostream &out,
+                        std::mutex &out_lock);
+
+/**
+    Run the query-batch command: read queries from a file (or stdin, "-")
+    QUERY_CHUNK lines at a time, group each chunk by timeslot, answer the
+    groups on args.query_threads workers with their own conn_logs, and
+    stream the results to stdout as NDJSON.
+
+    \param devices Device log, read once for every query.
+    \param args struct args_struct containing the input file and options.
+
+    \return EXIT_SUCCESS, or EXIT_FAILURE if the input can't be opened.
+*/
+int query_batch(device_log &devices,
+                const struct args_struct &args);
+
+/**
+    Get edict serve's device log cache, reloading it (and emptying the
+    result cache) first if devices were logged since it was loaded. The
+    result cache is also emptied once a device was purged.
+
+    \param state Shared serve state.
+
+    \return The device log cache, valid for as long as it is held.
+*/
+std::shared_ptr<const std::map<std::string, struct device_log_entry> > serve_devices(struct serve_state *state);
+
+/**
+    Answer one edict serve request, a query-batch line, from the result
+    cache or with a worker's conn_log.
+
+    \param connections The calling worker's own conn_log.
+    \param state Shared serve state.
+    \param request Request line, "<timestamp> <version> <metadata>".
+    \param number Request's number on its connection, from 1.
+
+    \return One line of NDJSON, as query-batch, without the newline.
+*/
+std::string answer_request(conn_log &connections,
+                           struct serve_state *state,
+                           const std::string &request,
+                           size_t number);
+
+/**
+    Run the serve command: listen on a Unix socket and answer requests,
+    one per line, on SERVE_THREADS workers that each accept connections
+    with their own conn_log. The device log, backend connections and
+    recent results stay warm between requests.
+
+    \param devices Device log.
+    \param args struct args_struct containing the socket path and options.
+
+    \return EXIT_FAILURE if the socket can't be set up; otherwise runs
+        until killed.
+*/
+int serve_edict(device_log &devices,
+                const struct args_struct &args);
+
+/**
+    Run the stats command: print every filter in the backend, in memory or
+    archived, with its keys, capacity, size and estimated false positive
+    rate.
+
+    \param args struct args_struct containing the backend.
+
+    \return EXIT_SUCCESS.
+*/
+int print_stats(const struct args_struct &args);
+
+/**
+    Run the purge command: remove every key of one device from every
+    filter in the backend, in memory or archived, and from the reverse and
+    port indexes. Only backends that can delete keys (cuckoo) can purge.
+
+    \param devices Device log, to look up the device's ID.
+    \param args struct args_struct containing the MAC and the backend.
+
+    \return EXIT_SUCCESS, or EXIT_FAILURE if the MAC is invalid or unknown,
+        or the backend can't delete keys.
+*/
+int purge_device(device_log &devices,
+                 const struct args_struct &args);
+
+/**
+    Format a query's results as one line of NDJSON.
+
+    \param query The query, echoed back in the output.
+    \param results Matching devices, as returned from check_ipv4/ipv6.
+
+    \return JSON object, without a trailing newline.
+*/
+std::string format_results_json(const struct batch_query &query,
+                                const std::map<std::string, struct device_log_entry> &results);
+
 /**
     Print a query's results, formatted properly.
 
@@ -20,20 +20,43 @@ int main(int argc, char **argv)
     
     if (args.command == "start")
     {
-        conn_log connections;
+        conn_log connections(args.backend);
         device_log devices;
-        start_edict(connections, devices); 
+        start_edict(connections, devices, args);
     } 
     else if (args.command == "query")
     {
-        conn_log connections;
+        conn_log connections(args.backend);
         device_log devices;
+        connections.set_fine_window(args.fine_window);
 
         std::cout << "format: " << args.print_format << "\n";
 
         print_results(query_edict(connections, devices, args),
                       args.print_format);
     }
+    else if (args.command == "query-batch")
+    {
+        device_log devices;
+
+        return query_batch(devices, args);
+    }
+    else if (args.command == "serve")
+    {
+        device_log devices;
+
+        return serve_edict(devices, args);
+    }
+    else if (args.command == "stats")
+    {
+        return print_stats(args);
+    }
+    else if (args.command == "purge")
+    {
+        device_log devices;
+
+        return purge_device(devices, args);
+    }
     else if (args.command == "help")
     {
         print_help();
@@ -3,6 +3,7 @@ var fs = require('fs');
 var handlebars = require('handlebars');
 var http = require('http');
 var moment = require('moment-timezone');
+var net = require('net');
 var path = require('path');
 var sanitizer = require('sanitizer');
 var url = require('url');
@@ -10,6 +11,7 @@ var util = require('util');
 
 var baseDirectory = __dirname + "/www/";
 var port = 8000;
+var edictSocket = '/var/run/edict.sock';  // see "edict serve"
 
 var server = http.createServer(function (request, response)
 {
@@ -56,10 +58,6 @@ var server = http.createServer(function (request, response)
                 console.log('\nRequest:')
                 console.log(fields);
                 
-                var sys = require('sys')
-                var exec = require('child_process').exec;
-                var data;
-                
                 var sanitized_timestamp = sanitizer.escape(fields.timestamp);
                 var sanitized_source_port = sanitizer.escape(fields.source_port);
                 var sanitized_source_address = sanitizer.escape(fields.source_address);
@@ -69,27 +67,102 @@ var server = http.createServer(function (request, response)
                 **/
                 var utc_timestamp = moment.tz(sanitized_timestamp, 'UTC').format().substr(0,19) + "Z";
 
-                var command = "../query/query " + utc_timestamp + " v4 " + sanitized_source_port;
+                // one request line to the resident query daemon, one JSON line back
+                var query = sanitized_source_address ?
+                    utc_timestamp + " v6 " + sanitized_source_address :
+                    utc_timestamp + " v4 " + sanitized_source_port;
+                var reply = '';
 
-                
-                function puts(error, stdout, stderr)
+                function respond(device)
                 {
-                    var data = {
-                        device: stdout.split('START')[1].split('END')[0],
-                    };
-
                     var template = handlebars.compile(source);
-                    var html = template(data);
+                    var html = template({device: device});
                     
                     response.writeHead(200);
                     response.write(html);
                     response.end();
 
                     console.log('Reply:')
-                    console.log(stdout.split('START')[1].split('END')[0]);
+                    console.log(device);
                 }
 
-                exec(command, puts);
+                var client = net.createConnection(edictSocket, function()
+                {
+                    client.write(query.replace(/[\r\n]/g, ' ') + "\n");
+                });
+
+                var answered = false;
+
+                client.setTimeout(10000);
+
+                client.on('data', function(chunk)
+                {
+                    reply += chunk;
+                    if (reply.indexOf("\n") < 0 || answered)
+                    {
+                        return;
+                    }
+                    answered = true;
+                    client.end();
+
+                    var result;
+                    try
+                    {
+                        result = JSON.parse(reply.split("\n")[0]);
+                    }
+                    catch (e)
+                    {
+                        respond("Error: unreadable reply from EDICT: " + e.message);
+                        return;
+                    }
+
+                    if (result.error)
+                    {
+                        respond("Error: " + result.error);
+                    }
+                    else if (!result.matches.length)
+                    {
+                        respond("No match.");
+                    }
+                    else
+                    {
+                        respond(result.matches.map(function(match)
+                        {
+                            return "Match:" +
+                                   "\n  Make & model: " + match.make_model +
+                                   "\n  MAC address: " + match.mac +
+                                   "\n  First seen: " + match.first_seen;
+                        }).join("\n"));
+                    }
+                });
+
+                client.on('end', function()
+                {
+                    if (!answered)
+                    {
+                        answered = true;
+                        respond("Error: EDICT closed the connection without replying.");
+                    }
+                });
+
+                client.on('timeout', function()
+                {
+                    client.destroy();
+                    if (!answered)
+                    {
+                        answered = true;
+                        respond("Error: EDICT did not reply in time.");
+                    }
+                });
+
+                client.on('error', function(e)
+                {
+                    if (!answered)
+                    {
+                        answered = true;
+                        respond("EDICT is not running (edict serve): " + e.message);
+                    }
+                });
             });
 
             var sanitized_request = request;
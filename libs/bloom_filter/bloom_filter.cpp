@@ -0,0 +1,308 @@
+//=============================================================================
+//
+// Name:        bloom_filter.cpp
+// Authors:     James H. Loving
+// Description: This file defines the bloom_filter class. For additional
+//              documentation, refer to bloom_filter.hpp.
+//
+//=============================================================================
+
+#include "bloom_filter.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>    // AVX2 intrinsics
+#define BLOOM_FILTER_AVX2
+#endif
+
+static const size_t PREFETCH_DISTANCE = 8;  /**< keys a batch prefetches
+                                                 ahead */
+
+// odd multipliers, one per word; bit i of a key is the top 5 bits of
+// (low half of hash) * SALT[i]
+static const uint32_t SALT[bloom_filter::BLOCK_WORDS] __attribute__((aligned(32))) =
+{
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+    0x9e3779b1U, 0x85ebca77U, 0xc2b2ae3dU, 0x27d4eb2fU,
+    0x165667b1U, 0xd3a2646dU, 0xfd7046c5U, 0xb55a4f09U
+};
+
+uint64_t hash_key(const char *key,
+                  size_t length)
+{
+    // FNV-1a, then a SplitMix64 finalizer to spread the low bits
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; ++i)
+    {
+        h = (h ^ static_cast<uint8_t>(key[i])) * 0x100000001b3ULL;
+    }
+
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static inline void block_insert(uint32_t *block,
+                                uint32_t x)
+{
+    for (size_t i = 0; i < bloom_filter::BLOCK_WORDS; ++i)
+    {
+        uint32_t mask = 1U << ((x * SALT[i]) >> 27);
+
+        // skip the locked OR once the bit is set, as most are in a full filter
+        if (!(__atomic_load_n(&block[i], __ATOMIC_RELAXED) & mask))
+        {
+            __atomic_fetch_or(&block[i], mask, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static inline bool block_contains(const uint32_t *block,
+                                  uint32_t x)
+{
+    uint32_t missing = 0;
+    for (size_t i = 0; i < bloom_filter::BLOCK_WORDS; ++i)
+    {
+        uint32_t mask = 1U << ((x * SALT[i]) >> 27);
+        missing |= ~__atomic_load_n(&block[i], __ATOMIC_RELAXED) & mask;
+    }
+
+    return !missing;
+}
+
+#ifdef BLOOM_FILTER_AVX2
+__attribute__((target("avx2")))
+static inline void block_masks_avx2(uint32_t x,
+                                    __m256i *low,
+                                    __m256i *high)
+{
+    const __m256i key = _mm256_set1_epi32(x);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i *salt = reinterpret_cast<const __m256i *>(SALT);
+
+    *low = _mm256_sllv_epi32(one, _mm256_srli_epi32(_mm256_mullo_epi32(key, _mm256_load_si256(salt)), 27));
+    *high = _mm256_sllv_epi32(one, _mm256_srli_epi32(_mm256_mullo_epi32(key, _mm256_load_si256(salt + 1)), 27));
+}
+
+__attribute__((target("avx2")))
+static inline void block_insert_avx2(uint32_t *block,
+                                     uint32_t x)
+{
+    __m256i low, high;
+    block_masks_avx2(x, &low, &high);
+
+    // find the words missing a bit, and only OR those
+    const __m256i *words = reinterpret_cast<const __m256i *>(block);
+    __m256i missing_low = _mm256_andnot_si256(_mm256_load_si256(words), low);
+    __m256i missing_high = _mm256_andnot_si256(_mm256_load_si256(words + 1), high);
+    uint32_t missing = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(missing_low, _mm256_setzero_si256()))) |
+                       _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(missing_high, _mm256_setzero_si256()))) << 8;
+    missing = ~missing & 0xffff;
+
+    if (missing)
+    {
+        uint32_t masks[bloom_filter::BLOCK_WORDS] __attribute__((aligned(32)));
+        _mm256_store_si256(reinterpret_cast<__m256i *>(masks), low);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(masks) + 1, high);
+
+        while (missing)
+        {
+            int i = __builtin_ctz(missing);
+            __atomic_fetch_or(&block[i], masks[i], __ATOMIC_RELAXED);
+            missing &= missing - 1;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static inline bool block_contains_avx2(const uint32_t *block,
+                                       uint32_t x)
+{
+    __m256i low, high;
+    block_masks_avx2(x, &low, &high);
+
+    // testc is 1 when every bit of the mask is set in the block
+    const __m256i *words = reinterpret_cast<const __m256i *>(block);
+    return _mm256_testc_si256(_mm256_load_si256(words), low) &
+           _mm256_testc_si256(_mm256_load_si256(words + 1), high);
+}
+
+__attribute__((target("avx2")))
+static void insert_avx2(uint32_t *words,
+                        uint64_t block_mask,
+                        const uint64_t *hashes,
+                        size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (i + PREFETCH_DISTANCE < count)
+        {
+            __builtin_prefetch(words + ((hashes[i + PREFETCH_DISTANCE] >> 32) & block_mask) * bloom_filter::BLOCK_WORDS, 1);
+        }
+        block_insert_avx2(words + ((hashes[i] >> 32) & block_mask) * bloom_filter::BLOCK_WORDS,
+                          static_cast<uint32_t>(hashes[i]));
+    }
+}
+
+__attribute__((target("avx2")))
+static void contains_avx2(const uint32_t *words,
+                          uint64_t block_mask,
+                          const uint64_t *hashes,
+                          size_t count,
+                          uint64_t *found)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (i + PREFETCH_DISTANCE < count)
+        {
+            __builtin_prefetch(words + ((hashes[i + PREFETCH_DISTANCE] >> 32) & block_mask) * bloom_filter::BLOCK_WORDS, 0);
+        }
+        if (block_contains_avx2(words + ((hashes[i] >> 32) & block_mask) * bloom_filter::BLOCK_WORDS,
+                                static_cast<uint32_t>(hashes[i])))
+        {
+            found[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+}
+#endif
+
+/**
+    \return True if the CPU supports AVX2 (checked once).
+*/
+static bool have_avx2()
+{
+#ifdef BLOOM_FILTER_AVX2
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+double bloom_filter::false_positive_rate(uint64_t keys,
+                                         uint64_t blocks)
+{
+    // keys per block are Poisson distributed; with j keys in a block, each
+    // word's probed bit is set with probability 1 - (31/32)^j
+    double lambda = static_cast<double>(keys) / blocks;
+    double spread = 10 * sqrt(lambda) + 10;
+    uint64_t first = lambda > spread ? static_cast<uint64_t>(lambda - spread) : 0;
+    uint64_t last = static_cast<uint64_t>(lambda + spread);
+    double rate = 0;
+
+    for (uint64_t j = first; j <= last; ++j)
+    {
+        double p = exp(j * log(lambda > 0 ? lambda : 1) - lambda - lgamma(j + 1.0));
+        if (lambda == 0)
+        {
+            p = j == 0 ? 1 : 0;
+        }
+        rate += p * pow(1 - pow(31.0 / 32, static_cast<double>(j)), static_cast<double>(BLOCK_WORDS));
+    }
+
+    return rate;
+}
+
+uint64_t bloom_filter::optimal_blocks(uint64_t capacity,
+                                      double probability)
+{
+    uint64_t blocks = 1;
+    while (false_positive_rate(capacity, blocks) > probability)
+    {
+        blocks *= 2;
+    }
+
+    return blocks;
+}
+
+bloom_filter::bloom_filter(void *blocks,
+                           uint64_t count,
+                           bool simd)
+{
+    if (!count || (count & (count - 1)))
+    {
+        throw std::invalid_argument("bloom_filter: block count must be a power of two");
+    }
+
+    this->words = static_cast<uint32_t *>(blocks);
+    this->block_mask = count - 1;
+    this->simd = simd && have_avx2();
+}
+
+void bloom_filter::insert(uint64_t hash)
+{
+    insert(&hash, 1);
+}
+
+bool bloom_filter::contains(uint64_t hash) const
+{
+    uint64_t found = 0;
+    contains(&hash, 1, &found);
+
+    return found;
+}
+
+void bloom_filter::insert(const uint64_t *hashes,
+                          size_t count)
+{
+#ifdef BLOOM_FILTER_AVX2
+    if (simd)
+    {
+        insert_avx2(words, block_mask, hashes, count);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (i + PREFETCH_DISTANCE < count)
+        {
+            __builtin_prefetch(words + ((hashes[i + PREFETCH_DISTANCE] >> 32) & block_mask) * BLOCK_WORDS, 1);
+        }
+        block_insert(words + ((hashes[i] >> 32) & block_mask) * BLOCK_WORDS,
+                     static_cast<uint32_t>(hashes[i]));
+    }
+}
+
+void bloom_filter::contains(const uint64_t *hashes,
+                            size_t count,
+                            uint64_t *found) const
+{
+    for (size_t i = 0; i < (count + 63) / 64; ++i)
+    {
+        found[i] = 0;
+    }
+
+#ifdef BLOOM_FILTER_AVX2
+    if (simd)
+    {
+        contains_avx2(words, block_mask, hashes, count, found);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (i + PREFETCH_DISTANCE < count)
+        {
+            __builtin_prefetch(words + ((hashes[i + PREFETCH_DISTANCE] >> 32) & block_mask) * BLOCK_WORDS, 0);
+        }
+        if (block_contains(words + ((hashes[i] >> 32) & block_mask) * BLOCK_WORDS,
+                           static_cast<uint32_t>(hashes[i])))
+        {
+            found[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+}
+
+void bloom_filter::insert(const char *key,
+                          size_t length)
+{
+    insert(hash_key(key, length));
+}
+
+bool bloom_filter::contains(const char *key,
+                            size_t length) const
+{
+    return contains(hash_key(key, length));
+}
@@ -0,0 +1,144 @@
+//=============================================================================
+//
+// Name:        bloom_filter.hpp
+// Authors:     James H. Loving
+// Description: This file declares the bloom_filter class, a cache-line-
+//              blocked Bloom filter over caller-provided memory (ex a
+//              memory-mapped file), used by conn_log's in-process storage
+//              backend. Each key touches a single 64-byte block: one bit in
+//              each of the block's sixteen 32-bit words. The bit positions
+//              are computed with AVX2 when the CPU has it, and batches of
+//              keys are prefetched ahead of use to hide cache misses.
+//
+//=============================================================================
+
+#ifndef BLOOM_FILTER_HPP
+#define BLOOM_FILTER_HPP
+
+#include <math.h>         // exp(), lgamma(), pow()
+#include <stddef.h>       // size_t
+#include <stdexcept>      // invalid_argument
+#include <stdint.h>       // uint64_t
+
+/**
+    Hash a key to 64 bits.
+
+    \param key Pointer to the key.
+    \param length Length of the key in bytes.
+
+    \return 64-bit hash of the key.
+*/
+uint64_t hash_key(const char *key,
+                  size_t length);
+
+/**
+    Blocked Bloom filter over an array of 64-byte blocks it does not own.
+    Inserts use atomic ORs, so any number of threads may insert and check
+    at once. The number of blocks is a power of two, so filters of
+    different sizes can be folded or tiled onto each other.
+*/
+class bloom_filter
+{
+    private:
+        uint32_t *words;        /**< blocks, 16 words each */
+        uint64_t block_mask;    /**< number of blocks - 1 */
+        bool simd;              /**< probe with AVX2 */
+
+    public:
+        static const size_t BLOCK_BYTES = 64;   /**< bytes per block */
+        static const size_t BLOCK_WORDS = 16;   /**< 32-bit words per block */
+
+        /**
+            Estimate the false positive rate of a filter, accounting for
+            keys spreading unevenly over blocks.
+
+            \param keys Number of keys in the filter.
+            \param blocks Number of blocks.
+
+            \return Expected false positive rate, 0 to 1.
+        */
+        static double false_positive_rate(uint64_t keys,
+                                           uint64_t blocks);
+
+        /**
+            Compute the number of blocks for a capacity and false positive rate.
+
+            \param capacity Expected number of keys.
+            \param probability Target false positive rate, ex 0.0001.
+
+            \return Number of blocks, a power of two.
+        */
+        static uint64_t optimal_blocks(uint64_t capacity,
+                                       double probability);
+
+        /**
+            Use existing memory as a Bloom filter. Zeroed memory is empty.
+
+            \param blocks Pointer to the blocks, 64-byte aligned.
+            \param count Number of blocks, a power of two.
+            \param simd Use AVX2 if the CPU supports it. The scalar path
+                sets the same bits, so either may open a filter.
+        */
+        bloom_filter(void *blocks,
+                     uint64_t count,
+                     bool simd = true);
+
+        /**
+            Add a hashed key to the filter.
+
+            \param hash 64-bit hash of the key, see hash_key().
+        */
+        void insert(uint64_t hash);
+
+        /**
+            Check whether the filter contains a hashed key.
+
+            \param hash 64-bit hash of the key, see hash_key().
+
+            \return True if the key may be present, false if it is not.
+        */
+        bool contains(uint64_t hash) const;
+
+        /**
+            Add a batch of hashed keys to the filter.
+
+            \param hashes 64-bit hashes of the keys.
+            \param count Number of hashes.
+        */
+        void insert(const uint64_t *hashes,
+                    size_t count);
+
+        /**
+            Check a batch of hashed keys.
+
+            \param hashes 64-bit hashes of the keys.
+            \param count Number of hashes.
+            \param found Output bitmask, (count + 63) / 64 words: bit i is
+                set if key i may be present.
+        */
+        void contains(const uint64_t *hashes,
+                      size_t count,
+                      uint64_t *found) const;
+
+        /**
+            Add a key to the filter.
+
+            \param key Pointer to the key.
+            \param length Length of the key in bytes.
+        */
+        void insert(const char *key,
+                    size_t length);
+
+        /**
+            Check whether the filter contains a key.
+
+            \param key Pointer to the key.
+            \param length Length of the key in bytes.
+
+            \return True if the key may be present, false if it is not.
+        */
+        bool contains(const char *key,
+                      size_t length) const;
+};
+
+#endif
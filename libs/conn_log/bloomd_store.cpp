@@ -0,0 +1,290 @@
+//=============================================================================
+//
+// Name:        bloomd_store.cpp
+// Authors:     James H. Loving
+// Description: This file defines the bloomd_store class, conn_log's
+//              storage backend on a Bloomd server. For additional
+//              documentation, refer to bloomd_store.hpp and filter_store.hpp.
+//
+//=============================================================================
+
+#include "bloomd_store.hpp"
+
+bloomd_store::bloomd_store(const std::string &address,
+                           int port) : c(address, port, BLOOMD_CONNECTIONS)
+{
+    // test connection to Bloomd, and learn which filters already exist
+    std::map<std::string, uint64_t> names = list();
+    for (std::map<std::string, uint64_t>::iterator it = names.begin(); it != names.end(); ++it)
+    {
+        filters.insert(it->first);
+    }
+}
+
+bloomd_store::~bloomd_store()
+{
+}
+
+std::map<std::string, uint64_t> bloomd_store::list()
+{
+    std::map<std::string, uint64_t> sizes;
+
+    std::vector<std::string> lines = c.request("list\n", REPLY_BLOCK);
+    if (lines[0] != "START")
+    {
+        // error
+        throw std::runtime_error("bloomd_store received invalid list from bloomd: " + lines[0]);
+    }
+
+    // each line is "<name> <probability> <storage> <capacity> <size>"
+    for (size_t i = 1; i + 1 < lines.size(); ++i)
+    {
+        char name[256];
+        double probability;
+        unsigned long long storage;
+
+        if (sscanf(lines[i].c_str(), "%255s %lf %llu", name, &probability, &storage) == 3)
+        {
+            sizes[name] = storage;
+        }
+    }
+
+    return sizes;
+}
+
+uint64_t bloomd_store::info(const std::string &filter)
+{
+    uint64_t storage = 0;
+
+    std::vector<std::string> lines = c.request("info " + filter + "\n", REPLY_BLOCK);
+    if (lines[0] != "START")
+    {
+        // "Filter does not exist"
+        return 0;
+    }
+
+    for (size_t i = 1; i + 1 < lines.size(); ++i)
+    {
+        if (lines[i].substr(0, 8) == "storage ")
+        {
+            storage = strtoull(lines[i].c_str() + 8, NULL, 10);
+        }
+    }
+
+    return storage;
+}
+
+void bloomd_store::create_filter(const std::string &filter,
+                                 const std::string &reply)
+{
+    // "Done" or "Exists" both mean the filter is there now
+    if (reply != "Done" && reply != "Exists")
+    {
+        throw std::runtime_error("bloomd_store could not create filter " + filter + ": " + reply);
+    }
+
+    filters.insert(filter);
+}
+
+void bloomd_store::create(const std::string &filter)
+{
+    create_filter(filter, c.request("create " + filter + "\n")[0]);
+}
+
+void bloomd_store::create(const std::string &filter,
+                          uint64_t capacity,
+                          double probability)
+{
+    char options[64];
+    snprintf(options, sizeof(options), " capacity=%llu prob=%g\n",
+             static_cast<unsigned long long>(capacity), probability);
+
+    create_filter(filter, c.request("create " + filter + options)[0]);
+}
+
+bool bloomd_store::stats(const std::string &filter,
+                         struct filter_stats &stats)
+{
+    std::vector<std::string> lines = c.request("info " + filter + "\n", REPLY_BLOCK);
+    if (lines[0] != "START")
+    {
+        return false;
+    }
+
+    double probability = 0;
+    stats.keys = 0;
+    stats.capacity = 0;
+    stats.size = 0;
+    for (size_t i = 1; i + 1 < lines.size(); ++i)
+    {
+        const char *line = lines[i].c_str();
+        if (lines[i].substr(0, 9) == "capacity ")
+        {
+            stats.capacity = strtoull(line + 9, NULL, 10);
+        }
+        else if (lines[i].substr(0, 12) == "probability ")
+        {
+            probability = strtod(line + 12, NULL);
+        }
+        else if (lines[i].substr(0, 5) == "size ")
+        {
+            stats.keys = strtoull(line + 5, NULL, 10);
+        }
+        else if (lines[i].substr(0, 8) == "storage ")
+        {
+            stats.size = strtoull(line + 8, NULL, 10);
+        }
+    }
+
+    // a classic Bloom filter sized for capacity at probability; past
+    // capacity Bloomd adds layers that hold the rate about there
+    stats.probability = probability;
+    if (stats.capacity && probability > 0 && probability < 1)
+    {
+        double bits = -static_cast<double>(stats.capacity) * log(probability) / (M_LN2 * M_LN2);
+        double hashes = std::max(1.0, floor(bits / stats.capacity * M_LN2 + 0.5));
+        double keys = std::min(stats.keys, stats.capacity);
+        stats.probability = pow(1 - exp(-hashes * keys / bits), hashes);
+    }
+
+    return true;
+}
+
+void bloomd_store::drop(const std::string &filter)
+{
+    c.request("drop " + filter + "\n");
+
+    filters.erase(filter);
+}
+
+bool bloomd_store::archive(const std::string &filter)
+{
+    // Bloomd keeps a closed filter on disk and maps it back in when a
+    // check (or set) next uses it
+    std::string reply = c.request("close " + filter + "\n")[0];
+    if (reply != "Done" && reply != "Filter does not exist")
+    {
+        throw std::runtime_error("bloomd_store could not close filter " + filter + ": " + reply);
+    }
+
+    return true;
+}
+
+void bloomd_store::append_keys(const key_batch &keys,
+                               size_t first,
+                               size_t last)
+{
+    for (size_t i = first; i < last; ++i)
+    {
+        // hex in place, the '\0' format_hex() adds is cut off after
+        size_t at = command.length() + 1;
+        command.resize(at + 2 * keys.length(i) + 1, ' ');
+        format_hex(keys.key(i), keys.length(i), &command[at]);
+        command.resize(command.length() - 1);
+    }
+    command += '\n';
+}
+
+void bloomd_store::set(const std::string &filter,
+                       const key_batch &keys)
+{
+    if (!keys.size())
+    {
+        return;
+    }
+
+    // pipeline "create" (only for new filters) and "bulk" in one write;
+    // if the filter is gone (dropped, or a restarted server), create it
+    // and try once more
+    for (int attempt = 0; ; ++attempt)
+    {
+        bool create = !filters.count(filter);
+        command.clear();
+        if (create)
+        {
+            command += "create ";
+            command += filter;
+            command += '\n';
+        }
+        command += "b ";
+        command += filter;
+        append_keys(keys, 0, keys.size());
+
+        std::vector<std::string> replies = c.wait(c.send(command.data(), command.length(), create ? 2 : 1));
+
+        if (create)
+        {
+            create_filter(filter, replies[0]);
+        }
+
+        const std::string &reply = replies.back();
+        if (reply.substr(0, 3) == "Yes" || reply.substr(0, 2) == "No")
+        {
+            return;
+        }
+
+        filters.erase(filter);
+        if (create || attempt)
+        {
+            throw std::runtime_error("bloomd_store bulk set failed: " + reply);
+        }
+    }
+}
+
+void bloomd_store::check(const std::string &filter,
+                         const key_batch &keys,
+                         std::vector<bool> &found)
+{
+    found.assign(keys.size(), false);
+    if (!keys.size())
+    {
+        return;
+    }
+
+    // one "m" per BLOOMD_MULTI_KEYS keys; the commands are split evenly
+    // over the pool and sent before any reply is read, so a large check
+    // costs about one round trip on each connection
+    size_t commands = (keys.size() + BLOOMD_MULTI_KEYS - 1) / BLOOMD_MULTI_KEYS;
+    size_t shares = std::min(commands, c.size());
+    std::vector<uint64_t> tickets;
+    std::vector<size_t> firsts;
+
+    for (size_t share = 0; share < shares; ++share)
+    {
+        size_t begin = commands * share / shares;
+        size_t end = commands * (share + 1) / shares;
+
+        command.clear();
+        for (size_t m = begin; m < end; ++m)
+        {
+            command += "m ";
+            command += filter;
+            append_keys(keys, m * BLOOMD_MULTI_KEYS, std::min((m + 1) * BLOOMD_MULTI_KEYS, keys.size()));
+        }
+        tickets.push_back(c.send(command.data(), command.length(), end - begin, REPLY_LINE, share));
+        firsts.push_back(begin * BLOOMD_MULTI_KEYS);
+    }
+
+    // "Yes No Yes ..." per command, or "Filter does not exist"
+    for (size_t share = 0; share < tickets.size(); ++share)
+    {
+        std::vector<std::string> replies = c.wait(tickets[share]);
+        for (size_t r = 0; r < replies.size(); ++r)
+        {
+            const std::string &reply = replies[r];
+            size_t first = firsts[share] + r * BLOOMD_MULTI_KEYS;
+            size_t last = std::min(first + BLOOMD_MULTI_KEYS, keys.size());
+            size_t start = 0;
+            for (size_t i = first; i < last && start < reply.length(); ++i)
+            {
+                found[i] = reply.compare(start, 3, "Yes") == 0;
+                start = reply.find(' ', start);
+                if (start == std::string::npos)
+                {
+                    break;
+                }
+                ++start;
+            }
+        }
+    }
+}
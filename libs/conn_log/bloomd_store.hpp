@@ -0,0 +1,130 @@
+//=============================================================================
+//
+// Name:        bloomd_store.hpp
+// Authors:     James H. Loving
+// Description: This file declares the bloomd_store class, conn_log's
+//              storage backend on a Bloomd server.
+//
+//=============================================================================
+
+#ifndef BLOOMD_STORE_HPP
+#define BLOOMD_STORE_HPP
+
+#include <algorithm>      // min()
+#include <math.h>         // log(), exp(), pow()
+#include <set>            // known filters
+#include <stdio.h>        // snprintf(), sscanf()
+#include <stdlib.h>       // strtod(), strtoull()
+#include <string>         // string class
+
+#include "filter_store.hpp"
+#include "client_pool.hpp"
+#include "../flow_record/flow_record.hpp"
+
+const char BLOOMD_HOST[] = "localhost"; /**< Bloomd server address */
+const int BLOOMD_PORT = 8673;           /**< Bloomd server TCP port */
+const size_t BLOOMD_MULTI_KEYS = 1000;  /**< keys per "m" command; larger
+                                             checks are split into pipelined
+                                             commands */
+const unsigned int BLOOMD_CONNECTIONS = 4;
+                                        /**< connections per bloomd_store;
+                                             large checks are spread over
+                                             them */
+
+/**
+    Named Bloom filters on a Bloomd server, over a small pool of
+    connections. Commands that don't depend on each other are pipelined in
+    one write; a check too large for one command is spread over the pool.
+*/
+class bloomd_store : public filter_store
+{
+    private:
+        client_pool c;                  /**< connections to Bloomd */
+        std::set<std::string> filters;  /**< filters known to exist */
+        std::string command;            /**< reused command buffer */
+
+        bloomd_store(const bloomd_store &);
+        bloomd_store &operator=(const bloomd_store &);
+
+        /**
+            Check the reply to "create <filter>".
+
+            \param filter Name of the filter.
+            \param reply Reply line.
+        */
+        void create_filter(const std::string &filter,
+                           const std::string &reply);
+
+        /**
+            Append " <key>" for a range of keys in a batch to the command
+            buffer, then end the command. Binary keys are sent as hex, as
+            the protocol splits keys on whitespace.
+
+            \param keys Keys to append.
+            \param first Index of the first key to append.
+            \param last Index past the last key to append.
+        */
+        void append_keys(const key_batch &keys,
+                         size_t first,
+                         size_t last);
+
+    public:
+        /**
+            Connect to Bloomd and learn which filters already exist.
+
+            \param address Address of the Bloomd server, or the path of
+                its Unix socket.
+            \param port TCP port of the Bloomd server.
+        */
+        bloomd_store(const std::string &address,
+                     int port);
+
+        /**
+            Close the connections to Bloomd.
+        */
+        ~bloomd_store();
+
+        std::map<std::string, uint64_t> list();
+
+        uint64_t info(const std::string &filter);
+
+        void create(const std::string &filter);
+
+        /**
+            Create the filter with Bloomd's capacity and prob options.
+        */
+        void create(const std::string &filter,
+                    uint64_t capacity,
+                    double probability);
+
+        void drop(const std::string &filter);
+
+        /**
+            Read the filter's "info". Bloomd doesn't report its false
+            positive rate, so it is estimated from the keys set and the
+            capacity and rate the filter was created with.
+        */
+        bool stats(const std::string &filter,
+                   struct filter_stats &stats);
+
+        /**
+            Close the filter: Bloomd unmaps it until it is next used.
+        */
+        bool archive(const std::string &filter);
+
+        /**
+            Add keys with one "bulk" command, pipelined behind a "create"
+            if the filter is not known to exist yet.
+        */
+        void set(const std::string &filter,
+                 const key_batch &keys);
+
+        /**
+            Check keys with one "multi" command.
+        */
+        void check(const std::string &filter,
+                   const key_batch &keys,
+                   std::vector<bool> &found);
+};
+
+#endif
@@ -0,0 +1,422 @@
+//=============================================================================
+//
+// Name:        client_pool.cpp
+// Authors:     James H. Loving
+// Description: This file defines the client_pool class. For additional
+//              documentation, refer to client_pool.hpp.
+//
+//=============================================================================
+
+#include "client_pool.hpp"
+
+/**
+    \return Milliseconds since an arbitrary point, for timeouts.
+*/
+static int64_t monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return static_cast<int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+    Start a non-blocking connect() and wait at most CLIENT_TIMEOUT for it.
+
+    \return Connected non-blocking socket, or -1 (errno set).
+*/
+static int connect_socket(int family,
+                          const struct sockaddr *address,
+                          socklen_t length)
+{
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (connect(fd, address, length) < 0)
+    {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        int error = errno;
+        socklen_t error_length = sizeof(error);
+
+        if (error != EINPROGRESS)
+        {
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        if (poll(&pfd, 1, CLIENT_TIMEOUT) <= 0)
+        {
+            close(fd);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        if (error)
+        {
+            close(fd);
+            errno = error;
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+client_pool::client_pool(const std::string &address,
+                         int port,
+                         unsigned int size)
+{
+    this->address = address;
+    this->port = port;
+    next_ticket = 1;
+    reconnect_count = 0;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        throw std::runtime_error(std::string("client_pool could not create epoll instance: ") + strerror(errno));
+    }
+
+    connections.resize(size ? size : 1);
+    for (size_t c = 0; c < connections.size(); ++c)
+    {
+        connections[c].fd = -1;
+        connections[c].opened = false;
+    }
+}
+
+client_pool::~client_pool()
+{
+    for (size_t c = 0; c < connections.size(); ++c)
+    {
+        if (connections[c].fd >= 0)
+        {
+            close(connections[c].fd);
+        }
+    }
+    close(epfd);
+}
+
+void client_pool::open_connection(size_t c)
+{
+    int fd = -1;
+
+    if (!address.empty() && address[0] == '/')
+    {
+        struct sockaddr_un server;
+        memset(&server, 0, sizeof(server));
+        server.sun_family = AF_UNIX;
+        if (address.length() >= sizeof(server.sun_path))
+        {
+            throw std::runtime_error("client_pool: socket path too long: " + address);
+        }
+        memcpy(server.sun_path, address.c_str(), address.length());
+
+        fd = connect_socket(AF_UNIX, reinterpret_cast<struct sockaddr *>(&server), sizeof(server));
+    }
+    else
+    {
+        // try every address the name has, ex ::1 then 127.0.0.1
+        struct addrinfo hints;
+        struct addrinfo *found;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        int error = getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &found);
+        if (error)
+        {
+            throw std::runtime_error("client_pool could not resolve " + address + ": " + gai_strerror(error));
+        }
+        for (struct addrinfo *ai = found; ai && fd < 0; ai = ai->ai_next)
+        {
+            fd = connect_socket(ai->ai_family, ai->ai_addr, ai->ai_addrlen);
+        }
+        freeaddrinfo(found);
+    }
+
+    if (fd < 0)
+    {
+        throw std::runtime_error("client_pool could not connect to " + address + ": " + strerror(errno));
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+
+    connections[c].fd = fd;
+}
+
+void client_pool::fail_connection(size_t c,
+                                  const std::string &error)
+{
+    struct connection &conn = connections[c];
+
+    if (conn.fd >= 0)
+    {
+        // closing the socket also takes it out of the epoll set
+        close(conn.fd);
+        conn.fd = -1;
+    }
+
+    for (size_t i = 0; i < conn.inflight.size(); ++i)
+    {
+        failed[conn.inflight[i].ticket] = error;
+        completed.push_back(std::make_pair(monotonic_ms(), conn.inflight[i].ticket));
+    }
+    conn.inflight.clear();
+    conn.out.clear();
+    conn.in.clear();
+}
+
+void client_pool::flush_connection(size_t c)
+{
+    struct connection &conn = connections[c];
+    size_t sent = 0;
+
+    while (sent < conn.out.length())
+    {
+        // MSG_NOSIGNAL: a server going away is an error, not a SIGPIPE
+        ssize_t length = ::send(conn.fd, conn.out.data() + sent, conn.out.length() - sent,
+                                MSG_NOSIGNAL);
+        if (length < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+            fail_connection(c, std::string("client_pool send failed: ") + strerror(errno));
+            return;
+        }
+        sent += length;
+    }
+    conn.out.erase(0, sent);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | (conn.out.empty() ? 0 : static_cast<uint32_t>(EPOLLOUT));
+    event.data.u64 = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &event);
+}
+
+void client_pool::read_connection(size_t c)
+{
+    struct connection &conn = connections[c];
+    char buffer[CLIENT_READ_SIZE];
+
+    ssize_t length = recv(conn.fd, buffer, sizeof(buffer), 0);
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    else if (length <= 0)
+    {
+        fail_connection(c, length ? std::string("client_pool receive failed: ") + strerror(errno)
+                                  : std::string("client_pool: connection closed by server"));
+        return;
+    }
+    conn.in.append(buffer, length);
+
+    // frame lines and give them to the oldest request still waiting
+    size_t start = 0;
+    size_t newline;
+    while ((newline = conn.in.find('\n', start)) != std::string::npos)
+    {
+        if (conn.inflight.empty())
+        {
+            fail_connection(c, "client_pool: unexpected reply from server");
+            return;
+        }
+
+        struct request &req = conn.inflight.front();
+        req.lines.push_back(conn.in.substr(start, newline - start));
+        start = newline + 1;
+
+        const std::string &line = req.lines.back();
+        if (req.type == REPLY_BLOCK && !req.in_block && line == "START")
+        {
+            req.in_block = true;
+            continue;
+        }
+        else if (req.in_block && line != "END")
+        {
+            continue;
+        }
+
+        req.in_block = false;
+        if (--req.replies == 0)
+        {
+            finished[req.ticket].swap(req.lines);
+            completed.push_back(std::make_pair(monotonic_ms(), req.ticket));
+            conn.inflight.pop_front();
+        }
+    }
+    conn.in.erase(0, start);
+}
+
+void client_pool::poll_events(int timeout)
+{
+    struct epoll_event events[16];
+
+    int count = epoll_wait(epfd, events, 16, timeout);
+    if (count < 0 && errno != EINTR)
+    {
+        throw std::runtime_error(std::string("client_pool epoll_wait failed: ") + strerror(errno));
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        size_t c = events[i].data.u64;
+
+        if (connections[c].fd >= 0 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        {
+            read_connection(c);
+        }
+        if (connections[c].fd >= 0 && (events[i].events & EPOLLOUT))
+        {
+            flush_connection(c);
+        }
+    }
+}
+
+void client_pool::purge_abandoned()
+{
+    int64_t oldest = monotonic_ms() - CLIENT_ABANDON;
+
+    // replies are collected soon after they arrive, so these never will be
+    while (!completed.empty() && completed.front().first < oldest)
+    {
+        finished.erase(completed.front().second);
+        failed.erase(completed.front().second);
+        completed.pop_front();
+    }
+}
+
+uint64_t client_pool::send(const char *data,
+                           size_t length,
+                           unsigned int replies,
+                           reply_type type,
+                           int c)
+{
+    // the least busy connection; ties go to the first, so a light user
+    // only ever opens one
+    if (c < 0)
+    {
+        c = 0;
+        for (size_t i = 1; i < connections.size(); ++i)
+        {
+            if (connections[i].inflight.size() < connections[c].inflight.size())
+            {
+                c = i;
+            }
+        }
+    }
+    c %= connections.size();
+    purge_abandoned();
+
+    struct connection &conn = connections[c];
+    if (conn.fd < 0)
+    {
+        open_connection(c);
+        if (conn.opened)
+        {
+            ++reconnect_count;
+        }
+        conn.opened = true;
+    }
+
+    struct request req;
+    req.ticket = next_ticket++;
+    req.replies = replies;
+    req.type = type;
+    req.in_block = false;
+
+    if (!replies)
+    {
+        finished[req.ticket];
+        completed.push_back(std::make_pair(monotonic_ms(), req.ticket));
+    }
+    else
+    {
+        conn.inflight.push_back(req);
+    }
+
+    conn.out.append(data, length);
+    flush_connection(c);
+
+    return req.ticket;
+}
+
+std::vector<std::string> client_pool::wait(uint64_t ticket)
+{
+    int64_t deadline = monotonic_ms() + CLIENT_TIMEOUT;
+
+    while (true)
+    {
+        std::map<uint64_t, std::vector<std::string> >::iterator done = finished.find(ticket);
+        if (done != finished.end())
+        {
+            std::vector<std::string> lines;
+            lines.swap(done->second);
+            finished.erase(done);
+            return lines;
+        }
+
+        std::map<uint64_t, std::string>::iterator error = failed.find(ticket);
+        if (error != failed.end())
+        {
+            std::string message = error->second;
+            failed.erase(error);
+            throw std::runtime_error(message);
+        }
+
+        int64_t left = deadline - monotonic_ms();
+        if (left > 0)
+        {
+            poll_events(left);
+            continue;
+        }
+
+        // drop whichever connection the request is stuck on
+        bool inflight = false;
+        for (size_t c = 0; c < connections.size() && !inflight; ++c)
+        {
+            for (size_t i = 0; i < connections[c].inflight.size(); ++i)
+            {
+                if (connections[c].inflight[i].ticket == ticket)
+                {
+                    fail_connection(c, "client_pool: timed out waiting for " + address);
+                    inflight = true;
+                    break;
+                }
+            }
+        }
+        if (!inflight)
+        {
+            throw std::runtime_error("client_pool: unknown ticket");
+        }
+    }
+}
+
+std::vector<std::string> client_pool::request(const std::string &command,
+                                              reply_type type)
+{
+    return wait(send(command.data(), command.length(), 1, type));
+}
+
+size_t client_pool::size() const
+{
+    return connections.size();
+}
+
+uint64_t client_pool::reconnects() const
+{
+    return reconnect_count;
+}
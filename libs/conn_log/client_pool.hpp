@@ -0,0 +1,215 @@
+//=============================================================================
+//
+// Name:        client_pool.hpp
+// Authors:     James H. Loving
+// Description: This file declares the client_pool class, a small pool of
+//              non-blocking connections to a line-based server (ex Bloomd)
+//              over TCP or a Unix socket. Requests are pipelined: any
+//              number can be in flight per connection, and their replies
+//              are framed by line and matched to them in order. A failed
+//              connection is reopened by the next request that uses it.
+//
+//=============================================================================
+
+#ifndef CLIENT_POOL_HPP
+#define CLIENT_POOL_HPP
+
+#include <deque>          // in-flight requests
+#include <errno.h>        // errno
+#include <map>            // finished requests
+#include <netdb.h>        // getaddrinfo()
+#include <poll.h>         // poll() while connecting
+#include <stdexcept>      // exception handling
+#include <stdint.h>       // uint64_t
+#include <string.h>       // strerror()
+#include <string>         // string class
+#include <utility>        // pair
+#include <sys/epoll.h>    // epoll
+#include <sys/socket.h>   // socket()
+#include <sys/un.h>       // sockaddr_un
+#include <time.h>         // clock_gettime()
+#include <unistd.h>       // close()
+#include <vector>         // vector class
+
+const unsigned int CLIENT_TIMEOUT = 10000;  /**< max wait for a connection or
+                                                 a reply (ms) before the
+                                                 connection is dropped */
+const size_t CLIENT_READ_SIZE = 65536;      /**< bytes read per recv() */
+const unsigned int CLIENT_ABANDON = 60000;  /**< replies left uncollected
+                                                 this long (ms) are
+                                                 dropped */
+
+/**
+    How the reply to one command ends.
+*/
+enum reply_type
+{
+    REPLY_LINE,     /**< one line */
+    REPLY_BLOCK     /**< "START", lines, "END"; or one line (an error) */
+};
+
+/**
+    Pool of pipelined connections to one server. Not thread-safe: like
+    the store that owns it, a pool is used by one thread at a time.
+*/
+class client_pool
+{
+    private:
+        /**
+            Commands sent together, and the replies read for them so far.
+        */
+        struct request
+        {
+            uint64_t ticket;                /**< returned by send() */
+            unsigned int replies;           /**< replies still expected */
+            reply_type type;                /**< how each reply ends */
+            bool in_block;                  /**< inside START ... END */
+            std::vector<std::string> lines; /**< reply lines read */
+        };
+
+        /**
+            One connection, opened on first use.
+        */
+        struct connection
+        {
+            int fd;                         /**< socket, -1 if closed */
+            bool opened;                    /**< was ever opened */
+            std::string out;                /**< data not yet sent */
+            std::string in;                 /**< data not yet framed */
+            std::deque<struct request> inflight;
+                                            /**< oldest first */
+        };
+
+        std::string address;        /**< host name, or Unix socket path */
+        int port;                   /**< TCP port */
+        int epfd;                   /**< epoll instance */
+        uint64_t next_ticket;       /**< ticket of the next request */
+        uint64_t reconnect_count;   /**< connections reopened */
+        std::vector<struct connection> connections;
+        std::map<uint64_t, std::vector<std::string> > finished;
+                                    /**< replies not yet collected */
+        std::map<uint64_t, std::string> failed;
+                                    /**< errors not yet collected */
+        std::deque<std::pair<int64_t, uint64_t> > completed;
+                                    /**< time each request finished or
+                                         failed, and its ticket, oldest
+                                         first */
+
+        client_pool(const client_pool &);
+        client_pool &operator=(const client_pool &);
+
+        /**
+            Open a connection, waiting at most CLIENT_TIMEOUT for it.
+            Throws std::runtime_error on failure.
+
+            \param c Index of the connection.
+        */
+        void open_connection(size_t c);
+
+        /**
+            Close a connection, failing its in-flight requests.
+
+            \param c Index of the connection.
+            \param error Reason, returned by wait() for those requests.
+        */
+        void fail_connection(size_t c,
+                             const std::string &error);
+
+        /**
+            Send as much buffered data as the socket takes, and watch for
+            writability if some is left.
+
+            \param c Index of the connection.
+        */
+        void flush_connection(size_t c);
+
+        /**
+            Read what a connection received and hand complete reply lines
+            to its in-flight requests.
+
+            \param c Index of the connection.
+        */
+        void read_connection(size_t c);
+
+        /**
+            Handle the events on every connection, waiting for some at most
+            timeout ms.
+        */
+        void poll_events(int timeout);
+
+        /**
+            Forget the replies and errors left uncollected for CLIENT_ABANDON,
+            ex those of requests sent together with one whose wait() threw.
+        */
+        void purge_abandoned();
+
+    public:
+        /**
+            Create a pool; connections are opened as they are first used.
+
+            \param address Host name or address of the server, or the path
+                of its Unix socket if it starts with '/'.
+            \param port TCP port of the server (ignored for Unix sockets).
+            \param size Number of connections.
+        */
+        client_pool(const std::string &address,
+                    int port,
+                    unsigned int size);
+
+        /**
+            Close every connection.
+        */
+        ~client_pool();
+
+        /**
+            Send one or more commands without waiting for their replies.
+
+            \param data Newline-terminated commands.
+            \param length Number of bytes to send.
+            \param replies Number of replies the commands get.
+            \param type How each reply ends.
+            \param c Index of the connection to use, or -1 for the least
+                busy one.
+
+            \return Ticket to collect the replies with. Throws
+                std::runtime_error if the connection can't be (re)opened.
+        */
+        uint64_t send(const char *data,
+                      size_t length,
+                      unsigned int replies,
+                      reply_type type = REPLY_LINE,
+                      int c = -1);
+
+        /**
+            Wait for the replies to an earlier send().
+
+            \param ticket Ticket returned by send().
+
+            \return Reply lines, in order. Throws std::runtime_error if the
+                connection failed or timed out first.
+        */
+        std::vector<std::string> wait(uint64_t ticket);
+
+        /**
+            Send one command and wait for its reply.
+
+            \param command Newline-terminated command.
+            \param type How the reply ends.
+
+            \return Reply lines. Throws std::runtime_error on failure.
+        */
+        std::vector<std::string> request(const std::string &command,
+                                         reply_type type = REPLY_LINE);
+
+        /**
+            \return Number of connections in the pool.
+        */
+        size_t size() const;
+
+        /**
+            \return Number of times a failed connection was reopened.
+        */
+        uint64_t reconnects() const;
+};
+
+#endif
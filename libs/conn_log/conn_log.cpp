@@ -3,26 +3,134 @@
 // Name:        conn_log.cpp
 // Authors:     James H. Loving
 // Description: This file defines the conn_log class, used to log IPv4 and
-//              IPv6 communications on a local Bloomd server.
+//              IPv6 communications in time-sliced Bloom filters.
 //
 //=============================================================================
 
 #include "conn_log.hpp"
 
-conn_log::conn_log()
+conn_log::conn_log(const std::string &backend)
 {
-    // open socket                
-    c.conn("localhost", 8673);
+    batch_slot = 0;
+    fine_slot = 0;
+    fine_window = 0;
+    index_slot = 0;
+    port_minute = 0;
+
+    // open (and test) the storage backend
+    store = open_store(backend);
+    rolled_up = store->can_merge();
+
+    // the index only speeds up queries, so carry on without it
+    try
+    {
+        index = open_index(REVERSE_INDEX_DIR);
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "conn_log: no reverse index: " << e.what() << "\n";
+    }
+}
+
+conn_log::conn_log(std::shared_ptr<filter_store> store,
+                   std::shared_ptr<reverse_index> index)
+{
+    batch_slot = 0;
+    fine_slot = 0;
+    fine_window = 0;
+    index_slot = 0;
+    port_minute = 0;
+    this->store = store;
+    this->index = index;
+    rolled_up = store->can_merge();
+}
+
+conn_log::~conn_log()
+{
+    flush_ports();
+
+    try
+    {
+        flush();
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "conn_log: lost " << batch.size() << " keys: " << e.what() << "\n";
+    }
+}
+
+std::string conn_log::filter_name(time_t slot)
+{
+    return std::to_string(slot);
+}
+
+std::string conn_log::filter_name(time_t period,
+                                  unsigned int length)
+{
+    if (length == MINUTE_LENGTH)
+    {
+        return "m" + std::to_string(period);
+    }
+    else if (length == DAY_LENGTH)
+    {
+        return "d" + std::to_string(period);
+    }
+    else if (length == WEEK_LENGTH)
+    {
+        return "w" + std::to_string(period);
+    }
+
+    return std::to_string(period);
+}
 
-    // test connection to Bloomd
-    c.send_data("list\n");
-    std::string reply = c.receive(1024);
-    
-    if (reply.substr(0,5) != "START")
+bool conn_log::parse_filter_name(const std::string &name,
+                                 time_t *period,
+                                 unsigned int *length)
+{
+    size_t digits = 0;
+
+    if (name.empty())
+    {
+        return false;
+    }
+    else if (name[0] == 'm')
+    {
+        *length = MINUTE_LENGTH;
+        digits = 1;
+    }
+    else if (name[0] == 'd')
     {
-        // error
-        std::cout << reply;
+        *length = DAY_LENGTH;
+        digits = 1;
     }
+    else if (name[0] == 'w')
+    {
+        *length = WEEK_LENGTH;
+        digits = 1;
+    }
+    else
+    {
+        *length = FILTER_LENGTH;
+    }
+
+    if (name.length() == digits || name[digits + strspn(name.c_str() + digits, "0123456789")] != '\0')
+    {
+        return false;
+    }
+
+    *period = atol(name.c_str() + digits);
+    return true;
+}
+
+void conn_log::set_fine_window(time_t window)
+{
+    fine_window = window;
+}
+
+void conn_log::set_port_index(std::shared_ptr<port_index> index)
+{
+    flush_ports();
+    ports = index;
 }
 
 bool conn_log::valid_mac(std::string mac) const
@@ -59,238 +167,497 @@ bool conn_log::valid_ipv6(std::string ipv6) const
     }
 }
 
-unsigned int conn_log::get_filter_size()
+bool conn_log::queue_key(const char *key,
+                         size_t length,
+                         time_t timestamp)
 {
-    unsigned int sum = 0;
+    time_t slot = timestamp / FILTER_LENGTH;
+    uint64_t hash = hash_key(key, length);
+    bool queued = false;
+
+    // the minute's filter, unless it is dropped already (ex a replayed key)
+    time_t minute = timestamp / MINUTE_LENGTH;
+    if (fine_window && timestamp > time(nullptr) - fine_window &&
+        !fine_recent.seen(hash, minute))
+    {
+        if (fine_batch.size() && minute != fine_slot)
+        {
+            flush();
+        }
+        if (!batch.size() && !fine_batch.size())
+        {
+            batch_start = std::chrono::steady_clock::now();
+        }
+        fine_slot = minute;
+        fine_batch.add(key, length);
+    }
+
+    // most connections reuse a port or address seen earlier this timeslot
+    if (!recent.seen(hash, slot))
+    {
+        // keys are only batched within one timeslot
+        if (batch.size() && slot != batch_slot)
+        {
+            flush();
+        }
 
-    c.send_data("list\n");
-    std::string reply = c.receive(4096);
+        if (!batch.size() && !fine_batch.size())
+        {
+            batch_start = std::chrono::steady_clock::now();
+        }
+        batch_slot = slot;
 
-    if (reply.substr(0, 5) != "START")
+        batch.add(key, length);
+        queued = true;
+    }
+
+    if (batch.size() >= BULK_BATCH_SIZE || fine_batch.size() >= BULK_BATCH_SIZE)
     {
-        // error    
-        throw std::runtime_error("prune_filters() received invalid info from bloomd");
+        flush();
     }
-    
-    std::vector<char> reply_v(reply.begin(), reply.end());
-    reply_v.push_back('\0');
-    for (const char *line = strtok(&reply_v[0], "\n"); line; line = strtok(NULL, "\n")) 
+
+    return queued;
+}
+
+void conn_log::index_key(time_t slot,
+                         uint64_t attribute,
+                         uint32_t device)
+{
+    if (!index)
     {
-        std::string s = std::string(line);
-        if (s.substr(0,5) != "START" && s.substr(0,3) != "END")
+        return;
+    }
+
+    if (!index_current || slot != index_slot)
+    {
+        index_current = index->file(slot, true);
+        index_slot = slot;
+    }
+
+    index_current->insert(attribute, device);
+}
+
+bool conn_log::candidates(uint64_t attribute,
+                          time_t timestamp,
+                          std::set<uint32_t> &devices)
+{
+    time_t slot = timestamp / FILTER_LENGTH;
+
+    if (!index || !index->candidates(slot, attribute, devices))
+    {
+        return false;
+    }
+
+    // fuzzy timeslot, as has_keys()
+    time_t neighbor = fuzzy_slot(timestamp);
+    if (neighbor != slot && !index->candidates(neighbor, attribute, devices))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+void conn_log::flush()
+{
+    if (!batch.size() && !fine_batch.size())
+    {
+        return;
+    }
+
+    // on failure the keys are lost either way, don't resend them
+    try
+    {
+        if (batch.size())
+        {
+            store->set(filter_name(batch_slot), batch);
+        }
+        if (fine_batch.size())
         {
-            c.send_data("info " + s.substr(0, s.find_first_of(' ')) + "\n");
-            std::string info = c.receive(2048);
-            unsigned int filter = atoi(info.substr(info.find("storage ")+8, info.length()).c_str());
-            sum += filter;
+            store->set(filter_name(fine_slot, MINUTE_LENGTH), fine_batch);
         }
     }
+    catch (std::exception &e)
+    {
+        // the lost keys must not be skipped when they come around again
+        batch.clear();
+        fine_batch.clear();
+        recent.clear();
+        fine_recent.clear();
+        throw;
+    }
+    batch.clear();
+    fine_batch.clear();
+}
+
+void conn_log::flush_ports()
+{
+    if (!ports || port_batch.empty())
+    {
+        return;
+    }
 
-    return sum;
+    try
+    {
+        ports->append(port_minute * MINUTE_LENGTH / FILTER_LENGTH, port_minute, port_batch);
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "conn_log: lost the ports of " << port_batch.size() << " devices: " << e.what() << "\n";
+    }
+    port_batch.clear();
 }
 
-void conn_log::prune_filters()
+void conn_log::flush_stale()
 {
-    //for (int i = 0; get_filter_size() > MAX_FILTER_SIZE; ++i)
-    while (get_filter_size() > MAX_FILTER_SIZE)
+    // a minute's ports are written once it ends, or when the next starts
+    if (!port_batch.empty() && time(nullptr) / MINUTE_LENGTH != port_minute)
     {
-        // drop the oldest filter
-        c.send_data("list\n");
-        std::string reply = c.receive(4096);
+        flush_ports();
+    }
 
-        if (reply.substr(0, 5) != "START")
+    if ((batch.size() || fine_batch.size()) &&
+        std::chrono::steady_clock::now() - batch_start >= std::chrono::milliseconds(MAX_BATCH_LATENCY))
+    {
+        flush();
+    }
+}
+
+size_t conn_log::queued() const
+{
+    return batch.size() + fine_batch.size();
+}
+
+uint64_t conn_log::duplicate_keys() const
+{
+    return recent.hits();
+}
+
+uint64_t conn_log::distinct_keys() const
+{
+    return recent.misses();
+}
+
+time_t conn_log::fuzzy_slot(time_t timestamp) const
+{
+    return fuzzy_slot(timestamp, FILTER_LENGTH);
+}
+
+time_t conn_log::fuzzy_slot(time_t timestamp,
+                            unsigned int length) const
+{
+    time_t slot = timestamp / length;
+
+    // at most one applies, FUZZINESS being under MINUTE_LENGTH / 2
+    if ((timestamp - slot * static_cast<time_t>(length)) < FUZZINESS)
+    {
+        return slot - 1;
+    }
+    else if (((slot + 1) * static_cast<time_t>(length) - timestamp) < FUZZINESS)
+    {
+        return slot + 1;
+    }
+
+    return slot;
+}
+
+void conn_log::probe_filters(time_t timestamp,
+                             std::vector<std::string> &names) const
+{
+    time_t now = time(nullptr);
+    time_t slots[2] = {timestamp / FILTER_LENGTH, fuzzy_slot(timestamp)};
+    const unsigned int lengths[2] = {WEEK_LENGTH, DAY_LENGTH};
+
+    names.clear();
+
+    // the minute filters alone, while both are surely kept: tighter
+    // answers, and a key not found there was not seen. One may be missing
+    // all the same (ex written before they were, or dropped to stay within
+    // the budget); the hours have every key
+    time_t minute = timestamp / MINUTE_LENGTH;
+    time_t neighbor = fuzzy_slot(timestamp, MINUTE_LENGTH);
+    if (fine_window &&
+        std::min(minute, neighbor) * static_cast<time_t>(MINUTE_LENGTH) > now - fine_window + MINUTE_LENGTH &&
+        store->info(filter_name(minute, MINUTE_LENGTH)) &&
+        store->info(filter_name(neighbor, MINUTE_LENGTH)))
+    {
+        names.push_back(filter_name(minute, MINUTE_LENGTH));
+        if (neighbor != minute)
         {
-            // error    
-            throw std::runtime_error("prune_filters() received invalid info from bloomd");
+            names.push_back(filter_name(neighbor, MINUTE_LENGTH));
         }
-        
-        std::string victim = reply.substr(6, reply.find_first_of('0'));
-        victim = victim.substr(0, victim.length() - 1);
+        return;
+    }
 
-        c.send_data("drop " + victim + "\n");
-        reply = c.receive(1024);
-        std::cout << "size=" << get_filter_size() << "\n";
+    for (int s = 0; s < (slots[1] == slots[0] ? 1 : 2); ++s)
+    {
+        // whatever rules the manager rolls up by: a timeslot it has not
+        // reached yet is still found in the finer filters, and missing
+        // filters cost little, as rollups need a backend that stores
+        // filters locally
+        for (size_t r = 0; r < 2 && rolled_up; ++r)
+        {
+            time_t period = slots[s] * FILTER_LENGTH / lengths[r];
+            if ((period + 1) * static_cast<time_t>(lengths[r]) <= now)
+            {
+                names.push_back(filter_name(period, lengths[r]));
+            }
+        }
+        names.push_back(filter_name(slots[s]));
+    }
+
+    // a neighbor in the same rollup period shares its filter
+    for (size_t i = 1; i < names.size(); )
+    {
+        if (std::find(names.begin(), names.begin() + i, names[i]) != names.begin() + i)
+        {
+            names.erase(names.begin() + i);
+        }
+        else
+        {
+            ++i;
+        }
     }
 }
 
-void conn_log::add_ipv4(std::string mac_address,
-                        uint16_t port)
+bool conn_log::has_key(const char *key,
+                       size_t length,
+                       time_t timestamp)
+{
+    std::vector<bool> results;
+
+    probe.clear();
+    probe.add(key, length);
+    has_keys(probe, timestamp, results);
+
+    return results[0];
+}
+
+void conn_log::has_keys(const key_batch &keys,
+                        time_t timestamp,
+                        std::vector<bool> &results)
 {
-    // check for invalid MAC addresses
-    if (!valid_mac(mac_address))
+    // make keys this process queued visible to the check
+    flush();
+
+    // check 'correct' filter, then the fuzzy neighbor at the start or end
+    // of it, with rollups ahead of the hours they may have replaced
+    probe_filters(timestamp, probes);
+    store->check(probes[0], keys, results);
+
+    for (size_t p = 1; p < probes.size(); ++p)
     {
-        throw std::invalid_argument("Invalid conn_log.add_ipv4(mac_address): "
-                + mac_address);
+        // only the keys that weren't found need another look
+        retry.clear();
+        retry_index.clear();
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            if (!results[i])
+            {
+                retry.add(keys.key(i), keys.length(i));
+                retry_index.push_back(i);
+            }
+        }
+
+        if (!retry.size())
+        {
+            return;
+        }
+
+        store->check(probes[p], retry, found);
+        for (size_t i = 0; i < retry.size(); ++i)
+        {
+            if (found[i])
+            {
+                results[retry_index[i]] = true;
+            }
+        }
     }
+}
+
+void conn_log::add_ipv4(uint32_t device,
+                        uint16_t port)
+{
+    add_ipv4(device, port, time(nullptr));
+}
+
+void conn_log::add_ipv4(uint32_t device,
+                        uint16_t port,
+                        time_t timestamp)
+{
+    time_t slot = timestamp / FILTER_LENGTH;
+    char key[FLOW_KEY_BYTES];
 
-    // check for oversized conn_log and prune old filters every 10k connections
-    static int i = 0;
-    if (i++ % PRUNE_CHECK_FREQ == 0)
+    if (queue_key(key, pack_key_ipv4(device, port, key) - key, timestamp))
     {
-        prune_filters();
+        index_key(slot, reverse_index::ipv4_attribute(port), device);
     }
 
-    // create timestamp
-    time_t timestamp = time(nullptr);
-    
-    // check and create filter based on current timeslot
-    c.send_data("create " + std::to_string(timestamp / FILTER_LENGTH) + "\n");
-    std::string reply = c.receive(1024);
+    if (ports)
+    {
+        time_t minute = timestamp / MINUTE_LENGTH;
+        if (minute != port_minute)
+        {
+            flush_ports();
+            port_minute = minute;
+        }
+        port_batch[device].add(port);
+    }
+}
 
-    // set string(timestamp / FILTER_LENGTH) string(mac_address + port) 
-    c.send_data("set " + std::to_string(timestamp / FILTER_LENGTH) + " "
-                + mac_address + "|" + std::to_string(port) + "\n");
-    reply = c.receive(1024);
+bool conn_log::has_ipv4(uint32_t device,
+                        uint16_t port,
+                        time_t timestamp)
+{
+    char key[FLOW_KEY_BYTES];
 
-    std::cout << "conn_log.add_ipv4(" << timestamp << "," 
-              << mac_address << "," << port << ") - "
-              << std::to_string(timestamp / FILTER_LENGTH) + ":"
-              << mac_address + "|" + std::to_string(port) + "\n";
+    return has_key(key, pack_key_ipv4(device, port, key) - key, timestamp);
 }
 
-bool conn_log::has_ipv4(std::string mac_address,
+void conn_log::has_ipv4(const std::vector<uint32_t> &devices,
                         uint16_t port,
-                        time_t timestamp)
+                        time_t timestamp,
+                        std::vector<bool> &results)
 {
-    if (!valid_mac(mac_address))
+    char key[FLOW_KEY_BYTES];
+
+    probe.clear();
+    for (size_t i = 0; i < devices.size(); ++i)
     {
-        throw std::invalid_argument("Invalid conn_log.has_ipv4(mac_address): "
-                + mac_address);
+        probe.add(key, pack_key_ipv4(devices[i], port, key) - key);
     }
 
-    // check 'correct' filter
-    c.send_data("check " + std::to_string(timestamp / FILTER_LENGTH) + " "
-                + mac_address + "|" + std::to_string(port) + "\n");
-    std::string reply = c.receive(1024);
-    
-    if (reply.substr(0,3) == "Yes")
+    has_keys(probe, timestamp, results);
+}
+
+bool conn_log::candidates_ipv4(uint16_t port,
+                               time_t timestamp,
+                               std::set<uint32_t> &devices)
+{
+    return candidates(reverse_index::ipv4_attribute(port), timestamp, devices);
+}
+
+bool conn_log::exact_ipv4(const port_bitmap &query,
+                          time_t from,
+                          time_t to,
+                          std::set<uint32_t> &devices)
+{
+    std::map<uint32_t, port_bitmap> used;
+
+    if (!ports)
     {
-        return true;
+        return false;
     }
 
-    // fuzzy check at start of filter
-    time_t filter_start = (timestamp / FILTER_LENGTH) * FILTER_LENGTH;
-    if ((timestamp - filter_start) < FUZZINESS)
+    // make ports this process queued visible to the check
+    flush_ports();
+
+    for (time_t slot = from / FILTER_LENGTH; slot <= to / FILTER_LENGTH; ++slot)
     {
-        c.send_data("check " + std::to_string((timestamp / FILTER_LENGTH) - 1)
-                    + " " + mac_address + "|" + std::to_string(port) + "\n");
-        std::string reply = c.receive(1024);
-        
-        if (reply.substr(0,3) == "Yes")
+        if (!ports->load(slot, from / MINUTE_LENGTH, to / MINUTE_LENGTH, used))
         {
-            return true;
+            return false;
         }
     }
-    
-    // fuzzy check at end of filter
-    time_t filter_end = ((timestamp / FILTER_LENGTH) + 1) * FILTER_LENGTH;
-    if ((filter_end - timestamp) < FUZZINESS)
+
+    for (std::map<uint32_t, port_bitmap>::iterator it = used.begin(); it != used.end(); ++it)
     {
-        c.send_data("check " + std::to_string((timestamp / FILTER_LENGTH) + 1)
-                    + " " + mac_address + "|" + std::to_string(port) + "\n");
-        std::string reply = c.receive(1024);
-        
-        if (reply.substr(0,3) == "Yes")
+        if (it->second.intersects(query))
         {
-            return true;
+            devices.insert(it->first);
         }
     }
 
-    return false;
+    return true;
 }
 
-void conn_log::add_ipv6(std::string mac_address,
+void conn_log::add_ipv6(uint32_t device,
                         std::string ipv6_address)
 {
-    // check for invalid MAC addresses
-    if (!valid_mac(mac_address))
-    {
-        throw std::invalid_argument("Invalid conn_log.add_ipv6(mac_address): "
-                + mac_address);
-    }
+    struct in6_addr address;
 
     // check for invalid IPv6 addresses
-    if (!valid_ipv6(ipv6_address))
+    if (inet_pton(AF_INET6, ipv6_address.c_str(), &address) != 1)
     {
-        throw std::invalid_argument("Invalid conn_log.has_ipv6(ipv6_address): "
+        throw std::invalid_argument("Invalid conn_log.add_ipv6(ipv6_address): "
                 + ipv6_address);
     }
 
-    // check for oversized conn_log and prune old filters every 10k connections
-    static int i = 0;
-    if (i++ % PRUNE_CHECK_FREQ == 0)
-    {
-        prune_filters();
-    }
-
-    // create timestamp
-    time_t timestamp = time(nullptr);
-    
-    // check and create filter based on current timeslot
-    c.send_data("create " + std::to_string(timestamp / FILTER_LENGTH) + "\n");
-    std::string reply = c.receive(1024);
-    std::cout << reply;
+    add_ipv6(device, address.s6_addr);
+}
 
-    // set string(timestamp / FILTER_LENGTH) string(mac_address + ipv6) 
-    c.send_data("set " + std::to_string(timestamp / FILTER_LENGTH) + " "
-                + mac_address + "|" + ipv6_address + "\n");
-    reply = c.receive(1024);
-    std::cout << reply;
+void conn_log::add_ipv6(uint32_t device,
+                        const uint8_t *ipv6_address)
+{
+    add_ipv6(device, ipv6_address, time(nullptr));
 }
 
-bool conn_log::has_ipv6(std::string mac_address,
-                        std::string ipv6_address,
+void conn_log::add_ipv6(uint32_t device,
+                        const uint8_t *ipv6_address,
                         time_t timestamp)
 {
-    if (!valid_mac(mac_address))
+    time_t slot = timestamp / FILTER_LENGTH;
+    char key[FLOW_KEY_BYTES];
+
+    if (queue_key(key, pack_key_ipv6(device, ipv6_address, key) - key, timestamp))
     {
-        throw std::invalid_argument("Invalid conn_log.has_ipv6(mac_address): "
-                + mac_address);
+        index_key(slot, reverse_index::ipv6_attribute(ipv6_address), device);
     }
+}
+
+bool conn_log::has_ipv6(uint32_t device,
+                        std::string ipv6_address,
+                        time_t timestamp)
+{
+    struct in6_addr address;
 
-    if (!valid_ipv6(ipv6_address))
+    // the key holds the binary address, whatever its presentation
+    if (inet_pton(AF_INET6, ipv6_address.c_str(), &address) != 1)
     {
         throw std::invalid_argument("Invalid conn_log.has_ipv6(ipv6_address): "
                 + ipv6_address);
     }
 
-    // check 'correct' filter
-    c.send_data("check " + std::to_string(timestamp / FILTER_LENGTH) + " "
-                + mac_address + "|" + ipv6_address + "\n");
-    std::string reply = c.receive(1024);
-    
-    if (reply.substr(0,3) == "Yes")
+    char key[FLOW_KEY_BYTES];
+
+    return has_key(key, pack_key_ipv6(device, address.s6_addr, key) - key, timestamp);
+}
+
+void conn_log::has_ipv6(const std::vector<uint32_t> &devices,
+                        const std::string &ipv6_address,
+                        time_t timestamp,
+                        std::vector<bool> &results)
+{
+    struct in6_addr address;
+    char key[FLOW_KEY_BYTES];
+
+    // the key holds the binary address, whatever its presentation
+    if (inet_pton(AF_INET6, ipv6_address.c_str(), &address) != 1)
     {
-        return true;
+        throw std::invalid_argument("Invalid conn_log.has_ipv6(ipv6_address): "
+                + ipv6_address);
     }
 
-    // fuzzy check at start of filter
-    time_t filter_start = (timestamp / FILTER_LENGTH) * FILTER_LENGTH;
-    if ((timestamp - filter_start) < FUZZINESS)
+    probe.clear();
+    for (size_t i = 0; i < devices.size(); ++i)
     {
-        c.send_data("check " + std::to_string((timestamp / FILTER_LENGTH) - 1)
-                    + " " + mac_address + "|" + ipv6_address + "\n");
-        std::string reply = c.receive(1024);
-        
-        if (reply.substr(0,3) == "Yes")
-        {
-            return true;
-        }
+        probe.add(key, pack_key_ipv6(devices[i], address.s6_addr, key) - key);
     }
-    
-    // fuzzy check at end of filter
-    time_t filter_end = ((timestamp / FILTER_LENGTH) + 1) * FILTER_LENGTH;
-    if ((filter_end - timestamp) < FUZZINESS)
+
+    has_keys(probe, timestamp, results);
+}
+
+bool conn_log::candidates_ipv6(std::string ipv6_address,
+                               time_t timestamp,
+                               std::set<uint32_t> &devices)
+{
+    struct in6_addr address;
+
+    if (inet_pton(AF_INET6, ipv6_address.c_str(), &address) != 1)
     {
-        c.send_data("check " + std::to_string((timestamp / FILTER_LENGTH) + 1)
-                    + " " + mac_address + "|" + ipv6_address + "\n");
-        std::string reply = c.receive(1024);
-        
-        if (reply.substr(0,3) == "Yes")
-        {
-            return true;
-        }
+        throw std::invalid_argument("Invalid conn_log.candidates_ipv6(ipv6_address): "
+                + ipv6_address);
     }
 
-    return false;
+    return candidates(reverse_index::ipv6_attribute(address.s6_addr), timestamp, devices);
 }
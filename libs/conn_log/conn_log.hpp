@@ -3,55 +3,320 @@
 // Name:        conn_log.hpp
 // Authors:     James H. Loving
 // Description: This file declares the conn_log class, used to log IPv4 and
-//              IPv6 communications on a local Bloomd server.
+//              IPv6 communications in time-sliced Bloom filters, either on a
+//              local Bloomd server or in process (see filter_store.hpp).
 //
 //=============================================================================
 
 #ifndef CONN_LOG_HPP
 #define CONN_LOG_HPP
 
+#include <algorithm>      // sort(), find()
+#include <chrono>         // batch latency timer
 #include <exception>      // exception handling
 #include <iostream>       // output
+#include <map>            // port bitmaps by device
+#include <memory>         // shared_ptr
 #include <regex>          // MAC and IP address validation
+#include <set>            // candidate devices
 #include <string>         // string class
 #include <stdint.h>       // int vars of atypical size (16b, 32b)
+#include <stdlib.h>       // atol()
+#include <string.h>       // strspn()
 #include <time.h>         // time(), etc.
+#include <vector>         // rollup rules
 
-#include "tcp_client.hpp"
+#include "filter_store.hpp"
+#include "port_index.hpp"
+#include "recent_keys.hpp"
+#include "reverse_index.hpp"
+#include "../flow_record/flow_record.hpp"
+
+const unsigned int FILTER_LENGTH = 3600;/**< sublog length (seconds) */
+const unsigned int MINUTE_LENGTH = 60;  /**< fine sublog length (seconds) */
+const time_t FINE_WINDOW = 0;           /**< default time fine sublogs are
+                                             kept (seconds), 0 for none */
+const unsigned int DAY_LENGTH = 86400;  /**< day rollup length (seconds) */
+const unsigned int WEEK_LENGTH = 604800;/**< week rollup length (seconds) */
 
 /**
-    Log IPv4 and IPv6 communications on a local Bloomd server.
+    When to merge old filters into coarser ones: a rollup filter replaces
+    the finer filters of its period once the period ended age seconds ago.
+*/
+struct rollup_rule
+{
+    unsigned int length;    /**< DAY_LENGTH or WEEK_LENGTH */
+    time_t age;             /**< min age of the period's end (seconds) */
+};
+
+/**
+    Log IPv4 and IPv6 communications in one Bloom filter per timeslot.
 */
 class conn_log
 {
     private:
-        const unsigned int FILTER_LENGTH = 3600;    /**< sublog length (seconds) */
         const unsigned int FUZZINESS = 10;          /**< how fuzzy to check
                                                          sublogs (seconds) */
-        const int MAX_FILTER_SIZE = 102400000;      /**< max sum of filters (bytes) */
-        const unsigned int PRUNE_CHECK_FREQ = 10000;/**< how often to check for 
-                                                         oversized filter (seconds */
-        tcp_client c;                               /**< TCP client for communication
-                                                         with Bloomd */
+        const unsigned int BULK_BATCH_SIZE = 256;   /**< keys sent per bulk
+                                                         set */
+        const unsigned int MAX_BATCH_LATENCY = 100; /**< max time a key waits
+                                                         before it is sent (ms) */
+        std::shared_ptr<filter_store> store;        /**< storage backend */
+        time_t batch_slot;                          /**< timeslot of queued keys */
+        key_batch batch;                            /**< queued keys */
+        time_t fine_slot;                           /**< minute of queued
+                                                         fine keys */
+        key_batch fine_batch;                       /**< queued fine keys */
+        std::chrono::steady_clock::time_point batch_start;
+                                                    /**< when the first queued
+                                                         key was added */
+        key_batch probe;                            /**< reused by has_key() */
+        key_batch retry;                            /**< reused by has_keys() */
+        std::vector<size_t> retry_index;            /**< reused by has_keys() */
+        std::vector<bool> found;                    /**< reused by has_keys() */
+        std::shared_ptr<reverse_index> index;       /**< devices by flow
+                                                         attribute, or empty */
+        std::shared_ptr<index_file> index_current;  /**< index_slot's file */
+        time_t index_slot;                          /**< timeslot of
+                                                         index_current */
+        recent_keys recent;                         /**< keys written this
+                                                         timeslot */
+        recent_keys fine_recent;                    /**< keys written this
+                                                         minute */
+        time_t fine_window;                         /**< time fine filters
+                                                         are kept (seconds),
+                                                         0 for none */
+        bool rolled_up;                             /**< whether the
+                                                         backend may hold
+                                                         rollup filters */
+        std::vector<std::string> probes;            /**< reused by has_keys() */
+        std::shared_ptr<port_index> ports;          /**< exact port index,
+                                                         or empty for none */
+        time_t port_minute;                         /**< minute of
+                                                         port_batch */
+        std::map<uint32_t, port_bitmap> port_batch; /**< ports used this
+                                                         minute, by device */
+
+        /**
+            Append the ports queued for the exact port index, if any. The
+            index is optional: a failure is reported and the ports dropped.
+        */
+        void flush_ports();
 
         /**
-            Get the current total size of all Bloomd filters in bytes.
+            Queue a key for a timeslot's filter, and for its minute's filter
+            if fine filters are kept for that long, flushing the queue when
+            it is full, stale, or the timeslot rolls over. Keys already
+            written during the timeslot (or minute) are skipped.
 
-            \return Unsigned sum of all Bloomd filters, in bytes.
+            \param key Binary key, see pack_key_ipv4/ipv6.
+            \param length Length of the key in bytes.
+            \param timestamp Time_t-encoded timestamp of the connection.
+
+            \return False if the key was skipped as a duplicate in the
+                timeslot's filter.
         */
-        unsigned int get_filter_size();
-        
+        bool queue_key(const char *key,
+                       size_t length,
+                       time_t timestamp);
+
+        /**
+            Record a device's flow attribute in a timeslot's reverse index.
+
+            \param slot Current timeslot.
+            \param attribute Attribute hash, see reverse_index.
+            \param device Device ID.
+        */
+        void index_key(time_t slot,
+                       uint64_t attribute,
+                       uint32_t device);
+
+        /**
+            Collect candidate devices for an attribute from the reverse index
+            of a timestamp's timeslot, and of its fuzzy_slot().
+
+            \param attribute Attribute hash, see reverse_index.
+            \param timestamp Time_t-encoded timestamp of the connection.
+            \param devices Set the candidate device IDs are added to.
+
+            \return False if any of those timeslots has no usable index.
+        */
+        bool candidates(uint64_t attribute,
+                        time_t timestamp,
+                        std::set<uint32_t> &devices);
+
         /**
-            Delete the oldest Bloomd filter until the sum of all filters'
-            size in bytes is less than MAX_FILTER_SIZE.
+            Check a key in the timeslot of a timestamp, and in the neighboring
+            timeslot if the timestamp is within FUZZINESS of its boundary.
+
+            \param key Binary key, see pack_key_ipv4/ipv6.
+            \param length Length of the key in bytes.
+            \param timestamp Time_t-encoded timestamp of the connection.
+
+            \return Boolean indicator of the key's presence in filters.
         */
-        void prune_filters();
+        bool has_key(const char *key,
+                     size_t length,
+                     time_t timestamp);
 
     public:
         /**
-            Initialize & test the connection to the local Bloomd server.
+            Open & test the storage backend, and open the reverse index in
+            REVERSE_INDEX_DIR (queries check every device without it).
+
+            \param backend "bloomd" (the local Bloomd server) or "local"
+                (in-process, memory-mapped filters). See open_store().
+        */
+        conn_log(const std::string &backend = "bloomd");
+
+        /**
+            Use an already open storage backend.
+
+            \param store Storage backend, shared with other users.
+            \param index Reverse index, shared with other users, or empty
+                for none.
+        */
+        explicit conn_log(std::shared_ptr<filter_store> store,
+                          std::shared_ptr<reverse_index> index = std::shared_ptr<reverse_index>());
+
+        /**
+            Send any queued keys before the backend goes away.
+        */
+        ~conn_log();
+
+        /**
+            Name of the filter holding a timeslot.
+
+            \param slot Timeslot, i.e. timestamp / FILTER_LENGTH.
+
+            \return Filter name, the timeslot in decimal.
+        */
+        static std::string filter_name(time_t slot);
+
+        /**
+            Name of the filter holding one period of a level.
+
+            \param period Period, i.e. timestamp / length.
+            \param length FILTER_LENGTH, MINUTE_LENGTH, DAY_LENGTH or
+                WEEK_LENGTH.
+
+            \return Filter name: the period in decimal for hours, prefixed
+                with 'm' for minutes, 'd' for days and 'w' for weeks.
+        */
+        static std::string filter_name(time_t period,
+                                       unsigned int length);
+
+        /**
+            Parse a name made by filter_name().
+
+            \param name Filter name.
+            \param period Set to the period.
+            \param length Set to the level's length (seconds).
+
+            \return False if the name is not a filter_name().
+        */
+        static bool parse_filter_name(const std::string &name,
+                                      time_t *period,
+                                      unsigned int *length);
+
+        /**
+            Write each key to its minute's filter too, and check those
+            filters for timestamps they still cover; see filter_manager.
+
+            \param window Time fine filters are kept (seconds), as given to
+                the filter_manager; 0 for none.
+        */
+        void set_fine_window(time_t window);
+
+        /**
+            Also record each device's IPv4 source ports per minute in an
+            exact index, and answer exact_ipv4() from it.
+
+            \param index Port index, shared with other users, or empty to
+                stop.
+        */
+        void set_port_index(std::shared_ptr<port_index> index);
+
+        /**
+            List the filters that may hold a timestamp's connections, in the
+            order to check them. Within the fine window, the minute's filter
+            and that of its fuzzy neighbor only, if both exist. Otherwise,
+            for its timeslot and its fuzzy_slot(), the week and day filters
+            of periods that have ended, if the backend can merge (see
+            filter_manager), then the hourly filter.
+
+            \param timestamp Time_t-encoded timestamp of a connection.
+            \param names Set to the filter names, without duplicates.
+                Timestamps with the same list can share a has_keys() batch.
+        */
+        void probe_filters(time_t timestamp,
+                           std::vector<std::string> &names) const;
+
+        /**
+            The timeslot checked after a timestamp's own: the neighboring
+            timeslot if the timestamp is within FUZZINESS of its boundary.
+
+            \param timestamp Time_t-encoded timestamp of a connection.
+
+            \return The neighboring timeslot, or the timestamp's own
+                timeslot if there is none to check.
+        */
+        time_t fuzzy_slot(time_t timestamp) const;
+
+        /**
+            fuzzy_slot() for a level of another length.
+
+            \param timestamp Time_t-encoded timestamp of a connection.
+            \param length Length of the level's periods (seconds).
+
+            \return The neighboring period, or the timestamp's own.
+        */
+        time_t fuzzy_slot(time_t timestamp,
+                          unsigned int length) const;
+
+        /**
+            Check a batch of keys, all for the same timestamp: every key in
+            the timestamp's timeslot in one batch, then only the keys not
+            found there in the neighboring timeslot if the timestamp is
+            within FUZZINESS of its boundary. Where a rollup may hold the
+            timeslot, it is checked first; see probe_filters().
+
+            Timestamps with the same timeslot and fuzzy_slot() share one
+            batch.
+
+            \param keys Keys to check, see pack_key_ipv4/ipv6.
+            \param timestamp Time_t-encoded timestamp of the connections.
+            \param results Set to each key's presence in the filters.
+        */
+        void has_keys(const key_batch &keys,
+                      time_t timestamp,
+                      std::vector<bool> &results);
+
+        /**
+            Send all queued keys to the backend in one bulk set.
+        */
+        void flush();
+
+        /**
+            Flush the queued keys if the oldest has waited longer than
+            MAX_BATCH_LATENCY. Call this when there is nothing to add.
+        */
+        void flush_stale();
+
+        /**
+            \return Number of keys queued and not yet sent to the backend.
+        */
+        size_t queued() const;
+
+        /**
+            \return Number of keys skipped as already written this timeslot.
         */
-        conn_log();
+        uint64_t duplicate_keys() const;
+
+        /**
+            \return Number of keys queued for the backend.
+        */
+        uint64_t distinct_keys() const;
 
         // TODO: fix these functions
         /**
@@ -74,56 +339,169 @@ class conn_log
         bool valid_ipv6(std::string ipv6) const;
 
         /**
-            Add an IPv4/TCP connection to the current Bloomd filter.
+            Add an IPv4/TCP connection to the current filter. Keys
+            are queued and sent in bulk; see conn_log::flush. No
+            validation or heap allocation is done.
 
-            \param mac_address String-encoded MAC address.
-                See conn_log::valid_mac for validity rules.
+            \param device Device ID, see device_registry.
             \param port TCP source port, 0-65535.
         */
-        void add_ipv4(std::string mac_address,
+        void add_ipv4(uint32_t device,
                       uint16_t port);
+
+        /**
+            Add an IPv4/TCP connection to the filter of the timeslot it was
+            seen in, ex when replaying spooled connections.
+
+            \param device Device ID, see device_registry.
+            \param port TCP source port, 0-65535.
+            \param timestamp Time_t-encoded timestamp of the connection.
+        */
+        void add_ipv4(uint32_t device,
+                      uint16_t port,
+                      time_t timestamp);
         
         /**
-            Determine the appropriate Bloomd filter and check if it contains
+            Determine the appropriate filter and check if it contains
             a specific IPv4 connection.
 
-            \param mac_address MAC address of connection to check.
-                See conn_log::valid_mac for validity rules.
+            \param device ID of the device to check.
             \param port TCP source port (0-65535) of connection to check.
             \param timestamp Time_t-encoded timestamp of connection to check.
 
             \return Boolean indicator of the connection's presence in filters.
         */
-        bool has_ipv4(std::string mac_address,
+        bool has_ipv4(uint32_t device,
                       uint16_t port,
                       time_t timestamp);
 
         /**
-            Add an IPv6/TCP connection to the current Bloomd filter.
+            Check many devices for the same IPv4 connection at once, in
+            at most two batched lookups (see has_ipv4()).
+
+            \param devices IDs of the devices to check.
+            \param port TCP source port (0-65535) of connection to check.
+            \param timestamp Time_t-encoded timestamp of connection to check.
+            \param results Set to whether each device had the connection.
+        */
+        void has_ipv4(const std::vector<uint32_t> &devices,
+                      uint16_t port,
+                      time_t timestamp,
+                      std::vector<bool> &results);
+
+        /**
+            Find the devices that may have used an IPv4 source port around
+            a timestamp, from the reverse index. Each candidate must still be
+            checked with has_ipv4().
 
-            \param mac_address String-encoded MAC address.
-                See conn_log::valid_mac for validity rules.
+            \param port TCP/UDP source port, 0-65535.
+            \param timestamp Time_t-encoded timestamp of connection to check.
+            \param devices Set the candidate device IDs are added to.
+
+            \return False if the index can't answer (missing or overflowed);
+                every device must be checked instead.
+        */
+        bool candidates_ipv4(uint16_t port,
+                             time_t timestamp,
+                             std::set<uint32_t> &devices);
+
+        /**
+            Find the devices that used any of a set of IPv4 source ports
+            during a window, from the exact port index (see
+            set_port_index()). There are no false positives; the window is
+            widened to whole minutes.
+
+            \param query Source ports to look for, ex a range.
+            \param from Time_t-encoded start of the window.
+            \param to Time_t-encoded end of the window, inclusive.
+            \param devices Set the matching device IDs are added to.
+
+            \return False if there is no index, or part of it can't be read.
+                Timeslots with no index file count as empty.
+        */
+        bool exact_ipv4(const port_bitmap &query,
+                        time_t from,
+                        time_t to,
+                        std::set<uint32_t> &devices);
+
+        /**
+            Add an IPv6/TCP connection to the current filter. Keys
+            are queued and sent in bulk; see conn_log::flush.
+
+            \param device Device ID, see device_registry.
             \param ipv6_address 128-bit IPv6 address, encoded as a string.
                 See conn_log::valid_ipv6 for validity rules.
         */
-        void add_ipv6(std::string mac_address,
+        void add_ipv6(uint32_t device,
                       std::string ipv6_address);
+
+        /**
+            Add an IPv6/TCP connection to the current filter, from
+            a binary address. No validation or heap allocation is done.
+
+            \param device Device ID, see device_registry.
+            \param ipv6_address Pointer to the 16-byte binary IPv6 address.
+        */
+        void add_ipv6(uint32_t device,
+                      const uint8_t *ipv6_address);
+
+        /**
+            Add an IPv6/TCP connection to the filter of the timeslot it was
+            seen in, ex when replaying spooled connections.
+
+            \param device Device ID, see device_registry.
+            \param ipv6_address Pointer to the 16-byte binary IPv6 address.
+            \param timestamp Time_t-encoded timestamp of the connection.
+        */
+        void add_ipv6(uint32_t device,
+                      const uint8_t *ipv6_address,
+                      time_t timestamp);
         
         /**
-            Determine the appropriate Bloomd filter and check if it contains
+            Determine the appropriate filter and check if it contains
             a specific IPv6 connection.
 
-            \param mac_address MAC address of connection to check.
-                See conn_log::valid_mac for validity rules.
+            \param device ID of the device to check.
             \param ipv6_address 128-bit IPv6 address to check, encoded as a
                 string. See conn_log::valid_ipv6 for validity rules.
             \param timestamp Time_t-encoded timestamp of connection to check.
 
             \return Boolean indicator of the connection's presence in filters.
         */
-        bool has_ipv6(std::string mac_address,
+        bool has_ipv6(uint32_t device,
                       std::string ipv6_address,
                       time_t timestamp);
+
+        /**
+            Check many devices for the same IPv6 connection at once, in
+            at most two batched lookups (see has_ipv6()).
+
+            \param devices IDs of the devices to check.
+            \param ipv6_address 128-bit IPv6 address to check, encoded as a
+                string. See conn_log::valid_ipv6 for validity rules.
+            \param timestamp Time_t-encoded timestamp of connection to check.
+            \param results Set to whether each device had the connection.
+        */
+        void has_ipv6(const std::vector<uint32_t> &devices,
+                      const std::string &ipv6_address,
+                      time_t timestamp,
+                      std::vector<bool> &results);
+
+        /**
+            Find the devices that may have used an IPv6 source address
+            around a timestamp, from the reverse index. Each candidate must
+            still be checked with has_ipv6().
+
+            \param ipv6_address 128-bit IPv6 address, encoded as a string.
+            \param timestamp Time_t-encoded timestamp of connection to check.
+            \param devices Set the candidate device IDs are added to.
+
+            \return False if the index can't answer (missing or overflowed);
+                every device must be checked instead.
+        */
+        bool candidates_ipv6(std::string ipv6_address,
+                             time_t timestamp,
+                             std::set<uint32_t> &devices);
 };
 
 #endif
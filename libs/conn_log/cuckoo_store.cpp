@@ -0,0 +1,557 @@
+//=============================================================================
+//
+// Name:        cuckoo_store.cpp
+// Authors:     James H. Loving
+// Description: This file defines the cuckoo_store class, conn_log's
+//              deletable storage backend. For additional documentation,
+//              refer to cuckoo_store.hpp and filter_store.hpp.
+//
+//=============================================================================
+
+#include "cuckoo_store.hpp"
+
+static const char CUCKOO_FILE_MAGIC[8] = "EDICTCF";
+static const uint32_t CUCKOO_FILE_VERSION = 1;
+static const char CUCKOO_FILE_SUFFIX[] = ".cf";
+
+/**
+    Lock a filter against this process's other threads and against other
+    processes for as long as the object lives.
+*/
+class change_lock
+{
+    private:
+        std::lock_guard<std::mutex> guard;  /**< other threads */
+        int fd;                             /**< other processes */
+
+    public:
+        change_lock(std::mutex &lock,
+                    int fd) : guard(lock), fd(fd)
+        {
+            flock(fd, LOCK_EX);
+        }
+
+        ~change_lock()
+        {
+            flock(fd, LOCK_UN);
+        }
+};
+
+cuckoo_file::cuckoo_file(const std::string &path,
+                         bool create,
+                         uint64_t capacity)
+{
+    fd = open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("cuckoo_file could not open " + path + ": " + strerror(errno));
+    }
+
+    // another process may be creating the same file
+    flock(fd, LOCK_EX);
+
+    struct stat st;
+    fstat(fd, &st);
+    bool fresh = st.st_size == 0;
+
+    uint64_t buckets = cuckoo_filter::optimal_buckets(capacity);
+    length = fresh ? sizeof(struct cuckoo_file_header) + buckets * cuckoo_filter::BUCKET_BYTES : st.st_size;
+
+    // a new file is sized up front and reads back as zeros, i.e. empty
+    if (fresh && ftruncate(fd, length) < 0)
+    {
+        close(fd);
+        throw std::runtime_error("cuckoo_file could not size " + path + ": " + strerror(errno));
+    }
+
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        throw std::runtime_error("cuckoo_file could not map " + path + ": " + strerror(errno));
+    }
+    header = static_cast<struct cuckoo_file_header *>(map);
+
+    if (fresh)
+    {
+        memcpy(header->magic, CUCKOO_FILE_MAGIC, sizeof(header->magic));
+        header->version = CUCKOO_FILE_VERSION;
+        header->bucket_bytes = cuckoo_filter::BUCKET_BYTES;
+        header->buckets = buckets;
+        header->capacity = capacity;
+    }
+    flock(fd, LOCK_UN);
+
+    if (memcmp(header->magic, CUCKOO_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CUCKOO_FILE_VERSION ||
+        header->bucket_bytes != cuckoo_filter::BUCKET_BYTES ||
+        !header->buckets || (header->buckets & (header->buckets - 1)) ||
+        sizeof(struct cuckoo_file_header) + header->buckets * cuckoo_filter::BUCKET_BYTES > length)
+    {
+        munmap(map, length);
+        close(fd);
+        throw std::runtime_error("cuckoo_file: " + path + " is not a valid filter file");
+    }
+}
+
+cuckoo_file::~cuckoo_file()
+{
+    munmap(header, length);
+    close(fd);
+}
+
+uint64_t cuckoo_file::size() const
+{
+    return length;
+}
+
+uint64_t cuckoo_file::keys() const
+{
+    return __atomic_load_n(&header->keys, __ATOMIC_RELAXED);
+}
+
+uint64_t cuckoo_file::capacity() const
+{
+    return header->capacity;
+}
+
+uint64_t cuckoo_file::bucket_count() const
+{
+    return header->buckets;
+}
+
+bool cuckoo_file::replaced() const
+{
+    return __atomic_load_n(&header->replaced, __ATOMIC_ACQUIRE);
+}
+
+size_t cuckoo_file::insert(const uint64_t *entries,
+                           size_t count)
+{
+    change_lock guard(lock, fd);
+    if (replaced())
+    {
+        return 0;
+    }
+
+    cuckoo_filter filter(header + 1, header->buckets);
+    uint64_t added = 0;
+    size_t i = 0;
+    for (; i < count; ++i)
+    {
+        if (filter.contains(entries[i]))
+        {
+            continue;
+        }
+        else if (!filter.insert(entries[i]))
+        {
+            break;
+        }
+        ++added;
+    }
+    __atomic_fetch_add(&header->keys, added, __ATOMIC_RELAXED);
+
+    return i;
+}
+
+void cuckoo_file::contains(const uint64_t *entries,
+                           size_t count,
+                           uint64_t *found) const
+{
+    cuckoo_filter filter(header + 1, header->buckets);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (filter.contains(entries[i]))
+        {
+            found[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+}
+
+uint64_t cuckoo_file::purge(uint32_t device)
+{
+    change_lock guard(lock, fd);
+    if (replaced())
+    {
+        return 0;
+    }
+
+    cuckoo_filter filter(header + 1, header->buckets);
+    uint64_t removed = filter.purge(device);
+    __atomic_fetch_sub(&header->keys, std::min(removed, keys()), __ATOMIC_RELAXED);
+
+    return removed;
+}
+
+void cuckoo_file::entries(std::vector<uint64_t> &entries) const
+{
+    const uint64_t *slots = reinterpret_cast<const uint64_t *>(header + 1);
+    uint64_t count = header->buckets * cuckoo_filter::BUCKET_ENTRIES;
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        uint64_t entry = __atomic_load_n(&slots[i], __ATOMIC_ACQUIRE);
+        if (entry)
+        {
+            entries.push_back(entry);
+        }
+    }
+}
+
+void cuckoo_file::grow(const std::string &path)
+{
+    change_lock guard(lock, fd);
+    if (replaced())
+    {
+        return;
+    }
+
+    std::vector<uint64_t> copy;
+    entries(copy);
+
+    // the copy is complete before it takes the file's place, and it can't
+    // change meanwhile: every insert() and purge() holds the lock
+    std::string temporary = path + ".tmp";
+    unlink(temporary.c_str());
+    {
+        cuckoo_file larger(temporary, true, cuckoo_filter::capacity(header->buckets * 2));
+        if (larger.insert(copy.data(), copy.size()) < copy.size() ||
+            fsync(larger.fd) < 0)
+        {
+            unlink(temporary.c_str());
+            throw std::runtime_error("cuckoo_file could not grow " + path);
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) < 0)
+    {
+        std::string error = strerror(errno);
+        unlink(temporary.c_str());
+        throw std::runtime_error("cuckoo_file could not replace " + path + ": " + error);
+    }
+
+    __atomic_store_n(&header->replaced, 1, __ATOMIC_RELEASE);
+}
+
+cuckoo_store::cuckoo_store(const std::string &directory)
+{
+    this->directory = directory;
+
+    // create the directory (and its parents) if needed
+    for (size_t slash = directory.find('/', 1); ; slash = directory.find('/', slash + 1))
+    {
+        mkdir(directory.substr(0, slash).c_str(), 0755);
+        if (slash == std::string::npos)
+        {
+            break;
+        }
+    }
+
+    struct stat st;
+    if (stat(directory.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+    {
+        throw std::runtime_error("cuckoo_store could not open " + directory + ": " + strerror(errno));
+    }
+}
+
+std::string cuckoo_store::path(const std::string &filter) const
+{
+    if (filter.empty() ||
+        filter.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789_-") != std::string::npos)
+    {
+        throw std::invalid_argument("cuckoo_store: invalid filter name " + filter);
+    }
+
+    return directory + "/" + filter + CUCKOO_FILE_SUFFIX;
+}
+
+std::shared_ptr<cuckoo_file> cuckoo_store::find(const std::string &filter,
+                                                bool create,
+                                                bool keep,
+                                                uint64_t capacity)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    // a filter another user grew is opened again from its new file
+    std::map<std::string, std::shared_ptr<cuckoo_file> >::iterator it = filters.find(filter);
+    if (it != filters.end() && !it->second->replaced())
+    {
+        return it->second;
+    }
+
+    struct stat st;
+    std::string file = path(filter);
+    if (!create && stat(file.c_str(), &st) < 0)
+    {
+        if (it != filters.end())
+        {
+            filters.erase(it);
+        }
+        return std::shared_ptr<cuckoo_file>();
+    }
+
+    std::shared_ptr<cuckoo_file> opened = std::make_shared<cuckoo_file>(file, create, capacity);
+    if (keep || it != filters.end())
+    {
+        filters[filter] = opened;
+    }
+
+    return opened;
+}
+
+void cuckoo_store::add(const std::string &filter,
+                       const uint64_t *entries,
+                       size_t count)
+{
+    size_t done = 0;
+
+    while (true)
+    {
+        std::shared_ptr<cuckoo_file> f = find(filter, true, true);
+        done += f->insert(entries + done, count - done);
+        if (done == count)
+        {
+            break;
+        }
+
+        // full: the capacity predicted was too low
+        f->grow(path(filter));
+    }
+}
+
+std::vector<uint64_t> cuckoo_store::make_entries(const key_batch &keys)
+{
+    std::vector<uint64_t> entries(keys.size());
+
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        // the device ID, big-endian, as pack_key_ipv4/ipv6 write it
+        const unsigned char *key = reinterpret_cast<const unsigned char *>(keys.key(i));
+        uint32_t device = 0;
+        for (size_t b = 0; b < 4 && b < keys.length(i); ++b)
+        {
+            device = device << 8 | key[b];
+        }
+
+        entries[i] = cuckoo_filter::make_entry(device, hash_key(keys.key(i), keys.length(i)));
+    }
+
+    return entries;
+}
+
+std::map<std::string, uint64_t> cuckoo_store::list()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::map<std::string, uint64_t> sizes;
+
+    for (std::map<std::string, std::shared_ptr<cuckoo_file> >::iterator it = filters.begin(); it != filters.end(); ++it)
+    {
+        sizes[it->first] = it->second->size();
+    }
+
+    return sizes;
+}
+
+uint64_t cuckoo_store::info(const std::string &filter)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    std::map<std::string, std::shared_ptr<cuckoo_file> >::iterator it = filters.find(filter);
+    if (it != filters.end() && !it->second->replaced())
+    {
+        return it->second->size();
+    }
+
+    // a filter this process never mapped (ex a query process) is on disk
+    struct stat st;
+
+    return stat(path(filter).c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+void cuckoo_store::create(const std::string &filter)
+{
+    find(filter, true, true);
+}
+
+void cuckoo_store::create(const std::string &filter,
+                          uint64_t capacity,
+                          double /* probability */)
+{
+    find(filter, true, true, capacity);
+}
+
+void cuckoo_store::drop(const std::string &filter)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    // users holding the filter keep their mapping until they let go
+    filters.erase(filter);
+    unlink(path(filter).c_str());
+}
+
+void cuckoo_store::set(const std::string &filter,
+                       const key_batch &keys)
+{
+    std::vector<uint64_t> entries = make_entries(keys);
+
+    add(filter, entries.data(), entries.size());
+}
+
+void cuckoo_store::check(const std::string &filter,
+                         const key_batch &keys,
+                         std::vector<bool> &found)
+{
+    std::shared_ptr<cuckoo_file> f = find(filter, false, false);
+
+    found.assign(keys.size(), false);
+    if (!f)
+    {
+        return;
+    }
+
+    std::vector<uint64_t> entries = make_entries(keys);
+    std::vector<uint64_t> bits((keys.size() + 63) / 64);
+    f->contains(entries.data(), entries.size(), bits.data());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        found[i] = (bits[i / 64] >> (i % 64)) & 1;
+    }
+}
+
+bool cuckoo_store::stats(const std::string &filter,
+                         struct filter_stats &stats)
+{
+    std::shared_ptr<cuckoo_file> f = find(filter, false, false);
+    if (!f)
+    {
+        return false;
+    }
+
+    stats.keys = f->keys();
+    stats.capacity = f->capacity();
+    stats.size = f->size();
+    stats.probability = cuckoo_filter::false_positive_rate(stats.keys, f->bucket_count());
+
+    return true;
+}
+
+bool cuckoo_store::archive(const std::string &filter)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    filters.erase(filter);
+
+    return true;
+}
+
+bool cuckoo_store::merge(const std::string &filter,
+                         const std::vector<std::string> &sources,
+                         double /* probability */,
+                         double *rate)
+{
+    std::vector<uint64_t> entries;
+    bool found = false;
+
+    *rate = 0;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        std::shared_ptr<cuckoo_file> source = find(sources[i], false, false);
+        if (source)
+        {
+            source->entries(entries);
+            found = true;
+        }
+    }
+    if (!found)
+    {
+        return true;
+    }
+
+    // sized for the sources the first time; a later merge grows it
+    std::shared_ptr<cuckoo_file> target = find(filter, false, false);
+    if (!target)
+    {
+        find(filter, true, true, entries.size());
+    }
+    add(filter, entries.data(), entries.size());
+
+    struct filter_stats merged;
+    if (stats(filter, merged))
+    {
+        *rate = merged.probability;
+    }
+    archive(filter);
+
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        drop(sources[i]);
+    }
+
+    return true;
+}
+
+bool cuckoo_store::merged_rate(const std::string & /* filter */,
+                               const std::vector<std::string> & /* sources */,
+                               double *rate)
+{
+    // the filter grows, so no rate holds a merge back
+    *rate = 0;
+
+    return true;
+}
+
+bool cuckoo_store::can_merge()
+{
+    return true;
+}
+
+std::map<std::string, uint64_t> cuckoo_store::archived()
+{
+    std::map<std::string, uint64_t> sizes;
+
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+    {
+        return sizes;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    size_t suffix = strlen(CUCKOO_FILE_SUFFIX);
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        std::string name = entry->d_name;
+        if (name.length() > suffix &&
+            name.compare(name.length() - suffix, suffix, CUCKOO_FILE_SUFFIX) == 0 &&
+            !filters.count(name.substr(0, name.length() - suffix)) &&
+            stat((directory + "/" + name).c_str(), &st) == 0)
+        {
+            sizes[name.substr(0, name.length() - suffix)] = st.st_size;
+        }
+    }
+    closedir(dir);
+
+    return sizes;
+}
+
+bool cuckoo_store::purge(const std::string &filter,
+                         uint32_t device,
+                         uint64_t *removed)
+{
+    std::shared_ptr<cuckoo_file> f = find(filter, false, false);
+
+    // a filter grown meanwhile is purged again in its new file
+    *removed = 0;
+    while (f)
+    {
+        *removed += f->purge(device);
+        if (!f->replaced())
+        {
+            break;
+        }
+        f = find(filter, false, false);
+    }
+
+    return true;
+}
@@ -0,0 +1,296 @@
+//=============================================================================
+//
+// Name:        cuckoo_store.hpp
+// Authors:     James H. Loving
+// Description: This file declares the cuckoo_store class, a conn_log
+//              storage backend of cuckoo filters in memory-mapped files.
+//              Unlike a Bloom filter, a cuckoo filter can delete keys, and
+//              it keeps each key's device ID, so every key of a device
+//              can be purged from every timeslot (ex after an erasure
+//              request) without knowing the keys themselves.
+//
+//=============================================================================
+
+#ifndef CUCKOO_STORE_HPP
+#define CUCKOO_STORE_HPP
+
+#include <algorithm>      // min()
+#include <dirent.h>       // directory scan
+#include <errno.h>        // errno
+#include <fcntl.h>        // open()
+#include <map>            // open filters
+#include <memory>         // shared_ptr
+#include <mutex>          // guards the filter map, serializes inserts
+#include <stdio.h>        // rename()
+#include <string.h>       // strerror()
+#include <string>         // string class
+#include <sys/file.h>     // flock()
+#include <sys/mman.h>     // mmap()
+#include <sys/stat.h>     // mkdir(), fstat()
+#include <unistd.h>       // close(), ftruncate(), unlink()
+#include <vector>         // entry batches
+
+#include "filter_store.hpp"
+#include "../bloom_filter/bloom_filter.hpp"
+#include "../cuckoo_filter/cuckoo_filter.hpp"
+
+const char CUCKOO_FILTER_DIR[] = "/var/lib/edict/cuckoo";
+                                        /**< directory holding the cuckoo
+                                             backend's filter files */
+const uint64_t CUCKOO_FILTER_CAPACITY = 100000;
+                                        /**< keys per filter unless sized
+                                             otherwise; a full filter grows */
+
+/**
+    Header at the start of every cuckoo filter file.
+*/
+struct cuckoo_file_header
+{
+    char magic[8];          /**< "EDICTCF" + '\0' */
+    uint32_t version;       /**< file format version */
+    uint32_t bucket_bytes;  /**< bytes per bucket */
+    uint64_t buckets;       /**< number of buckets */
+    uint64_t keys;          /**< entries in use */
+    uint64_t capacity;      /**< keys it was sized for */
+    uint32_t replaced;      /**< set once a larger copy took the file's
+                                 place; users must open it again */
+    uint32_t padding;       /**< unused */
+    uint64_t reserved[2];   /**< aligns the buckets to a cache line */
+};
+
+/**
+    One cuckoo filter file, mapped into memory for as long as the object
+    lives. Changes are serialized between threads and, by flock(), between
+    processes; checks take no lock.
+*/
+class cuckoo_file
+{
+    private:
+        int fd;                         /**< open filter file */
+        size_t length;                  /**< mapped length in bytes */
+        struct cuckoo_file_header *header;
+                                        /**< start of the mapping */
+        std::mutex lock;                /**< serializes this process's
+                                             changes */
+
+        cuckoo_file(const cuckoo_file &);
+        cuckoo_file &operator=(const cuckoo_file &);
+
+    public:
+        /**
+            Open (or create) and map a filter file.
+
+            \param path Path of the filter file.
+            \param create Create an empty filter if the file does not exist.
+            \param capacity Keys a created filter is sized for.
+        */
+        cuckoo_file(const std::string &path,
+                    bool create,
+                    uint64_t capacity = CUCKOO_FILTER_CAPACITY);
+
+        /**
+            Unmap and close the filter file.
+        */
+        ~cuckoo_file();
+
+        /**
+            \return Size of the filter file in bytes.
+        */
+        uint64_t size() const;
+
+        /**
+            \return Number of keys in the filter.
+        */
+        uint64_t keys() const;
+
+        /**
+            \return Number of keys the filter was sized for.
+        */
+        uint64_t capacity() const;
+
+        /**
+            \return Number of buckets, a power of two.
+        */
+        uint64_t bucket_count() const;
+
+        /**
+            \return True once a larger copy has replaced the file.
+        */
+        bool replaced() const;
+
+        /**
+            Add a batch of entries, stopping at the first that doesn't fit.
+
+            \param entries Entries, see cuckoo_filter::make_entry().
+            \param count Number of entries.
+
+            \return Number of entries added (or already there), count
+                unless the filter filled up or was replaced.
+        */
+        size_t insert(const uint64_t *entries,
+                      size_t count);
+
+        /**
+            Check a batch of entries.
+
+            \param entries Entries, see cuckoo_filter::make_entry().
+            \param count Number of entries.
+            \param found Output bitmask, (count + 63) / 64 words: bit i is
+                set if entry i may be present.
+        */
+        void contains(const uint64_t *entries,
+                      size_t count,
+                      uint64_t *found) const;
+
+        /**
+            Remove every entry of a device.
+
+            \param device Device ID.
+
+            \return Number of entries removed, 0 if the file was replaced.
+        */
+        uint64_t purge(uint32_t device);
+
+        /**
+            Append every entry in the filter to a vector.
+
+            \param entries Vector to append to.
+        */
+        void entries(std::vector<uint64_t> &entries) const;
+
+        /**
+            Replace the file at path with a copy of the filter twice as
+            large, then mark this one replaced. Does nothing if it already
+            is.
+
+            \param path Path of the filter file.
+        */
+        void grow(const std::string &path);
+};
+
+/**
+    Named cuckoo filters in memory-mapped files under one directory. The
+    device ID of each key is its first four bytes (see pack_key_ipv4/ipv6).
+    A filter is mapped from its first use until it is archived, which only
+    unmaps it; checks and purges still find it on disk. Safe to share
+    between threads.
+*/
+class cuckoo_store : public filter_store
+{
+    private:
+        std::string directory;          /**< where filter files live */
+        std::mutex lock;                /**< guards filters */
+        std::map<std::string, std::shared_ptr<cuckoo_file> > filters;
+                                        /**< mapped filters, by name */
+
+        cuckoo_store(const cuckoo_store &);
+        cuckoo_store &operator=(const cuckoo_store &);
+
+        /**
+            \return Path of a filter's file. Throws on unsafe names.
+        */
+        std::string path(const std::string &filter) const;
+
+        /**
+            Look up a filter, mapping it if it exists on disk.
+
+            \param filter Name of the filter.
+            \param create Create the filter if it does not exist.
+            \param keep Keep it mapped for later use; otherwise it is only
+                mapped for as long as the caller holds it.
+            \param capacity Keys a created filter is sized for.
+
+            \return The filter, or an empty pointer.
+        */
+        std::shared_ptr<cuckoo_file> find(const std::string &filter,
+                                          bool create,
+                                          bool keep,
+                                          uint64_t capacity = CUCKOO_FILTER_CAPACITY);
+
+        /**
+            Add entries to a filter, creating it if needed and growing it
+            as it fills.
+
+            \param filter Name of the filter.
+            \param entries Entries, see cuckoo_filter::make_entry().
+            \param count Number of entries.
+        */
+        void add(const std::string &filter,
+                 const uint64_t *entries,
+                 size_t count);
+
+        /**
+            \return Entries of a batch of keys, see cuckoo_filter::make_entry().
+        */
+        static std::vector<uint64_t> make_entries(const key_batch &keys);
+
+    public:
+        /**
+            Use a directory of filter files, creating it if needed.
+
+            \param directory Directory holding the filter files.
+        */
+        explicit cuckoo_store(const std::string &directory);
+
+        /**
+            List the mapped filters.
+        */
+        std::map<std::string, uint64_t> list();
+
+        uint64_t info(const std::string &filter);
+
+        void create(const std::string &filter);
+
+        /**
+            Create the filter with the fewest buckets (a power of two) that
+            holds capacity keys. The false positive rate doesn't depend on
+            the size, so probability is not used.
+        */
+        void create(const std::string &filter,
+                    uint64_t capacity,
+                    double probability);
+
+        void drop(const std::string &filter);
+
+        void set(const std::string &filter,
+                 const key_batch &keys);
+
+        void check(const std::string &filter,
+                   const key_batch &keys,
+                   std::vector<bool> &found);
+
+        bool stats(const std::string &filter,
+                   struct filter_stats &stats);
+
+        /**
+            Unmap the filter; its file stays where check() finds it.
+        */
+        bool archive(const std::string &filter);
+
+        /**
+            Copy the sources' entries into the filter, unmap it, then
+            delete the sources. The filter grows to hold them, so its rate
+            stays that of its fingerprints and the merge always goes ahead.
+        */
+        bool merge(const std::string &filter,
+                   const std::vector<std::string> &sources,
+                   double probability,
+                   double *rate);
+
+        bool merged_rate(const std::string &filter,
+                         const std::vector<std::string> &sources,
+                         double *rate);
+
+        bool can_merge();
+
+        /**
+            List the filters on disk that are not mapped.
+        */
+        std::map<std::string, uint64_t> archived();
+
+        bool purge(const std::string &filter,
+                   uint32_t device,
+                   uint64_t *removed);
+};
+
+#endif
@@ -0,0 +1,537 @@
+//=============================================================================
+//
+// Name:        filter_manager.cpp
+// Authors:     James H. Loving
+// Description: This file defines the filter_manager class, which runs
+//              conn_log's filter housekeeping on a background thread.
+//              For additional documentation, refer to filter_manager.hpp.
+//
+//=============================================================================
+
+#include "filter_manager.hpp"
+
+filter_manager::filter_manager(uint64_t budget,
+                               time_t retention,
+                               const std::string &backend,
+                               const std::vector<struct rollup_rule> &rules,
+                               time_t fine_window,
+                               double probability)
+{
+    this->budget = budget;
+    this->retention = retention;
+    this->backend = backend;
+    this->fine_window = fine_window;
+    this->probability = probability;
+    this->rules = rules;
+    std::sort(this->rules.begin(), this->rules.end(),
+              [](const struct rollup_rule &a, const struct rollup_rule &b) { return a.length < b.length; });
+    total = 0;
+    archived_total = 0;
+    synced_slot = 0;
+    stopping = false;
+}
+
+filter_manager::~filter_manager()
+{
+    stop();
+}
+
+void filter_manager::start()
+{
+    if (!worker.joinable())
+    {
+        stopping = false;
+        worker = std::thread(&filter_manager::run, this);
+    }
+}
+
+void filter_manager::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+}
+
+void filter_manager::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (!stopping)
+    {
+        guard.unlock();
+        try
+        {
+            manage(time(nullptr));
+        }
+        catch (std::exception &e)
+        {
+            // try again with a fresh connection next pass
+            std::cout << "filter_manager: " << e.what() << "\n";
+            store.reset();
+        }
+        guard.lock();
+
+        wake.wait_for(guard, std::chrono::seconds(MANAGE_INTERVAL));
+    }
+}
+
+void filter_manager::load_sizes()
+{
+    if (!store)
+    {
+        store = open_store(backend);
+    }
+
+    if (!index)
+    {
+        try
+        {
+            index = open_index(REVERSE_INDEX_DIR);
+        }
+        catch (std::exception &e)
+        {
+            std::cout << "filter_manager: no reverse index: " << e.what() << "\n";
+        }
+    }
+
+    if (!ports)
+    {
+        try
+        {
+            ports = open_port_index(PORT_INDEX_DIR);
+        }
+        catch (std::exception &e)
+        {
+            std::cout << "filter_manager: no port index: " << e.what() << "\n";
+        }
+    }
+
+    // only timeslot and rollup filters, see conn_log::filter_name()
+    std::map<std::string, uint64_t> stored = store->archived();
+    time_t period;
+    unsigned int length;
+    uint64_t archived_sum = 0;
+    rollups.clear();
+    for (std::map<std::string, uint64_t>::iterator it = stored.begin(); it != stored.end(); ++it)
+    {
+        if (!conn_log::parse_filter_name(it->first, &period, &length))
+        {
+            continue;
+        }
+        else if (length == FILTER_LENGTH)
+        {
+            archives[period] = it->second;
+        }
+        else if (length != MINUTE_LENGTH)
+        {
+            rollups[std::make_pair(length, period)] = it->second;
+        }
+    }
+
+    // a filter archived here but still listed (ex closed in Bloomd) is on
+    // disk; one the backend lists as both was written to again since
+    std::map<std::string, uint64_t> names = store->list();
+    uint64_t sum = 0;
+    sizes.clear();
+    fine.clear();
+    for (std::map<std::string, uint64_t>::iterator it = names.begin(); it != names.end(); ++it)
+    {
+        if (!conn_log::parse_filter_name(it->first, &period, &length))
+        {
+            continue;
+        }
+        else if (length == MINUTE_LENGTH)
+        {
+            fine[period] = it->second;
+            sum += it->second;
+        }
+        else if (length != FILTER_LENGTH)
+        {
+            rollups[std::make_pair(length, period)] += it->second;
+        }
+        else if (!archives.count(period) || stored.count(it->first))
+        {
+            sizes[period] = it->second;
+            sum += it->second;
+        }
+    }
+
+    for (std::map<time_t, uint64_t>::iterator it = archives.begin(); it != archives.end(); ++it)
+    {
+        archived_sum += it->second;
+    }
+    for (std::map<std::pair<unsigned int, time_t>, uint64_t>::iterator it = rollups.begin(); it != rollups.end(); ++it)
+    {
+        archived_sum += it->second;
+    }
+
+    total = sum;
+    archived_total = archived_sum;
+}
+
+uint64_t filter_manager::slot_keys(time_t slot)
+{
+    std::map<time_t, uint64_t>::iterator it = counts.find(slot);
+    if (it != counts.end())
+    {
+        return it->second;
+    }
+
+    struct filter_stats stats;
+    uint64_t keys = store->stats(conn_log::filter_name(slot), stats) ? stats.keys : 0;
+    if (slot < synced_slot)
+    {
+        counts[slot] = keys;
+    }
+
+    return keys;
+}
+
+uint64_t filter_manager::predict_keys(time_t slot)
+{
+    const time_t day = DAY_LENGTH / FILTER_LENGTH;
+    uint64_t same_hour = slot_keys(slot - day);
+    uint64_t last = slot_keys(slot - 1);
+    uint64_t last_same_hour = slot_keys(slot - 1 - day);
+
+    if (same_hour && last && last_same_hour)
+    {
+        // one odd hour shouldn't resize the next one by more than this
+        double trend = std::min(4.0, std::max(0.25, static_cast<double>(last) / last_same_hour));
+        return static_cast<uint64_t>(same_hour * trend);
+    }
+
+    return last ? last : same_hour;
+}
+
+uint64_t filter_manager::filter_capacity(uint64_t keys) const
+{
+    if (!keys)
+    {
+        return FILTER_CAPACITY;
+    }
+
+    uint64_t capacity = static_cast<uint64_t>(keys * CAPACITY_HEADROOM);
+
+    return std::max(MIN_CAPACITY, std::min(MAX_CAPACITY, capacity));
+}
+
+void filter_manager::report(time_t slot)
+{
+    struct filter_stats stats;
+    if (!store->stats(conn_log::filter_name(slot), stats))
+    {
+        return;
+    }
+
+    std::cout << "filter_manager: filter " << slot << " closed with keys=" << stats.keys
+              << ", capacity=" << stats.capacity << ", fp rate=" << stats.probability << "\n";
+}
+
+void filter_manager::archive(time_t slot)
+{
+    std::string name = conn_log::filter_name(slot);
+    if (!store->archive(name))
+    {
+        drop(slot);
+        return;
+    }
+
+    std::map<std::string, uint64_t> stored = store->archived();
+    uint64_t size = stored.count(name) ? stored[name] : sizes[slot];
+    archived_total += size - (archives.count(slot) ? archives[slot] : 0);
+    archives[slot] = size;
+
+    total -= sizes[slot];
+    sizes.erase(slot);
+
+    std::cout << "filter_manager: archived filter " << slot
+              << ", size=" << total << "\n";
+}
+
+void filter_manager::roll_up(time_t now)
+{
+    if (!rules.empty() && !store->can_merge())
+    {
+        std::cout << "filter_manager: backend " << backend << " can't merge filters, so --rollup is ignored\n";
+        rules.clear();
+        return;
+    }
+
+    for (size_t r = 0; r < rules.size(); ++r)
+    {
+        // periods that ended at least the rule's age ago, and the finer
+        // filters in them
+        unsigned int length = rules[r].length;
+        time_t limit = (now - rules[r].age) / static_cast<time_t>(length);
+        std::map<time_t, std::vector<std::string> > periods;
+
+        for (std::map<time_t, uint64_t>::iterator it = sizes.begin(); it != sizes.end(); ++it)
+        {
+            if (it->first * FILTER_LENGTH / length < limit)
+            {
+                periods[it->first * FILTER_LENGTH / length].push_back(conn_log::filter_name(it->first));
+            }
+        }
+        for (std::map<time_t, uint64_t>::iterator it = archives.begin(); it != archives.end(); ++it)
+        {
+            if (it->first * FILTER_LENGTH / length < limit)
+            {
+                periods[it->first * FILTER_LENGTH / length].push_back(conn_log::filter_name(it->first));
+            }
+        }
+        for (std::map<std::pair<unsigned int, time_t>, uint64_t>::iterator it = rollups.begin(); it != rollups.end(); ++it)
+        {
+            time_t start = it->first.second * it->first.first;
+            if (it->first.first < length && start / length < limit)
+            {
+                periods[start / length].push_back(conn_log::filter_name(it->first.second, it->first.first));
+            }
+        }
+
+        for (std::map<time_t, std::vector<std::string> >::iterator it = periods.begin(); it != periods.end(); ++it)
+        {
+            std::string name = conn_log::filter_name(it->first, length);
+            if (refused.count(name))
+            {
+                continue;
+            }
+
+            double rate;
+            if (!store->merge(name, it->second, probability, &rate))
+            {
+                std::cout << "filter_manager: backend " << backend << " can't roll up filters\n";
+                rules.clear();
+                return;
+            }
+            else if (rate > probability)
+            {
+                // the filters stay apart, and are dropped in time as usual
+                std::cout << "filter_manager: not rolling " << it->second.size()
+                          << " filter(s) up into " << name << ", fp rate would be " << rate << "\n";
+                refused.insert(name);
+                continue;
+            }
+
+            // the merged filters are gone; the hours' reverse indexes stay
+            // until the rollup is dropped
+            for (size_t i = 0; i < it->second.size(); ++i)
+            {
+                time_t period;
+                unsigned int source_length;
+                conn_log::parse_filter_name(it->second[i], &period, &source_length);
+                if (source_length == FILTER_LENGTH)
+                {
+                    total -= sizes.count(period) ? sizes[period] : 0;
+                    sizes.erase(period);
+                    archived_total -= archives.count(period) ? archives[period] : 0;
+                    archives.erase(period);
+                }
+                else
+                {
+                    archived_total -= rollups[std::make_pair(source_length, period)];
+                    rollups.erase(std::make_pair(source_length, period));
+                }
+            }
+
+            std::map<std::string, uint64_t> stored = store->archived();
+            uint64_t &size = rollups[std::make_pair(length, it->first)];
+            archived_total -= size;
+            size = stored.count(name) ? stored[name] : 0;
+            archived_total += size;
+
+            std::cout << "filter_manager: rolled " << it->second.size()
+                      << " filter(s) up into " << name << ", fp rate=" << rate << "\n";
+        }
+    }
+}
+
+void filter_manager::drop_rollup(unsigned int length,
+                                 time_t period)
+{
+    store->drop(conn_log::filter_name(period, length));
+    if (index)
+    {
+        for (time_t slot = period * length / FILTER_LENGTH; slot < (period + 1) * length / FILTER_LENGTH; ++slot)
+        {
+            index->drop(slot);
+        }
+    }
+    if (ports)
+    {
+        for (time_t slot = period * length / FILTER_LENGTH; slot < (period + 1) * length / FILTER_LENGTH; ++slot)
+        {
+            ports->drop(slot);
+        }
+    }
+
+    archived_total -= rollups[std::make_pair(length, period)];
+    rollups.erase(std::make_pair(length, period));
+
+    std::cout << "filter_manager: dropped filter " << conn_log::filter_name(period, length) << "\n";
+}
+
+void filter_manager::drop_fine(time_t minute)
+{
+    store->drop(conn_log::filter_name(minute, MINUTE_LENGTH));
+
+    total -= fine[minute];
+    fine.erase(minute);
+}
+
+void filter_manager::drop(time_t slot)
+{
+    store->drop(conn_log::filter_name(slot));
+    if (index)
+    {
+        index->drop(slot);
+    }
+    if (ports)
+    {
+        ports->drop(slot);
+    }
+
+    total -= sizes.count(slot) ? sizes[slot] : 0;
+    sizes.erase(slot);
+    archived_total -= archives.count(slot) ? archives[slot] : 0;
+    archives.erase(slot);
+
+    std::cout << "filter_manager: dropped filter " << slot
+              << ", size=" << total << "\n";
+}
+
+void filter_manager::manage(time_t now)
+{
+    time_t current = now / FILTER_LENGTH;
+
+    // one full "list" per timeslot; in between only the filters that are
+    // still being written can change size
+    if (!store || synced_slot != current)
+    {
+        time_t closed = synced_slot;
+
+        load_sizes();
+        synced_slot = current;
+        if (closed && closed < current)
+        {
+            report(closed);
+        }
+
+        // only the last day (and an hour) is used for predictions
+        counts.erase(counts.begin(), counts.lower_bound(current - DAY_LENGTH / FILTER_LENGTH - 1));
+    }
+
+    // create the next timeslot's filter ahead of rollover, so the first
+    // writes of the new timeslot don't wait on a "create", sized so quiet
+    // hours don't hold as much memory as busy ones
+    if ((current + 1) * static_cast<time_t>(FILTER_LENGTH) - now <= PRECREATE_LEAD &&
+        !sizes.count(current + 1))
+    {
+        store->create(conn_log::filter_name(current + 1),
+                      filter_capacity(predict_keys(current + 1)), probability);
+    }
+
+    for (time_t slot = current - 1; slot <= current + 1; ++slot)
+    {
+        // an archived filter's size is on disk until the next full list
+        if (archives.count(slot))
+        {
+            continue;
+        }
+
+        uint64_t size = store->info(conn_log::filter_name(slot));
+
+        total -= sizes.count(slot) ? sizes[slot] : 0;
+        if (size)
+        {
+            sizes[slot] = size;
+            total += size;
+        }
+        else
+        {
+            sizes.erase(slot);
+        }
+    }
+
+    // the next minute's filter, sized from the last full minute; the
+    // minute filters being written, and those past the fine window, as
+    // they only repeat the hourly filters' keys
+    time_t minute = now / MINUTE_LENGTH;
+    if (fine_window && !fine.count(minute + 1))
+    {
+        struct filter_stats stats;
+        uint64_t keys = store->stats(conn_log::filter_name(minute - 1, MINUTE_LENGTH), stats) ? stats.keys : 0;
+        store->create(conn_log::filter_name(minute + 1, MINUTE_LENGTH), filter_capacity(keys), probability);
+    }
+    for (time_t m = minute - 1; fine_window && m <= minute + 1; ++m)
+    {
+        uint64_t size = store->info(conn_log::filter_name(m, MINUTE_LENGTH));
+
+        total -= fine.count(m) ? fine[m] : 0;
+        fine.erase(m);
+        if (size)
+        {
+            fine[m] = size;
+            total += size;
+        }
+    }
+    while (!fine.empty() &&
+           (fine.begin()->first + 1) * static_cast<time_t>(MINUTE_LENGTH) <= now - fine_window)
+    {
+        drop_fine(fine.begin()->first);
+    }
+
+    roll_up(now);
+
+    // enforce the retention period, rolled up
+    for (std::map<std::pair<unsigned int, time_t>, uint64_t>::iterator it = rollups.begin(); retention && it != rollups.end(); )
+    {
+        std::pair<unsigned int, time_t> rollup = (it++)->first;
+        if ((rollup.second + 1) * static_cast<time_t>(rollup.first) <= now - retention)
+        {
+            drop_rollup(rollup.first, rollup.second);
+        }
+    }
+
+    // in memory or archived
+    while (retention && (!sizes.empty() || !archives.empty()))
+    {
+        time_t oldest = sizes.empty() ? archives.begin()->first
+                      : archives.empty() ? sizes.begin()->first
+                      : std::min(sizes.begin()->first, archives.begin()->first);
+        if ((oldest + 1) * static_cast<time_t>(FILTER_LENGTH) > now - retention)
+        {
+            break;
+        }
+        drop(oldest);
+    }
+
+    // enforce the memory budget: minute filters first, as the hourly
+    // ones hold their keys too, then archive the oldest hourly filters
+    // (never the current timeslot), which stay queryable from disk
+    while (total > budget && !fine.empty() && fine.begin()->first < minute)
+    {
+        drop_fine(fine.begin()->first);
+    }
+    while (total > budget && !sizes.empty() && sizes.begin()->first < current)
+    {
+        archive(sizes.begin()->first);
+    }
+}
+
+uint64_t filter_manager::total_size() const
+{
+    return total;
+}
+
+uint64_t filter_manager::archived_size() const
+{
+    return archived_total;
+}
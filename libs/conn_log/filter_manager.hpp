@@ -0,0 +1,261 @@
+//=============================================================================
+//
+// Name:        filter_manager.hpp
+// Authors:     James H. Loving
+// Description: This file declares the filter_manager class, which runs
+//              conn_log's filter housekeeping on a background thread:
+//              creating each timeslot's filter before it is needed, sized
+//              for the keys predicted from recent timeslots, keeping
+//              track of filter sizes, dropping minute filters once they
+//              leave the fine window, rolling old hourly filters up into
+//              day and week filters, archiving old filters to disk to stay
+//              within a memory budget, and dropping them after the
+//              retention period.
+//
+//=============================================================================
+
+#ifndef FILTER_MANAGER_HPP
+#define FILTER_MANAGER_HPP
+
+#include <algorithm>            // min()
+#include <atomic>               // total size, read by other threads
+#include <condition_variable>   // prompt shutdown
+#include <map>                  // per-filter sizes
+#include <mutex>                // shutdown signalling
+#include <set>                  // refused rollups
+#include <stdint.h>             // uint64_t
+#include <stdlib.h>             // atol()
+#include <string.h>             // strspn()
+#include <string>               // string class
+#include <utility>              // pair
+#include <vector>               // rollup rules
+#include <thread>               // background thread
+#include <time.h>               // time(), etc.
+
+#include "conn_log.hpp"
+#include "filter_store.hpp"
+#include "port_index.hpp"
+#include "reverse_index.hpp"
+
+const uint64_t MAX_FILTER_SIZE = 102400000;
+                                        /**< default max sum of filters (bytes) */
+const time_t MAX_FILTER_AGE = 0;        /**< default max filter age (seconds),
+                                             0 for no limit */
+const double FILTER_PROBABILITY = 0.0001;
+                                        /**< default target false positive
+                                             rate of each filter */
+const uint64_t FILTER_CAPACITY = 100000;/**< keys a filter is sized for
+                                             before any are counted */
+
+/**
+    Manage the lifecycle of conn_log's filters off the packet path.
+*/
+class filter_manager
+{
+    private:
+        const unsigned int MANAGE_INTERVAL = 10;    /**< time between
+                                                         housekeeping passes
+                                                         (seconds) */
+        const unsigned int PRECREATE_LEAD = 60;     /**< create the next
+                                                         timeslot's filter this
+                                                         long before rollover
+                                                         (seconds) */
+        const uint64_t MIN_CAPACITY = 10000;        /**< smallest filter
+                                                         created (keys), as
+                                                         Bloomd's minimum */
+        const uint64_t MAX_CAPACITY = 1000000000;   /**< largest filter
+                                                         created (keys) */
+        const double CAPACITY_HEADROOM = 1.5;       /**< filters are sized
+                                                         for this many times
+                                                         the keys predicted */
+        uint64_t budget;                            /**< max sum of filters (bytes) */
+        time_t retention;                           /**< max filter age (seconds),
+                                                         0 for no limit */
+        std::string backend;                        /**< see open_store() */
+        std::shared_ptr<filter_store> store;        /**< own backend handle */
+        std::shared_ptr<reverse_index> index;       /**< dropped along with
+                                                         the filters, if open */
+        std::shared_ptr<port_index> ports;          /**< dropped along with
+                                                         the filters, if open */
+        std::map<time_t, uint64_t> sizes;           /**< storage of each known
+                                                         filter, by timeslot */
+        std::map<time_t, uint64_t> fine;            /**< storage of each minute
+                                                         filter, by minute */
+        time_t fine_window;                         /**< time minute filters
+                                                         are kept (seconds) */
+        double probability;                         /**< target false
+                                                         positive rate */
+        std::map<time_t, uint64_t> counts;          /**< keys in each recent
+                                                         closed filter, by
+                                                         timeslot */
+        std::atomic<uint64_t> total;                /**< sum of sizes and
+                                                         fine */
+        std::map<time_t, uint64_t> archives;        /**< size on disk of each
+                                                         archived filter, by
+                                                         timeslot */
+        std::map<std::pair<unsigned int, time_t>, uint64_t> rollups;
+                                                    /**< size of each rollup
+                                                         filter, by length
+                                                         and period */
+        std::atomic<uint64_t> archived_total;       /**< sum of archives and
+                                                         rollups */
+        std::vector<struct rollup_rule> rules;      /**< rollup rules,
+                                                         finest first */
+        std::set<std::string> refused;              /**< rollups left undone,
+                                                         their rate being
+                                                         above probability */
+        time_t synced_slot;                         /**< timeslot of the last
+                                                         full "list" */
+        std::thread worker;                         /**< housekeeping thread */
+        std::mutex lock;                            /**< guards stopping */
+        std::condition_variable wake;               /**< signals stopping */
+        bool stopping;                              /**< thread should exit */
+
+        /**
+            (Re)open the backend and load every filter's size from one list.
+        */
+        void load_sizes();
+
+        /**
+            \param slot Timeslot of the filter.
+
+            \return Keys in the filter, 0 if it doesn't exist or the
+                backend can't tell. Closed timeslots are counted once.
+        */
+        uint64_t slot_keys(time_t slot);
+
+        /**
+            Predict the keys of an upcoming timeslot: the same hour a day
+            earlier, scaled by how the last hour compares with its own a
+            day earlier, so sizing follows both the daily cycle and the
+            trend. Falls back to the last hour, then the hour a day earlier.
+
+            \param slot Timeslot of the filter.
+
+            \return Keys predicted, 0 if there is nothing to go on.
+        */
+        uint64_t predict_keys(time_t slot);
+
+        /**
+            \param keys Keys predicted, 0 if unknown.
+
+            \return Capacity to create a filter with.
+        */
+        uint64_t filter_capacity(uint64_t keys) const;
+
+        /**
+            Print a closed filter's keys, capacity and false positive rate.
+
+            \param slot Timeslot of the filter.
+        */
+        void report(time_t slot);
+
+        /**
+            Archive one filter, keeping its reverse index; drop it instead
+            if the backend can't archive.
+
+            \param slot Timeslot of the filter.
+        */
+        void archive(time_t slot);
+
+        /**
+            Merge the filters of every period a rollup rule has come due
+            for into that period's rollup filter, unless the merged filter
+            would be less precise than probability. Stops rolling up if the
+            backend can't merge filters.
+
+            \param now Time_t-encoded current time.
+        */
+        void roll_up(time_t now);
+
+        /**
+            Drop one minute filter and forget its size.
+
+            \param minute Minute of the filter, i.e. timestamp / MINUTE_LENGTH.
+        */
+        void drop_fine(time_t minute);
+
+        /**
+            Drop one rollup filter and the reverse and port indexes of its
+            hours.
+
+            \param length DAY_LENGTH or WEEK_LENGTH.
+            \param period Period of the rollup.
+        */
+        void drop_rollup(unsigned int length,
+                         time_t period);
+
+        /**
+            Drop one filter (in memory or archived) and its reverse and
+            port indexes, and forget its size.
+
+            \param slot Timeslot of the filter.
+        */
+        void drop(time_t slot);
+
+        /**
+            Background thread: run manage() every MANAGE_INTERVAL until stop().
+        */
+        void run();
+
+    public:
+        /**
+            Initialize the manager. Nothing runs until start().
+
+            \param budget Max sum of all filters' sizes, in bytes.
+            \param retention Max filter age in seconds, 0 for no limit.
+            \param backend Storage backend, see open_store().
+            \param rules Rollup rules; none to keep hourly filters.
+            \param fine_window Time minute filters are kept (seconds); 0
+                drops any that are left.
+            \param probability False positive rate filters are sized for,
+                and the most a rollup may have.
+        */
+        filter_manager(uint64_t budget,
+                       time_t retention,
+                       const std::string &backend = "bloomd",
+                       const std::vector<struct rollup_rule> &rules = std::vector<struct rollup_rule>(),
+                       time_t fine_window = FINE_WINDOW,
+                       double probability = FILTER_PROBABILITY);
+
+        /**
+            Stop the background thread, if running.
+        */
+        ~filter_manager();
+
+        /**
+            Start the background housekeeping thread.
+        */
+        void start();
+
+        /**
+            Stop the background housekeeping thread and wait for it.
+        */
+        void stop();
+
+        /**
+            Run one housekeeping pass: pre-create the upcoming timeslot's
+            (and minute's) filter sized for the keys predicted, refresh the
+            size of the filters still being written, drop minute filters
+            past the fine window, roll up filters as the rules say, then
+            drop filters past the retention period and free memory until
+            the total is within budget.
+
+            \param now Time_t-encoded current time.
+        */
+        void manage(time_t now);
+
+        /**
+            \return Last known sum of all filters' sizes, in bytes. Safe
+                to call from any thread.
+        */
+        uint64_t total_size() const;
+
+        /**
+            \return Last known sum of archived filters' sizes on disk, in
+                bytes. Safe to call from any thread.
+        */
+        uint64_t archived_size() const;
+};
+
+#endif
@@ -0,0 +1,134 @@
+//=============================================================================
+//
+// Name:        filter_store.cpp
+// Authors:     James H. Loving
+// Description: This file defines the key_batch class and open_store(), which
+//              selects conn_log's storage backend. For additional
+//              documentation, refer to filter_store.hpp.
+//
+//=============================================================================
+
+#include "filter_store.hpp"
+#include "bloomd_store.hpp"
+#include "cuckoo_store.hpp"
+#include "local_store.hpp"
+#include "sharded_store.hpp"
+
+void key_batch::add(const char *key,
+                    size_t length)
+{
+    data.append(key, length);
+    ends.push_back(data.length());
+}
+
+void key_batch::clear()
+{
+    data.clear();
+    ends.clear();
+}
+
+size_t key_batch::size() const
+{
+    return ends.size();
+}
+
+const char *key_batch::key(size_t i) const
+{
+    return data.data() + (i ? ends[i - 1] : 0);
+}
+
+size_t key_batch::length(size_t i) const
+{
+    return ends[i] - (i ? ends[i - 1] : 0);
+}
+
+std::shared_ptr<filter_store> open_store(const std::string &backend)
+{
+    if (backend == "bloomd")
+    {
+        // every caller gets its own connections
+        return std::make_shared<bloomd_store>(BLOOMD_HOST, BLOOMD_PORT);
+    }
+    else if (backend.compare(0, 7, "bloomd:") == 0)
+    {
+        // "bloomd:<host>:<port>", or "bloomd:<path>" for a Unix socket
+        std::string address = backend.substr(7);
+        size_t colon = address.rfind(':');
+        int port = BLOOMD_PORT;
+
+        if (address[0] != '/' && colon != std::string::npos)
+        {
+            port = atoi(address.c_str() + colon + 1);
+            address.erase(colon);
+        }
+        if (address.empty() || port <= 0 || port > 65535)
+        {
+            throw std::invalid_argument("Invalid storage backend: " + backend);
+        }
+
+        return std::make_shared<bloomd_store>(address, port);
+    }
+    else if (backend == "local" || backend.compare(0, 6, "local:") == 0)
+    {
+        // every caller shares the same mapped filters, per directory
+        static std::mutex lock;
+        static std::map<std::string, std::weak_ptr<local_store> > shared;
+
+        std::string directory = backend == "local" ? LOCAL_FILTER_DIR : backend.substr(6);
+        if (directory.empty())
+        {
+            throw std::invalid_argument("Invalid storage backend: " + backend);
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        std::shared_ptr<local_store> store = shared[directory].lock();
+        if (!store)
+        {
+            store = std::make_shared<local_store>(directory);
+            shared[directory] = store;
+        }
+
+        return store;
+    }
+    else if (backend == "cuckoo" || backend.compare(0, 7, "cuckoo:") == 0)
+    {
+        // every caller shares the same mapped filters, per directory
+        static std::mutex lock;
+        static std::map<std::string, std::weak_ptr<cuckoo_store> > shared;
+
+        std::string directory = backend == "cuckoo" ? CUCKOO_FILTER_DIR : backend.substr(7);
+        if (directory.empty())
+        {
+            throw std::invalid_argument("Invalid storage backend: " + backend);
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        std::shared_ptr<cuckoo_store> store = shared[directory].lock();
+        if (!store)
+        {
+            store = std::make_shared<cuckoo_store>(directory);
+            shared[directory] = store;
+        }
+
+        return store;
+    }
+    else if (backend.compare(0, 8, "sharded:") == 0)
+    {
+        // "sharded:<backend>,<backend>,..."
+        std::vector<std::string> shards;
+        std::string list = backend.substr(8);
+        for (size_t start = 0, comma; start <= list.length(); start = comma + 1)
+        {
+            comma = list.find(',', start);
+            if (comma == std::string::npos)
+            {
+                comma = list.length();
+            }
+            shards.push_back(list.substr(start, comma - start));
+        }
+
+        return std::make_shared<sharded_store>(shards);
+    }
+
+    throw std::invalid_argument("Invalid storage backend: " + backend);
+}
@@ -0,0 +1,286 @@
+//=============================================================================
+//
+// Name:        filter_store.hpp
+// Authors:     James H. Loving
+// Description: This file declares the filter_store interface, the storage
+//              backend behind conn_log: a set of named Bloom filters, one
+//              per timeslot, that keys can be added to and checked against.
+//              Backends are Bloomd (bloomd_store), an in-process store
+//              of memory-mapped files (local_store), and the same with
+//              deletable cuckoo filters (cuckoo_store).
+//
+//=============================================================================
+
+#ifndef FILTER_STORE_HPP
+#define FILTER_STORE_HPP
+
+#include <map>            // filter sizes
+#include <memory>         // shared_ptr
+#include <mutex>          // shared local_store
+#include <stddef.h>       // size_t
+#include <stdexcept>      // exception handling
+#include <stdint.h>       // uint64_t
+#include <string>         // string class
+#include <vector>         // key offsets, results
+
+/**
+    A batch of keys stored back to back in one buffer, so queuing a key
+    does not allocate once the batch has grown to its working size.
+*/
+class key_batch
+{
+    private:
+        std::string data;           /**< keys, concatenated */
+        std::vector<size_t> ends;   /**< offset past the end of each key */
+
+    public:
+        /**
+            Append a key to the batch.
+
+            \param key Pointer to the key.
+            \param length Length of the key in bytes.
+        */
+        void add(const char *key,
+                 size_t length);
+
+        /**
+            Empty the batch, keeping its buffers.
+        */
+        void clear();
+
+        /**
+            \return Number of keys in the batch.
+        */
+        size_t size() const;
+
+        /**
+            \param i Index of the key, 0 to size() - 1.
+
+            \return Pointer to the i-th key (not null-terminated).
+        */
+        const char *key(size_t i) const;
+
+        /**
+            \param i Index of the key, 0 to size() - 1.
+
+            \return Length of the i-th key in bytes.
+        */
+        size_t length(size_t i) const;
+};
+
+/**
+    How one filter is sized and how full it is.
+*/
+struct filter_stats
+{
+    uint64_t keys;          /**< keys added (approximate) */
+    uint64_t capacity;      /**< keys it was sized for, 0 if unknown */
+    uint64_t size;          /**< storage in bytes */
+    double probability;     /**< estimated false positive rate with the
+                                 keys it holds */
+};
+
+/**
+    Storage backend for conn_log: named Bloom filters.
+*/
+class filter_store
+{
+    public:
+        virtual ~filter_store() {}
+
+        /**
+            List every filter and its storage size.
+
+            \return Map of filter names to sizes in bytes.
+        */
+        virtual std::map<std::string, uint64_t> list() = 0;
+
+        /**
+            Get the storage size of one filter.
+
+            \param filter Name of the filter.
+
+            \return Size in bytes, or 0 if the filter does not exist.
+        */
+        virtual uint64_t info(const std::string &filter) = 0;
+
+        /**
+            Create a filter, if it does not exist yet.
+
+            \param filter Name of the filter.
+        */
+        virtual void create(const std::string &filter) = 0;
+
+        /**
+            Create a filter sized for a number of keys, if it does not
+            exist yet. Backends that can't size filters create them as
+            create(filter) does.
+
+            \param filter Name of the filter.
+            \param capacity Keys it should hold.
+            \param probability False positive rate at capacity.
+        */
+        virtual void create(const std::string &filter,
+                            uint64_t /* capacity */,
+                            double /* probability */)
+        {
+            create(filter);
+        }
+
+        /**
+            Delete a filter and everything in it.
+
+            \param filter Name of the filter.
+        */
+        virtual void drop(const std::string &filter) = 0;
+
+        /**
+            Add keys to a filter, creating it if needed.
+
+            \param filter Name of the filter.
+            \param keys Keys to add.
+        */
+        virtual void set(const std::string &filter,
+                         const key_batch &keys) = 0;
+
+        /**
+            Check whether a filter contains each of a batch of keys.
+
+            \param filter Name of the filter.
+            \param keys Keys to check.
+            \param found Output, one entry per key (all false if the
+                filter does not exist).
+        */
+        virtual void check(const std::string &filter,
+                           const key_batch &keys,
+                           std::vector<bool> &found) = 0;
+
+        /**
+            Get a filter's sizing and fill.
+
+            \param filter Name of the filter.
+            \param stats Set to the filter's stats.
+
+            \return False if the filter does not exist, or the backend
+                can't tell.
+        */
+        virtual bool stats(const std::string & /* filter */,
+                           struct filter_stats & /* stats */)
+        {
+            return false;
+        }
+
+        /**
+            Move a filter out of memory, keeping it on disk where check()
+            still finds it. Backends that can't leave the filter as is.
+
+            \param filter Name of the filter.
+
+            \return False if the backend can't archive filters.
+        */
+        virtual bool archive(const std::string & /* filter */)
+        {
+            return false;
+        }
+
+        /**
+            OR several filters into one, which is created (archived) if
+            need be, then drop them. Backends that can't leave them as is.
+
+            \param filter Name of the filter merged into.
+            \param sources Names of the filters to merge; missing ones are
+                skipped.
+            \param probability Highest false positive rate the merged
+                filter may have. Above it nothing is merged, and the
+                sources are left as they are.
+            \param rate Set to the merged filter's estimated false positive
+                rate, 0 if the backend can't tell.
+
+            \return False if the backend can't merge filters.
+        */
+        virtual bool merge(const std::string & /* filter */,
+                           const std::vector<std::string> & /* sources */,
+                           double /* probability */,
+                           double *rate)
+        {
+            *rate = 0;
+            return false;
+        }
+
+        /**
+            Estimate the rate merge() would find, without merging.
+
+            \param filter Name of the filter merged into.
+            \param sources Names of the filters to merge; missing ones are
+                skipped.
+            \param rate Set to the merged filter's estimated false positive
+                rate, as merge() measures it before it decides; 0 if the
+                backend merges whatever the rate.
+
+            \return False if the backend can't merge filters.
+        */
+        virtual bool merged_rate(const std::string & /* filter */,
+                                 const std::vector<std::string> & /* sources */,
+                                 double *rate)
+        {
+            *rate = 0;
+            return false;
+        }
+
+        /**
+            Tell whether merge() works, so whether rollup filters may
+            exist.
+
+            \return False if the backend can't merge filters.
+        */
+        virtual bool can_merge()
+        {
+            return false;
+        }
+
+        /**
+            List the archived filters the backend can tell apart, which
+            list() leaves out.
+
+            \return Map of filter names to sizes on disk in bytes.
+        */
+        virtual std::map<std::string, uint64_t> archived()
+        {
+            return std::map<std::string, uint64_t>();
+        }
+
+        /**
+            Remove every key of one device from a filter, in memory or
+            archived. Keys start with the device ID, see pack_key_ipv4/ipv6.
+            Bloom filters can't delete keys.
+
+            \param filter Name of the filter.
+            \param device Device ID, see device_registry.
+            \param removed Set to the number of keys removed.
+
+            \return False if the backend can't delete keys.
+        */
+        virtual bool purge(const std::string & /* filter */,
+                           uint32_t /* device */,
+                           uint64_t * /* removed */)
+        {
+            return false;
+        }
+};
+
+/**
+    Open a storage backend by name.
+
+    \param backend "bloomd" for new connections to the local Bloomd
+        server, "bloomd:<host>:<port>" or "bloomd:<path>" for another Bloomd
+        server (a path being its Unix socket), "local" or "local:<directory>"
+        for the process-wide in-process store in that directory, "cuckoo"
+        or "cuckoo:<directory>" for the same with deletable cuckoo
+        filters, or "sharded:<backend>,<backend>,..." to spread keys over
+        several of these.
+
+    \return Shared pointer to the backend. Throws std::invalid_argument.
+*/
+std::shared_ptr<filter_store> open_store(const std::string &backend);
+
+#endif
@@ -0,0 +1,863 @@
+//=============================================================================
+//
+// Name:        local_store.cpp
+// Authors:     James H. Loving
+// Description: This file defines the local_store class, conn_log's
+//              in-process storage backend. For additional documentation,
+//              refer to local_store.hpp and filter_store.hpp.
+//
+//=============================================================================
+
+#include "local_store.hpp"
+
+static const char LOCAL_FILTER_MAGIC[8] = "EDICTBF";
+static const uint32_t LOCAL_FILTER_VERSION = 2;
+static const char LOCAL_FILTER_SUFFIX[] = ".bf";
+static const char LOCAL_ARCHIVE_MAGIC[8] = "EDICTAR";
+static const uint32_t LOCAL_ARCHIVE_VERSION = 1;
+static const char LOCAL_ARCHIVE_SUFFIX[] = ".arc";
+
+local_filter::local_filter(const std::string &path,
+                           bool create,
+                           uint64_t capacity,
+                           double probability)
+{
+    fd = open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("local_filter could not open " + path + ": " + strerror(errno));
+    }
+
+    // another process may be creating the same file; only a creator sizes
+    // an empty one, and readers wait until it has
+    flock(fd, create ? LOCK_EX : LOCK_SH);
+
+    struct stat st;
+    fstat(fd, &st);
+    bool fresh = st.st_size == 0;
+    inode = st.st_ino;
+    if (fresh && !create)
+    {
+        close(fd);
+        throw std::runtime_error("local_filter: " + path + " is still being created");
+    }
+
+    uint64_t blocks = bloom_filter::optimal_blocks(capacity, probability);
+    length = fresh ? sizeof(struct local_filter_header) + blocks * bloom_filter::BLOCK_BYTES : st.st_size;
+
+    // a new file is sized up front and reads back as zeros, i.e. empty
+    if (fresh && ftruncate(fd, length) < 0)
+    {
+        close(fd);
+        throw std::runtime_error("local_filter could not size " + path + ": " + strerror(errno));
+    }
+
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        throw std::runtime_error("local_filter could not map " + path + ": " + strerror(errno));
+    }
+    header = static_cast<struct local_filter_header *>(map);
+
+    if (fresh)
+    {
+        memcpy(header->magic, LOCAL_FILTER_MAGIC, sizeof(header->magic));
+        header->version = LOCAL_FILTER_VERSION;
+        header->block_bytes = bloom_filter::BLOCK_BYTES;
+        header->blocks = blocks;
+        header->capacity = capacity;
+    }
+    flock(fd, LOCK_UN);
+
+    if (memcmp(header->magic, LOCAL_FILTER_MAGIC, sizeof(header->magic)) != 0 ||
+             header->version != LOCAL_FILTER_VERSION ||
+             header->block_bytes != bloom_filter::BLOCK_BYTES ||
+             !header->blocks || (header->blocks & (header->blocks - 1)) ||
+             sizeof(struct local_filter_header) + header->blocks * bloom_filter::BLOCK_BYTES > length)
+    {
+        munmap(map, length);
+        close(fd);
+        throw std::runtime_error("local_filter: " + path + " is not a valid filter file");
+    }
+}
+
+local_filter::~local_filter()
+{
+    munmap(header, length);
+    close(fd);
+}
+
+uint64_t local_filter::size() const
+{
+    return length;
+}
+
+ino_t local_filter::file() const
+{
+    return inode;
+}
+
+void local_filter::insert(const uint64_t *hashes,
+                          size_t count)
+{
+    bloom_filter filter(header + 1, header->blocks);
+    filter.insert(hashes, count);
+
+    __atomic_fetch_add(&header->keys, count, __ATOMIC_RELAXED);
+}
+
+void local_filter::contains(const uint64_t *hashes,
+                            size_t count,
+                            uint64_t *found) const
+{
+    bloom_filter filter(header + 1, header->blocks);
+
+    filter.contains(hashes, count, found);
+}
+
+const void *local_filter::blocks() const
+{
+    return header + 1;
+}
+
+uint64_t local_filter::block_count() const
+{
+    return header->blocks;
+}
+
+uint64_t local_filter::keys() const
+{
+    return __atomic_load_n(&header->keys, __ATOMIC_RELAXED);
+}
+
+uint64_t local_filter::capacity() const
+{
+    return header->capacity;
+}
+
+/**
+    \return Bytes from the start of an archive to its first stored block.
+*/
+static uint64_t archive_data_offset(uint64_t blocks)
+{
+    uint64_t words = (blocks + 63) / 64;
+    uint64_t offset = sizeof(struct local_archive_header) + words * (sizeof(uint64_t) + sizeof(uint32_t));
+
+    return (offset + bloom_filter::BLOCK_BYTES - 1) / bloom_filter::BLOCK_BYTES * bloom_filter::BLOCK_BYTES;
+}
+
+local_archive::local_archive(const std::string &path)
+{
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("local_archive could not open " + path + ": " + strerror(errno));
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    length = st.st_size;
+    inode = st.st_ino;
+    if (length < sizeof(struct local_archive_header))
+    {
+        close(fd);
+        throw std::runtime_error("local_archive: " + path + " is not a valid archive file");
+    }
+
+    // only the blocks a check touches are ever read from disk
+    void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        throw std::runtime_error("local_archive could not map " + path + ": " + strerror(errno));
+    }
+    header = static_cast<const struct local_archive_header *>(map);
+
+    if (memcmp(header->magic, LOCAL_ARCHIVE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != LOCAL_ARCHIVE_VERSION ||
+        header->block_bytes != bloom_filter::BLOCK_BYTES ||
+        !header->blocks || (header->blocks & (header->blocks - 1)) ||
+        header->present > header->blocks ||
+        header->data_offset != archive_data_offset(header->blocks) ||
+        header->data_offset + header->present * bloom_filter::BLOCK_BYTES > length)
+    {
+        munmap(map, length);
+        close(fd);
+        throw std::runtime_error("local_archive: " + path + " is not a valid archive file");
+    }
+
+    const char *base = static_cast<const char *>(map);
+    bitmap = reinterpret_cast<const uint64_t *>(header + 1);
+    ranks = reinterpret_cast<const uint32_t *>(bitmap + (header->blocks + 63) / 64);
+    data = base + header->data_offset;
+}
+
+local_archive::~local_archive()
+{
+    munmap(const_cast<struct local_archive_header *>(header), length);
+    close(fd);
+}
+
+const char *local_archive::block(uint64_t block) const
+{
+    uint64_t word = bitmap[block / 64];
+    uint64_t bit = block % 64;
+
+    if (!((word >> bit) & 1))
+    {
+        return NULL;
+    }
+
+    // stored blocks are in order: count the ones before this one
+    uint64_t index = ranks[block / 64] + __builtin_popcountll(word & ((1ULL << bit) - 1));
+
+    return data + index * bloom_filter::BLOCK_BYTES;
+}
+
+void local_archive::write(const std::string &path,
+                          const void *blocks,
+                          uint64_t size,
+                          uint64_t keys)
+{
+    const uint64_t *dense = static_cast<const uint64_t *>(blocks);
+    uint64_t words = (size + 63) / 64;
+    uint64_t words_per_block = bloom_filter::BLOCK_BYTES / sizeof(uint64_t);
+    std::vector<uint64_t> present(words);
+    std::vector<uint32_t> ranks(words);
+    std::string stored;
+    uint64_t stored_blocks = 0;
+    for (uint64_t b = 0; b < size; ++b)
+    {
+        const uint64_t *block = &dense[b * words_per_block];
+        if (b % 64 == 0)
+        {
+            ranks[b / 64] = stored_blocks;
+        }
+        for (uint64_t w = 0; w < words_per_block; ++w)
+        {
+            if (block[w])
+            {
+                present[b / 64] |= 1ULL << (b % 64);
+                stored.append(reinterpret_cast<const char *>(block), bloom_filter::BLOCK_BYTES);
+                ++stored_blocks;
+                break;
+            }
+        }
+    }
+
+    struct local_archive_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOCAL_ARCHIVE_MAGIC, sizeof(header.magic));
+    header.version = LOCAL_ARCHIVE_VERSION;
+    header.block_bytes = bloom_filter::BLOCK_BYTES;
+    header.blocks = size;
+    header.present = stored_blocks;
+    header.keys = keys;
+    header.data_offset = archive_data_offset(size);
+
+    std::string file(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.append(reinterpret_cast<const char *>(present.data()), words * sizeof(uint64_t));
+    file.append(reinterpret_cast<const char *>(ranks.data()), words * sizeof(uint32_t));
+    file.resize(header.data_offset, '\0');
+    file.append(stored);
+
+    // readers see the old archive or the new one, never half of one
+    std::string temporary = path + ".tmp";
+    int out = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t written = 0;
+    while (out >= 0 && written < file.length())
+    {
+        ssize_t length = ::write(out, file.data() + written, file.length() - written);
+        if (length < 0 && errno != EINTR)
+        {
+            break;
+        }
+        written += length > 0 ? length : 0;
+    }
+    if (out < 0 || written < file.length() || fsync(out) < 0 ||
+        rename(temporary.c_str(), path.c_str()) < 0)
+    {
+        std::string error = strerror(errno);
+        if (out >= 0)
+        {
+            close(out);
+            unlink(temporary.c_str());
+        }
+        throw std::runtime_error("local_archive could not write " + path + ": " + error);
+    }
+    close(out);
+}
+
+uint64_t local_archive::size() const
+{
+    return length;
+}
+
+ino_t local_archive::file() const
+{
+    return inode;
+}
+
+uint64_t local_archive::block_count() const
+{
+    return header->blocks;
+}
+
+uint64_t local_archive::keys() const
+{
+    return header->keys;
+}
+
+void local_archive::contains(const uint64_t *hashes,
+                             size_t count,
+                             uint64_t *found) const
+{
+    uint64_t mask = header->blocks - 1;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const char *stored = block((hashes[i] >> 32) & mask);
+        if (!stored)
+        {
+            continue;
+        }
+
+        // check the stored block as a filter of its own; the mapping is
+        // read-only and contains() never writes
+        bloom_filter filter(const_cast<char *>(stored), 1);
+        if (filter.contains(hashes[i]))
+        {
+            found[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+}
+
+void local_archive::expand(void *blocks,
+                           uint64_t count) const
+{
+    uint64_t *target = static_cast<uint64_t *>(blocks);
+    uint64_t words_per_block = bloom_filter::BLOCK_BYTES / sizeof(uint64_t);
+
+    for (uint64_t b = 0; b < header->blocks; ++b)
+    {
+        const uint64_t *stored = reinterpret_cast<const uint64_t *>(block(b));
+        // one copy per header->blocks blocks, or folded onto b's low bits
+        for (uint64_t t = b & (count - 1); stored && t < count; t += header->blocks)
+        {
+            uint64_t *into = target + t * words_per_block;
+            for (uint64_t w = 0; w < words_per_block; ++w)
+            {
+                into[w] |= stored[w];
+            }
+        }
+    }
+}
+
+local_store::local_store(const std::string &directory)
+{
+    this->directory = directory;
+
+    // create the directory (and its parents) if needed
+    for (size_t slash = directory.find('/', 1); ; slash = directory.find('/', slash + 1))
+    {
+        mkdir(directory.substr(0, slash).c_str(), 0755);
+        if (slash == std::string::npos)
+        {
+            break;
+        }
+    }
+
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+    {
+        throw std::runtime_error("local_store could not open " + directory + ": " + strerror(errno));
+    }
+
+    // map every filter left by a previous run
+    size_t suffix = strlen(LOCAL_FILTER_SUFFIX);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        std::string name = entry->d_name;
+        if (name.length() > suffix &&
+            name.compare(name.length() - suffix, suffix, LOCAL_FILTER_SUFFIX) == 0)
+        {
+            name = name.substr(0, name.length() - suffix);
+            try
+            {
+                filters[name] = std::make_shared<local_filter>(path(name), false);
+            }
+            catch (std::exception &e)
+            {
+                std::cout << "local_store: skipping " << e.what() << "\n";
+            }
+        }
+    }
+    closedir(dir);
+}
+
+std::string local_store::path(const std::string &filter) const
+{
+    if (filter.empty() ||
+        filter.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789_-") != std::string::npos)
+    {
+        throw std::invalid_argument("local_store: invalid filter name " + filter);
+    }
+
+    return directory + "/" + filter + LOCAL_FILTER_SUFFIX;
+}
+
+std::string local_store::archive_path(const std::string &filter) const
+{
+    std::string filter_path = path(filter);
+
+    return filter_path.substr(0, filter_path.length() - strlen(LOCAL_FILTER_SUFFIX)) + LOCAL_ARCHIVE_SUFFIX;
+}
+
+std::shared_ptr<local_filter> local_store::find(const std::string &filter,
+                                                bool create,
+                                                uint64_t capacity,
+                                                double probability)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    // another process (ex the capture process) may have created, dropped
+    // or replaced the file since it was mapped
+    struct stat st;
+    bool exists = stat(path(filter).c_str(), &st) == 0;
+    std::map<std::string, std::shared_ptr<local_filter> >::iterator it = filters.find(filter);
+    if (it != filters.end() && exists && it->second->file() == st.st_ino)
+    {
+        return it->second;
+    }
+    else if (it != filters.end())
+    {
+        filters.erase(it);
+    }
+
+    // an empty file is still being sized by the process creating it
+    if (!create && (!exists || st.st_size == 0))
+    {
+        return std::shared_ptr<local_filter>();
+    }
+
+    std::shared_ptr<local_filter> opened;
+    try
+    {
+        opened = std::make_shared<local_filter>(path(filter), create, capacity, probability);
+    }
+    catch (std::runtime_error &e)
+    {
+        if (create)
+        {
+            throw;
+        }
+        return opened;
+    }
+    sweep();
+    filters[filter] = opened;
+
+    return opened;
+}
+
+std::shared_ptr<local_archive> local_store::find_archive(const std::string &filter,
+                                                        bool open)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    // a merge replaces the file, so another process's one may be newer
+    struct stat st;
+    std::string archive = archive_path(filter);
+    bool exists = stat(archive.c_str(), &st) == 0;
+    std::map<std::string, std::shared_ptr<local_archive> >::iterator it = archives.find(filter);
+    if (it != archives.end() && exists && it->second->file() == st.st_ino)
+    {
+        return it->second;
+    }
+    else if (it != archives.end())
+    {
+        archives.erase(it);
+    }
+
+    if (!open || !exists)
+    {
+        return std::shared_ptr<local_archive>();
+    }
+
+    std::shared_ptr<local_archive> opened = std::make_shared<local_archive>(archive);
+    sweep();
+    archives[filter] = opened;
+
+    return opened;
+}
+
+void local_store::sweep()
+{
+    struct stat st;
+
+    for (std::map<std::string, std::shared_ptr<local_filter> >::iterator it = filters.begin(); it != filters.end(); )
+    {
+        if (stat(path(it->first).c_str(), &st) < 0 || st.st_ino != it->second->file())
+        {
+            filters.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    for (std::map<std::string, std::shared_ptr<local_archive> >::iterator it = archives.begin(); it != archives.end(); )
+    {
+        if (stat(archive_path(it->first).c_str(), &st) < 0 || st.st_ino != it->second->file())
+        {
+            archives.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+std::map<std::string, uint64_t> local_store::list()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::map<std::string, uint64_t> sizes;
+
+    sweep();
+    for (std::map<std::string, std::shared_ptr<local_filter> >::iterator it = filters.begin(); it != filters.end(); ++it)
+    {
+        sizes[it->first] = it->second->size();
+    }
+
+    return sizes;
+}
+
+uint64_t local_store::info(const std::string &filter)
+{
+    std::shared_ptr<local_filter> f = find(filter, false);
+
+    return f ? f->size() : 0;
+}
+
+void local_store::create(const std::string &filter)
+{
+    find(filter, true);
+}
+
+void local_store::create(const std::string &filter,
+                         uint64_t capacity,
+                         double probability)
+{
+    find(filter, true, capacity, probability);
+}
+
+void local_store::drop(const std::string &filter)
+{
+    remove(filter);
+}
+
+void local_store::set(const std::string &filter,
+                      const key_batch &keys)
+{
+    std::shared_ptr<local_filter> f = find(filter, true);
+
+    // hash the whole batch first so the filter can prefetch ahead
+    std::vector<uint64_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        hashes[i] = hash_key(keys.key(i), keys.length(i));
+    }
+
+    f->insert(hashes.data(), hashes.size());
+}
+
+void local_store::check(const std::string &filter,
+                        const key_batch &keys,
+                        std::vector<bool> &found)
+{
+    // a late write may have started a new hot filter next to the archive
+    std::shared_ptr<local_filter> f = find(filter, false);
+    std::shared_ptr<local_archive> a = find_archive(filter, true);
+
+    found.assign(keys.size(), false);
+    if (!f && !a)
+    {
+        return;
+    }
+
+    std::vector<uint64_t> hashes(keys.size());
+    std::vector<uint64_t> bits((keys.size() + 63) / 64);
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        hashes[i] = hash_key(keys.key(i), keys.length(i));
+    }
+
+    if (f)
+    {
+        f->contains(hashes.data(), hashes.size(), bits.data());
+    }
+    if (a)
+    {
+        a->contains(hashes.data(), hashes.size(), bits.data());
+    }
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        found[i] = (bits[i / 64] >> (i % 64)) & 1;
+    }
+}
+
+bool local_store::stats(const std::string &filter,
+                        struct filter_stats &stats)
+{
+    std::shared_ptr<local_filter> f = find(filter, false);
+    std::shared_ptr<local_archive> a = find_archive(filter, true);
+
+    // check() matches a key found in either, so their rates combine
+    double missed = 1.0;
+    stats.keys = 0;
+    stats.capacity = 0;
+    stats.size = 0;
+    if (f)
+    {
+        stats.keys += f->keys();
+        stats.capacity = f->capacity();
+        stats.size += f->size();
+        missed *= 1.0 - bloom_filter::false_positive_rate(f->keys(), f->block_count());
+    }
+    if (a)
+    {
+        stats.keys += a->keys();
+        stats.size += a->size();
+        missed *= 1.0 - bloom_filter::false_positive_rate(a->keys(), a->block_count());
+    }
+    stats.probability = 1.0 - missed;
+
+    return f || a;
+}
+
+/**
+    Grow a buffer of filter blocks to a larger power of two by repeating
+    it. Blocks are picked by the low bits of the block hash, so a key's
+    block is any of its copies; folding onto the smaller size instead
+    would crowd every key of the larger filter into it.
+
+    \param blocks Buffer of blocks, empty for a new one.
+    \param count Number of blocks it should have at least.
+*/
+static void tile_blocks(std::vector<uint64_t> &blocks,
+                        uint64_t count)
+{
+    size_t words = count * bloom_filter::BLOCK_BYTES / sizeof(uint64_t);
+    size_t old = blocks.size();
+
+    if (old >= words)
+    {
+        return;
+    }
+    blocks.resize(words, 0);
+    for (size_t i = old; old && i < words; ++i)
+    {
+        blocks[i] = blocks[i % old];
+    }
+}
+
+/**
+    Measure a buffer of blocks' false positive rate: a key is found if
+    each of its block's sixteen 32-bit words has its probed bit set.
+
+    \param blocks Buffer of blocks.
+
+    \return Chance that a key not added is found.
+*/
+static double measured_rate(const std::vector<uint64_t> &blocks)
+{
+    size_t words_per_block = bloom_filter::BLOCK_BYTES / sizeof(uint64_t);
+    double total = 0;
+
+    for (size_t b = 0; b < blocks.size(); b += words_per_block)
+    {
+        double rate = 1;
+        for (size_t w = 0; w < words_per_block; ++w)
+        {
+            rate *= __builtin_popcount(static_cast<uint32_t>(blocks[b + w])) / 32.0;
+            rate *= __builtin_popcount(static_cast<uint32_t>(blocks[b + w] >> 32)) / 32.0;
+        }
+        total += rate;
+    }
+
+    return blocks.empty() ? 0 : total * words_per_block / blocks.size();
+}
+
+bool local_store::gather(const std::string &filter,
+                         std::vector<uint64_t> &blocks,
+                         uint64_t *keys)
+{
+    std::shared_ptr<local_filter> f = find(filter, false);
+    std::shared_ptr<local_archive> a = find_archive(filter, true);
+    size_t words_per_block = bloom_filter::BLOCK_BYTES / sizeof(uint64_t);
+
+    if (f)
+    {
+        size_t words = f->block_count() * words_per_block;
+        const uint64_t *source = static_cast<const uint64_t *>(f->blocks());
+        tile_blocks(blocks, f->block_count());
+        for (size_t i = 0; i < blocks.size(); ++i)
+        {
+            blocks[i] |= source[i % words];
+        }
+        *keys += f->keys();
+    }
+
+    if (a)
+    {
+        tile_blocks(blocks, a->block_count());
+        a->expand(blocks.data(), blocks.size() / words_per_block);
+        *keys += a->keys();
+    }
+
+    return f || a;
+}
+
+void local_store::remove(const std::string &filter)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    // users holding the filter keep their mapping until they let go
+    if (filters.erase(filter))
+    {
+        unlink(path(filter).c_str());
+    }
+    archives.erase(filter);
+    unlink(archive_path(filter).c_str());
+}
+
+bool local_store::archive(const std::string &filter)
+{
+    if (!find(filter, false))
+    {
+        return true;
+    }
+
+    // write outside the lock; the filter is no longer written to, as its
+    // slot has passed
+    std::vector<uint64_t> blocks;
+    uint64_t keys = 0;
+    gather(filter, blocks, &keys);
+    local_archive::write(archive_path(filter), blocks.data(),
+                         blocks.size() * sizeof(uint64_t) / bloom_filter::BLOCK_BYTES, keys);
+
+    std::lock_guard<std::mutex> guard(lock);
+    archives.erase(filter);
+    if (filters.erase(filter))
+    {
+        unlink(path(filter).c_str());
+    }
+
+    return true;
+}
+
+bool local_store::merge(const std::string &filter,
+                        const std::vector<std::string> &sources,
+                        double probability,
+                        double *rate)
+{
+    std::vector<uint64_t> blocks;
+    uint64_t keys = 0;
+    bool found = false;
+
+    *rate = 0;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        found = gather(sources[i], blocks, &keys) || found;
+    }
+    if (!found)
+    {
+        return true;
+    }
+    gather(filter, blocks, &keys);
+
+    // bits can't be spread over more blocks, so filters that are full
+    // enough would merge into one that matches nearly everything
+    *rate = measured_rate(blocks);
+    if (*rate > probability)
+    {
+        return true;
+    }
+
+    // the sources go once the merged filter is in place; until then a
+    // check finds the keys in both
+    local_archive::write(archive_path(filter), blocks.data(),
+                         blocks.size() * sizeof(uint64_t) / bloom_filter::BLOCK_BYTES, keys);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        archives.erase(filter);
+        if (filters.erase(filter))
+        {
+            unlink(path(filter).c_str());
+        }
+    }
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        remove(sources[i]);
+    }
+
+    return true;
+}
+
+bool local_store::merged_rate(const std::string &filter,
+                              const std::vector<std::string> &sources,
+                              double *rate)
+{
+    std::vector<uint64_t> blocks;
+    uint64_t keys = 0;
+    bool found = false;
+
+    *rate = 0;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        found = gather(sources[i], blocks, &keys) || found;
+    }
+    if (found)
+    {
+        gather(filter, blocks, &keys);
+        *rate = measured_rate(blocks);
+    }
+
+    return true;
+}
+
+bool local_store::can_merge()
+{
+    return true;
+}
+
+std::map<std::string, uint64_t> local_store::archived()
+{
+    std::map<std::string, uint64_t> sizes;
+
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+    {
+        return sizes;
+    }
+
+    size_t suffix = strlen(LOCAL_ARCHIVE_SUFFIX);
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        std::string name = entry->d_name;
+        if (name.length() > suffix &&
+            name.compare(name.length() - suffix, suffix, LOCAL_ARCHIVE_SUFFIX) == 0 &&
+            stat((directory + "/" + name).c_str(), &st) == 0)
+        {
+            sizes[name.substr(0, name.length() - suffix)] = st.st_size;
+        }
+    }
+    closedir(dir);
+
+    return sizes;
+}
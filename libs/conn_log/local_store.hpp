@@ -0,0 +1,410 @@
+//=============================================================================
+//
+// Name:        local_store.hpp
+// Authors:     James H. Loving
+// Description: This file declares the local_store class, conn_log's
+//              in-process storage backend. Each filter is a Bloom filter in
+//              its own memory-mapped file, so filters survive a restart
+//              without a separate Bloomd process.
+//
+//=============================================================================
+
+#ifndef LOCAL_STORE_HPP
+#define LOCAL_STORE_HPP
+
+#include <algorithm>      // min()
+#include <dirent.h>       // directory scan
+#include <errno.h>        // errno
+#include <fcntl.h>        // open()
+#include <map>            // open filters
+#include <memory>         // shared_ptr
+#include <mutex>          // guards the filter map
+#include <stdio.h>        // rename()
+#include <string.h>       // strerror()
+#include <string>         // string class
+#include <sys/mman.h>     // mmap()
+#include <sys/file.h>     // flock()
+#include <sys/stat.h>     // mkdir(), fstat()
+#include <iostream>       // output
+#include <unistd.h>       // close(), ftruncate()
+#include <vector>         // hash batches
+
+#include "filter_store.hpp"
+#include "../bloom_filter/bloom_filter.hpp"
+
+const char LOCAL_FILTER_DIR[] = "/var/lib/edict/filters";
+                                        /**< directory holding the local
+                                             backend's filter files */
+const uint64_t LOCAL_FILTER_CAPACITY = 100000;
+                                        /**< keys per filter, as Bloomd's
+                                             default */
+const double LOCAL_FILTER_PROBABILITY = 0.0001;
+                                        /**< false positive rate at capacity,
+                                             as Bloomd's default */
+
+/**
+    Header at the start of every local filter file.
+*/
+struct local_filter_header
+{
+    char magic[8];          /**< "EDICTBF" + '\0' */
+    uint32_t version;       /**< file format version */
+    uint32_t block_bytes;   /**< bytes per filter block */
+    uint64_t blocks;        /**< number of filter blocks */
+    uint64_t keys;          /**< keys added (approximate with threads) */
+    uint64_t capacity;      /**< keys it was sized for, 0 if unknown */
+    uint64_t reserved[3];   /**< aligns the blocks to a cache line */
+};
+
+/**
+    Header at the start of every archived filter file. The header is
+    followed by a bitmap of the filter's non-empty blocks, the number of
+    non-empty blocks before each bitmap word, and (from data_offset) the
+    non-empty blocks themselves.
+*/
+struct local_archive_header
+{
+    char magic[8];          /**< "EDICTAR" + '\0' */
+    uint32_t version;       /**< file format version */
+    uint32_t block_bytes;   /**< bytes per filter block */
+    uint64_t blocks;        /**< number of filter blocks */
+    uint64_t present;       /**< number of non-empty blocks stored */
+    uint64_t keys;          /**< keys added, as the filter counted them */
+    uint64_t data_offset;   /**< offset of the first stored block, a
+                                 multiple of the block size */
+    uint64_t reserved[2];   /**< pads the header to a cache line */
+};
+
+/**
+    One filter file, mapped into memory for as long as the object lives.
+*/
+class local_filter
+{
+    private:
+        int fd;                         /**< open filter file */
+        ino_t inode;                    /**< its inode */
+        size_t length;                  /**< mapped length in bytes */
+        struct local_filter_header *header;
+                                        /**< start of the mapping */
+
+        local_filter(const local_filter &);
+        local_filter &operator=(const local_filter &);
+
+    public:
+        /**
+            Open (or create) and map a filter file. Throws
+            std::runtime_error, ex if create is false and the process
+            creating the file has not sized it yet.
+
+            \param path Path of the filter file.
+            \param create Create an empty filter if the file does not exist.
+            \param capacity Keys a created filter is sized for.
+            \param probability False positive rate of a created filter at
+                capacity.
+        */
+        local_filter(const std::string &path,
+                     bool create,
+                     uint64_t capacity = LOCAL_FILTER_CAPACITY,
+                     double probability = LOCAL_FILTER_PROBABILITY);
+
+        /**
+            Unmap and close the filter file.
+        */
+        ~local_filter();
+
+        /**
+            \return Size of the filter file in bytes.
+        */
+        uint64_t size() const;
+
+        /**
+            \return Inode of the filter file, to tell whether the file at
+                its path was replaced.
+        */
+        ino_t file() const;
+
+        /**
+            Add a batch of hashed keys to the filter.
+
+            \param hashes Hashes of the keys, see hash_key().
+            \param count Number of hashes.
+        */
+        void insert(const uint64_t *hashes,
+                    size_t count);
+
+        /**
+            Check a batch of hashed keys, see bloom_filter::contains().
+        */
+        void contains(const uint64_t *hashes,
+                      size_t count,
+                      uint64_t *found) const;
+
+        /**
+            \return Pointer to the filter's blocks.
+        */
+        const void *blocks() const;
+
+        /**
+            \return Number of blocks, a power of two.
+        */
+        uint64_t block_count() const;
+
+        /**
+            \return Number of keys added.
+        */
+        uint64_t keys() const;
+
+        /**
+            \return Number of keys the filter was sized for, 0 if unknown.
+        */
+        uint64_t capacity() const;
+};
+
+/**
+    An archived filter: only its non-empty blocks, in a read-only
+    memory-mapped file that is checked in place. A filter holding few keys
+    (ex a quiet hour) shrinks to a small fraction of its size; a full one
+    costs one bit per block more.
+*/
+class local_archive
+{
+    private:
+        int fd;                         /**< open archive file */
+        ino_t inode;                    /**< its inode */
+        size_t length;                  /**< mapped length in bytes */
+        const struct local_archive_header *header;
+                                        /**< start of the mapping */
+        const uint64_t *bitmap;         /**< non-empty blocks */
+        const uint32_t *ranks;          /**< non-empty blocks before each
+                                             bitmap word */
+        const char *data;               /**< the non-empty blocks */
+
+        local_archive(const local_archive &);
+        local_archive &operator=(const local_archive &);
+
+        /**
+            \param block Index of a block.
+
+            \return Pointer to the block, or NULL if it is empty.
+        */
+        const char *block(uint64_t block) const;
+
+    public:
+        /**
+            Open and map an archive file.
+
+            \param path Path of the archive file.
+        */
+        explicit local_archive(const std::string &path);
+
+        /**
+            Unmap and close the archive file.
+        */
+        ~local_archive();
+
+        /**
+            Write an archive of a filter's blocks, replacing any file at
+            path once it is complete.
+
+            \param path Path of the archive file.
+            \param blocks Pointer to the filter's blocks.
+            \param count Number of blocks, a power of two.
+            \param keys Number of keys in the filter.
+        */
+        static void write(const std::string &path,
+                          const void *blocks,
+                          uint64_t count,
+                          uint64_t keys);
+
+        /**
+            \return Size of the archive file in bytes.
+        */
+        uint64_t size() const;
+
+        /**
+            \return Inode of the archive file, to tell whether the file at
+                its path was replaced.
+        */
+        ino_t file() const;
+
+        /**
+            \return Number of blocks of the archived filter.
+        */
+        uint64_t block_count() const;
+
+        /**
+            \return Number of keys in the archived filter.
+        */
+        uint64_t keys() const;
+
+        /**
+            Check a batch of hashed keys, see bloom_filter::contains().
+        */
+        void contains(const uint64_t *hashes,
+                      size_t count,
+                      uint64_t *found) const;
+
+        /**
+            OR the archived blocks into a filter of any number of blocks,
+            folding them onto fewer or repeating them across more.
+
+            \param blocks Pointer to the filter's blocks.
+            \param count Number of blocks, a power of two.
+        */
+        void expand(void *blocks,
+                    uint64_t count) const;
+};
+
+/**
+    Named Bloom filters in memory-mapped files under one directory.
+    Archived filters live next to them, in their own files. Safe to share
+    between threads.
+*/
+class local_store : public filter_store
+{
+    private:
+        std::string directory;          /**< where filter files live */
+        std::mutex lock;                /**< guards filters */
+        std::map<std::string, std::shared_ptr<local_filter> > filters;
+                                        /**< open filters, by name */
+        std::map<std::string, std::shared_ptr<local_archive> > archives;
+                                        /**< open archives, by name */
+
+        local_store(const local_store &);
+        local_store &operator=(const local_store &);
+
+        /**
+            \return Path of a filter's file. Throws on unsafe names.
+        */
+        std::string path(const std::string &filter) const;
+
+        /**
+            \return Path of a filter's archive file.
+        */
+        std::string archive_path(const std::string &filter) const;
+
+        /**
+            Look up a filter, opening it if it exists on disk. A mapping
+            whose file another process dropped or replaced is let go.
+
+            \param filter Name of the filter.
+            \param create Create the filter if it does not exist.
+            \param capacity Keys a created filter is sized for.
+            \param probability False positive rate of a created filter at
+                capacity.
+
+            \return The filter, or an empty pointer.
+        */
+        std::shared_ptr<local_filter> find(const std::string &filter,
+                                           bool create,
+                                           uint64_t capacity = LOCAL_FILTER_CAPACITY,
+                                           double probability = LOCAL_FILTER_PROBABILITY);
+
+        /**
+            Look up an archived filter, reopening it if another process
+            replaced its file.
+
+            \param filter Name of the filter.
+            \param open Open its file if it is not open yet.
+
+            \return The archive, or an empty pointer.
+        */
+        std::shared_ptr<local_archive> find_archive(const std::string &filter,
+                                                    bool open);
+
+        /**
+            Let go of every filter and archive whose file another process
+            dropped or replaced, so a long-lived reader (ex edict serve)
+            does not keep them open. The caller holds the lock.
+        */
+        void sweep();
+
+        /**
+            OR a filter and its archive into a buffer of blocks. Filters of
+            different sizes are tiled onto the larger one, so each keeps
+            its own false positive rate.
+
+            \param filter Name of the filter.
+            \param blocks Buffer of blocks, empty to start a new one.
+            \param keys Incremented by the number of keys gathered.
+
+            \return False if there is no such filter.
+        */
+        bool gather(const std::string &filter,
+                    std::vector<uint64_t> &blocks,
+                    uint64_t *keys);
+
+        /**
+            Forget a filter and delete its files.
+
+            \param filter Name of the filter.
+        */
+        void remove(const std::string &filter);
+
+    public:
+        /**
+            Open every filter file in a directory, creating it if needed.
+
+            \param directory Directory holding the filter files.
+        */
+        explicit local_store(const std::string &directory);
+
+        std::map<std::string, uint64_t> list();
+
+        uint64_t info(const std::string &filter);
+
+        void create(const std::string &filter);
+
+        /**
+            Create the filter with the fewest blocks (a power of two) that
+            holds capacity keys at the given false positive rate.
+        */
+        void create(const std::string &filter,
+                    uint64_t capacity,
+                    double probability);
+
+        void drop(const std::string &filter);
+
+        void set(const std::string &filter,
+                 const key_batch &keys);
+
+        /**
+            Check the filter and, if there is one, its archive.
+        */
+        void check(const std::string &filter,
+                   const key_batch &keys,
+                   std::vector<bool> &found);
+
+        /**
+            Report the filter, or its archive if it has been archived, with
+            the false positive rate of its blocks at the keys counted.
+        */
+        bool stats(const std::string &filter,
+                   struct filter_stats &stats);
+
+        /**
+            Write the filter's non-empty blocks to an archive file (merged
+            with any earlier archive of it) and delete the filter file.
+        */
+        bool archive(const std::string &filter);
+
+        /**
+            Gather the sources and the filter into the filter's archive,
+            then delete the sources. The rate is measured from the
+            gathered blocks.
+        */
+        bool merge(const std::string &filter,
+                   const std::vector<std::string> &sources,
+                   double probability,
+                   double *rate);
+
+        bool merged_rate(const std::string &filter,
+                         const std::vector<std::string> &sources,
+                         double *rate);
+
+        bool can_merge();
+
+        std::map<std::string, uint64_t> archived();
+};
+
+#endif
@@ -0,0 +1,304 @@
+//=============================================================================
+//
+// Name:        port_index.cpp
+// Authors:     James H. Loving
+// Description: This file defines the port_index class. For additional
+//              documentation, refer to port_index.hpp.
+//
+//=============================================================================
+
+#include "port_index.hpp"
+
+static const char PORT_INDEX_MAGIC[8] = "EDICTPB";
+static const uint32_t PORT_INDEX_VERSION = 1;
+static const char PORT_INDEX_SUFFIX[] = ".ports";
+
+/**
+    Write a whole buffer to a file.
+
+    \return False on failure, with errno set.
+*/
+static bool write_all(int fd,
+                      const std::string &data)
+{
+    for (size_t done = 0; done < data.length(); )
+    {
+        ssize_t written = write(fd, data.data() + done, data.length() - done);
+        if (written < 0 && errno != EINTR)
+        {
+            return false;
+        }
+        done += written > 0 ? written : 0;
+    }
+
+    return true;
+}
+
+/**
+    \return A new index file's header.
+*/
+static std::string file_header()
+{
+    struct port_index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PORT_INDEX_MAGIC, sizeof(header.magic));
+    header.version = PORT_INDEX_VERSION;
+
+    return std::string(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+port_index::port_index(const std::string &directory)
+{
+    this->directory = directory;
+
+    // create the directory (and its parents) if needed
+    for (size_t slash = directory.find('/', 1); ; slash = directory.find('/', slash + 1))
+    {
+        mkdir(directory.substr(0, slash).c_str(), 0755);
+        if (slash == std::string::npos)
+        {
+            break;
+        }
+    }
+
+    struct stat st;
+    if (stat(directory.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+    {
+        throw std::runtime_error("port_index could not open " + directory + ": " + strerror(errno));
+    }
+}
+
+std::string port_index::path(time_t slot) const
+{
+    return directory + "/" + std::to_string(slot) + PORT_INDEX_SUFFIX;
+}
+
+bool port_index::read_file(int fd,
+                           std::string &data)
+{
+    struct stat st;
+    struct port_index_header header;
+
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(header))
+    {
+        return false;
+    }
+
+    data.resize(st.st_size);
+    for (size_t done = 0; done < data.length(); )
+    {
+        ssize_t got = pread(fd, &data[done], data.length() - done, done);
+        if (got == 0 || (got < 0 && errno != EINTR))
+        {
+            return false;
+        }
+        done += got > 0 ? got : 0;
+    }
+
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, PORT_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != PORT_INDEX_VERSION)
+    {
+        return false;
+    }
+    data.erase(0, sizeof(header));
+
+    return true;
+}
+
+void port_index::append(time_t slot,
+                        time_t minute,
+                        const std::map<uint32_t, port_bitmap> &ports)
+{
+    std::string records;
+    for (std::map<uint32_t, port_bitmap>::const_iterator it = ports.begin(); it != ports.end(); ++it)
+    {
+        struct port_record_header record;
+        size_t start = records.length();
+
+        records.append(sizeof(record), '\0');
+        it->second.write(records);
+
+        record.minute = minute;
+        record.device = it->first;
+        record.bytes = records.length() - start - sizeof(record);
+        memcpy(&records[start], &record, sizeof(record));
+    }
+
+    for (;;)
+    {
+        int fd = open(path(slot).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+        {
+            throw std::runtime_error("port_index could not open " + path(slot) + ": " + strerror(errno));
+        }
+        flock(fd, LOCK_EX);
+
+        // purge() may have replaced the file since it was opened
+        struct stat opened;
+        struct stat current;
+        if (fstat(fd, &opened) < 0 || stat(path(slot).c_str(), &current) < 0 ||
+            opened.st_ino != current.st_ino)
+        {
+            close(fd);
+            continue;
+        }
+
+        std::string data = opened.st_size == 0 ? file_header() + records : records;
+
+        bool written = write_all(fd, data);
+        int error = errno;
+        close(fd);
+        if (!written)
+        {
+            throw std::runtime_error("port_index could not write " + path(slot) + ": " + strerror(error));
+        }
+
+        return;
+    }
+}
+
+bool port_index::load(time_t slot,
+                      time_t first,
+                      time_t last,
+                      std::map<uint32_t, port_bitmap> &ports)
+{
+    // no file: nothing was recorded during the timeslot
+    int fd = open(path(slot).c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return errno == ENOENT;
+    }
+
+    std::string data;
+    flock(fd, LOCK_SH);
+    bool valid = read_file(fd, data);
+    close(fd);
+    if (!valid)
+    {
+        return false;
+    }
+
+    port_bitmap minute_ports;
+    for (size_t offset = 0; offset + sizeof(struct port_record_header) <= data.length(); )
+    {
+        struct port_record_header record;
+        memcpy(&record, data.data() + offset, sizeof(record));
+        offset += sizeof(record);
+        if (record.bytes > data.length() - offset)
+        {
+            break;
+        }
+
+        if (record.minute >= first && record.minute <= last &&
+            minute_ports.read(data.data() + offset, record.bytes))
+        {
+            ports[record.device].merge(minute_ports);
+        }
+        offset += record.bytes;
+    }
+
+    return true;
+}
+
+void port_index::drop(time_t slot)
+{
+    unlink(path(slot).c_str());
+}
+
+uint64_t port_index::purge(uint32_t device)
+{
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+    {
+        throw std::runtime_error("port_index could not open " + directory + ": " + strerror(errno));
+    }
+
+    uint64_t removed = 0;
+    size_t suffix = strlen(PORT_INDEX_SUFFIX);
+    for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name.length() <= suffix || name.compare(name.length() - suffix, suffix, PORT_INDEX_SUFFIX) != 0)
+        {
+            continue;
+        }
+
+        std::string file = directory + "/" + name;
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        // writers wait for the lock, then find the file replaced and
+        // append to the new one
+        std::string data;
+        flock(fd, LOCK_EX);
+        if (!read_file(fd, data))
+        {
+            close(fd);
+            continue;
+        }
+
+        std::string kept = file_header();
+        uint64_t dropped = 0;
+        for (size_t offset = 0; offset + sizeof(struct port_record_header) <= data.length(); )
+        {
+            struct port_record_header record;
+            memcpy(&record, data.data() + offset, sizeof(record));
+            size_t length = sizeof(record) + std::min<size_t>(record.bytes, data.length() - offset - sizeof(record));
+            if (record.device == device)
+            {
+                ++dropped;
+            }
+            else
+            {
+                kept.append(data, offset, length);
+            }
+            offset += length;
+        }
+
+        if (dropped)
+        {
+            std::string temporary = file + ".tmp";
+            int out = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out < 0 || !write_all(out, kept) || fsync(out) < 0 ||
+                rename(temporary.c_str(), file.c_str()) < 0)
+            {
+                int error = errno;
+                if (out >= 0)
+                {
+                    close(out);
+                }
+                unlink(temporary.c_str());
+                close(fd);
+                closedir(dir);
+                throw std::runtime_error("port_index could not rewrite " + file + ": " + strerror(error));
+            }
+            close(out);
+            removed += dropped;
+        }
+        close(fd);
+    }
+    closedir(dir);
+
+    return removed;
+}
+
+std::shared_ptr<port_index> open_port_index(const std::string &directory)
+{
+    // every caller shares the same index
+    static std::mutex lock;
+    static std::map<std::string, std::weak_ptr<port_index> > shared;
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<port_index> index = shared[directory].lock();
+    if (!index)
+    {
+        index = std::make_shared<port_index>(directory);
+        shared[directory] = index;
+    }
+
+    return index;
+}
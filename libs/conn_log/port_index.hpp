@@ -0,0 +1,155 @@
+//=============================================================================
+//
+// Name:        port_index.hpp
+// Authors:     James H. Loving
+// Description: This file declares the port_index class, an optional exact
+//              index of the IPv4 source ports each device used, one
+//              port_bitmap per device per minute, in one append-only file
+//              per timeslot. Unlike the Bloom filters it answers port range
+//              and port set queries, over any window of minutes, with no
+//              false positives.
+//
+//=============================================================================
+
+#ifndef PORT_INDEX_HPP
+#define PORT_INDEX_HPP
+
+#include <algorithm>      // min()
+#include <dirent.h>       // directory scan
+#include <errno.h>        // errno
+#include <fcntl.h>        // open()
+#include <map>            // bitmaps by device
+#include <memory>         // shared_ptr
+#include <mutex>          // guards the shared indexes
+#include <stdexcept>      // exception handling
+#include <stdint.h>       // uint32_t
+#include <stdio.h>        // rename()
+#include <string.h>       // strerror()
+#include <string>         // string class
+#include <sys/file.h>     // flock()
+#include <sys/stat.h>     // mkdir(), fstat()
+#include <time.h>         // time_t
+#include <unistd.h>       // read(), write(), unlink()
+
+#include "../port_bitmap/port_bitmap.hpp"
+
+const char PORT_INDEX_DIR[] = "/var/lib/edict/ports";
+                                        /**< directory holding one port
+                                             index file per timeslot */
+
+/**
+    Header at the start of every port index file.
+*/
+struct port_index_header
+{
+    char magic[8];          /**< "EDICTPB" + '\0' */
+    uint32_t version;       /**< file format version */
+    uint32_t reserved;      /**< unused */
+};
+
+/**
+    Header of each record in a port index file, followed by the ports, see
+    port_bitmap::write(). A device may have several records per minute
+    (ex from replayed flows); they add up.
+*/
+struct port_record_header
+{
+    int64_t minute;         /**< minute, i.e. timestamp / MINUTE_LENGTH */
+    uint32_t device;        /**< device ID, see device_registry */
+    uint32_t bytes;         /**< length of the ports that follow */
+};
+
+/**
+    Per-timeslot port index files under one directory. Writers append a
+    minute's bitmaps in one write under flock(), so any number of threads
+    and processes can share the files. Safe to share between threads.
+*/
+class port_index
+{
+    private:
+        std::string directory;          /**< where index files live */
+
+        port_index(const port_index &);
+        port_index &operator=(const port_index &);
+
+        /**
+            \return Path of a timeslot's index file.
+        */
+        std::string path(time_t slot) const;
+
+        /**
+            Read a whole index file; the caller holds a lock on it.
+
+            \param fd Open index file.
+            \param data Set to the file's records, without its header.
+
+            \return False if the file is not a valid index file.
+        */
+        static bool read_file(int fd,
+                              std::string &data);
+
+    public:
+        /**
+            Use a directory of index files, creating it if needed.
+
+            \param directory Directory holding the index files.
+        */
+        explicit port_index(const std::string &directory);
+
+        /**
+            Record the ports each device used during a minute.
+
+            \param slot Timeslot of the minute, i.e. timestamp / FILTER_LENGTH.
+            \param minute Minute, i.e. timestamp / MINUTE_LENGTH.
+            \param ports Ports used, by device ID.
+        */
+        void append(time_t slot,
+                    time_t minute,
+                    const std::map<uint32_t, port_bitmap> &ports);
+
+        /**
+            Collect the ports each device used during some of a timeslot's
+            minutes.
+
+            \param slot Timeslot, i.e. timestamp / FILTER_LENGTH.
+            \param first First minute to collect, i.e. timestamp / MINUTE_LENGTH.
+            \param last Last minute to collect, inclusive.
+            \param ports Map the ports are added to, by device ID.
+
+            \return False if the timeslot's index can't be read, i.e. the
+                ports may be incomplete. A timeslot without an index file
+                had no ports recorded.
+        */
+        bool load(time_t slot,
+                  time_t first,
+                  time_t last,
+                  std::map<uint32_t, port_bitmap> &ports);
+
+        /**
+            Delete a timeslot's index, along with its filter.
+
+            \param slot Timeslot, i.e. timestamp / FILTER_LENGTH.
+        */
+        void drop(time_t slot);
+
+        /**
+            Remove a device's records from every timeslot's index.
+
+            \param device Device ID, see device_registry.
+
+            \return Number of records removed.
+        */
+        uint64_t purge(uint32_t device);
+};
+
+/**
+    Open the port index in a directory, shared by every caller in the
+    process.
+
+    \param directory Directory holding the index files.
+
+    \return Shared pointer to the index. Throws std::runtime_error.
+*/
+std::shared_ptr<port_index> open_port_index(const std::string &directory = PORT_INDEX_DIR);
+
+#endif
@@ -0,0 +1,82 @@
+//=============================================================================
+//
+// Name:        recent_keys.cpp
+// Authors:     James H. Loving
+// Description: This file defines the recent_keys class. For additional
+//              documentation, refer to recent_keys.hpp.
+//
+//=============================================================================
+
+#include "recent_keys.hpp"
+
+recent_keys::recent_keys(size_t capacity)
+{
+    size_t buckets = capacity / RECENT_KEYS_WAYS;
+
+    if (!buckets || buckets * RECENT_KEYS_WAYS != capacity || (buckets & (buckets - 1)))
+    {
+        throw std::invalid_argument("recent_keys capacity must be a power of two multiple of RECENT_KEYS_WAYS");
+    }
+
+    this->capacity = capacity;
+    bucket_mask = buckets - 1;
+    slot = 0;
+    hit_count = 0;
+    miss_count = 0;
+}
+
+bool recent_keys::seen(uint64_t hash,
+                       time_t slot)
+{
+    // readers never write, so only writers pay for the hashes
+    if (hashes.empty())
+    {
+        hashes.assign(capacity, 0);
+    }
+
+    if (slot != this->slot)
+    {
+        clear();
+        this->slot = slot;
+    }
+
+    // 0 marks an empty way
+    uint64_t tag = hash | 1;
+    uint64_t *bucket = &hashes[(hash & bucket_mask) * RECENT_KEYS_WAYS];
+
+    for (size_t i = 0; i < RECENT_KEYS_WAYS; ++i)
+    {
+        if (bucket[i] == tag)
+        {
+            hit_count.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        else if (bucket[i] == 0)
+        {
+            bucket[i] = tag;
+            miss_count.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+
+    // full bucket: the hash's upper bits pick the way to evict
+    bucket[(hash >> 32) % RECENT_KEYS_WAYS] = tag;
+    miss_count.fetch_add(1, std::memory_order_relaxed);
+
+    return false;
+}
+
+void recent_keys::clear()
+{
+    std::fill(hashes.begin(), hashes.end(), 0);
+}
+
+uint64_t recent_keys::hits() const
+{
+    return hit_count.load(std::memory_order_relaxed);
+}
+
+uint64_t recent_keys::misses() const
+{
+    return miss_count.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,83 @@
+//=============================================================================
+//
+// Name:        recent_keys.hpp
+// Authors:     James H. Loving
+// Description: This file declares the recent_keys class, the duplicate
+//              filter in front of conn_log's storage backend: a bounded set
+//              of the keys already written during the current timeslot, so
+//              a device reusing a source port or address for many
+//              connections costs one write per timeslot, not one per packet.
+//
+//=============================================================================
+
+#ifndef RECENT_KEYS_HPP
+#define RECENT_KEYS_HPP
+
+#include <algorithm>      // fill()
+#include <atomic>         // counters read by other threads
+#include <stddef.h>       // size_t
+#include <stdexcept>      // invalid_argument
+#include <stdint.h>       // uint64_t
+#include <time.h>         // time_t
+#include <vector>         // key hashes
+
+const size_t RECENT_KEYS = 1 << 16;     /**< key hashes remembered (512 KiB),
+                                             a multiple of RECENT_KEYS_WAYS */
+const size_t RECENT_KEYS_WAYS = 8;      /**< hashes per bucket, one cache line */
+
+/**
+    Set-associative cache of recently written key hashes for one timeslot.
+    A key's bucket is one cache line of RECENT_KEYS_WAYS hashes; when the
+    bucket is full a pseudo-random way is evicted, so the worst case is a
+    redundant write, never a lost one. Only the counters are thread-safe.
+*/
+class recent_keys
+{
+    private:
+        size_t capacity;                /**< hashes to remember */
+        std::vector<uint64_t> hashes;   /**< buckets of hashes, 0 if empty;
+                                             allocated on first use */
+        uint64_t bucket_mask;           /**< number of buckets - 1 */
+        time_t slot;                    /**< timeslot the hashes belong to */
+        std::atomic<uint64_t> hit_count;    /**< keys already written */
+        std::atomic<uint64_t> miss_count;   /**< keys new to the timeslot */
+
+        recent_keys(const recent_keys &);
+        recent_keys &operator=(const recent_keys &);
+
+    public:
+        /**
+            \param capacity Hashes to remember, a power of two multiple of
+                RECENT_KEYS_WAYS. Throws std::invalid_argument otherwise.
+        */
+        explicit recent_keys(size_t capacity = RECENT_KEYS);
+
+        /**
+            Check whether a key was already written during a timeslot, and
+            remember it if not. A new timeslot forgets every key first.
+
+            \param hash Hash of the key, see hash_key().
+            \param slot Timeslot the key is written to.
+
+            \return True if the key can be skipped.
+        */
+        bool seen(uint64_t hash,
+                  time_t slot);
+
+        /**
+            Forget every key, ex when written keys were lost.
+        */
+        void clear();
+
+        /**
+            \return Number of keys found already written.
+        */
+        uint64_t hits() const;
+
+        /**
+            \return Number of keys new to their timeslot.
+        */
+        uint64_t misses() const;
+};
+
+#endif
@@ -0,0 +1,328 @@
+//=============================================================================
+//
+// Name:        reverse_index.cpp
+// Authors:     James H. Loving
+// Description: This file defines the reverse_index class. For additional
+//              documentation, refer to reverse_index.hpp.
+//
+//=============================================================================
+
+#include "reverse_index.hpp"
+
+static const char REVERSE_INDEX_MAGIC[8] = "EDICTIX";
+static const uint32_t REVERSE_INDEX_VERSION = 2;
+static const char REVERSE_INDEX_SUFFIX[] = ".idx";
+
+/**
+    \return The entry's tag for an attribute hash, never 0 so that an
+        entry is never 0 (empty).
+*/
+static inline uint64_t attribute_tag(uint64_t attribute)
+{
+    return (attribute >> 32) | 1;
+}
+
+index_file::index_file(const std::string &path,
+                       bool create)
+{
+    fd = open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("index_file could not open " + path + ": " + strerror(errno));
+    }
+
+    // another process may be creating the same file; only a creator sizes
+    // an empty one, and readers wait until it has
+    flock(fd, create ? LOCK_EX : LOCK_SH);
+
+    struct stat st;
+    fstat(fd, &st);
+    bool fresh = st.st_size == 0;
+    if (fresh && !create)
+    {
+        close(fd);
+        throw std::runtime_error("index_file: " + path + " is still being created");
+    }
+
+    length = fresh ? sizeof(struct reverse_index_header) + REVERSE_INDEX_CAPACITY * sizeof(uint64_t) : st.st_size;
+
+    // a new file is sized up front and reads back as zeros, i.e. empty
+    if (fresh && ftruncate(fd, length) < 0)
+    {
+        close(fd);
+        throw std::runtime_error("index_file could not size " + path + ": " + strerror(errno));
+    }
+
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        throw std::runtime_error("index_file could not map " + path + ": " + strerror(errno));
+    }
+    header = static_cast<struct reverse_index_header *>(map);
+    table = reinterpret_cast<uint64_t *>(header + 1);
+
+    if (fresh)
+    {
+        memcpy(header->magic, REVERSE_INDEX_MAGIC, sizeof(header->magic));
+        header->version = REVERSE_INDEX_VERSION;
+        header->capacity = REVERSE_INDEX_CAPACITY;
+    }
+    flock(fd, LOCK_UN);
+
+    if (memcmp(header->magic, REVERSE_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+             header->version != REVERSE_INDEX_VERSION ||
+             !header->capacity || (header->capacity & (header->capacity - 1)) ||
+             sizeof(struct reverse_index_header) + header->capacity * sizeof(uint64_t) > length)
+    {
+        munmap(map, length);
+        close(fd);
+        throw std::runtime_error("index_file: " + path + " is not a valid index file");
+    }
+}
+
+index_file::~index_file()
+{
+    munmap(header, length);
+    close(fd);
+}
+
+void index_file::insert(uint64_t attribute,
+                        uint32_t device)
+{
+    uint64_t entry = attribute_tag(attribute) << 32 | device;
+    uint64_t mask = header->capacity - 1;
+
+    if (__atomic_load_n(&header->overflow, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    // linear probing; entries are never emptied (purge() only clears the
+    // device), so a chain ends at the first empty entry
+    for (uint64_t i = attribute & mask; ; i = (i + 1) & mask)
+    {
+        uint64_t current = __atomic_load_n(&table[i], __ATOMIC_RELAXED);
+        if (current == entry)
+        {
+            return;
+        }
+        else if (current == 0)
+        {
+            // keep chains short: past 3/4 full, stop adding and let lookups
+            // fall back to checking every device
+            if (__atomic_add_fetch(&header->entries, 1, __ATOMIC_RELAXED) > header->capacity / 4 * 3)
+            {
+                __atomic_store_n(&header->overflow, 1, __ATOMIC_RELAXED);
+                return;
+            }
+
+            if (__atomic_compare_exchange_n(&table[i], &current, entry, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                return;
+            }
+
+            // lost the race for this entry; it may be ours, check it again
+            __atomic_sub_fetch(&header->entries, 1, __ATOMIC_RELAXED);
+            i = (i - 1) & mask;
+        }
+    }
+}
+
+bool index_file::lookup(uint64_t attribute,
+                        std::set<uint32_t> &devices) const
+{
+    uint64_t tag = attribute_tag(attribute);
+    uint64_t mask = header->capacity - 1;
+
+    for (uint64_t i = attribute & mask, n = 0; n < header->capacity; i = (i + 1) & mask, ++n)
+    {
+        uint64_t current = __atomic_load_n(&table[i], __ATOMIC_RELAXED);
+        if (current == 0)
+        {
+            break;
+        }
+        else if ((current >> 32) == tag && static_cast<uint32_t>(current))
+        {
+            devices.insert(static_cast<uint32_t>(current));
+        }
+    }
+
+    return !__atomic_load_n(&header->overflow, __ATOMIC_RELAXED);
+}
+
+uint64_t index_file::purge(uint32_t device)
+{
+    uint64_t removed = 0;
+
+    // insert() only fills empty entries, so a plain store can't lose one
+    for (uint64_t i = 0; i < header->capacity; ++i)
+    {
+        uint64_t current = __atomic_load_n(&table[i], __ATOMIC_RELAXED);
+        if (current && static_cast<uint32_t>(current) == device)
+        {
+            __atomic_store_n(&table[i], current >> 32 << 32, __ATOMIC_RELAXED);
+            ++removed;
+        }
+    }
+
+    return removed;
+}
+
+reverse_index::reverse_index(const std::string &directory)
+{
+    this->directory = directory;
+
+    // create the directory (and its parents) if needed
+    for (size_t slash = directory.find('/', 1); ; slash = directory.find('/', slash + 1))
+    {
+        mkdir(directory.substr(0, slash).c_str(), 0755);
+        if (slash == std::string::npos)
+        {
+            break;
+        }
+    }
+
+    struct stat st;
+    if (stat(directory.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+    {
+        throw std::runtime_error("reverse_index could not open " + directory + ": " + strerror(errno));
+    }
+}
+
+std::string reverse_index::path(time_t slot) const
+{
+    return directory + "/" + std::to_string(slot) + REVERSE_INDEX_SUFFIX;
+}
+
+std::shared_ptr<index_file> reverse_index::file(time_t slot,
+                                                bool create)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    std::map<time_t, std::shared_ptr<index_file> >::iterator it = files.find(slot);
+    if (it != files.end())
+    {
+        return it->second;
+    }
+
+    // another process (ex the capture process) may have created it since;
+    // an empty file is still being sized by it
+    struct stat st;
+    if (!create && (stat(path(slot).c_str(), &st) < 0 || st.st_size == 0))
+    {
+        return std::shared_ptr<index_file>();
+    }
+
+    std::shared_ptr<index_file> opened;
+    try
+    {
+        opened = std::make_shared<index_file>(path(slot), create);
+    }
+    catch (std::runtime_error &e)
+    {
+        // ex a file in an older format: readers do without it, and the
+        // writer starts the timeslot's index over
+        if (!create)
+        {
+            return std::shared_ptr<index_file>();
+        }
+        unlink(path(slot).c_str());
+        opened = std::make_shared<index_file>(path(slot), create);
+    }
+    files[slot] = opened;
+
+    return opened;
+}
+
+uint64_t reverse_index::ipv4_attribute(uint16_t port)
+{
+    char key[3] = {4, static_cast<char>(port >> 8), static_cast<char>(port & 0xff)};
+
+    return hash_key(key, sizeof(key));
+}
+
+uint64_t reverse_index::ipv6_attribute(const uint8_t *ipv6_address)
+{
+    char key[17];
+    key[0] = 6;
+    memcpy(key + 1, ipv6_address, 16);
+
+    return hash_key(key, sizeof(key));
+}
+
+void reverse_index::add(time_t slot,
+                        uint64_t attribute,
+                        uint32_t device)
+{
+    file(slot, true)->insert(attribute, device);
+}
+
+bool reverse_index::candidates(time_t slot,
+                               uint64_t attribute,
+                               std::set<uint32_t> &devices)
+{
+    std::shared_ptr<index_file> slot_file = file(slot, false);
+
+    return slot_file && slot_file->lookup(attribute, devices);
+}
+
+void reverse_index::drop(time_t slot)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    // users holding the index keep their mapping until they let go
+    files.erase(slot);
+    unlink(path(slot).c_str());
+}
+
+uint64_t reverse_index::purge(uint32_t device)
+{
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+    {
+        throw std::runtime_error("reverse_index could not open " + directory + ": " + strerror(errno));
+    }
+
+    // every index on disk, not only the open ones; the mappings are shared
+    uint64_t removed = 0;
+    size_t suffix = strlen(REVERSE_INDEX_SUFFIX);
+    for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name.length() <= suffix || name.compare(name.length() - suffix, suffix, REVERSE_INDEX_SUFFIX) != 0)
+        {
+            continue;
+        }
+
+        try
+        {
+            removed += index_file(directory + "/" + name, false).purge(device);
+        }
+        catch (std::runtime_error &e)
+        {
+            // ex a file in an older format, which nothing reads
+        }
+    }
+    closedir(dir);
+
+    return removed;
+}
+
+std::shared_ptr<reverse_index> open_index(const std::string &directory)
+{
+    // every caller shares the same mapped index files
+    static std::mutex lock;
+    static std::map<std::string, std::weak_ptr<reverse_index> > shared;
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<reverse_index> index = shared[directory].lock();
+    if (!index)
+    {
+        index = std::make_shared<reverse_index>(directory);
+        shared[directory] = index;
+    }
+
+    return index;
+}
@@ -0,0 +1,225 @@
+//=============================================================================
+//
+// Name:        reverse_index.hpp
+// Authors:     James H. Loving
+// Description: This file declares the reverse_index class, a per-timeslot
+//              index from a flow attribute (IPv4 source port, IPv6 source
+//              address) to the IDs of the devices that used it. Queries
+//              use it to check a handful of candidate devices instead of
+//              every known device.
+//
+//=============================================================================
+
+#ifndef REVERSE_INDEX_HPP
+#define REVERSE_INDEX_HPP
+
+#include <dirent.h>       // directory scan
+#include <errno.h>        // errno
+#include <fcntl.h>        // open()
+#include <map>            // open index files
+#include <memory>         // shared_ptr
+#include <mutex>          // guards the file map
+#include <set>            // candidate devices
+#include <stdint.h>       // uint64_t
+#include <string.h>       // strerror()
+#include <string>         // string class
+#include <sys/file.h>     // flock()
+#include <sys/mman.h>     // mmap()
+#include <sys/stat.h>     // mkdir(), fstat()
+#include <time.h>         // time_t
+#include <unistd.h>       // close(), ftruncate(), unlink()
+
+#include "../bloom_filter/bloom_filter.hpp"
+
+const char REVERSE_INDEX_DIR[] = "/var/lib/edict/index";
+                                        /**< directory holding one index
+                                             file per timeslot */
+const uint64_t REVERSE_INDEX_CAPACITY = 1 << 20;
+                                        /**< entries per index file, a power
+                                             of two (8 bytes each, sparse) */
+
+/**
+    Header at the start of every index file.
+*/
+struct reverse_index_header
+{
+    char magic[8];          /**< "EDICTIX" + '\0' */
+    uint32_t version;       /**< file format version */
+    uint32_t overflow;      /**< set once the table was too full to add to;
+                                 lookups in it are then incomplete */
+    uint64_t capacity;      /**< number of entries, a power of two */
+    uint64_t entries;       /**< entries in use */
+    uint64_t reserved[4];   /**< pads the table to 64 bytes */
+};
+
+/**
+    One timeslot's index: an open-addressing table of 64-bit entries, each
+    a 32-bit tag of the attribute's hash and a 32-bit device ID, mapped
+    from a file for as long as the object lives.
+*/
+class index_file
+{
+    private:
+        int fd;                         /**< open index file */
+        size_t length;                  /**< mapped length in bytes */
+        struct reverse_index_header *header;
+                                        /**< start of the mapping */
+        uint64_t *table;                /**< entries, 0 if empty */
+
+        index_file(const index_file &);
+        index_file &operator=(const index_file &);
+
+    public:
+        /**
+            Open (or create) and map an index file. Throws
+            std::runtime_error, ex if create is false and the process
+            creating the file has not sized it yet.
+
+            \param path Path of the index file.
+            \param create Create an empty index if the file does not exist.
+        */
+        index_file(const std::string &path,
+                   bool create);
+
+        /**
+            Unmap and close the index file.
+        */
+        ~index_file();
+
+        /**
+            Add a device to an attribute's entries, unless it is already there.
+            Safe to call from any number of threads.
+
+            \param attribute Hash of the attribute, see reverse_index.
+            \param device Device ID, see device_registry.
+        */
+        void insert(uint64_t attribute,
+                    uint32_t device);
+
+        /**
+            Collect the devices that may have used an attribute. Other
+            attributes sharing the tag can add false candidates.
+
+            \param attribute Hash of the attribute, see reverse_index.
+            \param devices Set the candidate device IDs are added to.
+
+            \return False if the index overflowed and may be missing devices.
+        */
+        bool lookup(uint64_t attribute,
+                    std::set<uint32_t> &devices) const;
+
+        /**
+            Remove every entry of a device. The entries keep their tag with
+            device ID 0, so the probe chains through them stay intact.
+
+            \param device Device ID, see device_registry.
+
+            \return Number of entries removed.
+        */
+        uint64_t purge(uint32_t device);
+};
+
+/**
+    Per-timeslot reverse indexes in memory-mapped files under one directory.
+    Safe to share between threads.
+*/
+class reverse_index
+{
+    private:
+        std::string directory;          /**< where index files live */
+        std::mutex lock;                /**< guards files */
+        std::map<time_t, std::shared_ptr<index_file> > files;
+                                        /**< open index files, by timeslot */
+
+        reverse_index(const reverse_index &);
+        reverse_index &operator=(const reverse_index &);
+
+        /**
+            \return Path of a timeslot's index file.
+        */
+        std::string path(time_t slot) const;
+
+    public:
+        /**
+            Use a directory of index files, creating it if needed.
+
+            \param directory Directory holding the index files.
+        */
+        explicit reverse_index(const std::string &directory);
+
+        /**
+            \return Attribute hash of an IPv4 source port.
+        */
+        static uint64_t ipv4_attribute(uint16_t port);
+
+        /**
+            \return Attribute hash of a 16-byte binary IPv6 source address.
+        */
+        static uint64_t ipv6_attribute(const uint8_t *ipv6_address);
+
+        /**
+            Look up a timeslot's index file, opening it if it exists. Writers
+            can hold on to the current timeslot's file to skip the lookup.
+
+            \param slot Timeslot, i.e. timestamp / FILTER_LENGTH.
+            \param create Create the index if it does not exist.
+
+            \return The index, or an empty pointer.
+        */
+        std::shared_ptr<index_file> file(time_t slot,
+                                         bool create);
+
+        /**
+            Record that a device used an attribute during a timeslot.
+
+            \param slot Timeslot, i.e. timestamp / FILTER_LENGTH.
+            \param attribute Attribute hash, see ipv4_attribute/ipv6_attribute.
+            \param device Device ID, see device_registry.
+        */
+        void add(time_t slot,
+                 uint64_t attribute,
+                 uint32_t device);
+
+        /**
+            Collect the devices that may have used an attribute during a
+            timeslot. Every candidate must still be checked in the filters.
+
+            \param slot Timeslot, i.e. timestamp / FILTER_LENGTH.
+            \param attribute Attribute hash, see ipv4_attribute/ipv6_attribute.
+            \param devices Set the candidate device IDs are added to.
+
+            \return False if the timeslot has no index or it overflowed,
+                i.e. the candidates may be incomplete.
+        */
+        bool candidates(time_t slot,
+                        uint64_t attribute,
+                        std::set<uint32_t> &devices);
+
+        /**
+            Delete a timeslot's index, along with its filter.
+
+            \param slot Timeslot, i.e. timestamp / FILTER_LENGTH.
+        */
+        void drop(time_t slot);
+
+        /**
+            Remove a device from every timeslot's index on disk.
+
+            \param device Device ID, see device_registry.
+
+            \return Number of entries removed.
+        */
+        uint64_t purge(uint32_t device);
+};
+
+/**
+    Open the reverse index in a directory, shared by every caller in the
+    process.
+
+    \param directory Directory holding the index files.
+
+    \return Shared pointer to the index. Throws std::runtime_error.
+*/
+std::shared_ptr<reverse_index> open_index(const std::string &directory = REVERSE_INDEX_DIR);
+
+#endif
@@ -0,0 +1,613 @@
+//=============================================================================
+//
+// Name:        sharded_store.cpp
+// Authors:     James H. Loving
+// Description: This file defines the sharded_store class. For additional
+//              documentation, refer to sharded_store.hpp and
+//              filter_store.hpp.
+//
+//=============================================================================
+
+#include "sharded_store.hpp"
+
+/**
+    Order ring points by position only.
+*/
+static bool point_before(const std::pair<uint64_t, size_t> &point,
+                         uint64_t position)
+{
+    return point.first < position;
+}
+
+shard_topology::shard_topology(const std::vector<std::string> &shards)
+{
+    this->shards = shards;
+
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        for (unsigned int p = 0; p < SHARD_POINTS; ++p)
+        {
+            std::string point = shards[i] + "#" + std::to_string(p);
+            points.push_back(std::make_pair(hash_key(point.data(), point.length()), i));
+        }
+    }
+    std::sort(points.begin(), points.end());
+}
+
+size_t shard_topology::shard(uint64_t hash) const
+{
+    // remix, so a shard's keys don't share the high hash bits the Bloom
+    // filters pick blocks with
+    uint64_t position = hash * 0x9E3779B97F4A7C15ULL;
+
+    // the first point at or after the key's position, wrapping around
+    std::vector<std::pair<uint64_t, size_t> >::const_iterator it =
+        std::lower_bound(points.begin(), points.end(), position, point_before);
+
+    return it == points.end() ? points.front().second : it->second;
+}
+
+sharded_store::sharded_store(const std::vector<std::string> &shards,
+                             const std::string &path)
+{
+    this->path = path;
+    loaded = 0;
+
+    if (shards.empty())
+    {
+        throw std::invalid_argument("sharded_store needs at least one backend");
+    }
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        if (shards[i].empty() || shards[i].find(',') != std::string::npos ||
+            shards[i].compare(0, 8, "sharded:") == 0)
+        {
+            throw std::invalid_argument("Invalid shard backend: " + shards[i]);
+        }
+    }
+
+    load();
+    if (generations.empty() || generations.back().shards != shards)
+    {
+        std::string line = "topology ";
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            line += (i ? "," : "") + shards[i];
+        }
+        append(line);
+    }
+
+    // the latest generation with these backends; another process may
+    // have appended since
+    current = generations.size() - 1;
+    while (generations[current].shards != shards)
+    {
+        --current;
+    }
+
+    // surface a missing backend now, as bloomd_store does
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        backend(shards[i]);
+    }
+}
+
+void sharded_store::load()
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+
+    // the file is only ever appended to; generations are known by their
+    // position in it
+    if (st.st_size < loaded)
+    {
+        close(fd);
+        throw std::runtime_error("sharded_store: " + path + " was truncated");
+    }
+
+    std::string data(st.st_size - loaded, '\0');
+    ssize_t length = data.empty() ? 0 : pread(fd, &data[0], data.length(), loaded);
+    close(fd);
+    if (length <= 0)
+    {
+        return;
+    }
+
+    // only whole lines; a line being appended is read next time
+    data.resize(length);
+    size_t end = data.rfind('\n');
+    if (end == std::string::npos)
+    {
+        return;
+    }
+    data.resize(end + 1);
+    loaded += data.length();
+
+    std::istringstream lines(data);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        std::istringstream fields(line);
+        std::string kind;
+        std::string value;
+        size_t generation = 0;
+
+        fields >> kind >> value;
+        if (kind == "topology")
+        {
+            std::vector<std::string> shards;
+            std::istringstream names(value);
+            std::string name;
+            while (std::getline(names, name, ','))
+            {
+                shards.push_back(name);
+            }
+            if (!shards.empty())
+            {
+                generations.push_back(shard_topology(shards));
+            }
+        }
+        else if (kind == "filter" && (fields >> generation) &&
+                 generation >= 1 && generation <= generations.size())
+        {
+            written[value].insert(generation - 1);
+        }
+        else if (kind == "drop")
+        {
+            written.erase(value);
+        }
+    }
+}
+
+void sharded_store::append(const std::string &line)
+{
+    // one write() per line, so lines from several processes don't mix
+    std::string data = line + "\n";
+    int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0 || write(fd, data.data(), data.length()) != static_cast<ssize_t>(data.length()))
+    {
+        std::string error = strerror(errno);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        throw std::runtime_error("sharded_store could not write " + path + ": " + error);
+    }
+    close(fd);
+
+    load();
+}
+
+void sharded_store::record(const std::string &filter)
+{
+    std::map<std::string, std::set<size_t> >::iterator it = written.find(filter);
+    if (it != written.end() && it->second.count(current))
+    {
+        return;
+    }
+
+    // another store may have recorded it already
+    load();
+    it = written.find(filter);
+    if (it == written.end() || !it->second.count(current))
+    {
+        append("filter " + filter + " " + std::to_string(current + 1));
+    }
+}
+
+std::set<size_t> sharded_store::filter_generations(const std::string &filter)
+{
+    std::map<std::string, std::set<size_t> >::iterator it = written.find(filter);
+    if (it == written.end())
+    {
+        load();
+        it = written.find(filter);
+    }
+
+    if (it == written.end())
+    {
+        std::set<size_t> generation;
+        generation.insert(current);
+        return generation;
+    }
+
+    return it->second;
+}
+
+filter_store &sharded_store::backend(const std::string &shard)
+{
+    std::shared_ptr<filter_store> &store = stores[shard];
+    if (!store)
+    {
+        store = open_store(shard);
+    }
+
+    return *store;
+}
+
+std::map<std::string, uint64_t> sharded_store::list()
+{
+    load();
+
+    // backends of the current generation and of any that wrote a filter
+    std::set<size_t> in_use;
+    in_use.insert(current);
+    for (std::map<std::string, std::set<size_t> >::iterator it = written.begin(); it != written.end(); ++it)
+    {
+        in_use.insert(it->second.begin(), it->second.end());
+    }
+
+    std::set<std::string> shards;
+    for (std::set<size_t>::iterator g = in_use.begin(); g != in_use.end(); ++g)
+    {
+        shards.insert(generations[*g].shards.begin(), generations[*g].shards.end());
+    }
+
+    std::map<std::string, uint64_t> sizes;
+    for (std::set<std::string>::iterator shard = shards.begin(); shard != shards.end(); ++shard)
+    {
+        std::map<std::string, uint64_t> part = backend(*shard).list();
+        for (std::map<std::string, uint64_t>::iterator it = part.begin(); it != part.end(); ++it)
+        {
+            sizes[it->first] += it->second;
+        }
+    }
+
+    return sizes;
+}
+
+uint64_t sharded_store::info(const std::string &filter)
+{
+    std::set<size_t> used = filter_generations(filter);
+    std::set<std::string> shards;
+    for (std::set<size_t>::iterator g = used.begin(); g != used.end(); ++g)
+    {
+        shards.insert(generations[*g].shards.begin(), generations[*g].shards.end());
+    }
+
+    uint64_t size = 0;
+    for (std::set<std::string>::iterator shard = shards.begin(); shard != shards.end(); ++shard)
+    {
+        size += backend(*shard).info(filter);
+    }
+
+    return size;
+}
+
+void sharded_store::create(const std::string &filter)
+{
+    record(filter);
+
+    const std::vector<std::string> &shards = generations[current].shards;
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        backend(shards[i]).create(filter);
+    }
+}
+
+void sharded_store::create(const std::string &filter,
+                           uint64_t capacity,
+                           double probability)
+{
+    record(filter);
+
+    // keys spread unevenly over the ring; leave each shard some headroom
+    const std::vector<std::string> &shards = generations[current].shards;
+    uint64_t share = capacity / shards.size() * 5 / 4 + 1;
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        backend(shards[i]).create(filter, share, probability);
+    }
+}
+
+bool sharded_store::stats(const std::string &filter,
+                          struct filter_stats &stats)
+{
+    std::set<size_t> used = filter_generations(filter);
+    std::set<std::string> shards;
+    for (std::set<size_t>::iterator g = used.begin(); g != used.end(); ++g)
+    {
+        shards.insert(generations[*g].shards.begin(), generations[*g].shards.end());
+    }
+
+    // a key is checked on one shard per generation, so the rate is the
+    // shards' rates weighted by the keys they hold
+    bool found = false;
+    double weighted = 0;
+    stats.keys = 0;
+    stats.capacity = 0;
+    stats.size = 0;
+    stats.probability = 0;
+    for (std::set<std::string>::iterator shard = shards.begin(); shard != shards.end(); ++shard)
+    {
+        struct filter_stats part;
+        if (backend(*shard).stats(filter, part))
+        {
+            found = true;
+            stats.keys += part.keys;
+            stats.capacity += part.capacity;
+            stats.size += part.size;
+            weighted += part.probability * part.keys;
+        }
+    }
+    if (stats.keys)
+    {
+        stats.probability = weighted / stats.keys;
+    }
+
+    return found;
+}
+
+void sharded_store::drop(const std::string &filter)
+{
+    std::set<size_t> used = filter_generations(filter);
+    std::set<std::string> shards;
+    for (std::set<size_t>::iterator g = used.begin(); g != used.end(); ++g)
+    {
+        shards.insert(generations[*g].shards.begin(), generations[*g].shards.end());
+    }
+
+    for (std::set<std::string>::iterator shard = shards.begin(); shard != shards.end(); ++shard)
+    {
+        backend(*shard).drop(filter);
+    }
+
+    if (written.count(filter))
+    {
+        append("drop " + filter);
+    }
+}
+
+bool sharded_store::archive(const std::string &filter)
+{
+    std::set<size_t> used = filter_generations(filter);
+    std::set<std::string> shards;
+    for (std::set<size_t>::iterator g = used.begin(); g != used.end(); ++g)
+    {
+        shards.insert(generations[*g].shards.begin(), generations[*g].shards.end());
+    }
+
+    bool archived = true;
+    for (std::set<std::string>::iterator shard = shards.begin(); shard != shards.end(); ++shard)
+    {
+        archived = backend(*shard).archive(filter) && archived;
+    }
+
+    return archived;
+}
+
+std::set<size_t> sharded_store::merge_generations(const std::string &filter,
+                                                  const std::vector<std::string> &sources)
+{
+    std::set<size_t> used = filter_generations(filter);
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        std::set<size_t> source = filter_generations(sources[i]);
+        used.insert(source.begin(), source.end());
+    }
+
+    return used;
+}
+
+bool sharded_store::merge(const std::string &filter,
+                          const std::vector<std::string> &sources,
+                          double probability,
+                          double *rate)
+{
+    // a backend that refused after others merged would leave their parts
+    // under no name the caller keeps, so all go ahead or none does
+    if (!merged_rate(filter, sources, rate))
+    {
+        return false;
+    }
+    else if (*rate > probability)
+    {
+        return true;
+    }
+
+    // each backend merges its own part of every source; the merged filter
+    // then holds keys placed by all of their generations
+    std::set<size_t> used = merge_generations(filter, sources);
+    std::set<std::string> shards;
+    for (std::set<size_t>::iterator g = used.begin(); g != used.end(); ++g)
+    {
+        shards.insert(generations[*g].shards.begin(), generations[*g].shards.end());
+    }
+
+    for (std::set<std::string>::iterator shard = shards.begin(); shard != shards.end(); ++shard)
+    {
+        double shard_rate;
+        if (!backend(*shard).merge(filter, sources, probability, &shard_rate))
+        {
+            return false;
+        }
+        *rate = std::max(*rate, shard_rate);
+    }
+
+    for (std::set<size_t>::iterator g = used.begin(); g != used.end(); ++g)
+    {
+        std::map<std::string, std::set<size_t> >::iterator known = written.find(filter);
+        if (known == written.end() || !known->second.count(*g))
+        {
+            append("filter " + filter + " " + std::to_string(*g + 1));
+        }
+    }
+    // a backend that refused still holds its part of the sources
+    for (size_t i = 0; i < sources.size() && *rate <= probability; ++i)
+    {
+        if (written.count(sources[i]))
+        {
+            append("drop " + sources[i]);
+        }
+    }
+
+    return true;
+}
+
+bool sharded_store::merged_rate(const std::string &filter,
+                                const std::vector<std::string> &sources,
+                                double *rate)
+{
+    std::set<size_t> used = merge_generations(filter, sources);
+    std::set<std::string> shards;
+    for (std::set<size_t>::iterator g = used.begin(); g != used.end(); ++g)
+    {
+        shards.insert(generations[*g].shards.begin(), generations[*g].shards.end());
+    }
+
+    *rate = 0;
+    for (std::set<std::string>::iterator shard = shards.begin(); shard != shards.end(); ++shard)
+    {
+        double shard_rate;
+        if (!backend(*shard).merged_rate(filter, sources, &shard_rate))
+        {
+            return false;
+        }
+        *rate = std::max(*rate, shard_rate);
+    }
+
+    return true;
+}
+
+bool sharded_store::can_merge()
+{
+    load();
+
+    for (size_t g = 0; g < generations.size(); ++g)
+    {
+        for (size_t i = 0; i < generations[g].shards.size(); ++i)
+        {
+            if (!backend(generations[g].shards[i]).can_merge())
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+std::map<std::string, uint64_t> sharded_store::archived()
+{
+    // archived filters may be from any generation
+    std::set<std::string> shards;
+    for (size_t g = 0; g < generations.size(); ++g)
+    {
+        shards.insert(generations[g].shards.begin(), generations[g].shards.end());
+    }
+
+    std::map<std::string, uint64_t> sizes;
+    for (std::set<std::string>::iterator shard = shards.begin(); shard != shards.end(); ++shard)
+    {
+        std::map<std::string, uint64_t> part = backend(*shard).archived();
+        for (std::map<std::string, uint64_t>::iterator it = part.begin(); it != part.end(); ++it)
+        {
+            sizes[it->first] += it->second;
+        }
+    }
+
+    return sizes;
+}
+
+bool sharded_store::purge(const std::string &filter,
+                          uint32_t device,
+                          uint64_t *removed)
+{
+    std::set<size_t> used = filter_generations(filter);
+    std::set<std::string> shards;
+    for (std::set<size_t>::iterator g = used.begin(); g != used.end(); ++g)
+    {
+        shards.insert(generations[*g].shards.begin(), generations[*g].shards.end());
+    }
+
+    bool purged = true;
+    *removed = 0;
+    for (std::set<std::string>::iterator shard = shards.begin(); shard != shards.end(); ++shard)
+    {
+        uint64_t part = 0;
+        purged = backend(*shard).purge(filter, device, &part) && purged;
+        *removed += part;
+    }
+
+    return purged;
+}
+
+void sharded_store::set(const std::string &filter,
+                        const key_batch &keys)
+{
+    if (!keys.size())
+    {
+        return;
+    }
+
+    record(filter);
+
+    const shard_topology &topology = generations[current];
+    std::vector<key_batch> parts(topology.shards.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        parts[topology.shard(hash_key(keys.key(i), keys.length(i)))].add(keys.key(i), keys.length(i));
+    }
+
+    for (size_t s = 0; s < parts.size(); ++s)
+    {
+        if (parts[s].size())
+        {
+            backend(topology.shards[s]).set(filter, parts[s]);
+        }
+    }
+}
+
+void sharded_store::check(const std::string &filter,
+                          const key_batch &keys,
+                          std::vector<bool> &found)
+{
+    found.assign(keys.size(), false);
+    if (!keys.size())
+    {
+        return;
+    }
+
+    // each key goes to the backend every generation that wrote the filter
+    // maps it to; usually they agree, and it is checked once
+    std::set<size_t> used = filter_generations(filter);
+    std::map<std::string, std::pair<key_batch, std::vector<size_t> > > parts;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        uint64_t hash = hash_key(keys.key(i), keys.length(i));
+        for (std::set<size_t>::iterator g = used.begin(); g != used.end(); ++g)
+        {
+            const shard_topology &topology = generations[*g];
+            std::pair<key_batch, std::vector<size_t> > &part = parts[topology.shards[topology.shard(hash)]];
+            if (part.second.empty() || part.second.back() != i)
+            {
+                part.first.add(keys.key(i), keys.length(i));
+                part.second.push_back(i);
+            }
+        }
+    }
+
+    std::vector<bool> part_found;
+    for (std::map<std::string, std::pair<key_batch, std::vector<size_t> > >::iterator it = parts.begin(); it != parts.end(); ++it)
+    {
+        backend(it->first).check(filter, it->second.first, part_found);
+        for (size_t j = 0; j < part_found.size(); ++j)
+        {
+            if (part_found[j])
+            {
+                found[it->second.second[j]] = true;
+            }
+        }
+    }
+}
+
+size_t sharded_store::size() const
+{
+    return generations[current].shards.size();
+}
@@ -0,0 +1,235 @@
+//=============================================================================
+//
+// Name:        sharded_store.hpp
+// Authors:     James H. Loving
+// Description: This file declares the sharded_store class, a conn_log
+//              storage backend that spreads every filter's keys over
+//              several backends (ex Bloomd instances) by consistent
+//              hashing. A Bloom filter's keys can't be moved, so adding a
+//              backend doesn't move data: a topology file records which
+//              set of backends (generation) wrote each filter, and a check
+//              asks the backends every such generation maps the key to.
+//
+//=============================================================================
+
+#ifndef SHARDED_STORE_HPP
+#define SHARDED_STORE_HPP
+
+#include <algorithm>      // sort(), upper_bound()
+#include <errno.h>        // errno
+#include <fcntl.h>        // open()
+#include <map>            // filter generations, open backends
+#include <memory>         // shared_ptr
+#include <set>            // generations per filter
+#include <sstream>        // topology parsing
+#include <stdexcept>      // exception handling
+#include <string.h>       // strerror()
+#include <string>         // string class
+#include <sys/stat.h>     // fstat()
+#include <unistd.h>       // close(), read(), write()
+#include <utility>        // pair
+#include <vector>         // shards, ring points
+
+#include "filter_store.hpp"
+#include "../bloom_filter/bloom_filter.hpp"
+
+const char SHARD_TOPOLOGY_FILE[] = "/var/lib/edict/topology.txt";
+                                        /**< backend generations, and which
+                                             ones wrote each filter */
+const unsigned int SHARD_POINTS = 64;   /**< points per backend on the hash
+                                             ring; more spread keys more
+                                             evenly */
+
+/**
+    One set of backends, and the consistent hash ring over them.
+*/
+struct shard_topology
+{
+    std::vector<std::string> shards;    /**< backend names, see open_store() */
+    std::vector<std::pair<uint64_t, size_t> > points;
+                                        /**< ring position, shard index */
+
+    /**
+        Build the ring. A backend's points depend only on its name, so
+        adding one moves about 1/n of the keys, all onto the new one.
+
+        \param shards Backend names.
+    */
+    explicit shard_topology(const std::vector<std::string> &shards);
+
+    /**
+        \param hash 64-bit hash of the key, see hash_key().
+
+        \return Index of the shard holding the key.
+    */
+    size_t shard(uint64_t hash) const;
+};
+
+/**
+    Filters spread over several backends by key. Like bloomd_store, one
+    thread at a time uses a sharded_store; the topology file may be shared
+    by any number of them and of processes.
+*/
+class sharded_store : public filter_store
+{
+    private:
+        std::string path;                           /**< topology file */
+        off_t loaded;                               /**< bytes of it read */
+        std::vector<shard_topology> generations;    /**< oldest first */
+        size_t current;                             /**< generation written */
+        std::map<std::string, std::set<size_t> > written;
+                                                    /**< generations that
+                                                         wrote each filter */
+        std::map<std::string, std::shared_ptr<filter_store> > stores;
+                                                    /**< open backends */
+
+        sharded_store(const sharded_store &);
+        sharded_store &operator=(const sharded_store &);
+
+        /**
+            Read what was appended to the topology file since the last call.
+        */
+        void load();
+
+        /**
+            Append a line to the topology file, then load() it.
+
+            \param line Line, without the newline.
+        */
+        void append(const std::string &line);
+
+        /**
+            Note that the current generation writes a filter.
+
+            \param filter Name of the filter.
+        */
+        void record(const std::string &filter);
+
+        /**
+            \param filter Name of the filter.
+
+            \return Generations that wrote the filter, or the current one
+                if it is unknown.
+        */
+        std::set<size_t> filter_generations(const std::string &filter);
+
+        /**
+            \param filter Name of the filter merged into.
+            \param sources Names of the filters to merge.
+
+            \return Generations that wrote the filter or any source.
+        */
+        std::set<size_t> merge_generations(const std::string &filter,
+                                           const std::vector<std::string> &sources);
+
+        /**
+            \param shard Backend name.
+
+            \return The backend, opened on first use.
+        */
+        filter_store &backend(const std::string &shard);
+
+    public:
+        /**
+            Open the backends, and make them the current generation if the
+            topology file doesn't already end with them.
+
+            \param shards Backend names, see open_store(); not "sharded:".
+            \param path Topology file.
+        */
+        explicit sharded_store(const std::vector<std::string> &shards,
+                               const std::string &path = SHARD_TOPOLOGY_FILE);
+
+        /**
+            List every filter on the backends of any generation still in
+            use, with its size summed over them.
+        */
+        std::map<std::string, uint64_t> list();
+
+        uint64_t info(const std::string &filter);
+
+        void create(const std::string &filter);
+
+        /**
+            Create the filter on every backend of the current generation,
+            each sized for its share of the keys.
+        */
+        void create(const std::string &filter,
+                    uint64_t capacity,
+                    double probability);
+
+        void drop(const std::string &filter);
+
+        /**
+            Sum the filter's stats over every backend that holds part of it.
+        */
+        bool stats(const std::string &filter,
+                   struct filter_stats &stats);
+
+        /**
+            Archive the filter on every backend that holds part of it.
+
+            \return False if any of them can't.
+        */
+        bool archive(const std::string &filter);
+
+        /**
+            Merge on every backend that holds part of the filter or of a
+            source, and record the merged filter under all of their
+            generations. The rate is the highest of theirs, from
+            merged_rate() first, so above the probability no backend
+            merges its part.
+
+            \return False if any of them can't.
+        */
+        bool merge(const std::string &filter,
+                   const std::vector<std::string> &sources,
+                   double probability,
+                   double *rate);
+
+        /**
+            \return The highest rate of the backends that hold part of the
+                filter or of a source; false if any of them can't merge.
+        */
+        bool merged_rate(const std::string &filter,
+                         const std::vector<std::string> &sources,
+                         double *rate);
+
+        /**
+            \return False if a backend of any generation can't merge.
+        */
+        bool can_merge();
+
+        std::map<std::string, uint64_t> archived();
+
+        /**
+            Purge the device from the filter on every backend that holds
+            part of it, adding up the keys removed.
+
+            \return False if any of them can't.
+        */
+        bool purge(const std::string &filter,
+                   uint32_t device,
+                   uint64_t *removed);
+
+        /**
+            Add each key on the backend the current generation maps it to.
+        */
+        void set(const std::string &filter,
+                 const key_batch &keys);
+
+        /**
+            Check each key on the backend of every generation that wrote
+            the filter.
+        */
+        void check(const std::string &filter,
+                   const key_batch &keys,
+                   std::vector<bool> &found);
+
+        /**
+            \return Number of backends in the current generation.
+        */
+        size_t size() const;
+};
+
+#endif
@@ -13,25 +13,25 @@ int main()
 {
     conn_log log;
 
-    std::string mac = "aa:bb:cc:dd:ee:ff";
+    uint32_t device = 1;
 
     std::cout << "\nTest add_ipv4:\n";
 
-    log.add_ipv4(mac, 17500);
+    log.add_ipv4(device, 17500);
 
     std::cout << "\nTest has_ipv4 (should be 10):\n";
 
-    std::cout << log.has_ipv4(mac, 17500, time(nullptr));
-    std::cout << log.has_ipv4(mac, 17, time(nullptr));
+    std::cout << log.has_ipv4(device, 17500, time(nullptr));
+    std::cout << log.has_ipv4(device, 17, time(nullptr));
 
     std::cout << "\n\nTest add_ipv6:\n";
 
-    log.add_ipv6(mac, "::1");
+    log.add_ipv6(device, "::1");
 
     std::cout << "\nTest has_ipv6 (should be 10):\n";
 
-    std::cout << log.has_ipv6(mac, "::1", time(nullptr));
-    std::cout << log.has_ipv6(mac, "::2", time(nullptr));
+    std::cout << log.has_ipv6(device, "::1", time(nullptr));
+    std::cout << log.has_ipv6(device, "::2", time(nullptr));
     
     std::cout << "\n\nTests complete.\n";
 
@@ -0,0 +1,219 @@
+//=============================================================================
+//
+// Name:        cuckoo_filter.cpp
+// Authors:     James H. Loving
+// Description: This file defines the cuckoo_filter class. For additional
+//              documentation, refer to cuckoo_filter.hpp.
+//
+//=============================================================================
+
+#include "cuckoo_filter.hpp"
+
+static const double MAX_LOAD = 0.9;     /**< share of entries optimal_buckets()
+                                             plans to fill; 8-entry buckets
+                                             insert reliably to about 0.95 */
+
+double cuckoo_filter::false_positive_rate(uint64_t keys,
+                                          uint64_t buckets)
+{
+    // every entry in the key's two buckets matches with probability
+    // 2^-32, and then only if it is the same device's
+    double occupied = 2.0 * keys / buckets;
+    if (occupied > 2.0 * BUCKET_ENTRIES)
+    {
+        occupied = 2.0 * BUCKET_ENTRIES;
+    }
+
+    return occupied / 4294967296.0;
+}
+
+uint64_t cuckoo_filter::optimal_buckets(uint64_t capacity)
+{
+    uint64_t buckets = 1;
+    while (buckets * BUCKET_ENTRIES * MAX_LOAD < capacity)
+    {
+        buckets *= 2;
+    }
+
+    return buckets;
+}
+
+uint64_t cuckoo_filter::capacity(uint64_t buckets)
+{
+    return static_cast<uint64_t>(buckets * BUCKET_ENTRIES * MAX_LOAD);
+}
+
+uint64_t cuckoo_filter::make_entry(uint32_t device,
+                                   uint64_t hash)
+{
+    uint32_t fingerprint = static_cast<uint32_t>(hash >> 32);
+
+    return static_cast<uint64_t>(device) << 32 | (fingerprint ? fingerprint : 1);
+}
+
+cuckoo_filter::cuckoo_filter(void *buckets,
+                             uint64_t count)
+{
+    if (!count || (count & (count - 1)))
+    {
+        throw std::invalid_argument("cuckoo_filter: bucket count must be a power of two");
+    }
+
+    this->entries = static_cast<uint64_t *>(buckets);
+    this->bucket_mask = count - 1;
+}
+
+uint64_t cuckoo_filter::first_bucket(uint64_t entry) const
+{
+    uint64_t fingerprint = static_cast<uint32_t>(entry);
+
+    return (fingerprint * 0x9e3779b97f4a7c15ULL >> 32) & bucket_mask;
+}
+
+uint64_t cuckoo_filter::other_bucket(uint64_t bucket,
+                                     uint64_t entry) const
+{
+    // XOR with a hash of the fingerprint, so either bucket leads to the
+    // other without knowing the key
+    uint64_t fingerprint = static_cast<uint32_t>(entry);
+
+    return (bucket ^ (fingerprint * 0xc2b2ae3d27d4eb4fULL >> 32)) & bucket_mask;
+}
+
+int cuckoo_filter::empty_slot(uint64_t bucket) const
+{
+    const uint64_t *slots = entries + bucket * BUCKET_ENTRIES;
+
+    for (size_t i = 0; i < BUCKET_ENTRIES; ++i)
+    {
+        if (!__atomic_load_n(&slots[i], __ATOMIC_ACQUIRE))
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+bool cuckoo_filter::insert(uint64_t entry)
+{
+    if (contains(entry))
+    {
+        return true;
+    }
+
+    uint64_t bucket = first_bucket(entry);
+    int slot = empty_slot(bucket);
+    if (slot < 0)
+    {
+        bucket = other_bucket(bucket, entry);
+        slot = empty_slot(bucket);
+    }
+    if (slot >= 0)
+    {
+        __atomic_store_n(&entries[bucket * BUCKET_ENTRIES + slot], entry, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // both buckets are full: find a chain of entries that can each move to
+    // their other bucket, ending at an empty entry, before moving any
+    std::vector<uint64_t> path;
+    for (unsigned int kick = 0; kick < MAX_KICKS; ++kick)
+    {
+        // a different victim each time round, never one already moving
+        uint64_t index = 0;
+        bool found = false;
+        for (size_t i = 0; i < BUCKET_ENTRIES && !found; ++i)
+        {
+            index = bucket * BUCKET_ENTRIES + (static_cast<uint32_t>(entry) + kick + i) % BUCKET_ENTRIES;
+            found = true;
+            for (size_t p = 0; p < path.size() && found; ++p)
+            {
+                found = path[p] != index;
+            }
+        }
+        if (!found)
+        {
+            return false;
+        }
+        path.push_back(index);
+
+        bucket = other_bucket(bucket, __atomic_load_n(&entries[index], __ATOMIC_ACQUIRE));
+        slot = empty_slot(bucket);
+        if (slot >= 0)
+        {
+            // from the end of the chain, copy each entry to its new place
+            // before overwriting its old one, so it is always somewhere
+            uint64_t to = bucket * BUCKET_ENTRIES + slot;
+            for (size_t p = path.size(); p-- > 0; )
+            {
+                __atomic_store_n(&entries[to], __atomic_load_n(&entries[path[p]], __ATOMIC_ACQUIRE),
+                                 __ATOMIC_RELEASE);
+                to = path[p];
+            }
+            __atomic_store_n(&entries[to], entry, __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool cuckoo_filter::contains(uint64_t entry) const
+{
+    uint64_t first = first_bucket(entry);
+    uint64_t buckets[2] = {first, other_bucket(first, entry)};
+
+    for (size_t b = 0; b < 2; ++b)
+    {
+        const uint64_t *slots = entries + buckets[b] * BUCKET_ENTRIES;
+        for (size_t i = 0; i < BUCKET_ENTRIES; ++i)
+        {
+            if (__atomic_load_n(&slots[i], __ATOMIC_ACQUIRE) == entry)
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+bool cuckoo_filter::remove(uint64_t entry)
+{
+    uint64_t first = first_bucket(entry);
+    uint64_t buckets[2] = {first, other_bucket(first, entry)};
+
+    for (size_t b = 0; b < 2; ++b)
+    {
+        uint64_t *slots = entries + buckets[b] * BUCKET_ENTRIES;
+        for (size_t i = 0; i < BUCKET_ENTRIES; ++i)
+        {
+            if (__atomic_load_n(&slots[i], __ATOMIC_ACQUIRE) == entry)
+            {
+                __atomic_store_n(&slots[i], 0, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+uint64_t cuckoo_filter::purge(uint32_t device)
+{
+    uint64_t count = (bucket_mask + 1) * BUCKET_ENTRIES;
+    uint64_t removed = 0;
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        uint64_t entry = __atomic_load_n(&entries[i], __ATOMIC_ACQUIRE);
+        if (entry && (entry >> 32) == device)
+        {
+            __atomic_store_n(&entries[i], 0, __ATOMIC_RELEASE);
+            ++removed;
+        }
+    }
+
+    return removed;
+}
@@ -0,0 +1,145 @@
+//=============================================================================
+//
+// Name:        cuckoo_filter.hpp
+// Authors:     James H. Loving
+// Description: This file declares the cuckoo_filter class, a bucketed
+//              cuckoo filter over caller-provided memory (ex a memory-
+//              mapped file), used by conn_log's deletable storage backend.
+//              Each key is a 32-bit fingerprint stored next to the ID of
+//              the device it belongs to, in one of two 64-byte buckets, so
+//              a check touches at most two cache lines and every key of a
+//              device can be found, and removed, by ID.
+//
+//=============================================================================
+
+#ifndef CUCKOO_FILTER_HPP
+#define CUCKOO_FILTER_HPP
+
+#include <stddef.h>       // size_t
+#include <stdexcept>      // invalid_argument
+#include <stdint.h>       // uint64_t
+#include <vector>         // eviction path
+
+/**
+    Cuckoo filter over an array of 64-byte buckets it does not own. An
+    entry is one 64-bit word, the device ID above a non-zero fingerprint;
+    0 is empty. Both of an entry's buckets follow from its fingerprint, so
+    entries can be copied into a filter of any size.
+
+    Not thread-safe: callers serialize insert() and remove() between
+    themselves. Entries are moved by copying before overwriting, so a
+    concurrent contains() (ex in another process) never misses a key.
+*/
+class cuckoo_filter
+{
+    private:
+        uint64_t *entries;      /**< buckets, 8 entries each */
+        uint64_t bucket_mask;   /**< number of buckets - 1 */
+
+        /**
+            \return Index of the entry's first bucket.
+        */
+        uint64_t first_bucket(uint64_t entry) const;
+
+        /**
+            \return Index of the entry's other bucket, given one of them.
+        */
+        uint64_t other_bucket(uint64_t bucket,
+                              uint64_t entry) const;
+
+        /**
+            \return Index of an empty entry in a bucket, or -1 if full.
+        */
+        int empty_slot(uint64_t bucket) const;
+
+    public:
+        static const size_t BUCKET_BYTES = 64;      /**< bytes per bucket */
+        static const size_t BUCKET_ENTRIES = 8;     /**< entries per bucket */
+        static const unsigned int MAX_KICKS = 256;  /**< longest eviction path
+                                                         tried before insert()
+                                                         gives up */
+
+        /**
+            Estimate the false positive rate of a filter: a check only
+            matches an entry of the same device, so this is an upper bound.
+
+            \param keys Number of keys in the filter.
+            \param buckets Number of buckets.
+
+            \return Expected false positive rate, 0 to 1.
+        */
+        static double false_positive_rate(uint64_t keys,
+                                           uint64_t buckets);
+
+        /**
+            Compute the number of buckets that holds a capacity at a load
+            inserts reliably reach.
+
+            \param capacity Expected number of keys.
+
+            \return Number of buckets, a power of two.
+        */
+        static uint64_t optimal_buckets(uint64_t capacity);
+
+        /**
+            \param buckets Number of buckets.
+
+            \return Number of keys optimal_buckets() plans that many
+                buckets for.
+        */
+        static uint64_t capacity(uint64_t buckets);
+
+        /**
+            \param device Device ID the key belongs to.
+            \param hash 64-bit hash of the key, see hash_key().
+
+            \return The key's entry.
+        */
+        static uint64_t make_entry(uint32_t device,
+                                   uint64_t hash);
+
+        /**
+            Use existing memory as a cuckoo filter. Zeroed memory is empty.
+
+            \param buckets Pointer to the buckets, 64-byte aligned.
+            \param count Number of buckets, a power of two.
+        */
+        cuckoo_filter(void *buckets,
+                      uint64_t count);
+
+        /**
+            Add an entry, unless the filter already has it.
+
+            \param entry Entry, see make_entry().
+
+            \return False if the filter is too full; it is then unchanged.
+        */
+        bool insert(uint64_t entry);
+
+        /**
+            \param entry Entry, see make_entry().
+
+            \return True if the key may be present, false if it is not.
+        */
+        bool contains(uint64_t entry) const;
+
+        /**
+            Remove an entry.
+
+            \param entry Entry, see make_entry().
+
+            \return False if the filter did not have it.
+        */
+        bool remove(uint64_t entry);
+
+        /**
+            Remove every entry of a device, in one pass over the buckets.
+
+            \param device Device ID.
+
+            \return Number of entries removed.
+        */
+        uint64_t purge(uint32_t device);
+};
+
+#endif
@@ -8,49 +8,126 @@
 //=============================================================================
 
 #include "device_log.hpp"
+#include "../flow_record/flow_record.hpp"
 
 device_log::device_log()
 {
+    registry = std::make_shared<device_registry>();
+
+    // carry the devices of older versions over, once
+    if (!registry->size() && std::ifstream(DEVICE_LOG_FILE).good())
+    {
+        registry->import_csv(DEVICE_LOG_FILE);
+    }
+
     dnt = get_dnt();
-    macs = get_macs();
+    load_table();
 }
 
-void device_log::add_device(std::string mac_address,
-                            std::string make_model)
+device_log::device_log(std::shared_ptr<device_registry> registry)
 {
-    if (current_mac_size < MAX_LOG_SIZE)
-    { 
-        // add the device
-        ++current_log_size;
-        macs.insert(mac_address);
+    this->registry = registry;
+    dnt = get_dnt();
+    load_table();
+}
 
-        std::ofstream outfile;
-        outfile.open(DEVICE_LOG_FILE, std::ios::out | std::ios::app);
+void device_log::load_table()
+{
+    std::vector<struct device_record> records = registry->records();
+    uint64_t mac;
 
-        time_t now;
-        time(&now);
-        char time_buf[sizeof("1111-11-11T11:11:11Z")];
-        strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    table = std::make_shared<device_table>(std::max(DEVICE_TABLE_MAX, records.size() + dnt.size()));
 
-        outfile << time_buf << ",";
-        outfile << mac_address << ",";
-        outfile << make_model << "\n";
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        table->set(records[i].mac, DEVICE_KNOWN, records[i].id);
+    }
 
-        outfile.close();
+    for (std::unordered_set<std::string>::const_iterator it = dnt.begin(); it != dnt.end(); ++it)
+    {
+        if (parse_mac(*it, &mac))
+        {
+            table->set(mac, DEVICE_DNT);
+        }
+    }
+}
 
-        std::cout << "device_log.add_device(" << time_buf << "," << mac_address 
-                  << "," << make_model << ")\n";
+bool device_log::refresh()
+{
+    return registry->refresh();
+}
+
+void device_log::add_device(std::string mac_address,
+                            std::string make_model)
+{
+    uint64_t mac;
+
+    if (!parse_mac(mac_address, &mac))
+    {
+        throw std::invalid_argument("Invalid device_log.add_device(mac_address): "
+                + mac_address);
     }
-    else
+
+    add_device(mac, make_model);
+}
+
+uint32_t device_log::add_device(uint64_t mac,
+                                const std::string &make_model)
+{
+    if (!table->set(mac, DEVICE_KNOWN))
     {
-        // TODO: get a better answer. Delete oldest? Delete newest?
-        throw std::runtime_error("Device_log is at MAX_LOG_SIZE. Please backup to an external source.");
+        throw std::runtime_error("Device_log is tracking DEVICE_TABLE_MAX devices. Please backup to an external source.");
     }
+
+    time_t now;
+    time(&now);
+    char time_buf[sizeof("1111-11-11T11:11:11Z")];
+    strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    uint32_t id = registry->add(mac, make_model, now);
+    table->set(mac, DEVICE_KNOWN, id);
+
+    std::cout << "device_log.add_device(" << time_buf << "," << mac_to_string(mac)
+              << "," << make_model << ")\n";
+
+    return id;
 }
 
 unsigned int device_log::count(std::string mac_address)
 {
-    return macs.count(mac_address);
+    uint64_t mac;
+
+    if (!parse_mac(mac_address, &mac))
+    {
+        return 0;
+    }
+
+    return count(mac);
+}
+
+unsigned int device_log::count(uint64_t mac)
+{
+    return device_id(mac) ? 1 : 0;
+}
+
+uint32_t device_log::device_id(uint64_t mac)
+{
+    uint32_t id;
+    struct device_record record;
+
+    if (table->state(mac, &id) & DEVICE_KNOWN)
+    {
+        return id;
+    }
+
+    // another process may have logged it; this is rare, new devices only
+    if (registry->find(mac, &record))
+    {
+        table->set(mac, DEVICE_KNOWN, record.id);
+        return record.id;
+    }
+
+    return 0;
 }
 
 bool device_log::should_log(std::string mac_address)
@@ -65,25 +142,20 @@ bool device_log::should_log(std::string mac_address)
     }
 }
 
+bool device_log::should_log(uint64_t mac) const
+{
+    return !(table->state(mac) & DEVICE_DNT);
+}
+
 std::unordered_set<std::string> device_log::get_macs()
 {
     std::unordered_set<std::string> mac_addresses;
+    std::vector<struct device_record> records = registry->records();
 
-    std::ifstream infile;
-    infile.open(DEVICE_LOG_FILE, std::ios::in);
-
-    std::string line;
-    while(std::getline(infile,line))
+    for (size_t i = 0; i < records.size(); ++i)
     {
-        std::stringstream lineStream(line);
-        std::string timestamp, mac_address, make_model;
-
-        std::getline(lineStream, timestamp, ',');
-        std::getline(lineStream, mac_address, ',');
-        std::getline(lineStream, make_model, ',');
-
-        mac_addresses.insert(mac_address);
-    }    
+        mac_addresses.insert(mac_to_string(records[i].mac));
+    }
 
     return mac_addresses;
 }
@@ -112,31 +184,17 @@ std::unordered_set<std::string> device_log::get_dnt()
 std::map<std::string, struct device_log_entry> device_log::get_devices()
 {
     std::map<std::string, struct device_log_entry> devices;
+    std::vector<struct device_record> records = registry->records();
 
-    std::ifstream infile;
-    infile.open(DEVICE_LOG_FILE, std::ios::in);
-
-    std::string line;
-    while(std::getline(infile,line))
+    for (size_t i = 0; i < records.size(); ++i)
     {
-        std::stringstream lineStream(line);
-        std::string timestamp, mac_address, make_model;
-
-        std::getline(lineStream, timestamp, ',');
-        std::getline(lineStream, mac_address, ',');
-        std::getline(lineStream, make_model, ',');
-
         struct device_log_entry entry;
-        
-        entry.make_model = make_model;
 
-        struct tm t{};
-        if (strptime(timestamp.c_str(), "%Y-%m-%dT%H:%M:%SZ", &t) != NULL)
-        {
-            entry.first_seen = mktime(&t) + (&t)->tm_gmtoff;
-        }
+        entry.make_model = records[i].make_model;
+        entry.first_seen = records[i].first_seen;
+        entry.id = records[i].id;
 
-        devices.insert(std::pair<std::string, struct device_log_entry>(mac_address, entry));
+        devices.insert(std::pair<std::string, struct device_log_entry>(mac_to_string(records[i].mac), entry));
     }
 
     return devices;
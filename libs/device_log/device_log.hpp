@@ -18,11 +18,15 @@
 #include <string>         // string class
 #include <time.h>         // time(), etc.
 #include <map>
+#include <memory>         // shared_ptr
 #include <unordered_set>
 
+#include "device_registry.hpp"
+#include "device_table.hpp"
+
 const char DEVICE_LOG_FILE[] = "/var/lib/edict/device_log.txt";
-                                        /**< file location to store
-                                             device log entries */
+                                        /**< CSV device log of older
+                                             versions, imported once */
 const char DNT_FILE[] = "/var/lib/edict/do_not_track.txt";
                                         /**< file location to store
                                              DO-NOT-TRACK entries */
@@ -35,6 +39,7 @@ struct device_log_entry
 {
     std::string make_model; /**< Model and manufacturer of device */
     time_t first_seen;      /**< Timestamp of device's initial connection */
+    uint32_t id;            /**< Device ID its connections are logged under */
 };
 
 /**
@@ -43,20 +48,38 @@ struct device_log_entry
 */
 class device_log
 {
-    private:
-        const unsigned int MAX_LOG_SIZE = 1000; /**< max number of devices to log */
-	unsigned int current_log_size;		/**< current number of devices in log */
-
     protected:
-        std::unordered_set<std::string> macs;   /**< cache of stored MACs */
+        std::shared_ptr<device_registry> registry;
+                                                /**< stored devices, shared by copies */
+        std::shared_ptr<device_table> table;    /**< per-packet device states */
         std::unordered_set<std::string> dnt;    /**< cache of DO-NOT-TRACK list */
 
+        /**
+            Fill the device table from the registry and DO-NOT-TRACK list.
+        */
+        void load_table();
+
     public:
         /**
-            Initiate the device_log and MAC cache from file.
+            Open the device registry, importing DEVICE_LOG_FILE into it if
+            it is empty, and read the DO-NOT-TRACK list.
         */
         device_log();
 
+        /**
+            Use an already opened device registry.
+
+            \param registry Device registry to log devices in.
+        */
+        explicit device_log(std::shared_ptr<device_registry> registry);
+
+        /**
+            Pick up devices logged by another process since the last call.
+
+            \return True if the device log changed.
+        */
+        bool refresh();
+
         /**
             Add a device to the log.
 
@@ -67,6 +90,17 @@ class device_log
         void add_device(std::string mac_address,
                         std::string make_model);
 
+        /**
+            Add a device to the log.
+
+            \param mac 48-bit MAC address of device to store, see pack_mac().
+            \param make_model String-encoded info on device's make and model.
+
+            \return The device's ID.
+        */
+        uint32_t add_device(uint64_t mac,
+                            const std::string &make_model);
+
         /**
             Get the number of devices logged under a specified MAC address.
 
@@ -76,6 +110,24 @@ class device_log
         */
         unsigned int count(std::string mac_address);
 
+        /**
+            Get the number of devices logged under a specified MAC address.
+
+            \param mac 48-bit MAC address of device to search, see pack_mac().
+
+            \return Number of devices stored under that MAC address.
+        */
+        unsigned int count(uint64_t mac);
+
+        /**
+            Get the ID a device's connections are logged under.
+
+            \param mac 48-bit MAC address of device to search, see pack_mac().
+
+            \return The device's ID, or 0 if the device isn't logged.
+        */
+        uint32_t device_id(uint64_t mac);
+
         /**
             Determine if a MAC address is on the user's DO-NOT-TRACK list.
 
@@ -86,9 +138,18 @@ class device_log
         bool should_log(std::string mac_address);
 
         /**
-            Recreate the MAC cache from file.
+            Determine if a MAC address is on the user's DO-NOT-TRACK list.
+
+            \param mac 48-bit MAC address of device to check, see pack_mac().
+
+            \return Boolean to identify whether the device should be logged.
+        */
+        bool should_log(uint64_t mac) const;
+
+        /**
+            List the logged MACs.
 
-            \return MAC cache, as an unordered set of String-encoded MACs.
+            \return MACs, as an unordered set of String-encoded MACs.
         */
         std::unordered_set<std::string> get_macs();
         
@@ -100,7 +161,7 @@ class device_log
         std::unordered_set<std::string> get_dnt();
 
         /**
-            Recreate the device log cache from file, especially for easy queries.
+            Build the device log cache from the registry, especially for easy queries.
 
             \return Device log, as a map of MACs to device_log entries.
         */
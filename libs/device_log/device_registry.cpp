@@ -0,0 +1,330 @@
+//=============================================================================
+//
+// Name:        device_registry.cpp
+// Authors:     James H. Loving
+// Description: This file defines the device_registry class. For additional
+//              documentation, refer to device_registry.hpp.
+//
+//=============================================================================
+
+#include "device_registry.hpp"
+#include "../flow_record/flow_record.hpp"
+
+static const char DEVICE_REGISTRY_MAGIC[8] = "EDICTDR";
+static const uint32_t DEVICE_REGISTRY_VERSION = 2;
+
+/**
+    Order records by MAC.
+*/
+static bool record_less(const struct device_record &a,
+                        const struct device_record &b)
+{
+    return a.mac < b.mac;
+}
+
+device_registry::device_registry(const std::string &snapshot_path,
+                                 const std::string &journal_path)
+{
+    this->snapshot_path = snapshot_path;
+    this->journal_path = journal_path;
+    snapshot_fd = -1;
+    snapshot_length = 0;
+    header = NULL;
+    snapshot = NULL;
+    snapshot_inode = 0;
+    journal_offset = 0;
+    next_id = 1;
+
+    journal_fd = open(journal_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal_fd < 0)
+    {
+        throw std::runtime_error("device_registry could not open " + journal_path + ": " + strerror(errno));
+    }
+
+    map_snapshot();
+    read_journal();
+}
+
+device_registry::~device_registry()
+{
+    unmap_snapshot();
+    close(journal_fd);
+}
+
+void device_registry::map_snapshot()
+{
+    unmap_snapshot();
+
+    snapshot_fd = open(snapshot_path.c_str(), O_RDONLY);
+    if (snapshot_fd < 0)
+    {
+        // no devices compacted yet
+        return;
+    }
+
+    struct stat st;
+    fstat(snapshot_fd, &st);
+    snapshot_inode = st.st_ino;
+    snapshot_length = st.st_size;
+
+    void *map = snapshot_length >= sizeof(struct device_registry_header) ?
+        mmap(NULL, snapshot_length, PROT_READ, MAP_SHARED, snapshot_fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED)
+    {
+        close(snapshot_fd);
+        snapshot_fd = -1;
+        throw std::runtime_error("device_registry could not map " + snapshot_path);
+    }
+    header = static_cast<const struct device_registry_header *>(map);
+    snapshot = reinterpret_cast<const struct device_record *>(header + 1);
+
+    if (memcmp(header->magic, DEVICE_REGISTRY_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != DEVICE_REGISTRY_VERSION ||
+        header->record_size != sizeof(struct device_record) ||
+        sizeof(struct device_registry_header) + header->count * sizeof(struct device_record) > snapshot_length)
+    {
+        unmap_snapshot();
+        throw std::runtime_error("device_registry: " + snapshot_path + " is not a valid registry file");
+    }
+
+    // journal records, read after this, can only raise it
+    next_id = header->next_id;
+}
+
+void device_registry::unmap_snapshot()
+{
+    if (header)
+    {
+        munmap(const_cast<struct device_registry_header *>(header), snapshot_length);
+        header = NULL;
+        snapshot = NULL;
+    }
+
+    if (snapshot_fd >= 0)
+    {
+        close(snapshot_fd);
+        snapshot_fd = -1;
+    }
+}
+
+uint64_t device_registry::snapshot_count() const
+{
+    return header ? header->count : 0;
+}
+
+bool device_registry::read_journal()
+{
+    struct stat st;
+    fstat(journal_fd, &st);
+
+    // the journal was emptied by a compaction; start over
+    if (st.st_size < journal_offset)
+    {
+        journal.clear();
+        journal_offset = 0;
+    }
+
+    size_t count = (st.st_size - journal_offset) / sizeof(struct device_record);
+    if (!count)
+    {
+        return false;
+    }
+
+    size_t first = journal.size();
+    journal.resize(first + count);
+    ssize_t bytes = pread(journal_fd, &journal[first], count * sizeof(struct device_record), journal_offset);
+    if (bytes < 0)
+    {
+        bytes = 0;
+    }
+
+    // ignore a record still being written
+    journal.resize(first + bytes / sizeof(struct device_record));
+    journal_offset += (journal.size() - first) * sizeof(struct device_record);
+
+    for (size_t i = first; i < journal.size(); ++i)
+    {
+        next_id = std::max(next_id, journal[i].id + 1);
+    }
+
+    return journal.size() > first;
+}
+
+bool device_registry::refresh()
+{
+    struct stat st;
+    bool changed = false;
+
+    // a compaction renames a new snapshot into place, then empties the journal
+    if (stat(snapshot_path.c_str(), &st) == 0 && (!header || st.st_ino != snapshot_inode))
+    {
+        map_snapshot();
+        journal.clear();
+        journal_offset = 0;
+        changed = true;
+    }
+
+    return read_journal() || changed;
+}
+
+bool device_registry::find(uint64_t mac,
+                           struct device_record *record) const
+{
+    struct device_record key;
+    key.mac = mac;
+
+    const struct device_record *end = snapshot + snapshot_count();
+    const struct device_record *found = std::lower_bound(snapshot, end, key, record_less);
+    if (found != end && found->mac == mac)
+    {
+        if (record)
+        {
+            *record = *found;
+        }
+        return true;
+    }
+
+    for (size_t i = 0; i < journal.size(); ++i)
+    {
+        if (journal[i].mac == mac)
+        {
+            if (record)
+            {
+                *record = journal[i];
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint32_t device_registry::add(uint64_t mac,
+                              const std::string &make_model,
+                              time_t first_seen)
+{
+    struct device_record record;
+    memset(&record, 0, sizeof(record));
+    record.mac = mac;
+    record.first_seen = first_seen;
+    record.id = next_id;
+    strncpy(record.make_model, make_model.c_str(), MAKE_MODEL_LENGTH - 1);
+
+    // O_APPEND makes the one write atomic with respect to readers
+    if (write(journal_fd, &record, sizeof(record)) != sizeof(record))
+    {
+        throw std::runtime_error("device_registry could not write " + journal_path + ": " + strerror(errno));
+    }
+    journal.push_back(record);
+    journal_offset += sizeof(record);
+    ++next_id;
+
+    if (journal.size() >= DEVICE_JOURNAL_LIMIT)
+    {
+        compact();
+    }
+
+    return record.id;
+}
+
+std::vector<struct device_record> device_registry::records() const
+{
+    std::vector<struct device_record> merged(snapshot, snapshot + snapshot_count());
+    merged.insert(merged.end(), journal.begin(), journal.end());
+
+    // a device keeps its first record
+    std::stable_sort(merged.begin(), merged.end(), record_less);
+    std::vector<struct device_record>::iterator last = std::unique(merged.begin(), merged.end(),
+        [](const struct device_record &a, const struct device_record &b) { return a.mac == b.mac; });
+    merged.erase(last, merged.end());
+
+    return merged;
+}
+
+size_t device_registry::size() const
+{
+    return snapshot_count() + journal.size();
+}
+
+void device_registry::compact()
+{
+    std::vector<struct device_record> merged = records();
+
+    struct device_registry_header new_header;
+    memset(&new_header, 0, sizeof(new_header));
+    memcpy(new_header.magic, DEVICE_REGISTRY_MAGIC, sizeof(new_header.magic));
+    new_header.version = DEVICE_REGISTRY_VERSION;
+    new_header.record_size = sizeof(struct device_record);
+    new_header.count = merged.size();
+    new_header.next_id = next_id;
+
+    // write the new snapshot beside the old one, then swap it in
+    std::string temporary = snapshot_path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t length = merged.size() * sizeof(struct device_record);
+    if (fd < 0 ||
+        write(fd, &new_header, sizeof(new_header)) != sizeof(new_header) ||
+        (length && write(fd, merged.data(), length) != static_cast<ssize_t>(length)) ||
+        fsync(fd) < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        unlink(temporary.c_str());
+        throw std::runtime_error("device_registry could not write " + temporary + ": " + strerror(errno));
+    }
+    close(fd);
+
+    if (rename(temporary.c_str(), snapshot_path.c_str()) < 0)
+    {
+        throw std::runtime_error("device_registry could not replace " + snapshot_path + ": " + strerror(errno));
+    }
+
+    // every journal record is in the snapshot now
+    if (ftruncate(journal_fd, 0) < 0)
+    {
+        throw std::runtime_error("device_registry could not empty " + journal_path + ": " + strerror(errno));
+    }
+    journal.clear();
+    journal_offset = 0;
+
+    map_snapshot();
+}
+
+size_t device_registry::import_csv(const std::string &path)
+{
+    std::ifstream infile(path.c_str());
+    std::string line;
+    size_t imported = 0;
+
+    while (std::getline(infile, line))
+    {
+        std::stringstream lineStream(line);
+        std::string timestamp, mac_address, make_model;
+        uint64_t mac;
+
+        std::getline(lineStream, timestamp, ',');
+        std::getline(lineStream, mac_address, ',');
+        std::getline(lineStream, make_model, ',');
+
+        if (!parse_mac(mac_address, &mac) || find(mac, NULL))
+        {
+            continue;
+        }
+
+        time_t first_seen = 0;
+        struct tm t{};
+        if (strptime(timestamp.c_str(), "%Y-%m-%dT%H:%M:%SZ", &t) != NULL)
+        {
+            first_seen = mktime(&t) + (&t)->tm_gmtoff;
+        }
+
+        add(mac, make_model, first_seen);
+        ++imported;
+    }
+
+    compact();
+
+    return imported;
+}
@@ -0,0 +1,196 @@
+//=============================================================================
+//
+// Name:        device_registry.hpp
+// Authors:     James H. Loving
+// Description: This file declares the device_registry class, the on-disk
+//              store behind device_log: fixed-size binary records keyed by
+//              48-bit MAC, each with a dense 32-bit device ID that the
+//              connection store uses in place of the MAC. A sorted snapshot file is memory-mapped and used
+//              as is, new devices are appended to a journal, and the
+//              journal is periodically compacted into a new snapshot.
+//
+//=============================================================================
+
+#ifndef DEVICE_REGISTRY_HPP
+#define DEVICE_REGISTRY_HPP
+
+#include <algorithm>      // sort(), lower_bound()
+#include <errno.h>        // errno
+#include <fcntl.h>        // open()
+#include <fstream>        // CSV import
+#include <sstream>        // CSV import
+#include <stdexcept>      // exception handling
+#include <stdint.h>       // uint64_t
+#include <string.h>       // strerror(), memcpy()
+#include <string>         // string class
+#include <sys/mman.h>     // mmap()
+#include <sys/stat.h>     // fstat()
+#include <time.h>         // time_t, strptime()
+#include <unistd.h>       // pread(), write(), rename()
+#include <vector>         // journal records
+
+const char DEVICE_REGISTRY_FILE[] = "/var/lib/edict/devices.bin";
+                                        /**< snapshot of the device
+                                             registry, sorted by MAC */
+const char DEVICE_JOURNAL_FILE[] = "/var/lib/edict/devices.journal";
+                                        /**< devices added since the
+                                             snapshot */
+const unsigned int DEVICE_JOURNAL_LIMIT = 4096;
+                                        /**< journal records that trigger a
+                                             compaction */
+const size_t MAKE_MODEL_LENGTH = 44;    /**< max make & model length,
+                                             including the '\0' */
+
+/**
+    One device, as stored in the snapshot and journal files.
+*/
+struct device_record
+{
+    uint64_t mac;                       /**< 48-bit MAC, see pack_mac() */
+    int64_t first_seen;                 /**< time_t of first connection */
+    uint32_t id;                        /**< device ID, from 1 up in the
+                                             order devices were added */
+    char make_model[MAKE_MODEL_LENGTH]; /**< null-terminated make & model */
+};
+
+/**
+    Header at the start of the snapshot file.
+*/
+struct device_registry_header
+{
+    char magic[8];          /**< "EDICTDR" + '\0' */
+    uint32_t version;       /**< file format version */
+    uint32_t record_size;   /**< sizeof(struct device_record) */
+    uint64_t count;         /**< records in the snapshot */
+    uint64_t next_id;       /**< ID of the next device added */
+    uint64_t reserved[4];   /**< pads the records to 64 bytes */
+};
+
+/**
+    Binary device registry: a memory-mapped sorted snapshot plus an append
+    journal. One process (the capture process) adds devices; any number
+    may read, calling refresh() to pick up its changes. Not thread-safe.
+*/
+class device_registry
+{
+    private:
+        std::string snapshot_path;          /**< sorted snapshot file */
+        std::string journal_path;           /**< append journal file */
+        int snapshot_fd;                    /**< open snapshot, or -1 */
+        size_t snapshot_length;             /**< mapped length in bytes */
+        const struct device_registry_header *header;
+                                            /**< start of the mapping, or NULL */
+        const struct device_record *snapshot;
+                                            /**< snapshot records, by MAC */
+        ino_t snapshot_inode;               /**< to notice compactions */
+        int journal_fd;                     /**< open journal */
+        off_t journal_offset;               /**< journal bytes read */
+        uint32_t next_id;                   /**< ID of the next device added */
+        std::vector<struct device_record> journal;
+                                            /**< journal records read */
+
+        device_registry(const device_registry &);
+        device_registry &operator=(const device_registry &);
+
+        /**
+            (Re)map the snapshot file, if there is one.
+        */
+        void map_snapshot();
+
+        /**
+            Unmap the snapshot file.
+        */
+        void unmap_snapshot();
+
+        /**
+            Read journal records appended since the last read.
+
+            \return True if any were read.
+        */
+        bool read_journal();
+
+        /**
+            \return Number of records in the snapshot.
+        */
+        uint64_t snapshot_count() const;
+
+    public:
+        /**
+            Open (or create) the registry. Nothing is parsed: the snapshot is
+            mapped and only the journal, at most DEVICE_JOURNAL_LIMIT
+            records, is read.
+
+            \param snapshot_path Path of the snapshot file.
+            \param journal_path Path of the journal file.
+        */
+        device_registry(const std::string &snapshot_path = DEVICE_REGISTRY_FILE,
+                        const std::string &journal_path = DEVICE_JOURNAL_FILE);
+
+        /**
+            Unmap and close the registry files.
+        */
+        ~device_registry();
+
+        /**
+            Pick up devices another process added, and a new snapshot if
+            the registry was compacted.
+
+            \return True if anything changed.
+        */
+        bool refresh();
+
+        /**
+            Look up a device.
+
+            \param mac 48-bit MAC address, see pack_mac().
+            \param record Set to the device's record, if found and not NULL.
+
+            \return True if the device is registered.
+        */
+        bool find(uint64_t mac,
+                  struct device_record *record) const;
+
+        /**
+            Register a device under the next device ID by appending it to
+            the journal, compacting the journal once it reaches
+            DEVICE_JOURNAL_LIMIT records.
+
+            \param mac 48-bit MAC address, see pack_mac().
+            \param make_model Make & model, truncated to MAKE_MODEL_LENGTH - 1.
+            \param first_seen Time_t-encoded timestamp of first connection.
+
+            \return The device's ID.
+        */
+        uint32_t add(uint64_t mac,
+                     const std::string &make_model,
+                     time_t first_seen);
+
+        /**
+            Merge the journal into a new sorted snapshot, replacing the old
+            one atomically, then empty the journal.
+        */
+        void compact();
+
+        /**
+            \return Every registered device, sorted by MAC.
+        */
+        std::vector<struct device_record> records() const;
+
+        /**
+            \return Number of registered devices (journal duplicates of
+                snapshot devices are counted twice until compaction).
+        */
+        size_t size() const;
+
+        /**
+            One-shot import of the old CSV device log
+            ("<timestamp>,<mac>,<make_model>" lines), then compact.
+
+            \param path Path of the CSV file.
+
+            \return Number of devices imported.
+        */
+        size_t import_csv(const std::string &path);
+};
+
+#endif
@@ -0,0 +1,103 @@
+//=============================================================================
+//
+// Name:        device_table.cpp
+// Authors:     James H. Loving
+// Description: This file defines the device_table class. For additional
+//              documentation, refer to device_table.hpp.
+//
+//=============================================================================
+
+#include "device_table.hpp"
+
+static const uint64_t SLOT_OCCUPIED = 1ULL << 63;   /**< marks a used slot */
+static const uint64_t SLOT_MAC = (1ULL << 48) - 1;  /**< MAC bits */
+static const unsigned int SLOT_FLAGS_SHIFT = 48;    /**< flag bits' offset */
+
+device_table::device_table(size_t max_entries)
+{
+    this->max_entries = max_entries;
+    used = 0;
+    slots.assign(DEVICE_TABLE_INITIAL, device_slot());
+    mask = slots.size() - 1;
+}
+
+size_t device_table::probe(uint64_t mac) const
+{
+    // Fibonacci hashing spreads the vendor-prefixed MACs over the table
+    size_t i = (mac * 0x9E3779B97F4A7C15ULL) >> 32 & mask;
+
+    while (slots[i].key && (slots[i].key & SLOT_MAC) != mac)
+    {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+void device_table::grow()
+{
+    std::vector<struct device_slot> old;
+    old.swap(slots);
+
+    slots.assign(old.size() * 2, device_slot());
+    mask = slots.size() - 1;
+
+    for (size_t i = 0; i < old.size(); ++i)
+    {
+        if (old[i].key)
+        {
+            slots[probe(old[i].key & SLOT_MAC)] = old[i];
+        }
+    }
+}
+
+uint8_t device_table::state(uint64_t mac,
+                            uint32_t *id) const
+{
+    const struct device_slot &slot = slots[probe(mac)];
+
+    if (id)
+    {
+        *id = slot.id;
+    }
+
+    return slot.key >> SLOT_FLAGS_SHIFT;
+}
+
+bool device_table::set(uint64_t mac,
+                       uint8_t flags,
+                       uint32_t id)
+{
+    size_t i = probe(mac);
+
+    if (!slots[i].key)
+    {
+        if (used >= max_entries)
+        {
+            return false;
+        }
+
+        // keep at most half the slots in use, so probes stay short
+        if ((used + 1) * 2 > slots.size())
+        {
+            grow();
+            i = probe(mac);
+        }
+
+        slots[i].key = SLOT_OCCUPIED | mac;
+        ++used;
+    }
+
+    slots[i].key |= static_cast<uint64_t>(flags) << SLOT_FLAGS_SHIFT;
+    if (id)
+    {
+        slots[i].id = id;
+    }
+
+    return true;
+}
+
+size_t device_table::size() const
+{
+    return used;
+}
@@ -0,0 +1,104 @@
+//=============================================================================
+//
+// Name:        device_table.hpp
+// Authors:     James H. Loving
+// Description: This file declares the device_table class, device_log's
+//              per-packet view of its devices: a flat open-addressing hash
+//              table from 48-bit MAC to the device's state and ID, so that
+//              deciding whether to log a packet's device, and under which
+//              ID, is one probe into one cache line, with no strings hashed
+//              or allocated.
+//
+//=============================================================================
+
+#ifndef DEVICE_TABLE_HPP
+#define DEVICE_TABLE_HPP
+
+#include <stddef.h>       // size_t
+#include <stdint.h>       // uint64_t
+#include <vector>         // table slots
+
+const size_t DEVICE_TABLE_MAX = 1 << 21;
+                                        /**< max devices tracked, bounding
+                                             the table at 64 MiB */
+const size_t DEVICE_TABLE_INITIAL = 1024;
+                                        /**< slots allocated up front */
+
+const uint8_t DEVICE_KNOWN = 1;         /**< device is in the registry */
+const uint8_t DEVICE_DNT = 2;           /**< device is on DO-NOT-TRACK */
+
+/**
+    One device_table slot.
+*/
+struct device_slot
+{
+    uint64_t key;                       /**< 0, or occupied | flags | MAC */
+    uint32_t id;                        /**< device ID, 0 if none yet */
+    uint32_t reserved;                  /**< pads the slot to 16 bytes */
+};
+
+/**
+    Flat hash table of device states, keyed by 48-bit MAC. Each 16-byte slot
+    holds the MAC, the state flags, an occupied bit and the device ID, so
+    four share a cache line and linear probing rarely leaves the first.
+    Doubles at half full, up to room for max_entries devices. Not
+    thread-safe.
+*/
+class device_table
+{
+    private:
+        std::vector<struct device_slot> slots;
+                                        /**< the table, a power of two */
+        uint64_t mask;                  /**< slots.size() - 1 */
+        size_t used;                    /**< occupied slots */
+        size_t max_entries;             /**< devices allowed */
+
+        /**
+            \return Index of the MAC's slot, or of the empty slot it goes in.
+        */
+        size_t probe(uint64_t mac) const;
+
+        /**
+            Double the table, reinserting every device.
+        */
+        void grow();
+
+    public:
+        /**
+            Create an empty table.
+
+            \param max_entries Max devices to hold, bounding its memory.
+        */
+        explicit device_table(size_t max_entries = DEVICE_TABLE_MAX);
+
+        /**
+            Look up a device's state.
+
+            \param mac 48-bit MAC address, see pack_mac().
+            \param id Set to the device's ID (0 if none), if not NULL.
+
+            \return DEVICE_* flags, 0 if the device isn't in the table.
+        */
+        uint8_t state(uint64_t mac,
+                      uint32_t *id = NULL) const;
+
+        /**
+            Add flags to a device's state, adding the device if needed.
+
+            \param mac 48-bit MAC address, see pack_mac().
+            \param flags DEVICE_* flags to set.
+            \param id Device ID to store, or 0 to keep the current one.
+
+            \return False if the device is new and the table is full.
+        */
+        bool set(uint64_t mac,
+                 uint8_t flags,
+                 uint32_t id = 0);
+
+        /**
+            \return Number of devices in the table.
+        */
+        size_t size() const;
+};
+
+#endif
@@ -0,0 +1,243 @@
+//=============================================================================
+//
+// Name:        flow_record.cpp
+// Authors:     James H. Loving
+// Description: This file defines the functions used to parse packets into
+//              flow records and to format flow records as text. For
+//              additional documentation, refer to flow_record.hpp.
+//
+//=============================================================================
+
+#include "flow_record.hpp"
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+bool parse_flow(const char *payload,
+                int payload_len,
+                const uint8_t *hw_addr,
+                int hw_len,
+                time_t timestamp,
+                struct flow_record *record)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(payload);
+    const uint8_t *transport = NULL;
+    int transport_len = 0;
+
+    memset(record, 0, sizeof(*record));
+    record->mac = pack_mac(hw_addr, hw_len);
+    record->timestamp = timestamp;
+
+    if (!p || payload_len < 1)
+    {
+        return false;
+    }
+
+    record->version = p[0] >> 4;
+
+    if (record->version == 4)
+    {
+        int header_len = (p[0] & 0x0f) << 2;
+        if (payload_len < 20 || header_len < 20 || header_len > payload_len)
+        {
+            return false;
+        }
+
+        record->protocol = p[9];
+        memcpy(record->source_address, p + 12, 4);
+        memcpy(record->dest_address, p + 16, 4);
+
+        // only the first fragment carries the TCP/UDP header
+        if (((p[6] << 8) | p[7]) & 0x1fff)
+        {
+            return true;
+        }
+
+        transport = p + header_len;
+        transport_len = payload_len - header_len;
+    }
+    else if (record->version == 6)
+    {
+        if (payload_len < 40)
+        {
+            return false;
+        }
+
+        // extension headers are not followed; ports stay 0 behind them
+        record->protocol = p[6];
+        memcpy(record->source_address, p + 8, 16);
+        memcpy(record->dest_address, p + 24, 16);
+
+        transport = p + 40;
+        transport_len = payload_len - 40;
+    }
+    else
+    {
+        return false;
+    }
+
+    // TCP, UDP and UDP-Lite all start with source & destination ports
+    if ((record->protocol == IPPROTO_TCP ||
+         record->protocol == IPPROTO_UDP ||
+         record->protocol == IPPROTO_UDPLITE) &&
+        transport_len >= 4)
+    {
+        record->source_port = (transport[0] << 8) | transport[1];
+        record->dest_port = (transport[2] << 8) | transport[3];
+    }
+
+    return true;
+}
+
+uint64_t pack_mac(const uint8_t *hw_addr,
+                  int hw_len)
+{
+    uint64_t mac = 0;
+
+    if (!hw_addr)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < hw_len && i < 6; ++i)
+    {
+        mac = (mac << 8) | hw_addr[i];
+    }
+
+    return mac;
+}
+
+bool parse_mac(const std::string &mac_address,
+               uint64_t *mac)
+{
+    uint64_t value = 0;
+
+    if (mac_address.length() != 12)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < 12; ++i)
+    {
+        char c = mac_address[i];
+
+        if (c >= '0' && c <= '9')
+        {
+            value = (value << 4) | (c - '0');
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            value = (value << 4) | (c - 'a' + 10);
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    *mac = value;
+    return true;
+}
+
+char *format_mac(uint64_t mac,
+                 char *out)
+{
+    for (int i = 11; i >= 0; --i)
+    {
+        out[i] = HEX_DIGITS[mac & 0xf];
+        mac >>= 4;
+    }
+    out[12] = '\0';
+
+    return out + 12;
+}
+
+char *format_uint(uint64_t value,
+                  char *out)
+{
+    char digits[20];
+    int n = 0;
+
+    do
+    {
+        digits[n++] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+
+    while (n)
+    {
+        *out++ = digits[--n];
+    }
+    *out = '\0';
+
+    return out;
+}
+
+char *format_address(uint8_t version,
+                     const uint8_t *address,
+                     char *out)
+{
+    if (!inet_ntop(version == 6 ? AF_INET6 : AF_INET, address, out, INET6_ADDRSTRLEN))
+    {
+        out[0] = '\0';
+    }
+
+    return out + strlen(out);
+}
+
+char *format_hex(const char *data,
+                 size_t length,
+                 char *out)
+{
+    for (size_t i = 0; i < length; ++i)
+    {
+        uint8_t byte = data[i];
+        *out++ = HEX_DIGITS[byte >> 4];
+        *out++ = HEX_DIGITS[byte & 0xf];
+    }
+    *out = '\0';
+
+    return out;
+}
+
+/**
+    Write a device ID big-endian, so keys sort and print by device.
+*/
+static inline char *pack_device(uint32_t device,
+                                char *out)
+{
+    out[0] = device >> 24;
+    out[1] = device >> 16;
+    out[2] = device >> 8;
+    out[3] = device;
+
+    return out + 4;
+}
+
+char *pack_key_ipv4(uint32_t device,
+                    uint16_t port,
+                    char *out)
+{
+    out = pack_device(device, out);
+    out[0] = port >> 8;
+    out[1] = port & 0xff;
+
+    return out + 2;
+}
+
+char *pack_key_ipv6(uint32_t device,
+                    const uint8_t *address,
+                    char *out)
+{
+    out = pack_device(device, out);
+    memcpy(out, address, 16);
+
+    return out + 16;
+}
+
+std::string mac_to_string(uint64_t mac)
+{
+    char buf[MAC_STRLEN];
+    format_mac(mac, buf);
+
+    return std::string(buf, 12);
+}
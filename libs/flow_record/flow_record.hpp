@@ -0,0 +1,170 @@
+//=============================================================================
+//
+// Name:        flow_record.hpp
+// Authors:     James H. Loving
+// Description: This file declares the flow_record structure, a fixed-size
+//              binary summary of a logged packet, along with the functions
+//              used to parse packets into flow records and to convert flow
+//              records to text only when they need to be printed.
+//
+//=============================================================================
+
+#ifndef FLOW_RECORD_HPP
+#define FLOW_RECORD_HPP
+
+#include <arpa/inet.h>    // inet_ntop()
+#include <netinet/in.h>   // IPPROTO_*
+#include <stddef.h>       // size_t
+#include <stdint.h>       // int vars of atypical size (16b, 48b, 64b)
+#include <string.h>       // memcpy(), memset()
+#include <string>         // string class
+#include <time.h>         // time_t
+
+const size_t MAC_STRLEN = 13;           /**< 12 hex chars + '\0' */
+const size_t FLOW_KEY_BYTES = 20;       /**< longest binary flow key, a
+                                             device ID and IPv6 address */
+
+/**
+    Fixed-size, allocation-free summary of a logged packet. Addresses and
+    ports are kept in binary; use the format_* functions to print them.
+*/
+struct flow_record
+{
+    uint64_t mac;                   /**< 48-bit source MAC, in the low bits */
+    time_t timestamp;               /**< time the packet was logged */
+    uint8_t source_address[16];     /**< source IP (IPv4 in first 4 bytes) */
+    uint8_t dest_address[16];       /**< dest IP (IPv4 in first 4 bytes) */
+    uint16_t source_port;           /**< TCP/UDP source port, host order */
+    uint16_t dest_port;             /**< TCP/UDP dest port, host order */
+    uint8_t version;                /**< IP version, 4 or 6 */
+    uint8_t protocol;               /**< IP protocol, ex IPPROTO_TCP */
+    uint32_t device;                /**< device ID, set by log_packet() */
+};
+
+/**
+    Parse a raw IPv4/IPv6 packet into a flow record, without allocating.
+
+    \param payload Pointer to the packet, starting at the IP header.
+    \param payload_len Length of the packet in bytes.
+    \param hw_addr Pointer to the source hardware address, or NULL.
+    \param hw_len Length of the hardware address in bytes.
+    \param timestamp Time_t-encoded timestamp to store in the record.
+    \param record Flow record to fill.
+
+    \return True if the packet was a well-formed IPv4/IPv6 packet.
+*/
+bool parse_flow(const char *payload,
+                int payload_len,
+                const uint8_t *hw_addr,
+                int hw_len,
+                time_t timestamp,
+                struct flow_record *record);
+
+/**
+    Pack a hardware address into a 48-bit integer MAC.
+
+    \param hw_addr Pointer to the hardware address, or NULL.
+    \param hw_len Length of the hardware address in bytes (max 6 used).
+
+    \return 48-bit MAC in the low bits of a uint64_t (0 if no address).
+*/
+uint64_t pack_mac(const uint8_t *hw_addr,
+                  int hw_len);
+
+/**
+    Parse a 12-char, lowercase hex MAC (ex "aabbccddeeff") into an integer.
+
+    \param mac_address String-encoded MAC address.
+    \param mac Output 48-bit MAC.
+
+    \return True if mac_address was valid. See conn_log::valid_mac.
+*/
+bool parse_mac(const std::string &mac_address,
+               uint64_t *mac);
+
+/**
+    Write a 48-bit MAC as 12 lowercase hex chars.
+
+    \param mac 48-bit MAC.
+    \param out Output buffer, at least MAC_STRLEN bytes. Null-terminated.
+
+    \return Pointer to the terminating '\0' in out.
+*/
+char *format_mac(uint64_t mac,
+                 char *out);
+
+/**
+    Write an unsigned integer in decimal.
+
+    \param value Value to write.
+    \param out Output buffer, at least 21 bytes. Null-terminated.
+
+    \return Pointer to the terminating '\0' in out.
+*/
+char *format_uint(uint64_t value,
+                  char *out);
+
+/**
+    Write an IPv4 or IPv6 address from a flow record in presentation format.
+
+    \param version IP version, 4 or 6.
+    \param address Pointer to the binary address.
+    \param out Output buffer, at least INET6_ADDRSTRLEN bytes.
+
+    \return Pointer to the terminating '\0' in out.
+*/
+char *format_address(uint8_t version,
+                     const uint8_t *address,
+                     char *out);
+
+/**
+    Write bytes as lowercase hex, 2 chars per byte.
+
+    \param data Pointer to the bytes.
+    \param length Number of bytes.
+    \param out Output buffer, at least 2 * length + 1 bytes. Null-terminated.
+
+    \return Pointer to the terminating '\0' in out.
+*/
+char *format_hex(const char *data,
+                 size_t length,
+                 char *out);
+
+/**
+    Write the binary conn_log key for an IPv4 connection: the device ID and
+    source port, big-endian (6 bytes).
+
+    \param device Device ID, see device_registry.
+    \param port TCP/UDP source port.
+    \param out Output buffer, at least FLOW_KEY_BYTES bytes.
+
+    \return Pointer past the end of the key in out.
+*/
+char *pack_key_ipv4(uint32_t device,
+                    uint16_t port,
+                    char *out);
+
+/**
+    Write the binary conn_log key for an IPv6 connection: the device ID,
+    big-endian, and the source address (20 bytes).
+
+    \param device Device ID, see device_registry.
+    \param address Pointer to the 16-byte binary IPv6 source address.
+    \param out Output buffer, at least FLOW_KEY_BYTES bytes.
+
+    \return Pointer past the end of the key in out.
+*/
+char *pack_key_ipv6(uint32_t device,
+                    const uint8_t *address,
+                    char *out);
+
+/**
+    Convenience wrapper around format_mac() for printing.
+
+    \param mac 48-bit MAC.
+
+    \return String-encoded MAC address.
+*/
+std::string mac_to_string(uint64_t mac);
+
+#endif
@@ -0,0 +1,132 @@
+//=============================================================================
+//
+// Name:        flow_spool.cpp
+// Authors:     James H. Loving
+// Description: This file defines the flow_spool class. For additional
+//              documentation, refer to flow_spool.hpp.
+//
+//=============================================================================
+
+#include "flow_spool.hpp"
+
+static const char FLOW_SPOOL_MAGIC[8] = "EDICTSP";
+static const uint32_t FLOW_SPOOL_VERSION = 1;
+
+flow_spool::flow_spool(const std::string &path,
+                       uint64_t capacity)
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("flow_spool could not open " + path + ": " + strerror(errno));
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    bool fresh = st.st_size == 0;
+
+    length = fresh ? sizeof(struct flow_spool_header) + capacity * sizeof(struct flow_record) : st.st_size;
+
+    // a new file is sized up front; it stays sparse until records arrive
+    if (fresh && ftruncate(fd, length) < 0)
+    {
+        close(fd);
+        throw std::runtime_error("flow_spool could not size " + path + ": " + strerror(errno));
+    }
+
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        throw std::runtime_error("flow_spool could not map " + path + ": " + strerror(errno));
+    }
+    header = static_cast<struct flow_spool_header *>(map);
+    records = reinterpret_cast<struct flow_record *>(header + 1);
+
+    if (fresh)
+    {
+        memcpy(header->magic, FLOW_SPOOL_MAGIC, sizeof(header->magic));
+        header->version = FLOW_SPOOL_VERSION;
+        header->record_size = sizeof(struct flow_record);
+        header->capacity = capacity;
+    }
+    else if (memcmp(header->magic, FLOW_SPOOL_MAGIC, sizeof(header->magic)) != 0 ||
+             header->version != FLOW_SPOOL_VERSION ||
+             header->record_size != sizeof(struct flow_record) ||
+             !header->capacity || header->tail > header->head ||
+             header->head - header->tail > header->capacity ||
+             sizeof(struct flow_spool_header) + header->capacity * sizeof(struct flow_record) > length)
+    {
+        munmap(map, length);
+        close(fd);
+        throw std::runtime_error("flow_spool: " + path + " is not a valid spool file");
+    }
+}
+
+flow_spool::~flow_spool()
+{
+    munmap(header, length);
+    close(fd);
+}
+
+bool flow_spool::push(const struct flow_record &flow)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (header->head - header->tail >= header->capacity)
+    {
+        ++header->drops;
+        return false;
+    }
+
+    records[header->head % header->capacity] = flow;
+    __atomic_store_n(&header->head, header->head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+size_t flow_spool::peek(struct flow_record *flows,
+                        size_t max)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    size_t count = std::min<uint64_t>(max, header->head - header->tail);
+    for (size_t i = 0; i < count; ++i)
+    {
+        flows[i] = records[(header->tail + i) % header->capacity];
+    }
+
+    return count;
+}
+
+void flow_spool::pop(size_t count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    count = std::min<uint64_t>(count, header->head - header->tail);
+    __atomic_store_n(&header->tail, header->tail + count, __ATOMIC_RELEASE);
+}
+
+uint64_t flow_spool::depth() const
+{
+    uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&header->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+time_t flow_spool::age(time_t now)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (header->head == header->tail)
+    {
+        return 0;
+    }
+
+    return now - records[header->tail % header->capacity].timestamp;
+}
+
+uint64_t flow_spool::drops() const
+{
+    return __atomic_load_n(&header->drops, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,132 @@
+//=============================================================================
+//
+// Name:        flow_spool.hpp
+// Authors:     James H. Loving
+// Description: This file declares the flow_spool class, a write-ahead spool
+//              of flow records in a memory-mapped ring file. The storage
+//              threads spool the flows they could not store while the
+//              backend is failing or restarting, the capture thread the
+//              flows a full flow ring turned away, and a replayer stores
+//              them later, in order and under their original timestamps.
+//              The spool survives a restart of EDICT.
+//
+//=============================================================================
+
+#ifndef FLOW_SPOOL_HPP
+#define FLOW_SPOOL_HPP
+
+#include <algorithm>      // min()
+#include <atomic>         // lock-free depth
+#include <errno.h>        // errno
+#include <fcntl.h>        // open()
+#include <mutex>          // guards the ring
+#include <stdexcept>      // exception handling
+#include <stdint.h>       // uint64_t
+#include <string.h>       // strerror(), memcpy()
+#include <string>         // string class
+#include <sys/mman.h>     // mmap()
+#include <sys/stat.h>     // fstat()
+#include <time.h>         // time_t
+#include <unistd.h>       // close(), ftruncate()
+
+#include "../flow_record/flow_record.hpp"
+
+const char SPOOL_FILE[] = "/var/lib/edict/spool.bin";
+                                        /**< spooled flow records */
+const uint64_t SPOOL_CAPACITY = 1 << 20;/**< records the spool holds
+                                             (64 MiB) before dropping */
+
+/**
+    Header at the start of the spool file. head and tail only ever grow;
+    records live at their position modulo capacity.
+*/
+struct flow_spool_header
+{
+    char magic[8];          /**< "EDICTSP" + '\0' */
+    uint32_t version;       /**< file format version */
+    uint32_t record_size;   /**< sizeof(struct flow_record) */
+    uint64_t capacity;      /**< number of records */
+    uint64_t head;          /**< records ever spooled */
+    uint64_t tail;          /**< records ever replayed */
+    uint64_t drops;         /**< records dropped, the spool being full */
+    uint64_t reserved[2];   /**< pads the records to 64 bytes */
+};
+
+/**
+    Bounded FIFO of flow records in a memory-mapped file. Any number of
+    threads may spool; one replayer takes records out. depth() is lock-free
+    so the storage threads can check it per flow.
+*/
+class flow_spool
+{
+    private:
+        int fd;                             /**< open spool file */
+        size_t length;                      /**< mapped length in bytes */
+        struct flow_spool_header *header;   /**< start of the mapping */
+        struct flow_record *records;        /**< the ring */
+        std::mutex lock;                    /**< guards the ring */
+
+        flow_spool(const flow_spool &);
+        flow_spool &operator=(const flow_spool &);
+
+    public:
+        /**
+            Open (or create) and map a spool file, keeping what it holds.
+
+            \param path Path of the spool file.
+            \param capacity Records a new spool file holds.
+        */
+        explicit flow_spool(const std::string &path = SPOOL_FILE,
+                            uint64_t capacity = SPOOL_CAPACITY);
+
+        /**
+            Unmap and close the spool file.
+        */
+        ~flow_spool();
+
+        /**
+            Spool a flow record, or drop it if the spool is full.
+
+            \param flow Flow record to spool.
+
+            \return False if the record was dropped.
+        */
+        bool push(const struct flow_record &flow);
+
+        /**
+            Copy out the oldest records, leaving them spooled.
+
+            \param flows Output buffer.
+            \param max Max records to copy.
+
+            \return Number of records copied.
+        */
+        size_t peek(struct flow_record *flows,
+                    size_t max);
+
+        /**
+            Remove the oldest records, once they are stored.
+
+            \param count Number of records, at most what peek() returned.
+        */
+        void pop(size_t count);
+
+        /**
+            \return Number of records spooled.
+        */
+        uint64_t depth() const;
+
+        /**
+            \param now Current time.
+
+            \return Age of the oldest record in seconds, 0 if empty.
+        */
+        time_t age(time_t now);
+
+        /**
+            \return Number of records ever dropped, the spool being full.
+        */
+        uint64_t drops() const;
+};
+
+#endif
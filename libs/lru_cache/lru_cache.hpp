@@ -0,0 +1,152 @@
+//=============================================================================
+//
+// Name:        lru_cache.hpp
+// Authors:     James H. Loving
+// Description: This file declares and defines the lru_cache class, a
+//              bounded map that evicts its least recently used entry when
+//              full. edict serve keeps recent query results in one. Any
+//              number of threads may use it concurrently.
+//
+//=============================================================================
+
+#ifndef LRU_CACHE_HPP
+#define LRU_CACHE_HPP
+
+#include <list>           // recency order
+#include <mutex>          // guards the cache
+#include <stddef.h>       // size_t
+#include <stdint.h>       // uint64_t
+#include <unordered_map>  // lookup by key
+#include <utility>        // pair
+
+/**
+    Bounded, thread-safe map evicting the least recently used entry.
+*/
+template <typename K, typename V>
+class lru_cache
+{
+    private:
+        typedef std::list<std::pair<K, V> > entry_list;
+
+        size_t capacity;                /**< max entries */
+        std::mutex lock;                /**< guards everything below */
+        entry_list entries;             /**< most recently used first */
+        std::unordered_map<K, typename entry_list::iterator> index;
+                                        /**< entries, by key */
+        uint64_t hit_count;             /**< lookups found */
+        uint64_t miss_count;            /**< lookups not found */
+
+        lru_cache(const lru_cache &);
+        lru_cache &operator=(const lru_cache &);
+
+    public:
+        /**
+            \param capacity Max number of entries.
+        */
+        explicit lru_cache(size_t capacity)
+        {
+            this->capacity = capacity ? capacity : 1;
+            hit_count = 0;
+            miss_count = 0;
+        }
+
+        /**
+            Look up an entry, marking it most recently used.
+
+            \param key Key to look up.
+            \param value Set to the entry's value, if found.
+
+            \return True if the key was found.
+        */
+        bool get(const K &key,
+                 V &value)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            typename std::unordered_map<K, typename entry_list::iterator>::iterator it = index.find(key);
+            if (it == index.end())
+            {
+                ++miss_count;
+                return false;
+            }
+
+            entries.splice(entries.begin(), entries, it->second);
+            value = it->second->second;
+            ++hit_count;
+
+            return true;
+        }
+
+        /**
+            Add or replace an entry, evicting the least recently used
+            entry if the cache is full.
+
+            \param key Key of the entry.
+            \param value Value of the entry.
+        */
+        void put(const K &key,
+                 const V &value)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            typename std::unordered_map<K, typename entry_list::iterator>::iterator it = index.find(key);
+            if (it != index.end())
+            {
+                it->second->second = value;
+                entries.splice(entries.begin(), entries, it->second);
+                return;
+            }
+
+            if (entries.size() >= capacity)
+            {
+                index.erase(entries.back().first);
+                entries.pop_back();
+            }
+
+            entries.push_front(std::make_pair(key, value));
+            index[key] = entries.begin();
+        }
+
+        /**
+            Remove every entry.
+        */
+        void clear()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            entries.clear();
+            index.clear();
+        }
+
+        /**
+            \return Number of entries.
+        */
+        size_t size()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            return entries.size();
+        }
+
+        /**
+            \return Number of lookups that found their key.
+        */
+        uint64_t hits()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            return hit_count;
+        }
+
+        /**
+            \return Number of lookups that did not find their key.
+        */
+        uint64_t misses()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            return miss_count;
+        }
+};
+
+#endif
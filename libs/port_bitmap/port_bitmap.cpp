@@ -0,0 +1,294 @@
+//=============================================================================
+//
+// Name:        port_bitmap.cpp
+// Authors:     James H. Loving
+// Description: This file defines the port_bitmap class. For additional
+//              documentation, refer to port_bitmap.hpp.
+//
+//=============================================================================
+
+#include "port_bitmap.hpp"
+
+port_bitmap::port_bitmap()
+{
+    count = 0;
+}
+
+void port_bitmap::convert()
+{
+    if (bits.empty() && count > ARRAY_MAX)
+    {
+        bits.assign(BITSET_WORDS, 0);
+        for (size_t i = 0; i < array.size(); ++i)
+        {
+            bits[array[i] >> 6] |= 1ULL << (array[i] & 63);
+        }
+        std::vector<uint16_t>().swap(array);
+    }
+    else if (!bits.empty() && count <= ARRAY_MAX)
+    {
+        array.reserve(count);
+        for (size_t word = 0; word < BITSET_WORDS; ++word)
+        {
+            for (uint64_t w = bits[word]; w; w &= w - 1)
+            {
+                array.push_back(static_cast<uint16_t>(word << 6 | __builtin_ctzll(w)));
+            }
+        }
+        std::vector<uint64_t>().swap(bits);
+    }
+}
+
+bool port_bitmap::add(uint16_t port)
+{
+    if (!bits.empty())
+    {
+        uint64_t bit = 1ULL << (port & 63);
+        if (bits[port >> 6] & bit)
+        {
+            return false;
+        }
+        bits[port >> 6] |= bit;
+        ++count;
+        return true;
+    }
+
+    std::vector<uint16_t>::iterator it = std::lower_bound(array.begin(), array.end(), port);
+    if (it != array.end() && *it == port)
+    {
+        return false;
+    }
+    array.insert(it, port);
+    ++count;
+    convert();
+
+    return true;
+}
+
+void port_bitmap::add_range(uint16_t first,
+                            uint16_t last)
+{
+    port_bitmap range;
+
+    if (first > last)
+    {
+        return;
+    }
+
+    // a wide range goes straight to a bitset, a narrow one to an array
+    range.count = last - first + 1;
+    if (range.count > ARRAY_MAX)
+    {
+        range.bits.assign(BITSET_WORDS, 0);
+        for (uint32_t port = first; port <= last; ++port)
+        {
+            range.bits[port >> 6] |= 1ULL << (port & 63);
+        }
+    }
+    else
+    {
+        for (uint32_t port = first; port <= last; ++port)
+        {
+            range.array.push_back(static_cast<uint16_t>(port));
+        }
+    }
+
+    merge(range);
+}
+
+bool port_bitmap::contains(uint16_t port) const
+{
+    if (!bits.empty())
+    {
+        return bits[port >> 6] & (1ULL << (port & 63));
+    }
+
+    return std::binary_search(array.begin(), array.end(), port);
+}
+
+size_t port_bitmap::cardinality() const
+{
+    return count;
+}
+
+void port_bitmap::merge(const port_bitmap &other)
+{
+    if (bits.empty() && other.bits.empty() && count + other.count <= ARRAY_MAX)
+    {
+        std::vector<uint16_t> both;
+        both.reserve(count + other.count);
+        std::set_union(array.begin(), array.end(), other.array.begin(), other.array.end(),
+                       std::back_inserter(both));
+        array.swap(both);
+        count = array.size();
+        return;
+    }
+
+    // the union may still fit an array if the sets overlap
+    if (bits.empty())
+    {
+        bits.assign(BITSET_WORDS, 0);
+        for (size_t i = 0; i < array.size(); ++i)
+        {
+            bits[array[i] >> 6] |= 1ULL << (array[i] & 63);
+        }
+        std::vector<uint16_t>().swap(array);
+    }
+    if (other.bits.empty())
+    {
+        for (size_t i = 0; i < other.array.size(); ++i)
+        {
+            bits[other.array[i] >> 6] |= 1ULL << (other.array[i] & 63);
+        }
+    }
+    else
+    {
+        for (size_t word = 0; word < BITSET_WORDS; ++word)
+        {
+            bits[word] |= other.bits[word];
+        }
+    }
+
+    count = 0;
+    for (size_t word = 0; word < BITSET_WORDS; ++word)
+    {
+        count += __builtin_popcountll(bits[word]);
+    }
+    convert();
+}
+
+bool port_bitmap::intersects(const port_bitmap &other) const
+{
+    if (!bits.empty() && !other.bits.empty())
+    {
+        for (size_t word = 0; word < BITSET_WORDS; ++word)
+        {
+            if (bits[word] & other.bits[word])
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    else if (!bits.empty() || !other.bits.empty())
+    {
+        // probe the bitset with each port of the array
+        const port_bitmap &small = bits.empty() ? *this : other;
+        const port_bitmap &large = bits.empty() ? other : *this;
+        for (size_t i = 0; i < small.array.size(); ++i)
+        {
+            if (large.contains(small.array[i]))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // two arrays: walk both in order
+    for (size_t i = 0, j = 0; i < array.size() && j < other.array.size(); )
+    {
+        if (array[i] == other.array[j])
+        {
+            return true;
+        }
+        else if (array[i] < other.array[j])
+        {
+            ++i;
+        }
+        else
+        {
+            ++j;
+        }
+    }
+
+    return false;
+}
+
+bool port_bitmap::intersects(uint16_t first,
+                             uint16_t last) const
+{
+    if (first > last)
+    {
+        return false;
+    }
+
+    if (bits.empty())
+    {
+        std::vector<uint16_t>::const_iterator it = std::lower_bound(array.begin(), array.end(), first);
+        return it != array.end() && *it <= last;
+    }
+
+    // whole words between the partial first and last ones
+    size_t first_word = first >> 6;
+    size_t last_word = last >> 6;
+    uint64_t first_mask = ~0ULL << (first & 63);
+    uint64_t last_mask = ~0ULL >> (63 - (last & 63));
+    if (first_word == last_word)
+    {
+        return bits[first_word] & first_mask & last_mask;
+    }
+    if ((bits[first_word] & first_mask) || (bits[last_word] & last_mask))
+    {
+        return true;
+    }
+    for (size_t word = first_word + 1; word < last_word; ++word)
+    {
+        if (bits[word])
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void port_bitmap::write(std::string &out) const
+{
+    uint32_t ports = static_cast<uint32_t>(count);
+
+    out.append(reinterpret_cast<const char *>(&ports), sizeof(ports));
+    if (bits.empty())
+    {
+        out.append(reinterpret_cast<const char *>(array.data()), array.size() * sizeof(uint16_t));
+    }
+    else
+    {
+        out.append(reinterpret_cast<const char *>(bits.data()), BITSET_WORDS * sizeof(uint64_t));
+    }
+}
+
+size_t port_bitmap::read(const char *data,
+                         size_t length)
+{
+    uint32_t ports;
+
+    if (length < sizeof(ports))
+    {
+        return 0;
+    }
+    memcpy(&ports, data, sizeof(ports));
+
+    // the number of ports decides the container, as in write()
+    size_t bytes = ports > ARRAY_MAX ? BITSET_WORDS * sizeof(uint64_t) : ports * sizeof(uint16_t);
+    if (ports > 65536 || length - sizeof(ports) < bytes)
+    {
+        return 0;
+    }
+
+    count = ports;
+    if (ports > ARRAY_MAX)
+    {
+        std::vector<uint16_t>().swap(array);
+        bits.resize(BITSET_WORDS);
+        memcpy(bits.data(), data + sizeof(ports), bytes);
+    }
+    else
+    {
+        std::vector<uint64_t>().swap(bits);
+        array.resize(ports);
+        memcpy(array.data(), data + sizeof(ports), bytes);
+    }
+
+    return sizeof(ports) + bytes;
+}
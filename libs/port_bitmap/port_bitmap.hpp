@@ -0,0 +1,126 @@
+//=============================================================================
+//
+// Name:        port_bitmap.hpp
+// Authors:     James H. Loving
+// Description: This file declares the port_bitmap class, an exact set of
+//              16-bit TCP/UDP ports stored like one roaring bitmap
+//              container: a sorted array while the set is small, a 65536-
+//              bit bitset once that is smaller. conn_log's exact port index
+//              keeps one per device per minute, and answers port range and
+//              port set queries by intersecting them.
+//
+//=============================================================================
+
+#ifndef PORT_BITMAP_HPP
+#define PORT_BITMAP_HPP
+
+#include <algorithm>      // lower_bound(), set_union()
+#include <iterator>       // back_inserter()
+#include <stddef.h>       // size_t
+#include <stdint.h>       // uint16_t, uint64_t
+#include <string.h>       // memcpy()
+#include <string>         // serialized bitmaps
+#include <vector>         // containers
+
+/**
+    Exact set of ports. Like a roaring container, it is an array of sorted
+    ports while it holds at most ARRAY_MAX of them (2 bytes each), and a
+    bitset of every port (8 KiB) above that, so it never takes more than
+    8 KiB and a typical device's few ports take a few bytes.
+*/
+class port_bitmap
+{
+    private:
+        std::vector<uint16_t> array;    /**< sorted ports, while few */
+        std::vector<uint64_t> bits;     /**< bit per port once many,
+                                             empty otherwise */
+        size_t count;                   /**< number of ports */
+
+        /**
+            Switch from the array to the bitset, or back, whichever suits
+            the number of ports.
+        */
+        void convert();
+
+    public:
+        static const size_t ARRAY_MAX = 4096;   /**< most ports kept as an
+                                                     array; more take less
+                                                     room as a bitset */
+        static const size_t BITSET_WORDS = 1024;/**< 64-bit words of the
+                                                     bitset */
+
+        /**
+            Initialize an empty set.
+        */
+        port_bitmap();
+
+        /**
+            Add a port.
+
+            \param port TCP/UDP port, 0-65535.
+
+            \return True if the port was not in the set yet.
+        */
+        bool add(uint16_t port);
+
+        /**
+            Add every port of a range.
+
+            \param first First port of the range.
+            \param last Last port of the range, inclusive.
+        */
+        void add_range(uint16_t first,
+                       uint16_t last);
+
+        /**
+            \return True if the port is in the set.
+        */
+        bool contains(uint16_t port) const;
+
+        /**
+            \return Number of ports in the set.
+        */
+        size_t cardinality() const;
+
+        /**
+            Add every port of another set.
+
+            \param other Set to add.
+        */
+        void merge(const port_bitmap &other);
+
+        /**
+            \return True if the sets have a port in common.
+        */
+        bool intersects(const port_bitmap &other) const;
+
+        /**
+            \param first First port of the range.
+            \param last Last port of the range, inclusive.
+
+            \return True if the set has a port in the range.
+        */
+        bool intersects(uint16_t first,
+                        uint16_t last) const;
+
+        /**
+            Append the set to a buffer: the number of ports (32 bits), then
+            the sorted ports (16 bits each) or, above ARRAY_MAX, the bitset.
+
+            \param out Buffer to append to.
+        */
+        void write(std::string &out) const;
+
+        /**
+            Replace the set with one written by write().
+
+            \param data Start of the written set.
+            \param length Bytes available at data.
+
+            \return Bytes read, or 0 if data is not a valid set.
+        */
+        size_t read(const char *data,
+                    size_t length);
+};
+
+#endif
@@ -0,0 +1,264 @@
+//=============================================================================
+//
+// Name:        ring_buffer.hpp
+// Authors:     James H. Loving
+// Description: This file declares and defines the ring_buffer class, a
+//              bounded lock-free queue used to hand flow records from the
+//              capture thread to the storage threads. Any number of threads
+//              may push and pop concurrently.
+//
+//              Based on Dmitry Vyukov's bounded MPMC queue:
+//              http://www.1024cores.net/home/lock-free-algorithms/queues/
+//              bounded-mpmc-queue
+//
+//=============================================================================
+
+#ifndef RING_BUFFER_HPP
+#define RING_BUFFER_HPP
+
+#include <atomic>         // lock-free positions & counters
+#include <memory>         // unique_ptr
+#include <stddef.h>       // size_t
+#include <stdexcept>      // exception handling
+#include <stdint.h>       // uint64_t
+#include <string>         // string class
+#include <thread>         // this_thread::yield()
+
+/**
+    What a full ring_buffer does with a newly pushed item.
+*/
+enum overflow_policy
+{
+    DROP_NEWEST,    /**< discard the new item */
+    DROP_OLDEST,    /**< discard the oldest queued item to make room */
+    BLOCK           /**< wait until a consumer makes room */
+};
+
+/**
+    Parse an overflow policy name ("drop-newest", "drop-oldest", "block").
+
+    \param name String-encoded policy name.
+
+    \return The matching overflow_policy. Throws std::invalid_argument.
+*/
+inline overflow_policy parse_overflow_policy(const std::string &name)
+{
+    if (name == "drop-newest")
+    {
+        return DROP_NEWEST;
+    }
+    else if (name == "drop-oldest")
+    {
+        return DROP_OLDEST;
+    }
+    else if (name == "block")
+    {
+        return BLOCK;
+    }
+
+    throw std::invalid_argument("Invalid overflow policy: " + name);
+}
+
+/**
+    Bounded, lock-free, multi-producer multi-consumer queue.
+*/
+template <typename T>
+class ring_buffer
+{
+    private:
+        static const size_t CACHE_LINE = 64;
+
+        struct cell
+        {
+            std::atomic<size_t> sequence;   /**< slot state, see Vyukov */
+            T data;                         /**< queued item */
+        };
+
+        std::unique_ptr<cell[]> cells;      /**< ring storage */
+        size_t mask;                        /**< capacity - 1 */
+        overflow_policy policy;             /**< behavior when full */
+
+        char pad0[CACHE_LINE];
+        std::atomic<size_t> enqueue_pos;    /**< next slot to push */
+        char pad1[CACHE_LINE];
+        std::atomic<size_t> dequeue_pos;    /**< next slot to pop */
+        char pad2[CACHE_LINE];
+
+        std::atomic<uint64_t> pushed;       /**< items accepted */
+        std::atomic<uint64_t> dropped;      /**< items lost to overflow */
+
+        /**
+            Push without applying the overflow policy.
+
+            \return False if the ring is full.
+        */
+        bool try_push(const T &item)
+        {
+            size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+
+            while (true)
+            {
+                cell *c = &cells[pos & mask];
+                size_t seq = c->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+                if (diff == 0)
+                {
+                    if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        c->data = item;
+                        c->sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+    public:
+        /**
+            Initialize an empty ring.
+
+            \param capacity Number of items the ring can hold, rounded up to
+                a power of two.
+            \param policy What push() does when the ring is full.
+        */
+        ring_buffer(size_t capacity,
+                    overflow_policy policy)
+            : mask(0),
+              policy(policy),
+              enqueue_pos(0),
+              dequeue_pos(0),
+              pushed(0),
+              dropped(0)
+        {
+            size_t size = 2;
+            while (size < capacity)
+            {
+                size <<= 1;
+            }
+
+            cells.reset(new cell[size]);
+            mask = size - 1;
+
+            for (size_t i = 0; i < size; ++i)
+            {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        /**
+            Queue an item, applying the overflow policy if the ring is full.
+
+            \param item Item to copy into the ring.
+
+            \return False if the item (not an older one) was dropped.
+        */
+        bool push(const T &item)
+        {
+            while (!try_push(item))
+            {
+                if (policy == DROP_NEWEST)
+                {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                else if (policy == DROP_OLDEST)
+                {
+                    T victim;
+                    if (pop(victim))
+                    {
+                        dropped.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+
+            pushed.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        /**
+            Take the oldest item from the ring.
+
+            \param item Output item.
+
+            \return False if the ring was empty.
+        */
+        bool pop(T &item)
+        {
+            size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+
+            while (true)
+            {
+                cell *c = &cells[pos & mask];
+                size_t seq = c->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+                if (diff == 0)
+                {
+                    if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        item = c->data;
+                        c->sequence.store(pos + mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = dequeue_pos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /**
+            \return Number of items the ring can hold.
+        */
+        size_t capacity() const
+        {
+            return mask + 1;
+        }
+
+        /**
+            \return Approximate number of queued items.
+        */
+        size_t depth() const
+        {
+            size_t tail = dequeue_pos.load(std::memory_order_relaxed);
+            size_t head = enqueue_pos.load(std::memory_order_relaxed);
+
+            return head > tail ? head - tail : 0;
+        }
+
+        /**
+            \return Total items accepted by push().
+        */
+        uint64_t pushes() const
+        {
+            return pushed.load(std::memory_order_relaxed);
+        }
+
+        /**
+            \return Total items lost to the overflow policy.
+        */
+        uint64_t drops() const
+        {
+            return dropped.load(std::memory_order_relaxed);
+        }
+};
+
+#endif
@@ -16,12 +16,16 @@
 #define _BSD_SOURCE
 #define __FAVOR_BSD
 
+#include <algorithm>
 #include <cstdlib>
 #include <string>
 #include <unistd.h>
 
 #include "gtest/gtest.h"
 #include "../edict.hpp"
+#include "../libs/conn_log/client_pool.hpp"
+#include "../libs/conn_log/cuckoo_store.hpp"
+#include "../libs/conn_log/sharded_store.hpp"
 
 TEST(conn_log, valid_mac)
 {
@@ -98,6 +102,74 @@ TEST(device_log, should_log)
     system("mv /var/lib/edict/do_not_track.txt.backup /var/lib/edict/do_not_track.txt");
 }
 
+TEST(device_table, grow_and_bound)
+{
+    device_table table(5000);
+
+    // well past the initial size, and the old 1000-device limit
+    for (uint64_t mac = 1; mac <= 5000; ++mac)
+    {
+        ASSERT_TRUE(table.set(mac << 8, DEVICE_KNOWN));
+    }
+    ASSERT_EQ(5000u, table.size());
+    ASSERT_FALSE(table.set(0xaabbccddeeffULL, DEVICE_KNOWN));
+
+    uint32_t id;
+    ASSERT_TRUE(table.set(42 << 8, DEVICE_KNOWN, 42));
+    ASSERT_TRUE(table.set(42 << 8, DEVICE_DNT));
+    ASSERT_EQ(DEVICE_KNOWN | DEVICE_DNT, table.state(42 << 8, &id));
+    ASSERT_EQ(42u, id);
+    ASSERT_EQ(DEVICE_KNOWN, table.state(4999 << 8));
+    ASSERT_EQ(0, table.state(0xaabbccddeeffULL));
+    ASSERT_EQ(5000u, table.size());
+}
+
+TEST(device_registry, journal_compact_import)
+{
+    std::string base = "/tmp/edict_test_devices_" + std::to_string(getpid());
+    struct device_record record;
+
+    {
+        device_registry writer(base + ".bin", base + ".journal");
+        device_registry reader(base + ".bin", base + ".journal");
+
+        ASSERT_EQ(1u, writer.add(0xaabbccddeeffULL, "phone", 100));
+        ASSERT_TRUE(writer.find(0xaabbccddeeffULL, &record));
+        ASSERT_STREQ("phone", record.make_model);
+
+        // another process sees journal appends and compactions on refresh()
+        ASSERT_FALSE(reader.find(0xaabbccddeeffULL, NULL));
+        ASSERT_TRUE(reader.refresh());
+        ASSERT_TRUE(reader.find(0xaabbccddeeffULL, NULL));
+
+        // IDs carry on from the snapshot
+        writer.compact();
+        ASSERT_EQ(2u, writer.add(0x112233445566ULL, "tablet", 200));
+        ASSERT_TRUE(reader.refresh());
+        ASSERT_EQ(2u, reader.records().size());
+        ASSERT_TRUE(reader.find(0x112233445566ULL, &record));
+        ASSERT_EQ(200, record.first_seen);
+        ASSERT_FALSE(reader.refresh());
+    }
+
+    // the old CSV log skips devices already registered
+    std::ofstream csv((base + ".csv").c_str());
+    csv << "2018-01-01T00:00:00Z,aabbccddeeff,phone\n"
+        << "2018-01-01T00:01:00Z,010203040506,laptop\n";
+    csv.close();
+
+    device_registry registry(base + ".bin", base + ".journal");
+    ASSERT_EQ(1u, registry.import_csv(base + ".csv"));
+    ASSERT_EQ(3u, registry.size());
+    ASSERT_TRUE(registry.find(0x010203040506ULL, &record));
+    ASSERT_EQ(1514764860, record.first_seen);
+    ASSERT_EQ(3u, record.id);
+
+    unlink((base + ".bin").c_str());
+    unlink((base + ".journal").c_str());
+    unlink((base + ".csv").c_str());
+}
+
 TEST(edict, parse_args)
 {
     int arg_count = 2;
@@ -130,6 +202,1158 @@ TEST(edict, parse_args)
     arg_count = 7;
     args = parse_args(arg_count, arg_vector);
     ASSERT_EQ("invalid", args.command);
+
+    // test "purge" parsing
+    arg_vector[1] = (char *)"purge";
+    arg_vector[2] = (char *)"aabbccddeeff";
+    arg_vector[3] = (char *)"--backend=cuckoo";
+    arg_count = 4;
+    args = parse_args(arg_count, arg_vector);
+    ASSERT_EQ("purge", args.command);
+    ASSERT_EQ("aabbccddeeff", args.purge_mac);
+    ASSERT_EQ("cuckoo", args.backend);
+}
+
+TEST(local_store, set_check_drop)
+{
+    std::string directory = "/tmp/edict_test_filters_" + std::to_string(getpid());
+    key_batch keys;
+    std::vector<bool> found;
+
+    keys.add("aabbccddeeff|80", 15);
+    keys.add("aabbccddeeff|443", 16);
+
+    {
+        local_store store(directory);
+        store.set("100", keys);
+        ASSERT_GT(store.info("100"), 0u);
+        ASSERT_EQ(0u, store.info("101"));
+    }
+
+    // filters survive reopening the store
+    local_store store(directory);
+    ASSERT_EQ(1u, store.list().size());
+
+    keys.add("aabbccddeeff|8080", 17);
+    store.check("100", keys, found);
+    ASSERT_TRUE(found[0]);
+    ASSERT_TRUE(found[1]);
+    ASSERT_FALSE(found[2]);
+
+    store.check("101", keys, found);
+    ASSERT_FALSE(found[0]);
+
+    // filters another process creates later are found too
+    {
+        local_store writer(directory);
+        writer.set("101", keys);
+    }
+    store.check("101", keys, found);
+    ASSERT_TRUE(found[0]);
+
+    // and let go of once it drops them
+    {
+        local_store writer(directory);
+        writer.drop("101");
+    }
+    store.check("101", keys, found);
+    ASSERT_FALSE(found[0]);
+    ASSERT_EQ(1u, store.list().size());
+
+    // a file its creator has not sized yet is left alone
+    std::string unsized = directory + "/102.bf";
+    close(open(unsized.c_str(), O_RDWR | O_CREAT, 0644));
+    ASSERT_EQ(0u, store.info("102"));
+    struct stat st;
+    ASSERT_EQ(0, stat(unsized.c_str(), &st));
+    ASSERT_EQ(0, st.st_size);
+    unlink(unsized.c_str());
+
+    store.drop("100");
+    ASSERT_EQ(0u, store.list().size());
+    ASSERT_THROW(store.create("../100"), std::invalid_argument);
+
+    rmdir(directory.c_str());
+}
+
+TEST(local_store, archive)
+{
+    std::string directory = "/tmp/edict_test_archive_" + std::to_string(getpid());
+    key_batch keys;
+    key_batch late;
+    key_batch absent;
+    std::vector<bool> found;
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        std::string key = "aabbccddeeff|" + std::to_string(i);
+        keys.add(key.data(), key.length());
+    }
+    late.add("aabbccddeeff|late", 17);
+    absent.add("aabbccddeeff|none", 17);
+
+    {
+        local_store store(directory);
+        store.set("100", keys);
+        uint64_t hot = store.info("100");
+
+        // archived filters leave memory, shrink, and stay queryable
+        ASSERT_TRUE(store.archive("100"));
+        ASSERT_EQ(0u, store.list().size());
+        ASSERT_EQ(1u, store.archived().size());
+        ASSERT_LT(store.archived()["100"], hot / 4);
+
+        // a late write is merged into the archive when it is archived again
+        store.set("100", late);
+        ASSERT_TRUE(store.archive("100"));
+    }
+
+    local_store store(directory);
+    ASSERT_EQ(0u, store.list().size());
+    store.check("100", keys, found);
+    ASSERT_EQ(keys.size(), static_cast<size_t>(std::count(found.begin(), found.end(), true)));
+    store.check("100", late, found);
+    ASSERT_TRUE(found[0]);
+    store.check("100", absent, found);
+    ASSERT_FALSE(found[0]);
+
+    // another late write starts a hot filter; a new process sees both
+    key_batch later;
+    later.add("aabbccddeeff|later", 18);
+    store.set("100", later);
+    {
+        local_store reader(directory);
+        struct filter_stats stats;
+        reader.check("100", keys, found);
+        ASSERT_EQ(keys.size(), static_cast<size_t>(std::count(found.begin(), found.end(), true)));
+        reader.check("100", later, found);
+        ASSERT_TRUE(found[0]);
+        ASSERT_TRUE(reader.stats("100", stats));
+        ASSERT_EQ(keys.size() + 2, stats.keys);
+    }
+
+    store.drop("100");
+    ASSERT_EQ(0u, store.archived().size());
+    store.check("100", keys, found);
+    ASSERT_FALSE(found[0]);
+
+    rmdir(directory.c_str());
+}
+
+TEST(cuckoo_store, purge_and_grow)
+{
+    std::string directory = "/tmp/edict_test_cuckoo_" + std::to_string(getpid());
+    key_batch first;
+    key_batch second;
+    std::vector<bool> found;
+
+    for (uint16_t port = 0; port < 5000; ++port)
+    {
+        char key[FLOW_KEY_BYTES];
+        first.add(key, pack_key_ipv4(1, port, key) - key);
+        second.add(key, pack_key_ipv4(2, port, key) - key);
+    }
+
+    {
+        // a filter sized far too small grows and keeps every key
+        cuckoo_store store(directory);
+        store.create("100", 100, 0);
+        uint64_t small = store.info("100");
+        store.set("100", first);
+        store.set("100", second);
+        ASSERT_GT(store.info("100"), small);
+        store.check("100", first, found);
+        ASSERT_EQ(first.size(), static_cast<size_t>(std::count(found.begin(), found.end(), true)));
+
+        ASSERT_TRUE(store.archive("100"));
+        ASSERT_EQ(0u, store.list().size());
+        ASSERT_EQ(1u, store.archived().size());
+    }
+
+    // purging one device leaves the other's keys, archived or not
+    cuckoo_store store(directory);
+    ASSERT_GT(store.info("100"), 0u);
+    ASSERT_EQ(0u, store.info("101"));
+    uint64_t removed = 0;
+    ASSERT_TRUE(store.purge("100", 1, &removed));
+    ASSERT_EQ(first.size(), removed);
+    store.check("100", first, found);
+    ASSERT_EQ(0, std::count(found.begin(), found.end(), true));
+    store.check("100", second, found);
+    ASSERT_EQ(second.size(), static_cast<size_t>(std::count(found.begin(), found.end(), true)));
+
+    ASSERT_FALSE(local_store(directory + "_local").purge("100", 1, &removed));
+    rmdir((directory + "_local").c_str());
+
+    store.drop("100");
+    ASSERT_EQ(0u, store.archived().size());
+    rmdir(directory.c_str());
+}
+
+TEST(client_pool, framing_and_reconnect)
+{
+    std::string path = "/tmp/edict_test_pool_" + std::to_string(getpid()) + ".sock";
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ(0, bind(listener, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)));
+    listen(listener, 4);
+
+    // replies split mid-line and merged across commands, then a restart
+    std::thread server([listener]()
+    {
+        char buffer[256];
+        int fd = accept(listener, NULL, NULL);
+        for (int lines = 0; lines < 2; )
+        {
+            ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+            lines += std::count(buffer, buffer + std::max<ssize_t>(length, 0), '\n');
+        }
+        send(fd, "STA", strlen("STA"), 0);
+        usleep(10000);
+        send(fd, "RT\na 1\nEND\nDo", strlen("RT\na 1\nEND\nDo"), 0);
+        usleep(10000);
+        send(fd, "ne\n", strlen("ne\n"), 0);
+        usleep(10000);
+        close(fd);
+
+        fd = accept(listener, NULL, NULL);
+        recv(fd, buffer, sizeof(buffer), 0);
+        send(fd, "Exists\n", strlen("Exists\n"), 0);
+        close(fd);
+    });
+
+    client_pool pool(path, 0, 2);
+    uint64_t list = pool.send("list\n", 5, 1, REPLY_BLOCK, 0);
+    uint64_t create = pool.send("create x\n", 9, 1, REPLY_LINE, 0);
+
+    std::vector<std::string> lines = pool.wait(list);
+    ASSERT_EQ(3u, lines.size());
+    ASSERT_EQ("a 1", lines[1]);
+    ASSERT_EQ("Done", pool.wait(create)[0]);
+
+    // the closed connection is reopened on the next request
+    usleep(50000);
+    ASSERT_THROW(pool.request("create y\n"), std::runtime_error);
+    ASSERT_EQ("Exists", pool.request("create y\n")[0]);
+    ASSERT_EQ(1u, pool.reconnects());
+
+    server.join();
+    close(listener);
+    unlink(path.c_str());
+}
+
+TEST(sharded_store, add_backend)
+{
+    std::string prefix = "/tmp/edict_test_shards_" + std::to_string(getpid());
+    std::vector<std::string> shards;
+    shards.push_back("local:" + prefix + "_a");
+    shards.push_back("local:" + prefix + "_b");
+
+    key_batch keys;
+    std::vector<bool> found;
+    for (uint32_t i = 0; i < 3000; ++i)
+    {
+        char key[FLOW_KEY_BYTES];
+        keys.add(key, pack_key_ipv4(i, 443, key) - key);
+    }
+
+    {
+        sharded_store store(shards, prefix + ".txt");
+        store.set("100", keys);
+        store.check("100", keys, found);
+        ASSERT_EQ(keys.size(), static_cast<size_t>(std::count(found.begin(), found.end(), true)));
+    }
+
+    // a third backend takes about a third of the keys, all from the others
+    shard_topology before(shards);
+    shards.push_back("local:" + prefix + "_c");
+    shard_topology after(shards);
+    size_t moved = 0;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        uint64_t hash = hash_key(keys.key(i), keys.length(i));
+        if (before.shard(hash) != after.shard(hash))
+        {
+            ASSERT_EQ(2u, after.shard(hash));
+            ++moved;
+        }
+    }
+    ASSERT_GT(moved, keys.size() / 5);
+    ASSERT_LT(moved, keys.size() / 2);
+
+    // the filter written before the change still answers, and so does one
+    // written across it
+    sharded_store store(shards, prefix + ".txt");
+    ASSERT_EQ(3u, store.size());
+    store.check("100", keys, found);
+    ASSERT_EQ(keys.size(), static_cast<size_t>(std::count(found.begin(), found.end(), true)));
+
+    key_batch more;
+    char key[FLOW_KEY_BYTES];
+    more.add(key, pack_key_ipv4(5000, 80, key) - key);
+    store.set("100", more);
+    store.set("101", keys);
+    ASSERT_GT(open_store(shards[2])->info("101"), 0u);
+
+    sharded_store reader(shards, prefix + ".txt");
+    reader.check("100", keys, found);
+    ASSERT_EQ(keys.size(), static_cast<size_t>(std::count(found.begin(), found.end(), true)));
+    reader.check("100", more, found);
+    ASSERT_TRUE(found[0]);
+    ASSERT_EQ(2u, reader.list().size());
+
+    reader.drop("100");
+    reader.drop("101");
+    ASSERT_EQ(0u, store.list().size());
+
+    // one backend's part merging into a filter that matches too much
+    // keeps the others from merging theirs
+    key_batch busy;
+    for (int i = 0; i < 50000; ++i)
+    {
+        std::string busy_key = "aabbccddeeff|" + std::to_string(i);
+        busy.add(busy_key.data(), busy_key.length());
+    }
+    open_store(shards[0])->create("200", 1000, 0.0001);
+    open_store(shards[0])->set("200", more);
+    open_store(shards[1])->create("201", 1000, 0.0001);
+    open_store(shards[1])->set("201", busy);
+    double rate;
+    ASSERT_TRUE(store.merge("d1", std::vector<std::string>{"200", "201"}, 0.001, &rate));
+    ASSERT_GT(rate, 0.001);
+    ASSERT_GT(open_store(shards[0])->info("200"), 0u);
+    ASSERT_EQ(0u, store.archived().size());
+    open_store(shards[0])->drop("200");
+    open_store(shards[1])->drop("201");
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        rmdir(shards[i].substr(6).c_str());
+    }
+    unlink((prefix + ".txt").c_str());
+}
+
+TEST(conn_log, local_fuzziness)
+{
+    std::string directory = "/tmp/edict_test_filters_" + std::to_string(getpid());
+    std::shared_ptr<filter_store> store = std::make_shared<local_store>(directory);
+    conn_log c(store);
+
+    time_t now = time(nullptr);
+    time_t next_slot = (now / FILTER_LENGTH + 1) * FILTER_LENGTH;
+
+    c.add_ipv4(7, 51234);
+    c.add_ipv6(7, "2001:db8::1");
+    ASSERT_TRUE(c.has_ipv4(7, 51234, now));
+    ASSERT_FALSE(c.has_ipv4(7, 51235, now));
+    ASSERT_FALSE(c.has_ipv4(8, 51234, now));
+    ASSERT_TRUE(c.has_ipv6(7, "2001:0db8:0:0::1", now));
+    ASSERT_FALSE(c.has_ipv6(7, "2001:db8::2", now));
+
+    // just past the timeslot boundary the previous timeslot is checked too
+    ASSERT_TRUE(c.has_ipv4(7, 51234, next_slot + 5));
+    ASSERT_FALSE(c.has_ipv4(7, 51234, next_slot + 20));
+
+    std::map<std::string, uint64_t> filters = store->list();
+    for (std::map<std::string, uint64_t>::iterator it = filters.begin(); it != filters.end(); ++it)
+    {
+        store->drop(it->first);
+    }
+    rmdir(directory.c_str());
+}
+
+TEST(conn_log, local_batch)
+{
+    std::string directory = "/tmp/edict_test_batch_" + std::to_string(getpid());
+    std::shared_ptr<filter_store> store = std::make_shared<local_store>(directory);
+    conn_log c(store);
+
+    time_t now = time(nullptr);
+    time_t next_slot = (now / FILTER_LENGTH + 1) * FILTER_LENGTH;
+    std::vector<uint32_t> devices;
+    std::vector<bool> found;
+
+    for (uint32_t device = 1; device <= 3000; ++device)
+    {
+        devices.push_back(device);
+        if (device % 3 == 0)
+        {
+            c.add_ipv4(device, 443);
+        }
+    }
+
+    c.has_ipv4(devices, 443, now, found);
+    ASSERT_EQ(devices.size(), found.size());
+    for (size_t i = 0; i < devices.size(); ++i)
+    {
+        ASSERT_EQ(devices[i] % 3 == 0, found[i]);
+    }
+
+    // keys missing from the next timeslot are found in this one
+    c.has_ipv4(devices, 443, next_slot + 5, found);
+    ASSERT_TRUE(found[2]);
+    ASSERT_FALSE(found[3]);
+    c.has_ipv4(devices, 443, next_slot + 20, found);
+    ASSERT_FALSE(found[2]);
+
+    store->drop(conn_log::filter_name(now / FILTER_LENGTH));
+    rmdir(directory.c_str());
+}
+
+TEST(filter_manager, rollup)
+{
+    std::string directory = "/tmp/edict_test_rollup_" + std::to_string(getpid());
+    std::shared_ptr<filter_store> store = open_store("local:" + directory);
+    conn_log c(store);
+
+    std::vector<struct rollup_rule> rules(1);
+    rules[0].length = DAY_LENGTH;
+    rules[0].age = DAY_LENGTH;
+    time_t now = time(nullptr);
+    time_t day = now / DAY_LENGTH - 3;
+    time_t start = day * DAY_LENGTH;
+
+    c.add_ipv4(7, 443, start + 100);
+    c.add_ipv4(8, 80, start + 5 * FILTER_LENGTH + 100);
+    c.flush();
+    ASSERT_GT(store->info(conn_log::filter_name(start / FILTER_LENGTH)), 0u);
+
+    // the day's hours become one archived filter
+    ASSERT_TRUE(store->can_merge());
+    filter_manager manager(MAX_FILTER_SIZE, 0, "local:" + directory, rules);
+    manager.manage(now);
+    ASSERT_EQ(0u, store->info(conn_log::filter_name(start / FILTER_LENGTH)));
+    ASSERT_EQ(1u, store->archived().size());
+    ASSERT_EQ(1u, store->archived().count(conn_log::filter_name(day, DAY_LENGTH)));
+    ASSERT_EQ(store->archived().begin()->second, manager.archived_size());
+
+    // queries find them there without the rule, at day precision
+    conn_log query(store);
+    ASSERT_TRUE(query.has_ipv4(7, 443, start + 100));
+    ASSERT_TRUE(query.has_ipv4(8, 80, start + 100));
+    ASSERT_FALSE(query.has_ipv4(9, 80, start + 100));
+
+    store->drop(conn_log::filter_name(day, DAY_LENGTH));
+    store->drop(conn_log::filter_name(now / FILTER_LENGTH + 1));
+    rmdir(directory.c_str());
+}
+
+TEST(filter_manager, rollup_precision)
+{
+    std::string directory = "/tmp/edict_test_precision_" + std::to_string(getpid());
+    std::shared_ptr<filter_store> store = open_store("local:" + directory);
+    std::vector<struct rollup_rule> rules(1);
+    rules[0].length = DAY_LENGTH;
+    rules[0].age = DAY_LENGTH;
+    time_t now = time(nullptr);
+    time_t day = now / DAY_LENGTH - 3;
+    time_t first = day * DAY_LENGTH / FILTER_LENGTH;
+    struct filter_stats stats;
+
+    // a busy hour and a quiet one, each at its design load
+    key_batch busy;
+    key_batch quiet;
+    for (int i = 0; i < 50000; ++i)
+    {
+        std::string key = "aabbccddeeff|" + std::to_string(i);
+        busy.add(key.data(), key.length());
+    }
+    for (int i = 0; i < 1000; ++i)
+    {
+        std::string key = "665544332211|" + std::to_string(i);
+        quiet.add(key.data(), key.length());
+    }
+    store->create(conn_log::filter_name(first), 50000, 0.0001);
+    store->set(conn_log::filter_name(first), busy);
+    store->create(conn_log::filter_name(first + 1), 1000, 0.0001);
+    store->set(conn_log::filter_name(first + 1), quiet);
+
+    // the quiet hour is spread over the busy hour's blocks, not the
+    // other way around
+    filter_manager manager(MAX_FILTER_SIZE, 0, "local:" + directory, rules, 0, 0.001);
+    manager.manage(now);
+    ASSERT_TRUE(store->stats(conn_log::filter_name(day, DAY_LENGTH), stats));
+    ASSERT_EQ(51000u, stats.keys);
+    ASSERT_LT(stats.probability, 0.001);
+
+    // two busy hours would merge into a filter that matches too much
+    store->create(conn_log::filter_name(first + 24), 1000, 0.0001);
+    store->set(conn_log::filter_name(first + 24), quiet);
+    store->create(conn_log::filter_name(first + 25), 1000, 0.0001);
+    store->set(conn_log::filter_name(first + 25), busy);
+    manager.manage(now);
+    ASSERT_EQ(0u, store->archived().count(conn_log::filter_name(day + 1, DAY_LENGTH)));
+    ASSERT_GT(store->info(conn_log::filter_name(first + 24)), 0u);
+
+    store->drop(conn_log::filter_name(day, DAY_LENGTH));
+    store->drop(conn_log::filter_name(first + 24));
+    store->drop(conn_log::filter_name(first + 25));
+    store->drop(conn_log::filter_name(now / FILTER_LENGTH + 1));
+    rmdir(directory.c_str());
+}
+
+TEST(filter_manager, sizing)
+{
+    std::string directory = "/tmp/edict_test_sizing_" + std::to_string(getpid());
+    std::shared_ptr<filter_store> store = open_store("local:" + directory);
+    time_t day = DAY_LENGTH / FILTER_LENGTH;
+    time_t current = time(nullptr) / FILTER_LENGTH;
+    struct filter_stats stats;
+
+    // the next hour had 20000 keys yesterday, and traffic has doubled since
+    key_batch keys;
+    for (int i = 0; i < 20000; ++i)
+    {
+        std::string key = "aabbccddeeff|" + std::to_string(i);
+        keys.add(key.data(), key.length());
+    }
+    store->set(conn_log::filter_name(current + 1 - day), keys);
+    store->set(conn_log::filter_name(current), keys);
+    key_batch half;
+    for (int i = 0; i < 10000; ++i)
+    {
+        half.add(keys.key(i), keys.length(i));
+    }
+    store->set(conn_log::filter_name(current - day), half);
+
+    // a full filter reports about the rate it was sized for
+    ASSERT_TRUE(store->stats(conn_log::filter_name(current), stats));
+    ASSERT_EQ(20000u, stats.keys);
+    ASSERT_EQ(LOCAL_FILTER_CAPACITY, stats.capacity);
+    ASSERT_GT(stats.probability, 0.0);
+    ASSERT_LT(stats.probability, LOCAL_FILTER_PROBABILITY);
+    ASSERT_FALSE(store->stats(conn_log::filter_name(current + 2), stats));
+
+    // the next hour is created for twice yesterday's keys, with headroom
+    filter_manager manager(MAX_FILTER_SIZE, 0, "local:" + directory);
+    manager.manage((current + 1) * FILTER_LENGTH - 30);
+    ASSERT_TRUE(store->stats(conn_log::filter_name(current + 1), stats));
+    ASSERT_EQ(0u, stats.keys);
+    ASSERT_EQ(60000u, stats.capacity);
+
+    for (time_t slot = current - day; slot <= current + 1; ++slot)
+    {
+        store->drop(conn_log::filter_name(slot));
+    }
+    store->drop(conn_log::filter_name(current + 1 - day));
+    rmdir(directory.c_str());
+}
+
+TEST(conn_log, fine_window)
+{
+    std::string directory = "/tmp/edict_test_fine_" + std::to_string(getpid());
+    std::shared_ptr<filter_store> store = open_store("local:" + directory);
+    conn_log c(store);
+    c.set_fine_window(FILTER_LENGTH);
+
+    time_t now = time(nullptr);
+    time_t minute = now / MINUTE_LENGTH;
+    std::vector<std::string> probes;
+
+    c.add_ipv4(7, 443, now);
+    ASSERT_EQ(2u, c.queued());
+    c.add_ipv4(7, 443, now);
+    ASSERT_EQ(2u, c.queued());
+
+    // recent timestamps probe minute filters only, so a use of the port
+    // two minutes off doesn't match (the manager creates them ahead)
+    for (time_t m = minute - 3; m <= minute + 1; ++m)
+    {
+        store->create(conn_log::filter_name(m, MINUTE_LENGTH));
+    }
+    ASSERT_TRUE(c.has_ipv4(7, 443, now));
+    c.probe_filters(now, probes);
+    ASSERT_EQ(conn_log::filter_name(minute, MINUTE_LENGTH), probes[0]);
+    ASSERT_FALSE(c.has_ipv4(7, 443, now - 2 * MINUTE_LENGTH));
+    ASSERT_GT(store->info(conn_log::filter_name(now / FILTER_LENGTH)), 0u);
+
+    // without its minute filter, a recent timestamp is found in the hour
+    store->drop(conn_log::filter_name(minute - 2, MINUTE_LENGTH));
+    ASSERT_TRUE(c.has_ipv4(7, 443, now - 2 * MINUTE_LENGTH));
+
+    // old timestamps probe the hourly filters, after any ended day's
+    c.probe_filters(now - 2 * FILTER_LENGTH, probes);
+    ASSERT_EQ(conn_log::filter_name(now / FILTER_LENGTH - 2), probes.back());
+
+    // minute filters are dropped once out of the window
+    filter_manager manager(MAX_FILTER_SIZE, 0, "local:" + directory, std::vector<struct rollup_rule>(), 0);
+    manager.manage(now + 2 * MINUTE_LENGTH);
+    ASSERT_EQ(0u, store->info(conn_log::filter_name(minute, MINUTE_LENGTH)));
+
+    store->drop(conn_log::filter_name(now / FILTER_LENGTH));
+    store->drop(conn_log::filter_name(now / FILTER_LENGTH + 1));
+    rmdir(directory.c_str());
+}
+
+TEST(recent_keys, duplicates)
+{
+    recent_keys recent(64);
+
+    ASSERT_THROW(recent_keys(100), std::invalid_argument);
+
+    ASSERT_FALSE(recent.seen(hash_key("a", 1), 10));
+    ASSERT_TRUE(recent.seen(hash_key("a", 1), 10));
+    ASSERT_FALSE(recent.seen(hash_key("b", 1), 10));
+
+    // a new timeslot's filter doesn't have the key yet
+    ASSERT_FALSE(recent.seen(hash_key("a", 1), 11));
+    ASSERT_EQ(1u, recent.hits());
+    ASSERT_EQ(3u, recent.misses());
+
+    // a full bucket evicts, so at worst a key is written twice
+    for (uint64_t i = 0; i < 1000; ++i)
+    {
+        recent.seen(i << 3, 11);
+    }
+    ASSERT_FALSE(recent.seen(0, 11) && recent.seen(8, 11) && recent.seen(16, 11) &&
+                 recent.seen(24, 11) && recent.seen(32, 11) && recent.seen(40, 11) &&
+                 recent.seen(48, 11) && recent.seen(56, 11) && recent.seen(64, 11));
+
+    // the same flow repeated is written once per timeslot
+    std::string directory = "/tmp/edict_test_recent_" + std::to_string(getpid());
+    std::shared_ptr<filter_store> store = std::make_shared<local_store>(directory);
+    conn_log c(store);
+    time_t now = time(nullptr);
+
+    for (int i = 0; i < 10; ++i)
+    {
+        c.add_ipv4(1, 443);
+    }
+    c.add_ipv4(2, 443);
+    ASSERT_EQ(9u, c.duplicate_keys());
+    ASSERT_EQ(2u, c.distinct_keys());
+    ASSERT_TRUE(c.has_ipv4(1, 443, now));
+
+    store->drop(conn_log::filter_name(now / FILTER_LENGTH));
+    rmdir(directory.c_str());
+}
+
+TEST(flow_spool, persist_and_drain)
+{
+    std::string path = "/tmp/edict_test_spool_" + std::to_string(getpid());
+    struct flow_record flow;
+    struct flow_record out[4];
+    memset(&flow, 0, sizeof(flow));
+
+    // spooled flows outlive the process, in order
+    {
+        flow_spool spool(path, 3);
+        for (int i = 0; i < 3; ++i)
+        {
+            flow.timestamp = 1000 + i;
+            ASSERT_TRUE(spool.push(flow));
+        }
+        ASSERT_FALSE(spool.push(flow));
+        ASSERT_EQ(1u, spool.drops());
+    }
+
+    flow_spool spool(path, 3);
+    ASSERT_EQ(3u, spool.depth());
+    ASSERT_EQ(10, spool.age(1010));
+
+    // peek leaves records spooled until they are popped
+    ASSERT_EQ(2u, spool.peek(out, 2));
+    ASSERT_EQ(1000, out[0].timestamp);
+    ASSERT_EQ(1001, out[1].timestamp);
+    ASSERT_EQ(3u, spool.depth());
+    spool.pop(2);
+
+    // the ring wraps around
+    flow.timestamp = 1003;
+    ASSERT_TRUE(spool.push(flow));
+    ASSERT_EQ(2u, spool.peek(out, 4));
+    ASSERT_EQ(1002, out[0].timestamp);
+    ASSERT_EQ(1003, out[1].timestamp);
+    spool.pop(2);
+    ASSERT_EQ(0u, spool.depth());
+    ASSERT_EQ(0, spool.age(1010));
+
+    unlink(path.c_str());
+}
+
+TEST(flow_spool, replay)
+{
+    std::string path = "/tmp/edict_test_replay_" + std::to_string(getpid());
+    std::string directory = path + "_filters";
+    struct flow_record flow;
+    memset(&flow, 0, sizeof(flow));
+
+    // long past flows, replayed with no retention limit
+    flow_spool spool(path, 16);
+    flow.version = 4;
+    flow.device = 7;
+    flow.timestamp = 1500000000;
+    for (uint16_t port = 1000; port < 1003; ++port)
+    {
+        flow.source_port = port;
+        ASSERT_TRUE(spool.push(flow));
+    }
+
+    std::atomic<bool> running(true);
+    std::thread replayer(replay_spool, &spool, "local:" + directory, 0, 0, false, &running,
+                         static_cast<std::atomic<time_t> *>(NULL));
+    for (int i = 0; i < 500 && spool.depth(); ++i)
+    {
+        usleep(10000);
+    }
+    running = false;
+    replayer.join();
+    ASSERT_EQ(0u, spool.depth());
+
+    conn_log c("local:" + directory);
+    ASSERT_TRUE(c.has_ipv4(7, 1000, flow.timestamp));
+    ASSERT_TRUE(c.has_ipv4(7, 1002, flow.timestamp));
+
+    open_store("local:" + directory)->drop(conn_log::filter_name(flow.timestamp / FILTER_LENGTH));
+    rmdir(directory.c_str());
+    unlink(path.c_str());
+}
+
+TEST(reverse_index, check_ipv4)
+{
+    std::string directory = "/tmp/edict_test_index_" + std::to_string(getpid());
+    std::shared_ptr<filter_store> store = std::make_shared<local_store>(directory);
+    std::shared_ptr<reverse_index> index = open_index(directory);
+    conn_log c(store, index);
+
+    time_t now = time(nullptr);
+    time_t slot = now / FILTER_LENGTH;
+    uint8_t address[16] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    std::set<uint32_t> ids;
+
+    c.add_ipv4(1, 51234);
+    c.add_ipv4(3, 51234);
+    c.add_ipv4(3, 51234);
+    c.add_ipv6(3, address);
+
+    ASSERT_TRUE(index->candidates(slot, reverse_index::ipv4_attribute(51234), ids));
+    ASSERT_EQ(2u, ids.size());
+    ids.clear();
+    ASSERT_TRUE(c.candidates_ipv6("2001:db8::1", slot * FILTER_LENGTH + FILTER_LENGTH / 2, ids));
+    ASSERT_EQ(1u, ids.count(3));
+
+    // no index for a timeslot means every device has to be checked
+    ASSERT_FALSE(c.candidates_ipv4(51234, now - 7200, ids));
+
+    // only candidates that are known devices and in the filter match
+    std::map<std::string, struct device_log_entry> devices;
+    devices["aabbccddeeff"].make_model = "phone";
+    devices["aabbccddeeff"].id = 1;
+    devices["665544332211"].make_model = "tablet";
+    devices["665544332211"].id = 2;
+    std::map<std::string, struct device_log_entry> results = check_ipv4(c, devices, slot * FILTER_LENGTH + FILTER_LENGTH / 2, 51234);
+    ASSERT_EQ(1u, results.size());
+    ASSERT_EQ("phone", results["aabbccddeeff"].make_model);
+
+    store->drop(conn_log::filter_name(slot));
+    index->drop(slot);
+    rmdir(directory.c_str());
+}
+
+TEST(port_index, check_ipv4_ports)
+{
+    std::string directory = "/tmp/edict_test_ports_" + std::to_string(getpid());
+    std::shared_ptr<filter_store> store = std::make_shared<local_store>(directory);
+    std::shared_ptr<port_index> ports = open_port_index(directory);
+    conn_log c(store);
+    c.set_port_index(ports);
+
+    // a fixed hour, two minutes in
+    time_t slot = 1500000000 / FILTER_LENGTH;
+    time_t start = slot * FILTER_LENGTH + 120;
+    std::set<uint32_t> ids;
+    port_bitmap query;
+
+    c.add_ipv4(1, 40000, start);
+    c.add_ipv4(2, 50000, start);
+    for (uint16_t port = 10000; port < 15000; ++port)
+    {
+        c.add_ipv4(3, port, start);
+    }
+    c.add_ipv4(1, 40010, start + 60);
+
+    // only the minutes of the window count
+    query.add_range(40005, 40010);
+    ASSERT_TRUE(c.exact_ipv4(query, start, start + 59, ids));
+    ASSERT_EQ(0u, ids.size());
+    ASSERT_TRUE(c.exact_ipv4(query, start, start + 60, ids));
+    ASSERT_EQ(1u, ids.size());
+    ASSERT_EQ(1u, ids.count(1));
+
+    // ranges and sets, against small and large bitmaps
+    std::map<std::string, struct device_log_entry> devices;
+    devices["aabbccddeeff"].make_model = "phone";
+    devices["aabbccddeeff"].id = 2;
+    devices["665544332211"].make_model = "tablet";
+    devices["665544332211"].id = 3;
+    port_bitmap wide;
+    wide.add_range(12345, 50000);
+    ASSERT_EQ(2u, check_ipv4_ports(c, devices, start - 30, start + 30, wide).size());
+    port_bitmap set;
+    set.add(80);
+    set.add(14999);
+    std::map<std::string, struct device_log_entry> results = check_ipv4_ports(c, devices, start, start, set);
+    ASSERT_EQ(1u, results.size());
+    ASSERT_EQ("tablet", results["665544332211"].make_model);
+
+    // hours without an index file had no ports, but an unreadable one
+    // means no answer
+    ids.clear();
+    ASSERT_TRUE(c.exact_ipv4(set, start - 7200, start, ids));
+    ASSERT_EQ(1u, ids.size());
+    ASSERT_EQ(1u, check_ipv4_ports(c, devices, start - 7200, start, set).size());
+    std::string unreadable = directory + "/" + std::to_string(slot - 1) + ".ports";
+    std::ofstream(unreadable.c_str()) << "not an index";
+    ASSERT_FALSE(c.exact_ipv4(set, start - 7200, start, ids));
+    ASSERT_THROW(check_ipv4_ports(c, devices, start - 7200, start, set), std::runtime_error);
+    unlink(unreadable.c_str());
+
+    // a purged device is gone from the index
+    ASSERT_EQ(1u, ports->purge(2));
+    ASSERT_EQ(1u, check_ipv4_ports(c, devices, start - 30, start + 30, wide).size());
+
+    c.flush();
+    store->drop(conn_log::filter_name(slot));
+    ports->drop(slot);
+    rmdir(directory.c_str());
+}
+
+TEST(flow_record, parse_flow)
+{
+    uint8_t hw_addr[6] = {0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+    struct flow_record flow;
+    char buf[INET6_ADDRSTRLEN];
+
+    // IPv4/TCP, 192.168.1.23:51234 -> 93.184.216.34:80
+    uint8_t v4[40] = {0x45, 0, 0, 40, 0, 0, 0, 0, 64, IPPROTO_TCP, 0, 0,
+                      192, 168, 1, 23, 93, 184, 216, 34,
+                      0xc8, 0x22, 0, 80};
+    ASSERT_TRUE(parse_flow(reinterpret_cast<char *>(v4), sizeof(v4), hw_addr, 6, 100, &flow));
+    ASSERT_EQ(4, flow.version);
+    ASSERT_EQ(0xaabbccddeeffULL, flow.mac);
+    ASSERT_EQ(51234, flow.source_port);
+    ASSERT_EQ(80, flow.dest_port);
+    format_address(flow.version, flow.source_address, buf);
+    ASSERT_STREQ("192.168.1.23", buf);
+    char key[FLOW_KEY_BYTES];
+    char hex[2 * FLOW_KEY_BYTES + 1];
+    format_hex(key, pack_key_ipv4(258, flow.source_port, key) - key, hex);
+    ASSERT_STREQ("00000102c822", hex);
+
+    // IPv6/UDP
+    uint8_t v6[48] = {0x60, 0, 0, 0, 0, 8, IPPROTO_UDP, 64};
+    inet_pton(AF_INET6, "2001:db8::1", v6 + 8);
+    v6[40] = 0x13;
+    v6[41] = 0x88;
+    ASSERT_TRUE(parse_flow(reinterpret_cast<char *>(v6), sizeof(v6), hw_addr, 6, 100, &flow));
+    ASSERT_EQ(6, flow.version);
+    ASSERT_EQ(5000, flow.source_port);
+    format_hex(key, pack_key_ipv6(258, flow.source_address, key) - key, hex);
+    ASSERT_STREQ("0000010220010db8000000000000000000000001", hex);
+
+    // truncated packets are rejected
+    ASSERT_FALSE(parse_flow(reinterpret_cast<char *>(v4), 12, hw_addr, 6, 100, &flow));
+    ASSERT_FALSE(parse_flow(reinterpret_cast<char *>(v6), 39, hw_addr, 6, 100, &flow));
+}
+
+TEST(flow_record, parse_mac)
+{
+    uint64_t mac;
+
+    ASSERT_TRUE(parse_mac("aabbccddeeff", &mac));
+    ASSERT_EQ(0xaabbccddeeffULL, mac);
+    ASSERT_EQ("aabbccddeeff", mac_to_string(mac));
+
+    ASSERT_TRUE(parse_mac("001122334455", &mac));
+    ASSERT_EQ("001122334455", mac_to_string(mac));
+
+    ASSERT_FALSE(parse_mac("aa:bb:cc:dd:ee:ff", &mac));
+    ASSERT_FALSE(parse_mac("AABBCCDDEEFF", &mac));
+    ASSERT_FALSE(parse_mac("ggbbccddeeff", &mac));
+}
+
+TEST(ring_buffer, overflow_policy)
+{
+    int item;
+
+    ring_buffer<int> newest(4, DROP_NEWEST);
+    for (int i = 0; i < 6; ++i)
+    {
+        newest.push(i);
+    }
+    ASSERT_EQ(4u, newest.depth());
+    ASSERT_EQ(2u, newest.drops());
+    ASSERT_TRUE(newest.pop(item));
+    ASSERT_EQ(0, item);
+
+    ring_buffer<int> oldest(4, DROP_OLDEST);
+    for (int i = 0; i < 6; ++i)
+    {
+        oldest.push(i);
+    }
+    ASSERT_EQ(4u, oldest.depth());
+    ASSERT_EQ(2u, oldest.drops());
+    ASSERT_TRUE(oldest.pop(item));
+    ASSERT_EQ(2, item);
+
+    ASSERT_THROW(parse_overflow_policy("sometimes"), std::invalid_argument);
+}
+
+TEST(ring_buffer, concurrent)
+{
+    ring_buffer<int> ring(1024, BLOCK);
+    std::atomic<long> sum(0);
+    std::atomic<bool> running(true);
+    std::vector<std::thread> threads;
+
+    // two producers and two consumers, every item must arrive exactly once
+    for (int t = 0; t < 2; ++t)
+    {
+        threads.push_back(std::thread([&ring, t]()
+        {
+            for (int i = 1; i <= 100000; ++i)
+            {
+                ring.push(t ? -i : 2 * i);
+            }
+        }));
+    }
+    for (int t = 0; t < 2; ++t)
+    {
+        threads.push_back(std::thread([&]()
+        {
+            int item;
+            while (running || ring.depth())
+            {
+                if (ring.pop(item))
+                {
+                    sum += item;
+                }
+            }
+        }));
+    }
+
+    threads[0].join();
+    threads[1].join();
+    running = false;
+    threads[2].join();
+    threads[3].join();
+
+    ASSERT_EQ(100000L * 100001L / 2, sum.load());
+    ASSERT_EQ(0u, ring.drops());
+}
+
+TEST(edict, parse_option)
+{
+    struct args_struct args = parse_args(1, NULL);
+
+    ASSERT_TRUE(parse_option("--storage-threads=4", args));
+    ASSERT_EQ(4u, args.storage_threads);
+    ASSERT_TRUE(parse_option("--overflow=block", args));
+    ASSERT_EQ("block", args.ring_overflow);
+    ASSERT_FALSE(parse_option("--storage-threads=0", args));
+    ASSERT_FALSE(parse_option("--ring-size=lots", args));
+    ASSERT_FALSE(parse_option("--colour=blue", args));
+    ASSERT_FALSE(parse_option("storage-threads=4", args));
+    ASSERT_TRUE(parse_option("--query-threads=8", args));
+    ASSERT_EQ(8u, args.query_threads);
+    ASSERT_TRUE(parse_option("--rollup=day:7,week:30", args));
+    ASSERT_EQ(2u, args.rollups.size());
+    ASSERT_EQ(WEEK_LENGTH, args.rollups[1].length);
+    ASSERT_EQ(30 * 86400, args.rollups[1].age);
+    ASSERT_FALSE(parse_option("--rollup=month:90", args));
+    ASSERT_FALSE(parse_option("--rollup=day:", args));
+    ASSERT_TRUE(parse_option("--fp-rate=0.001", args));
+    ASSERT_DOUBLE_EQ(0.001, args.fp_rate);
+    ASSERT_FALSE(parse_option("--fp-rate=1", args));
+}
+
+TEST(edict, storage_shard)
+{
+    // dense device IDs still spread evenly, and always to the same thread
+    std::vector<unsigned int> counts(4, 0);
+    for (uint32_t device = 1; device <= 10000; ++device)
+    {
+        size_t shard = storage_shard(device, counts.size());
+        ASSERT_LT(shard, counts.size());
+        ASSERT_EQ(shard, storage_shard(device, counts.size()));
+        ++counts[shard];
+    }
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        ASSERT_GT(counts[i], 2000u);
+        ASSERT_LT(counts[i], 3000u);
+    }
+    ASSERT_EQ(0u, storage_shard(12345, 1));
+}
+
+TEST(bloom_filter, blocked)
+{
+    uint64_t blocks = bloom_filter::optimal_blocks(10000, 0.001);
+    std::vector<uint64_t> memory(blocks * bloom_filter::BLOCK_BYTES / 8 + 8);
+    uint64_t *aligned = &memory[(8 - reinterpret_cast<uintptr_t>(&memory[0]) / 8 % 8) % 8];
+
+    ASSERT_EQ(0u, blocks & (blocks - 1));
+    ASSERT_LE(bloom_filter::false_positive_rate(10000, blocks), 0.001);
+    ASSERT_THROW(bloom_filter(aligned, 3), std::invalid_argument);
+
+    bloom_filter simd(aligned, blocks, true);
+    bloom_filter scalar(aligned, blocks, false);
+    std::vector<uint64_t> hashes;
+    for (int i = 0; i < 20000; ++i)
+    {
+        std::string key = "aabbccddeeff|" + std::to_string(i);
+        hashes.push_back(hash_key(key.data(), key.length()));
+    }
+
+    // the two paths set and test the same bits
+    simd.insert(&hashes[0], 5000);
+    scalar.insert(&hashes[5000], 5000);
+
+    std::vector<uint64_t> found_simd(hashes.size() / 64 + 1);
+    std::vector<uint64_t> found_scalar(hashes.size() / 64 + 1);
+    simd.contains(&hashes[0], hashes.size(), &found_simd[0]);
+    scalar.contains(&hashes[0], hashes.size(), &found_scalar[0]);
+    ASSERT_EQ(found_simd, found_scalar);
+
+    int positives = 0;
+    for (size_t i = 0; i < hashes.size(); ++i)
+    {
+        bool found = (found_simd[i / 64] >> (i % 64)) & 1;
+        if (i < 10000)
+        {
+            ASSERT_TRUE(found);
+        }
+        positives += found;
+    }
+    ASSERT_LE(positives - 10000, 50);
+    ASSERT_TRUE(simd.contains("aabbccddeeff|0", 14));
+}
+
+TEST(port_bitmap, containers)
+{
+    port_bitmap ports;
+    ports.add(443);
+    ports.add(80);
+    ASSERT_FALSE(ports.add(80));
+    ASSERT_EQ(2u, ports.cardinality());
+    ASSERT_TRUE(ports.intersects(80, 80));
+    ASSERT_TRUE(ports.intersects(100, 500));
+    ASSERT_FALSE(ports.intersects(81, 442));
+
+    // past ARRAY_MAX ports it turns into a bitset, with the same answers
+    port_bitmap many;
+    many.add_range(1000, 1000 + port_bitmap::ARRAY_MAX);
+    many.add(65535);
+    ASSERT_EQ(port_bitmap::ARRAY_MAX + 2, many.cardinality());
+    ASSERT_TRUE(many.contains(65535));
+    ASSERT_FALSE(many.contains(999));
+    ASSERT_TRUE(many.intersects(5096, 5200));
+    ASSERT_FALSE(many.intersects(5097, 65534));
+    ASSERT_FALSE(many.intersects(ports));
+    ports.add(2000);
+    ASSERT_TRUE(many.intersects(ports));
+    ASSERT_TRUE(ports.intersects(many));
+
+    // both containers survive a round trip
+    std::string data;
+    ports.write(data);
+    size_t small = data.length();
+    many.write(data);
+    ASSERT_EQ(4 + 3 * 2u, small);
+    port_bitmap copy;
+    ASSERT_EQ(small, copy.read(data.data(), data.length()));
+    ASSERT_TRUE(copy.contains(2000));
+    ASSERT_EQ(data.length() - small, copy.read(data.data() + small, data.length() - small));
+    ASSERT_EQ(many.cardinality(), copy.cardinality());
+    ASSERT_TRUE(copy.contains(65535));
+    ASSERT_EQ(0u, copy.read(data.data(), small - 1));
+
+    // a union counts shared ports once
+    port_bitmap merged;
+    merged.merge(ports);
+    merged.merge(many);
+    ASSERT_EQ(many.cardinality() + 2, merged.cardinality());
+
+    ASSERT_TRUE(parse_ports("80,1024-2047", &copy));
+    ASSERT_FALSE(parse_ports("80,2047-1024", &copy));
+    ASSERT_FALSE(parse_ports("65536", &copy));
+    ASSERT_FALSE(parse_ports("80,", &copy));
+}
+
+TEST(edict, query_batch)
+{
+    struct batch_query query;
+
+    ASSERT_TRUE(parse_batch_query("2018-01-01T12:00:00Z v4 443", query));
+    ASSERT_FALSE(query.ipv6);
+    ASSERT_EQ(443, query.source_port);
+    ASSERT_TRUE(parse_batch_query("2018-01-01T12:00:00Z,v6,2001:db8::1\r", query));
+    ASSERT_TRUE(query.ipv6);
+    ASSERT_FALSE(parse_batch_query("2018-01-01T12:00:00Z v4 70000", query));
+    ASSERT_FALSE(parse_batch_query("2018-01-01T12:00:00Z v6 nonsense", query));
+    ASSERT_FALSE(parse_batch_query("yesterday v4 443", query));
+
+    std::string directory = "/tmp/edict_test_query_batch_" + std::to_string(getpid());
+    std::shared_ptr<filter_store> store = std::make_shared<local_store>(directory);
+    conn_log c(store);
+    time_t now = time(nullptr);
+
+    c.add_ipv4(1, 443);
+    c.add_ipv4(2, 8080);
+
+    std::map<std::string, struct device_log_entry> devices;
+    devices["aabbccddeeff"].make_model = "phone \"x\"";
+    devices["aabbccddeeff"].first_seen = 0;
+    devices["aabbccddeeff"].id = 1;
+    devices["001122334455"].make_model = "tablet";
+    devices["001122334455"].first_seen = 0;
+    devices["001122334455"].id = 2;
+
+    std::vector<struct batch_query> group(2);
+    group[0].line = 1;
+    group[0].text = "q1";
+    group[0].timestamp = now;
+    group[0].ipv6 = false;
+    group[0].source_port = 443;
+    group[1] = group[0];
+    group[1].line = 2;
+    group[1].text = "q2";
+    group[1].source_port = 22;
+
+    std::ostringstream out;
+    std::mutex out_lock;
+    answer_query_group(c, devices, group, out, out_lock);
+    ASSERT_EQ("{\"line\":1,\"query\":\"q1\",\"matches\":[{\"mac\":\"aabbccddeeff\","
+              "\"make_model\":\"phone \\\"x\\\"\",\"first_seen\":\"1970-01-01T00:00:00Z\"}]}\n"
+              "{\"line\":2,\"query\":\"q2\",\"matches\":[]}\n", out.str());
+
+    store->drop(conn_log::filter_name(now / FILTER_LENGTH));
+    rmdir(directory.c_str());
+}
+
+TEST(lru_cache, eviction)
+{
+    lru_cache<std::string, int> cache(2);
+    int value;
+
+    cache.put("a", 1);
+    cache.put("b", 2);
+    ASSERT_TRUE(cache.get("a", value));
+    ASSERT_EQ(1, value);
+
+    // "b" is now the least recently used
+    cache.put("c", 3);
+    ASSERT_FALSE(cache.get("b", value));
+    ASSERT_TRUE(cache.get("c", value));
+    ASSERT_EQ(2u, cache.size());
+    ASSERT_EQ(2u, cache.hits());
+    ASSERT_EQ(1u, cache.misses());
+
+    cache.clear();
+    ASSERT_FALSE(cache.get("a", value));
 }
 
 int main(int argc, char **argv)